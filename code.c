@@ -1,43 +1,149 @@
+#define _FILE_OFFSET_BITS 64 // 64-bit file offsets for large covers on 32-bit POSIX systems
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h> // Needed for strcmp, strcspn
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h> // Block mode worker threads (winpthreads on MinGW)
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#endif
+#else
+#include <fcntl.h>
+#include <io.h> // _setmode for binary stdin/stdout
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STEGO_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#define stegoSeek _fseeki64
+#define stegoTell _ftelli64
+#else
+#define stegoSeek fseeko
+#define stegoTell ftello
+#endif
 
 #define BYTE_RANGE 256
+#define BMP_HEADER_SIZE 54 // Headers of a plain BMP; images before format version 6 used every byte after them
+#define MAX_CODE_LENGTH 64 // Codes are stored in a uint64_t
 #define MAX_PATH_LEN 1024 // Maximum length for file paths
 
-// --- Data Structures (HuffmanNode, CodeTable) remain the same ---
+// --- Options and Progress Output (stegoOptions, stegoProgress, stegoError) ---
+// Process-wide settings from the command line. -1 (or 0 threads) defers to the STEGO_*
+// environment variables and then to the built-in defaults.
+typedef struct {
+    int streaming;     // Force streaming on (1) or off (0)
+    int blocks;        // Force block mode on (1) or off (0)
+    int method;        // Force a payload method (STEGO_METHOD_*)
+    int depth;         // Bits hidden per pixel byte (1-4) or STEGO_DEPTH_AUTO
+    int seek;          // Seek index interval as a power of two, or 0 for none
+    int threads;       // Worker threads for block mode
+    int quiet;         // Suppress progress messages
+    int stats;         // Record job statistics (see Job Statistics)
+    int clone;         // Encode into a clone of the cover file (see Cover Clones)
+    FILE* progress;    // Where progress messages go; NULL means stdout
+    const char* key;   // Pixel order key (see Keyed Scatter), or NULL
+} StegoOptions;
+
+static StegoOptions stegoOptions = { -1, -1, -1, -1, -1, 0, 0, 0, 1, NULL, NULL };
+
+// Errors go to stderr, or into the calling thread's capture buffer while one is set (see
+// Library API), so that a library call can hand its caller the reason it failed. Progress is
+// not reported during library calls.
+static _Thread_local char* stegoErrorCapture;
+static _Thread_local size_t stegoErrorCaptureSize;
+
+// Encoding and decoding report what they are doing through here rather than printf, so that
+// callers which own stdout (worker mode) can silence or redirect them.
+void stegoProgress(const char* format, ...) {
+    if (stegoOptions.quiet || stegoErrorCapture) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stegoOptions.progress ? stegoOptions.progress : stdout, format, args);
+    va_end(args);
+}
+
+void stegoError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (stegoErrorCapture) {
+        size_t used = strlen(stegoErrorCapture);
+        if (used + 1 < stegoErrorCaptureSize) vsnprintf(stegoErrorCapture + used, stegoErrorCaptureSize - used, format, args);
+    } else {
+        vfprintf(stderr, format, args);
+    }
+    va_end(args);
+}
+
+// stegoError for a failed system or library call, as perror.
+void stegoSystemError(const char* what) {
+    const char* reason = strerror(errno);
+    stegoError("%s: %s\n", what, reason);
+}
+
+
+// --- Data Structures (HuffmanNode, HuffmanArena, CodeTable, BitWriter) ---
 typedef struct HuffmanNode {
     unsigned char data;
     int freq;
     struct HuffmanNode *left, *right;
 } HuffmanNode;
 
+// Trees are built in a fixed array of nodes, usually on the caller's stack: a tree over the
+// 256 byte values has at most 2 * 256 - 1 nodes, and it goes away with its arena.
+#define HUFFMAN_MAX_NODES (2 * BYTE_RANGE - 1)
+
+typedef struct {
+    HuffmanNode nodes[HUFFMAN_MAX_NODES];
+    int count;
+} HuffmanArena;
+
+// Huffman code for one byte value; tables are indexed by the byte. The code is kept
+// right-aligned in an integer; its first bit is the most significant of the 'length' valid bits.
 typedef struct {
-    unsigned char byte;
-    char *code;
+    uint64_t code;
+    int length; // 0 when the byte does not occur in the input
 } CodeTable;
 
+// Packs variable-length codes MSB-first into a byte buffer through a 64-bit accumulator.
+typedef struct {
+    unsigned char* buffer;
+    size_t pos;       // Next byte of buffer to be written
+    uint64_t acc;     // Pending bits, right-aligned
+    int accBits;      // Number of pending bits in acc (always < 32 between calls)
+} BitWriter;
+
 
-// --- Huffman Node/Tree Functions (createNode, freeHuffmanTree) remain the same ---
-HuffmanNode* createNode(unsigned char data, int freq) {
-    HuffmanNode* node = (HuffmanNode*)malloc(sizeof(HuffmanNode));
-    if (!node) {
-        perror("Failed to allocate Huffman node");
+// --- Huffman Node Functions (createNode) ---
+// Takes the next node of the arena. Returns NULL if the arena is full.
+HuffmanNode* createNode(HuffmanArena* arena, unsigned char data, int freq) {
+    if (arena->count >= HUFFMAN_MAX_NODES) {
+        stegoError("Huffman tree has too many nodes.\n");
         return NULL;
     }
+    HuffmanNode* node = &arena->nodes[arena->count++];
     node->data = data;
     node->freq = freq;
     node->left = node->right = NULL;
     return node;
 }
 
-void freeHuffmanTree(HuffmanNode* node) {
-    if (!node) return;
-    freeHuffmanTree(node->left);
-    freeHuffmanTree(node->right);
-    free(node);
-}
-
 // --- Min-Heap Functions (swap, heapify, buildMinHeap, extractMin) remain the same ---
 void swap(HuffmanNode** a, HuffmanNode** b) {
     HuffmanNode* temp = *a;
@@ -79,43 +185,32 @@ HuffmanNode* extractMin(HuffmanNode** heap, int *n) {
     return temp;
 }
 
-// --- Huffman Tree Building (buildHuffmanTree) remains the same ---
-HuffmanNode* buildHuffmanTree(int freq[BYTE_RANGE]) {
+// --- Huffman Tree Building (buildHuffmanTree) ---
+// Builds the tree for freq in an emptied arena. Legacy images store frequencies rather than
+// code lengths, so their decoder depends on this exact construction, ties included.
+HuffmanNode* buildHuffmanTree(HuffmanArena* arena, int freq[BYTE_RANGE]) {
     HuffmanNode* heap[BYTE_RANGE];
     int size = 0;
+    arena->count = 0;
 
     for (int i = 0; i < BYTE_RANGE; i++) {
-        if (freq[i] > 0) {
-            heap[size] = createNode((unsigned char)i, freq[i]);
-            if (!heap[size]) return NULL;
-            size++;
-        }
+        if (freq[i] > 0) heap[size++] = createNode(arena, (unsigned char)i, freq[i]);
     }
 
     if (size == 0) return NULL;
     if (size == 1) {
-        HuffmanNode* root = createNode(0, heap[0]->freq);
-        if (!root) return NULL;
+        HuffmanNode* root = createNode(arena, 0, heap[0]->freq);
         root->left = heap[0];
         return root;
     }
 
     buildMinHeap(heap, size);
 
+    // n leaves take n - 1 internal nodes, so the arena cannot run out.
     while (size > 1) {
         HuffmanNode *left = extractMin(heap, &size);
         HuffmanNode *right = extractMin(heap, &size);
-        if (!left || !right) {
-             fprintf(stderr, "Heap extraction error.\n");
-             if(left) freeHuffmanTree(left);
-             return NULL;
-        }
-        HuffmanNode *internalNode = createNode('$', left->freq + right->freq);
-        if (!internalNode) {
-            freeHuffmanTree(left);
-            freeHuffmanTree(right);
-            return NULL;
-        }
+        HuffmanNode *internalNode = createNode(arena, '$', left->freq + right->freq);
         internalNode->left = left;
         internalNode->right = right;
 
@@ -131,466 +226,7151 @@ HuffmanNode* buildHuffmanTree(int freq[BYTE_RANGE]) {
 }
 
 
-// --- Code Generation & Compression (generateCodesRecursive, generateCodes, freeCodeTable, huffmanCompress) remain the same ---
-void generateCodesRecursive(HuffmanNode* root, char* currentCode, int depth, CodeTable* codeTable) {
-    if (!root) return;
+// --- Code Generation (generateCodesRecursive, generateCodes) ---
+int generateCodesRecursive(HuffmanNode* root, uint64_t currentCode, int depth, CodeTable* codeTable) {
+    if (!root) return 1;
     if (!root->left && !root->right) {
-        currentCode[depth] = '\0';
-        int i;
-        for(i = 0; i < BYTE_RANGE; i++){
-            if(codeTable[i].byte == root->data){
-                codeTable[i].code = strdup(currentCode);
-                if(!codeTable[i].code) perror("strdup failed in generateCodes");
-                break;
-            }
-        }
-        return;
-    }
-    if (root->left) {
-        currentCode[depth] = '0';
-        if(depth + 1 < BYTE_RANGE) // Basic bounds check for code buffer
-             generateCodesRecursive(root->left, currentCode, depth + 1, codeTable);
+        codeTable[root->data].code = currentCode;
+        codeTable[root->data].length = depth;
+        return 1;
     }
-    if (root->right) {
-        currentCode[depth] = '1';
-         if(depth + 1 < BYTE_RANGE) // Basic bounds check
-             generateCodesRecursive(root->right, currentCode, depth + 1, codeTable);
+    if (depth + 1 > MAX_CODE_LENGTH) {
+        stegoError("Huffman code longer than %d bits.\n", MAX_CODE_LENGTH);
+        return 0;
     }
+    if (root->left && !generateCodesRecursive(root->left, currentCode << 1, depth + 1, codeTable))
+        return 0;
+    if (root->right && !generateCodesRecursive(root->right, (currentCode << 1) | 1, depth + 1, codeTable))
+        return 0;
+    return 1;
 }
 
-int generateCodes(HuffmanNode* root, int freq[BYTE_RANGE], CodeTable* codeTable) {
-    for (int i = 0; i < BYTE_RANGE; i++) {
-        codeTable[i].byte = (unsigned char)i;
-        codeTable[i].code = NULL;
-    }
+int generateCodes(HuffmanNode* root, CodeTable* codeTable) {
+    memset(codeTable, 0, BYTE_RANGE * sizeof(CodeTable));
     if (root && !root->right && root->left && !root->left->left && !root->left->right) {
-         codeTable[root->left->data].code = strdup("0");
-         if (!codeTable[root->left->data].code) {
-             perror("strdup failed for single char");
-             return 0;
-         }
-    } else if (root) {
-        char currentCode[BYTE_RANGE];
-        generateCodesRecursive(root, currentCode, 0, codeTable);
+        // A single distinct byte still needs one bit per occurrence
+        codeTable[root->left->data].code = 0;
+        codeTable[root->left->data].length = 1;
+        return 1;
     }
-    return 1;
+    return generateCodesRecursive(root, 0, 0, codeTable);
 }
 
-void freeCodeTable(CodeTable* table) {
-    if (!table) return;
-    for (int i = 0; i < BYTE_RANGE; i++) {
-        free(table[i].code);
-        table[i].code = NULL;
-    }
+
+// --- Bit Packing (bitWriterInit, bitWriterPut, bitWriterFlush) ---
+void bitWriterInit(BitWriter* bw, unsigned char* buffer) {
+    bw->buffer = buffer;
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->accBits = 0;
 }
 
-unsigned char* huffmanCompress(unsigned char* input, long fileSize, long* outSize, int freq[BYTE_RANGE]) {
-    HuffmanNode* root = buildHuffmanTree(freq);
-    if (!root && fileSize > 0) {
-        fprintf(stderr, "Failed to build Huffman tree.\n");
-        return NULL;
+// Appends the low 'length' bits of code. Bits above 'length' must be zero.
+static inline void bitWriterPut(BitWriter* bw, uint64_t code, int length) {
+    if (length > 32) {
+        bitWriterPut(bw, code >> 32, length - 32);
+        code &= 0xFFFFFFFFu;
+        length = 32;
     }
-     if (!root && fileSize == 0) {
-        *outSize = 0;
-        return NULL;
+    bw->acc = (bw->acc << length) | code;
+    bw->accBits += length;
+    if (bw->accBits >= 32) {
+        bw->accBits -= 32;
+        uint32_t word = (uint32_t)(bw->acc >> bw->accBits);
+        unsigned char* out = bw->buffer + bw->pos;
+        out[0] = (unsigned char)(word >> 24);
+        out[1] = (unsigned char)(word >> 16);
+        out[2] = (unsigned char)(word >> 8);
+        out[3] = (unsigned char)word;
+        bw->pos += 4;
     }
+}
 
-    CodeTable codeTable[BYTE_RANGE];
-    if (!generateCodes(root, freq, codeTable)) {
-        fprintf(stderr, "Failed to generate Huffman codes.\n");
-        freeHuffmanTree(root);
-        return NULL;
+// Writes out any pending bits, zero-padding the last byte.
+void bitWriterFlush(BitWriter* bw) {
+    while (bw->accBits >= 8) {
+        bw->accBits -= 8;
+        bw->buffer[bw->pos++] = (unsigned char)(bw->acc >> bw->accBits);
+    }
+    if (bw->accBits > 0) {
+        bw->buffer[bw->pos++] = (unsigned char)(bw->acc << (8 - bw->accBits));
+        bw->accBits = 0;
     }
+}
 
-    long totalBits = 0;
-    for (long i = 0; i < fileSize; i++) {
-        if (codeTable[input[i]].code) {
-            totalBits += strlen(codeTable[input[i]].code);
+
+// --- Canonical Codes (computeCodeLengths, buildCanonicalCodes, buildTreeFromCodes) ---
+#define MAX_CANONICAL_LENGTH 15 // Lengths are stored as 4-bit values in the stego header
+
+// Turns weights sorted in ascending order into Huffman code lengths in place, without building
+// a tree (Moffat and Katajainen). The first pass stores parent indices, the second the depths
+// of internal nodes, the third the depths of the leaves. Needs n >= 2.
+static void minimumRedundancyLengths(int* a, int n) {
+    int root = 0, leaf = 2;
+    a[0] += a[1];
+    for (int next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
         } else {
-             if (root && root->left && !root->right && root->left->data == input[i]) {
-                 totalBits += 1;
-             } else {
-                fprintf(stderr, "Warning: No code found for byte %d (freq %d) during compression.\n", input[i], freq[input[i]]);
-             }
+            a[next] += a[leaf++];
         }
     }
-    *outSize = totalBits;
 
-    if (totalBits == 0) {
-        freeCodeTable(codeTable);
-        freeHuffmanTree(root);
-        return NULL;
+    a[n - 2] = 0;
+    for (int next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+
+    int available = 1, used = 0, depth = 0, next = n - 1;
+    root = n - 2;
+    while (available > 0) {
+        while (root >= 0 && a[root] == depth) {
+            used++;
+            root--;
+        }
+        while (available > used) {
+            a[next--] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
     }
+}
 
-    unsigned char* bitStream = (unsigned char*)malloc(totalBits * sizeof(unsigned char));
-    if (!bitStream) {
-        perror("Failed to allocate memory for bit stream");
-        freeCodeTable(codeTable);
-        freeHuffmanTree(root);
-        return NULL;
+static int compareSymbolKeys(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Computes Huffman code lengths for freq and limits them to maxLength bits. Works on the
+// sorted frequencies alone, so nothing is allocated. Returns 0 if no byte occurs.
+int computeCodeLengths(int freq[BYTE_RANGE], unsigned char lengths[BYTE_RANGE], int maxLength) {
+    memset(lengths, 0, BYTE_RANGE);
+
+    // Frequency in the high bits, byte in the low 8: sorting orders by frequency, ties by byte.
+    uint64_t keys[BYTE_RANGE];
+    int symbolCount = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        if (freq[s] > 0) keys[symbolCount++] = ((uint64_t)freq[s] << 8) | (unsigned int)s;
+    }
+    if (symbolCount == 0) return 0;
+    if (symbolCount == 1) {
+        lengths[keys[0] & 0xFF] = 1; // A single distinct byte still needs one bit per occurrence
+        return 1;
     }
+    qsort(keys, symbolCount, sizeof(keys[0]), compareSymbolKeys);
 
-    long bitIndex = 0;
-    for (long i = 0; i < fileSize; i++) {
-        char* codeStr = codeTable[input[i]].code;
-         if (!codeStr && root && root->left && !root->right && root->left->data == input[i]) {
-             codeStr = "0";
-         }
-
-        if (codeStr) {
-            while (*codeStr) {
-                if (bitIndex < totalBits) {
-                    bitStream[bitIndex++] = (*codeStr == '1') ? 1 : 0;
-                }
-                codeStr++;
+    int depths[BYTE_RANGE];
+    for (int i = 0; i < symbolCount; i++) depths[i] = (int)(keys[i] >> 8);
+    minimumRedundancyLengths(depths, symbolCount);
+    unsigned int lengthCount[MAX_CODE_LENGTH + 1] = {0};
+    for (int i = 0; i < symbolCount; i++) lengthCount[depths[i] < MAX_CODE_LENGTH ? depths[i] : MAX_CODE_LENGTH]++;
+
+    // Fold over-long codes into maxLength, then split shorter codes until the Kraft sum fits.
+    for (int len = maxLength + 1; len <= MAX_CODE_LENGTH; len++) {
+        lengthCount[maxLength] += lengthCount[len];
+        lengthCount[len] = 0;
+    }
+    uint32_t kraft = 0;
+    for (int len = 1; len <= maxLength; len++) kraft += lengthCount[len] << (maxLength - len);
+    while (kraft > (1u << maxLength)) {
+        lengthCount[maxLength]--;
+        for (int len = maxLength - 1; len > 0; len--) {
+            if (lengthCount[len]) {
+                lengthCount[len]--;
+                lengthCount[len + 1] += 2;
+                break;
             }
         }
+        kraft--;
     }
 
-    freeCodeTable(codeTable);
-    freeHuffmanTree(root);
-
-    return bitStream;
+    // Least frequent symbols take the longest lengths.
+    int next = 0;
+    for (int len = maxLength; len >= 1; len--) {
+        for (unsigned int k = 0; k < lengthCount[len]; k++) lengths[keys[next++] & 0xFF] = (unsigned char)len;
+    }
+    return 1;
 }
 
-
-// --- File I/O and LSB Steganography (readBinaryFile, encodeBinaryIntoImage) remain the same ---
-unsigned char* readBinaryFile(const char* filePath, long* fileSize) {
-    FILE* file = fopen(filePath, "rb");
-    if (!file) {
-        fprintf(stderr, "Error opening file: %s\n", filePath);
-        return NULL;
+// Code lengths are computed from int frequencies whose sum must fit in an int; larger counts (from
+// streamed payloads) are scaled down, keeping every present byte at a count of at least 1.
+void scaleFrequencies(const unsigned long long counts[BYTE_RANGE], int freq[BYTE_RANGE]) {
+    unsigned long long total = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) total += counts[s];
+    int shift = 0;
+    while ((total >> shift) + BYTE_RANGE > (unsigned long long)INT_MAX) shift++;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        unsigned long long scaled = counts[s] >> shift;
+        freq[s] = counts[s] == 0 ? 0 : (scaled == 0 ? 1 : (int)scaled);
     }
+}
 
-    fseek(file, 0, SEEK_END);
-    *fileSize = ftell(file);
-    if (*fileSize < 0) {
-        perror("ftell error");
-        fclose(file);
-        return NULL;
+// Assigns canonical codes: shorter codes first, equal lengths in byte order. Returns 0 if the
+// lengths are out of range or over-subscribe the code space (only possible for corrupt input).
+int buildCanonicalCodes(const unsigned char lengths[BYTE_RANGE], CodeTable codeTable[BYTE_RANGE]) {
+    int lengthCount[MAX_CANONICAL_LENGTH + 1] = {0};
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        if (lengths[s] > MAX_CANONICAL_LENGTH) return 0;
+        lengthCount[lengths[s]]++;
     }
-    if (*fileSize == 0) {
-        printf("Input file '%s' is empty.\n", filePath);
-        fclose(file);
-        *fileSize = 0; // Ensure fileSize is 0 for caller
-        return NULL;
+    lengthCount[0] = 0;
+
+    long available = 1;
+    uint64_t nextCode[MAX_CANONICAL_LENGTH + 1];
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_CANONICAL_LENGTH; len++) {
+        available = (available << 1) - lengthCount[len];
+        if (available < 0) return 0;
+        code = (code + lengthCount[len - 1]) << 1;
+        nextCode[len] = code;
     }
-    fseek(file, 0, SEEK_SET);
 
-    unsigned char* buffer = (unsigned char*)malloc(*fileSize);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed for reading file!\n");
-        fclose(file);
-        return NULL;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        codeTable[s].length = lengths[s];
+        codeTable[s].code = lengths[s] ? nextCode[lengths[s]]++ : 0;
     }
+    return 1;
+}
 
-    size_t bytesRead = fread(buffer, 1, *fileSize, file);
-    if (bytesRead != (size_t)*fileSize) {
-         fprintf(stderr, "Error reading file content.\n");
-         free(buffer);
-         fclose(file);
-         return NULL;
+// Rebuilds a pointer tree from a code table in an emptied arena; used by the tree-walk
+// reference decoder. Returns NULL if the codes need more nodes than the arena holds.
+HuffmanNode* buildTreeFromCodes(HuffmanArena* arena, const CodeTable codeTable[BYTE_RANGE]) {
+    arena->count = 0;
+    HuffmanNode* root = createNode(arena, '$', 0);
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        HuffmanNode* node = root;
+        for (int i = codeTable[s].length - 1; i >= 0; i--) {
+            HuffmanNode** child = ((codeTable[s].code >> i) & 1) ? &node->right : &node->left;
+            if (!*child && !(*child = createNode(arena, '$', 0))) return NULL;
+            node = *child;
+        }
+        if (node != root) node->data = (unsigned char)s;
     }
-    fclose(file);
-    return buffer;
+    return root;
 }
 
-void encodeBinaryIntoImage(const char *imagePath, const char *binaryFilePath, const char *outputPath) {
-    FILE *image = NULL, *output = NULL;
-    unsigned char* inputData = NULL;
-    unsigned char* bitStream = NULL;
 
-    long originalFileSize = 0; // Initialize to 0
-    inputData = readBinaryFile(binaryFilePath, &originalFileSize);
-    if (!inputData && originalFileSize > 0) {
-        fprintf(stderr, "Failed to read file to hide.\n");
-        return;
-    }
-    // If inputData is NULL and originalFileSize is 0, it's an empty file, proceed.
+// --- Scratch Buffers (scratchReserve, stegoScratchFree) ---
+// The large per-job buffers of encode and decode. Batch and worker threads pass the same
+// scratch to every job they run, so those buffers are allocated (and page-faulted in) once per
+// thread rather than once per job. Callers that pass NULL get a scratch for that call only.
+#define SCRATCH_RETAIN_BYTES (64u << 20) // Larger buffers are released between jobs
 
-    int freq[BYTE_RANGE] = {0};
-    if (inputData) {
-        for (long i = 0; i < originalFileSize; i++) {
-            freq[inputData[i]]++;
-        }
+typedef struct {
+    unsigned char* data;
+    size_t capacity;
+} ScratchBuffer;
+
+typedef struct {
+    ScratchBuffer input;  // Secret file contents
+    ScratchBuffer packed; // Compressed stream or block index
+    ScratchBuffer output; // Decoded payload, or the changed bytes of a cloned cover
+    ScratchBuffer slots;  // Block-mode stream slots, one per thread
+} StegoScratch;
+
+// Returns buf's memory grown to at least size bytes (old contents are not kept), or NULL.
+unsigned char* scratchReserve(ScratchBuffer* buf, size_t size) {
+    if (size == 0) size = 1;
+    if (buf->capacity < size) {
+        free(buf->data);
+        buf->data = (unsigned char*)malloc(size);
+        buf->capacity = buf->data ? size : 0;
     }
+    return buf->data;
+}
 
-    long compressedBitsCount = 0; // Initialize to 0
-    bitStream = huffmanCompress(inputData, originalFileSize, &compressedBitsCount, freq);
-    if (!bitStream && originalFileSize > 0) {
-         fprintf(stderr, "Huffman compression failed.\n");
-         free(inputData);
-         return;
+static void scratchRelease(ScratchBuffer* buf, size_t keep) {
+    if (buf->capacity > keep) {
+        free(buf->data);
+        buf->data = NULL;
+        buf->capacity = 0;
     }
-    // If bitStream is NULL and originalFileSize is 0, it's okay.
+}
 
-    image = fopen(imagePath, "rb");
-    if (!image) { fprintf(stderr, "Error opening input image: %s\n", imagePath); goto encode_cleanup; }
-    output = fopen(outputPath, "wb");
-    if (!output) { fprintf(stderr, "Error opening output image: %s\n", outputPath); goto encode_cleanup; }
+void stegoScratchFree(StegoScratch* scratch) {
+    scratchRelease(&scratch->input, 0);
+    scratchRelease(&scratch->packed, 0);
+    scratchRelease(&scratch->output, 0);
+    scratchRelease(&scratch->slots, 0);
+}
 
-    unsigned char header[54];
-    if (fread(header, 1, 54, image) != 54) { fprintf(stderr, "Error reading BMP header.\n"); goto encode_cleanup; }
-    if (fwrite(header, 1, 54, output) != 54) { fprintf(stderr, "Error writing BMP header.\n"); goto encode_cleanup; }
+// Called between jobs so that one very large job does not pin its buffers for good.
+void stegoScratchTrim(StegoScratch* scratch) {
+    scratchRelease(&scratch->input, SCRATCH_RETAIN_BYTES);
+    scratchRelease(&scratch->packed, SCRATCH_RETAIN_BYTES);
+    scratchRelease(&scratch->output, SCRATCH_RETAIN_BYTES);
+    scratchRelease(&scratch->slots, SCRATCH_RETAIN_BYTES);
+}
 
-    long currentImagePos = ftell(image);
-    fseek(image, 0, SEEK_END);
-    long imageFileSize = ftell(image);
-    fseek(image, currentImagePos, SEEK_SET);
-    long availableBytesForData = imageFileSize - 54;
-    long requiredBits = 32 + (BYTE_RANGE * 32) + compressedBitsCount;
 
-    if (availableBytesForData < requiredBits) {
-        fprintf(stderr, "Error: Image capacity insufficient.\n");
-        fprintf(stderr, "  Available LSBs (pixels/bytes): %ld\n", availableBytesForData);
-        fprintf(stderr, "  Required LSBs (bits): %ld\n", requiredBits);
-        goto encode_cleanup;
+// --- Compression (packHuffmanCodes, huffmanCompress) ---
+// Encodes input with codeTable into a packed MSB-first stream of totalBits bits, held in buffer
+// if one is given and freshly allocated otherwise.
+unsigned char* packHuffmanCodes(const unsigned char* input, long fileSize, const CodeTable codeTable[BYTE_RANGE], long totalBits,
+                                ScratchBuffer* buffer) {
+    size_t bytes = (size_t)(totalBits + 7) / 8;
+    unsigned char* bitStream = buffer ? scratchReserve(buffer, bytes) : (unsigned char*)malloc(bytes);
+    if (!bitStream) {
+        stegoSystemError("Failed to allocate memory for bit stream");
+        return NULL;
     }
-    printf("Capacity OK. Required: %ld bits, Available: %ld pixels\n", requiredBits, availableBytesForData);
 
-    printf("Embedding file size (%ld bytes)...\n", originalFileSize);
-    unsigned int size_val = (unsigned int)originalFileSize;
-    for (int i = 0; i < 32; i++) {
-        unsigned char pixel_byte;
-        if(fread(&pixel_byte, 1, 1, image) != 1) {fprintf(stderr, "Error reading image pixel for size.\n"); goto encode_cleanup;}
-        unsigned char bit_to_embed = (size_val >> (31 - i)) & 1;
-        pixel_byte = (pixel_byte & 0xFE) | bit_to_embed;
-        if(fwrite(&pixel_byte, 1, 1, output) != 1) {fprintf(stderr, "Error writing image pixel for size.\n"); goto encode_cleanup;}
+    BitWriter bw;
+    bitWriterInit(&bw, bitStream);
+    for (long i = 0; i < fileSize; i++) {
+        const CodeTable* entry = &codeTable[input[i]];
+        bitWriterPut(&bw, entry->code, entry->length);
     }
+    bitWriterFlush(&bw);
+    return bitStream;
+}
 
-    printf("Embedding frequency table...\n");
-    for (int i = 0; i < BYTE_RANGE; i++) {
-        unsigned int freq_val = (unsigned int)freq[i];
-        for (int j = 0; j < 32; j++) {
-            unsigned char pixel_byte;
-             if(fread(&pixel_byte, 1, 1, image) != 1) {fprintf(stderr, "Error reading image pixel for freq table.\n"); goto encode_cleanup;}
-             unsigned char bit_to_embed = (freq_val >> (31 - j)) & 1;
-            pixel_byte = (pixel_byte & 0xFE) | bit_to_embed;
-            if(fwrite(&pixel_byte, 1, 1, output) != 1) {fprintf(stderr, "Error writing image pixel for freq table.\n"); goto encode_cleanup;}
-        }
+// Returns the compressed stream packed 8 bits per byte (MSB-first); *outSize receives
+// the number of valid bits and codeLengths the canonical code length of every byte value.
+// The stream lives in buffer if one is given; otherwise the caller frees it.
+unsigned char* huffmanCompress(const unsigned char* input, long fileSize, long* outSize, int freq[BYTE_RANGE],
+                               unsigned char codeLengths[BYTE_RANGE], ScratchBuffer* buffer) {
+    *outSize = 0;
+    if (fileSize == 0) {
+        memset(codeLengths, 0, BYTE_RANGE);
+        return NULL;
+    }
+    if (!computeCodeLengths(freq, codeLengths, MAX_CANONICAL_LENGTH)) {
+        stegoError("Failed to build Huffman tree.\n");
+        return NULL;
     }
 
-    printf("Embedding compressed data (%ld bits)...\n", compressedBitsCount);
-    // Only embed if there are bits to embed (handles empty file case)
-    if (bitStream && compressedBitsCount > 0) {
-        for (long i = 0; i < compressedBitsCount; i++) {
-            unsigned char pixel_byte;
-            if(fread(&pixel_byte, 1, 1, image) != 1) {fprintf(stderr, "Error reading image pixel for data.\n"); goto encode_cleanup;}
-            unsigned char bit_to_embed = bitStream[i];
-            pixel_byte = (pixel_byte & 0xFE) | bit_to_embed;
-            if(fwrite(&pixel_byte, 1, 1, output) != 1) {fprintf(stderr, "Error writing image pixel for data.\n"); goto encode_cleanup;}
-        }
+    CodeTable codeTable[BYTE_RANGE];
+    if (!buildCanonicalCodes(codeLengths, codeTable)) {
+        stegoError("Failed to generate Huffman codes.\n");
+        return NULL;
     }
 
-    printf("Copying remaining image data...\n");
-    unsigned char pixel_byte;
-    while (fread(&pixel_byte, 1, 1, image) == 1) {
-        if (fwrite(&pixel_byte, 1, 1, output) != 1) {
-             fprintf(stderr, "Error writing remaining pixel data.\n");
-             break;
-        }
+    long totalBits = 0;
+    for (int i = 0; i < BYTE_RANGE; i++) {
+        totalBits += (long)freq[i] * codeTable[i].length;
     }
-     printf("Encoding finished successfully for '%s'.\n", outputPath);
+    *outSize = totalBits;
 
-encode_cleanup:
-    if (image) fclose(image);
-    if (output) fclose(output);
-    if (inputData) free(inputData);
-    if (bitStream) free(bitStream);
+    return packHuffmanCodes(input, fileSize, codeTable, totalBits, buffer);
+}
+
+
+// --- Table-Driven Decoding (bitReader*, buildDecodeTable, huffmanDecodeTable, huffmanDecodeTreeWalk) ---
+// The primary table is indexed by the next DECODE_PRIMARY_BITS bits of the stream. An entry
+// either resolves one or two whole symbols, or links to a secondary table for longer codes.
+#define DECODE_PRIMARY_BITS 11
+#define DECODE_MAX_SECONDARY_BITS 12 // Codes longer than 23 bits fall back to the tree walk
+
+#define ENTRY_INVALID 0u
+#define ENTRY_ONE 1u
+#define ENTRY_TWO 2u
+#define ENTRY_LINK 3u
+
+// Entry layout: sym1 [0..7], sym2 [8..15], total length [16..20], kind [21..22], sym1 length [23..27].
+// Links store the secondary table offset in [0..20] and its index width in [23..27].
+#define ENTRY_KIND(e) (((e) >> 21) & 3u)
+#define ENTRY_LENGTH(e) (((e) >> 16) & 31u)
+#define ENTRY_FIRST_LENGTH(e) (((e) >> 23) & 31u)
+#define ENTRY_LINK_OFFSET(e) ((e) & 0x1FFFFFu)
+#define MAKE_ENTRY(kind, sym1, sym2, len, len1) \
+    ((uint32_t)(sym1) | ((uint32_t)(sym2) << 8) | ((uint32_t)(len) << 16) | ((uint32_t)(kind) << 21) | ((uint32_t)(len1) << 23))
+#define MAKE_LINK(offset, bits) ((uint32_t)(offset) | (ENTRY_LINK << 21) | ((uint32_t)(bits) << 23))
+
+typedef struct {
+    uint32_t* entries; // Primary table followed by all secondary tables
+    size_t count;
+} HuffmanDecodeTable;
+
+// Reads an MSB-first packed stream; bits past the end of the data read as zero.
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;     // Next byte of data to load
+    uint64_t buf;   // Unconsumed bits, left-aligned
+    int bufBits;    // Number of valid bits in buf
+} BitReader;
+
+void bitReaderInit(BitReader* br, const unsigned char* data, size_t size) {
+    br->data = data;
+    br->size = size;
+    br->pos = 0;
+    br->buf = 0;
+    br->bufBits = 0;
+}
+
+static inline uint64_t loadBigEndian64(const unsigned char* p) {
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
 }
 
+static unsigned int loadBigEndian32(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
 
-// --- Decoding Function (read_lsb, decodeHuffmanFromImage) remain the same ---
-int read_lsb(FILE *image) {
-    unsigned char pixel_byte;
-    if (fread(&pixel_byte, 1, 1, image) == 1) {
-        return pixel_byte & 1;
+// Tops buf up to at least 57 valid bits.
+static inline void bitReaderRefill(BitReader* br) {
+    if (br->pos + 8 <= br->size) {
+        // Whole-word load; bits beyond the bytes we account for are reloaded next time.
+        br->buf |= loadBigEndian64(br->data + br->pos) >> br->bufBits;
+        int bytes = (63 - br->bufBits) >> 3;
+        br->pos += bytes;
+        br->bufBits += bytes * 8;
+        return;
+    }
+    while (br->bufBits <= 56) {
+        uint64_t byte = br->pos < br->size ? br->data[br->pos] : 0;
+        br->buf |= byte << (56 - br->bufBits);
+        br->pos++;
+        br->bufBits += 8;
     }
-    return -1;
 }
 
-void decodeHuffmanFromImage(const char *stegoImagePath, const char *outputFilePath) {
-    FILE *image = NULL, *output = NULL;
-    unsigned char *decodedData = NULL;
-    HuffmanNode *root = NULL;
+static inline void bitReaderSkip(BitReader* br, int count) {
+    br->buf <<= count;
+    br->bufBits -= count;
+}
+
+static inline unsigned long long bitReaderConsumed(const BitReader* br) {
+    return (unsigned long long)br->pos * 8 - br->bufBits;
+}
 
-    image = fopen(stegoImagePath, "rb");
-    if (!image) { fprintf(stderr, "Error opening stego image: %s\n", stegoImagePath); return; }
+void freeDecodeTable(HuffmanDecodeTable* table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+}
+
+// Builds lookup tables for any prefix code described by codeTable. Returns 0 when a code is
+// too long for the two-level scheme (the caller then uses huffmanDecodeTreeWalk) or on allocation failure.
+int buildDecodeTable(const CodeTable codeTable[BYTE_RANGE], HuffmanDecodeTable* table) {
+    const int primarySize = 1 << DECODE_PRIMARY_BITS;
+    int secondaryBits[1 << DECODE_PRIMARY_BITS] = {0};
+    size_t secondaryOffset[1 << DECODE_PRIMARY_BITS];
 
-    if (fseek(image, 54, SEEK_SET) != 0) { perror("fseek error skipping header"); fclose(image); return; }
+    table->entries = NULL;
+    table->count = 0;
 
-    unsigned int originalFileSize = 0;
-    printf("Reading original file size...\n");
-    for (int i = 0; i < 32; i++) {
-        int bit = read_lsb(image);
-        if (bit < 0) { fprintf(stderr, "Error reading file size from image.\n"); goto decode_cleanup; }
-        originalFileSize = (originalFileSize << 1) | bit;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        int len = codeTable[s].length;
+        if (len > DECODE_PRIMARY_BITS + DECODE_MAX_SECONDARY_BITS) return 0;
+        if (len > DECODE_PRIMARY_BITS) {
+            int prefix = (int)(codeTable[s].code >> (len - DECODE_PRIMARY_BITS));
+            if (len - DECODE_PRIMARY_BITS > secondaryBits[prefix])
+                secondaryBits[prefix] = len - DECODE_PRIMARY_BITS;
+        }
     }
-    printf("Extracted original file size: %u bytes\n", originalFileSize);
 
-     if (originalFileSize == 0) {
-        printf("Original file was empty. Creating empty output file.\n");
-        output = fopen(outputFilePath, "wb");
-        if (output) fclose(output);
-        else perror("Error creating empty output file");
-        goto decode_cleanup;
+    size_t count = primarySize;
+    for (int p = 0; p < primarySize; p++) {
+        secondaryOffset[p] = count;
+        if (secondaryBits[p]) count += (size_t)1 << secondaryBits[p];
+    }
+    uint32_t* entries = (uint32_t*)calloc(count, sizeof(uint32_t));
+    if (!entries) {
+        stegoSystemError("Failed to allocate Huffman decode table");
+        return 0;
+    }
+    for (int p = 0; p < primarySize; p++) {
+        if (secondaryBits[p]) entries[p] = MAKE_LINK(secondaryOffset[p], secondaryBits[p]);
     }
 
-    int freq[BYTE_RANGE];
-    printf("Reading frequency table...\n");
-    for (int i = 0; i < BYTE_RANGE; i++) {
-        unsigned int freq_val = 0;
-        for (int j = 0; j < 32; j++) {
-             int bit = read_lsb(image);
-             if (bit < 0) { fprintf(stderr, "Error reading frequency table from image.\n"); goto decode_cleanup; }
-             freq_val = (freq_val << 1) | bit;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        int len = codeTable[s].length;
+        if (len == 0) continue;
+        uint64_t code = codeTable[s].code;
+        uint32_t entry = MAKE_ENTRY(ENTRY_ONE, s, 0, len, len);
+        if (len <= DECODE_PRIMARY_BITS) {
+            size_t first = (size_t)code << (DECODE_PRIMARY_BITS - len);
+            size_t span = (size_t)1 << (DECODE_PRIMARY_BITS - len);
+            for (size_t i = 0; i < span; i++) entries[first + i] = entry;
+        } else {
+            int extra = len - DECODE_PRIMARY_BITS;
+            int prefix = (int)(code >> extra);
+            int bits = secondaryBits[prefix];
+            uint64_t low = code & (((uint64_t)1 << extra) - 1);
+            size_t first = secondaryOffset[prefix] + ((size_t)low << (bits - extra));
+            size_t span = (size_t)1 << (bits - extra);
+            for (size_t i = 0; i < span; i++) entries[first + i] = entry;
         }
-        freq[i] = (int)freq_val;
     }
 
-    printf("Rebuilding Huffman tree...\n");
-    root = buildHuffmanTree(freq);
-    if (!root) { fprintf(stderr, "Error rebuilding Huffman tree.\n"); goto decode_cleanup; }
-    if (!root->left && !root->right) { fprintf(stderr, "Error: Rebuilt tree is empty but file size > 0.\n"); goto decode_cleanup; }
+    // Pair up short codes: if the bits after the first symbol hold another complete
+    // primary-table symbol, one lookup emits both.
+    uint32_t single[1 << DECODE_PRIMARY_BITS];
+    memcpy(single, entries, sizeof(single));
+    for (int i = 0; i < primarySize; i++) {
+        uint32_t first = single[i];
+        if (ENTRY_KIND(first) != ENTRY_ONE) continue;
+        int len1 = (int)ENTRY_LENGTH(first);
+        if (len1 >= DECODE_PRIMARY_BITS) continue;
+        uint32_t second = single[(i << len1) & (primarySize - 1)];
+        if (ENTRY_KIND(second) != ENTRY_ONE) continue;
+        int len2 = (int)ENTRY_LENGTH(second);
+        if (len1 + len2 > DECODE_PRIMARY_BITS) continue;
+        entries[i] = MAKE_ENTRY(ENTRY_TWO, first & 0xFF, second & 0xFF, len1 + len2, len1);
+    }
 
-    decodedData = (unsigned char*)malloc(originalFileSize);
-    if (!decodedData) { perror("Memory allocation failed for decoded data"); goto decode_cleanup; }
+    table->entries = entries;
+    table->count = count;
+    return 1;
+}
 
-    printf("Decoding data...\n");
-    HuffmanNode *currentNode = root;
-    unsigned int bytesDecoded = 0;
-    while (bytesDecoded < originalFileSize) {
-        int bit = read_lsb(image);
-        if (bit < 0) { fprintf(stderr, "Error: Unexpected end of image data during decoding.\n"); goto decode_cleanup; }
+// Decodes up to outLen bytes from br into out and stores the count in *decoded. Unless 'final'
+// is set, decoding stops while the reader still has 8 unread bytes, so that the caller can
+// append more input first. Returns 0 on an invalid code.
+int huffmanDecodeChunk(const HuffmanDecodeTable* table, BitReader* br, unsigned char* out, size_t outLen,
+                       int final, size_t* decoded) {
+    const uint32_t* entries = table->entries;
+    size_t n = 0;
+    while (n < outLen && (final || br->pos + 8 <= br->size)) {
+        bitReaderRefill(br);
+        uint32_t e = entries[br->buf >> (64 - DECODE_PRIMARY_BITS)];
+        if (ENTRY_KIND(e) == ENTRY_LINK) {
+            int subBits = (int)ENTRY_FIRST_LENGTH(e);
+            e = entries[ENTRY_LINK_OFFSET(e) + (size_t)((br->buf << DECODE_PRIMARY_BITS) >> (64 - subBits))];
+        }
+        if (ENTRY_KIND(e) == ENTRY_TWO && n + 1 < outLen) {
+            out[n++] = (unsigned char)e;
+            out[n++] = (unsigned char)(e >> 8);
+            bitReaderSkip(br, (int)ENTRY_LENGTH(e));
+        } else if (ENTRY_KIND(e) != ENTRY_INVALID) {
+            out[n++] = (unsigned char)e;
+            bitReaderSkip(br, (int)ENTRY_FIRST_LENGTH(e));
+        } else {
+            stegoError("Error: Invalid code in Huffman stream during decoding.\n");
+            *decoded = n;
+            return 0;
+        }
+    }
+    *decoded = n;
+    return 1;
+}
 
-        if (bit == 0) { currentNode = currentNode->left; }
-        else { currentNode = currentNode->right; }
+// Decodes outLen bytes from a packed stream of bitCount bits. Returns 1 on success. Past the
+// end the reader returns zero bits, so the stream is checked for overruns every
+// HUFFMAN_CHECK_BYTES bytes rather than once at the end.
+#define HUFFMAN_CHECK_BYTES ((size_t)1 << 16)
+int huffmanDecodeTable(const HuffmanDecodeTable* table, const unsigned char* bits, unsigned long long bitCount,
+                       unsigned char* out, size_t outLen) {
+    BitReader br;
+    bitReaderInit(&br, bits, (size_t)((bitCount + 7) / 8));
+    for (size_t at = 0; at < outLen;) {
+        size_t want = outLen - at < HUFFMAN_CHECK_BYTES ? outLen - at : HUFFMAN_CHECK_BYTES;
+        size_t decoded = 0;
+        if (!huffmanDecodeChunk(table, &br, out + at, want, 1, &decoded)) return 0;
+        if (bitReaderConsumed(&br) > bitCount) {
+            stegoError("Error: Unexpected end of compressed data during decoding.\n");
+            return 0;
+        }
+        at += decoded;
+    }
+    return 1;
+}
 
+// Reference decoder: follows tree pointers one bit at a time.
+int huffmanDecodeTreeWalk(HuffmanNode* root, const unsigned char* bits, unsigned long long bitCount,
+                          unsigned char* out, size_t outLen) {
+    HuffmanNode* currentNode = root;
+    unsigned long long bitIndex = 0;
+    size_t n = 0;
+    while (n < outLen) {
+        if (bitIndex >= bitCount) {
+            stegoError("Error: Unexpected end of compressed data during decoding.\n");
+            return 0;
+        }
+        int bit = (bits[bitIndex >> 3] >> (7 - (bitIndex & 7))) & 1;
+        bitIndex++;
+        currentNode = bit ? currentNode->right : currentNode->left;
         if (currentNode == NULL) {
-             if (root->left && !root->right && !root->left->left && !root->left->right && bit == 0) {
-                currentNode = root->left;
-             } else {
-                fprintf(stderr, "Error: Invalid path in Huffman tree during decoding.\n");
-                goto decode_cleanup;
-             }
+            stegoError("Error: Invalid path in Huffman tree during decoding.\n");
+            return 0;
         }
-
-        if (currentNode && !currentNode->left && !currentNode->right) {
-            if (bytesDecoded < originalFileSize) { // Check bounds before writing
-                decodedData[bytesDecoded] = currentNode->data;
-            } else {
-                 fprintf(stderr, "Error: Decoded more bytes than expected.\n");
-                 goto decode_cleanup;
-            }
-            bytesDecoded++;
+        if (!currentNode->left && !currentNode->right) {
+            out[n++] = currentNode->data;
             currentNode = root;
         }
     }
-    printf("Decoded %u bytes.\n", bytesDecoded);
+    return 1;
+}
 
-    output = fopen(outputFilePath, "wb");
-    if (!output) { perror("Error creating output file"); goto decode_cleanup; }
 
-    if (fwrite(decodedData, 1, originalFileSize, output) != originalFileSize) {
-        fprintf(stderr, "Error writing decoded data to output file.\n");
-        fclose(output); output = NULL;
-        remove(outputFilePath);
-        goto decode_cleanup;
-    }
-    printf("File extracted successfully to '%s'\n", outputFilePath);
+// --- CRC32C (crc32cSoftware, crc32cHardware, crc32c) ---
+// CRC-32C (Castagnoli, reflected polynomial 0x82F63B78) guards the stego header and payload.
+// On x86 CPUs with SSE4.2 the crc32 instruction does the work, on three interleaved streams
+// since it has a latency of three cycles but a throughput of one per cycle. The three CRCs
+// are joined by shifting the earlier ones over the later streams' lengths of zeros with
+// precomputed tables. Elsewhere, slicing-by-8 tables handle eight bytes per step.
+// crc32c(crc32c(0, a), b) is the CRC of a followed by b.
+#define CRC32C_POLY 0x82F63B78u
+#define CRC32C_LONG 8192  // Bytes per stream in the long three-way loop
+#define CRC32C_SHORT 256  // and in the short one
 
-decode_cleanup:
-    if (image) fclose(image);
-    if (output) fclose(output);
-    if (decodedData) free(decodedData);
-    if (root) freeHuffmanTree(root);
+static uint32_t crc32cTable[8][BYTE_RANGE];
+static uint32_t crc32cLongShift[4][BYTE_RANGE];
+static uint32_t crc32cShortShift[4][BYTE_RANGE];
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+// Multiplies the GF(2) 32x32 matrix mat by the vector vec.
+static uint32_t gf2MatrixTimes(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
 }
 
+static void gf2MatrixSquare(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2MatrixTimes(mat, mat[n]);
+}
 
-// -----------------------------------------------------------------------------
-// NEW Main Function (Interactive CLI)
-// -----------------------------------------------------------------------------
+// Builds byte-wise tables for the operator that appends 'bytes' zero bytes (a power of two) to a CRC.
+static void crc32cShiftTables(uint32_t shift[4][BYTE_RANGE], size_t bytes) {
+    uint32_t op[32], square[32];
+    op[0] = CRC32C_POLY; // One zero bit
+    for (int n = 1; n < 32; n++) op[n] = 1u << (n - 1);
+    for (size_t bits = 1; bits < bytes * 8; bits <<= 1) {
+        gf2MatrixSquare(square, op);
+        memcpy(op, square, sizeof(op));
+    }
+    for (uint32_t n = 0; n < BYTE_RANGE; n++) {
+        for (int k = 0; k < 4; k++) shift[k][n] = gf2MatrixTimes(op, n << (8 * k));
+    }
+}
 
-// Helper function to read a line and remove trailing newline
-void readLine(char* buffer, int size) {
-    if (fgets(buffer, size, stdin)) {
-        buffer[strcspn(buffer, "\n")] = 0; // Remove trailing newline
-    } else {
-        buffer[0] = '\0'; // Handle EOF or read error
+static void crc32cInit(void) {
+    for (uint32_t n = 0; n < BYTE_RANGE; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32cTable[0][n] = crc;
     }
+    for (uint32_t n = 0; n < BYTE_RANGE; n++) {
+        for (int k = 1; k < 8; k++) crc32cTable[k][n] = crc32cTable[0][crc32cTable[k - 1][n] & 0xFF] ^ (crc32cTable[k - 1][n] >> 8);
+    }
+    crc32cShiftTables(crc32cLongShift, CRC32C_LONG);
+    crc32cShiftTables(crc32cShortShift, CRC32C_SHORT);
 }
 
-// Helper function to check if filename ends with .bmp (case-insensitive)
-int endsWithBMP(const char* filename) {
-    const char* dot = strrchr(filename, '.'); // Find last dot
-    if (dot && (strcasecmp(dot, ".bmp") == 0)) { // Compare ignoring case
-         return 1;
+static inline uint32_t crc32cShift(uint32_t shift[4][BYTE_RANGE], uint32_t crc) {
+    return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^ shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+    pthread_once(&crc32cOnce, crc32cInit);
+    crc = ~crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^ crc32cTable[5][(low >> 16) & 0xFF] ^
+              crc32cTable[4][low >> 24] ^ crc32cTable[3][data[4]] ^ crc32cTable[2][data[5]] ^ crc32cTable[1][data[6]] ^
+              crc32cTable[0][data[7]];
     }
-    return 0;
+    for (; size > 0; data++, size--) crc = crc32cTable[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    return ~crc;
 }
 
+#if defined(STEGO_X86) && defined(__x86_64__)
+static inline uint64_t loadWord64(const unsigned char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
 
-int main() {
-    char choice[20];
-    char inputImagePath[MAX_PATH_LEN];
-    char secretFilePath[MAX_PATH_LEN];
-    char outputImagePath[MAX_PATH_LEN];
-    char stegoImagePath[MAX_PATH_LEN];
-    char outputFilePath[MAX_PATH_LEN];
+// Runs the crc32 instruction over three streams of 'stream' bytes each, starting at *data.
+#define CRC32C_THREE_WAY(stream, shift)                                        \
+    while (size >= (stream) * 3) {                                             \
+        uint64_t crc1 = 0, crc2 = 0;                                           \
+        const unsigned char* end = data + (stream);                            \
+        for (; data < end; data += 8) {                                        \
+            crc0 = _mm_crc32_u64(crc0, loadWord64(data));                      \
+            crc1 = _mm_crc32_u64(crc1, loadWord64(data + (stream)));           \
+            crc2 = _mm_crc32_u64(crc2, loadWord64(data + (stream) * 2));       \
+        }                                                                      \
+        crc0 = crc32cShift(shift, (uint32_t)crc0) ^ (uint32_t)crc1;            \
+        crc0 = crc32cShift(shift, (uint32_t)crc0) ^ (uint32_t)crc2;            \
+        data += (stream) * 2;                                                  \
+        size -= (stream) * 3;                                                  \
+    }
 
-    printf("-------------------------------------------\n");
-    printf(" Simple Huffman Steganography Tool (BMP) \n");
-    printf("-------------------------------------------\n");
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    pthread_once(&crc32cOnce, crc32cInit);
+    uint64_t crc0 = ~crc;
+    for (; size > 0 && ((uintptr_t)data & 7) != 0; data++, size--) crc0 = _mm_crc32_u8((uint32_t)crc0, *data);
+    CRC32C_THREE_WAY(CRC32C_LONG, crc32cLongShift)
+    CRC32C_THREE_WAY(CRC32C_SHORT, crc32cShortShift)
+    for (; size >= 8; data += 8, size -= 8) crc0 = _mm_crc32_u64(crc0, loadWord64(data));
+    for (; size > 0; data++, size--) crc0 = _mm_crc32_u8((uint32_t)crc0, *data);
+    return ~(uint32_t)crc0;
+}
 
-    printf("Choose operation:\n");
-    printf("  1. Encode (hide file in BMP)\n");
-    printf("  2. Decode (extract file from BMP)\n");
-    printf("Enter choice (1 or 2): ");
-    readLine(choice, sizeof(choice));
+static int crc32cHardwareSupported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
 
-    if (strcmp(choice, "1") == 0) {
-        printf("\n--- Encode Mode ---\n");
+static int crc32cHardwareFound;
 
-        // Get Input BMP Image Path
-        printf("Enter path to the input BMP image file: ");
-        readLine(inputImagePath, sizeof(inputImagePath));
-        if (!endsWithBMP(inputImagePath)) {
-            printf("Warning: Input image file does not end with .bmp. Proceeding anyway.\n");
-            // You could add stricter checking or loop here if needed
-        }
+static void crc32cHardwareCheck(void) {
+    crc32cHardwareFound = crc32cHardwareSupported();
+}
+#endif
 
-        // Get Secret File Path (can be any file type)
-        printf("Enter path to the secret file to hide (text, image, etc.): ");
-        readLine(secretFilePath, sizeof(secretFilePath));
+// CRC-32C of size bytes of data, continuing from crc (0 to start).
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size) {
+#if defined(STEGO_X86) && defined(__x86_64__)
+    static pthread_once_t hardwareOnce = PTHREAD_ONCE_INIT;
+    pthread_once(&hardwareOnce, crc32cHardwareCheck);
+    if (crc32cHardwareFound) return crc32cHardware(crc, data, size);
+#endif
+    return crc32cSoftware(crc, data, size);
+}
 
-        // Get Output BMP Image Path
-        printf("Enter path for the output BMP image file (e.g., output.bmp): ");
-        readLine(outputImagePath, sizeof(outputImagePath));
-         if (!endsWithBMP(outputImagePath)) {
-            printf("Warning: Output image file does not end with .bmp. Output will be created with this name.\n");
-        }
+// Names the path crc32c takes on this CPU, for the self-test and bench output.
+const char* crc32cPathName(void) {
+#if defined(STEGO_X86) && defined(__x86_64__)
+    if (crc32cHardwareSupported()) return "sse4.2";
+#endif
+    return "slicing-by-8";
+}
 
 
-        printf("\nStarting encoding...\n");
-        encodeBinaryIntoImage(inputImagePath, secretFilePath, outputImagePath);
-        // Result message is printed inside encodeBinaryIntoImage
+// --- Stego Header (writeCodeLengths, readCodeLengths, writeStegoHeader, readStegoHeader) ---
+// The header is packed MSB-first and embedded in the LSBs of the first pixel bytes:
+//   magic 32 | version 8 | flags 8 | method 8 | depth 8 | original size 64 | compressed bits 64 |
+//   single stream (flags 0): code lengths, present when the size is non-zero (see writeCodeLengths)
+//   seek index (STEGO_FLAG_SEEK): checkpoint interval as a power of two (8), after the code lengths
+//   block mode (STEGO_FLAG_BLOCKS): block size as a power of two (8)
+//   shard (STEGO_FLAG_SHARD): set id (32) | shard index (16) | shard count (16) | offset of the
+//     payload in the whole file (64) | size of the whole file (64) | its CRC32C (32); see Shards
+//   zero padding up to a byte boundary | CRC32C of the header bytes before it (32).
+// Single-stream payloads start right after the header; with STEGO_FLAG_SEEK the stream is
+// followed by its seek index (see Seek Index). In block mode the header is followed by the
+// block index, one 32-bit stream size in bytes per block, and then the block streams.
+// The header always uses one bit per pixel byte; everything after it uses 'depth' bits per
+// pixel byte (see LSB Embedding), each index and every block stream starting on a new one.
+// The payload ends with the CRC32C of the original file (32), also on a new pixel byte.
+// Stored payloads (STEGO_METHOD_STORED) are the original bytes as they are, with no code
+// lengths and never in block mode. tANS payloads (STEGO_METHOD_TANS) always use block mode.
+// From version 6 on all of this goes into the usable pixel bytes of the BMP (see BMP Layout);
+// earlier versions used every byte from offset 54 on, row padding included.
+// With STEGO_FLAG_SCATTER all of it, the header included, goes into the pixel bytes in a keyed
+// order (see Keyed Scatter). Scattering is new in version 10, shards in version 9, checksums
+// in version 8 and seek indexes in version 7. Version 4 headers have no depth byte (always 1),
+// version 3 headers no method byte either (always Huffman), version 2 headers no flags byte
+// and version 1 headers also use 32-bit sizes.
+// Images from before the header existed begin with the 32-bit size and a table of 256
+// 32-bit frequencies instead (see decodeLegacyPayload).
+#define STEGO_MAGIC 0x53544748u // "STGH"
+#define STEGO_FORMAT_VERSION 10
+#define STEGO_SPAN_VERSION 6   // First version embedded on the pixel spans of the BMP
+#define STEGO_MAX_HEADER_BYTES 196
+#define STEGO_MAX_CODE_LENGTHS_BYTES 129 // Largest writeCodeLengths output, rounded up to bytes
+#define STEGO_FLAG_BLOCKS 0x01u
+#define STEGO_FLAG_SEEK 0x02u
+#define STEGO_FLAG_SHARD 0x04u
+#define STEGO_FLAG_SCATTER 0x08u
+#define STEGO_SEEK_VERSION 7   // First version with seek indexes
+#define STEGO_CHECKSUM_VERSION 8 // First version with header and payload checksums
+#define STEGO_SHARD_VERSION 9  // First version with shards
+#define STEGO_SCATTER_VERSION 10 // First version with keyed pixel orders
+#define STEGO_MAX_SHARDS 65535 // Shard indexes and counts take 16 bits
+#define STEGO_CHECKSUM_BITS 32
+#define STEGO_METHOD_HUFFMAN 0
+#define STEGO_METHOD_STORED 1
+#define STEGO_METHOD_TANS 2
+#define LSB_MAX_DEPTH 4        // Most bits hidden per pixel byte
+#define BLOCK_SIZE_LOG2 20     // Block mode splits payloads into 1 MB blocks
+#define BLOCK_SIZE_LOG2_MIN 12
+#define BLOCK_SIZE_LOG2_MAX 24 // Keeps every block stream size within 32 bits
+#define SEEK_LOG2_MIN 12
+#define SEEK_LOG2_MAX 24       // Keeps the code bits of every interval within 32 bits
 
-    } else if (strcmp(choice, "2") == 0) {
-        printf("\n--- Decode Mode ---\n");
+typedef struct {
+    uint32_t setId;                          // Shared by the shards of one encode
+    unsigned int index;                      // From 0
+    unsigned int count;
+    unsigned long long offset;               // Of this shard's payload in the whole file
+    unsigned long long totalSize;            // Of the whole file
+    uint32_t totalChecksum;                  // CRC32C of the whole file
+} StegoShard;
 
-        // Get Stego BMP Image Path
-        printf("Enter path to the stego BMP image file (containing hidden data): ");
-        readLine(stegoImagePath, sizeof(stegoImagePath));
-         if (!endsWithBMP(stegoImagePath)) {
-            printf("Warning: Stego image file does not end with .bmp. Proceeding anyway.\n");
-        }
+typedef struct {
+    unsigned int version;
+    unsigned int flags;
+    unsigned int method;                     // STEGO_METHOD_*
+    unsigned int depth;                      // Bits per pixel byte after the header, 1 to LSB_MAX_DEPTH
+    unsigned long long originalSize;
+    unsigned long long compressedBits;       // Block mode: total size of all block streams
+    unsigned char codeLengths[BYTE_RANGE];   // Single stream only
+    unsigned int blockSizeLog2;              // Block mode only
+    unsigned int seekLog2;                   // STEGO_FLAG_SEEK only
+    StegoShard shard;                        // STEGO_FLAG_SHARD only
+} StegoHeader;
+
+static inline unsigned int bitReaderGet(BitReader* br, int count) {
+    bitReaderRefill(br);
+    unsigned int value = (unsigned int)(br->buf >> (64 - count));
+    bitReaderSkip(br, count);
+    return value;
+}
+
+static inline unsigned long long bitReaderGet64(BitReader* br) {
+    unsigned long long high = bitReaderGet(br, 32);
+    return (high << 32) | bitReaderGet(br, 32);
+}
+
+// Code lengths take one of two forms (1 bit):
+//   sparse (0): symbol count - 1 (8), then per symbol: byte value (8), length (4)
+//   dense  (1): 256 x length (4)
+void writeCodeLengths(BitWriter* bw, const unsigned char lengths[BYTE_RANGE]) {
+    int symbolCount = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) symbolCount += lengths[s] != 0;
+    if (8 + 12 * symbolCount < 4 * BYTE_RANGE) {
+        bitWriterPut(bw, 0, 1);
+        bitWriterPut(bw, (uint64_t)(symbolCount - 1), 8);
+        for (int s = 0; s < BYTE_RANGE; s++) {
+            if (lengths[s]) bitWriterPut(bw, ((uint64_t)s << 4) | lengths[s], 12);
+        }
+    } else {
+        bitWriterPut(bw, 1, 1);
+        for (int s = 0; s < BYTE_RANGE; s++) bitWriterPut(bw, lengths[s], 4);
+    }
+}
+
+void readCodeLengths(BitReader* br, unsigned char lengths[BYTE_RANGE]) {
+    memset(lengths, 0, BYTE_RANGE);
+    if (bitReaderGet(br, 1) == 0) {
+        int symbolCount = (int)bitReaderGet(br, 8) + 1;
+        for (int i = 0; i < symbolCount; i++) {
+            unsigned int entry = bitReaderGet(br, 12);
+            lengths[entry >> 4] = (unsigned char)(entry & 0xF);
+        }
+    } else {
+        for (int s = 0; s < BYTE_RANGE; s++) lengths[s] = (unsigned char)bitReaderGet(br, 4);
+    }
+}
+
+// Serializes h into out (at least STEGO_MAX_HEADER_BYTES long). Returns the header size in bytes.
+size_t writeStegoHeader(const StegoHeader* h, unsigned char* out) {
+    BitWriter bw;
+    bitWriterInit(&bw, out);
+    bitWriterPut(&bw, STEGO_MAGIC, 32);
+    bitWriterPut(&bw, STEGO_FORMAT_VERSION, 8);
+    bitWriterPut(&bw, h->flags, 8);
+    bitWriterPut(&bw, h->method, 8);
+    bitWriterPut(&bw, h->depth, 8);
+    bitWriterPut(&bw, h->originalSize, 64);
+    bitWriterPut(&bw, h->compressedBits, 64);
+    if (h->flags & STEGO_FLAG_BLOCKS) {
+        bitWriterPut(&bw, h->blockSizeLog2, 8);
+    } else if (h->method == STEGO_METHOD_HUFFMAN && h->originalSize > 0) {
+        writeCodeLengths(&bw, h->codeLengths);
+        if (h->flags & STEGO_FLAG_SEEK) bitWriterPut(&bw, h->seekLog2, 8);
+    }
+    if (h->flags & STEGO_FLAG_SHARD) {
+        bitWriterPut(&bw, h->shard.setId, 32);
+        bitWriterPut(&bw, h->shard.index, 16);
+        bitWriterPut(&bw, h->shard.count, 16);
+        bitWriterPut(&bw, h->shard.offset, 64);
+        bitWriterPut(&bw, h->shard.totalSize, 64);
+        bitWriterPut(&bw, h->shard.totalChecksum, 32);
+    }
+    bitWriterFlush(&bw);
+    uint32_t checksum = crc32c(0, out, bw.pos);
+    bitWriterPut(&bw, checksum, 32);
+    bitWriterFlush(&bw);
+    return bw.pos;
+}
+
+// Parses a header from the first size bytes of data. Returns 1 on success (headerBytes receives
+// the header size), 0 if data does not start with the magic number, and -1 if it is malformed.
+int readStegoHeader(const unsigned char* data, size_t size, StegoHeader* h, size_t* headerBytes) {
+    BitReader br;
+    bitReaderInit(&br, data, size);
+    memset(h, 0, sizeof(*h));
+    if (size < 4 || bitReaderGet(&br, 32) != STEGO_MAGIC) return 0;
+
+    h->version = bitReaderGet(&br, 8);
+    h->depth = 1;
+    if (h->version == 1) {
+        h->originalSize = bitReaderGet(&br, 32);
+        h->compressedBits = bitReaderGet(&br, 32);
+    } else if (h->version >= 2 && h->version <= STEGO_FORMAT_VERSION) {
+        if (h->version >= 3) h->flags = bitReaderGet(&br, 8);
+        if (h->version >= 4) h->method = bitReaderGet(&br, 8);
+        h->depth = h->version >= 5 ? bitReaderGet(&br, 8) : 1;
+        h->originalSize = bitReaderGet64(&br);
+        h->compressedBits = bitReaderGet64(&br);
+    } else {
+        stegoError("Error: Unsupported stego format version %u.\n", h->version);
+        return -1;
+    }
+    unsigned int knownFlags = STEGO_FLAG_BLOCKS | (h->version >= STEGO_SEEK_VERSION ? STEGO_FLAG_SEEK : 0u) |
+                              (h->version >= STEGO_SHARD_VERSION ? STEGO_FLAG_SHARD : 0u) |
+                              (h->version >= STEGO_SCATTER_VERSION ? STEGO_FLAG_SCATTER : 0u);
+    if (h->flags & ~knownFlags) {
+        stegoError("Error: Unsupported stego header flags 0x%02x.\n", h->flags);
+        return -1;
+    }
+    if (h->method > STEGO_METHOD_TANS) {
+        stegoError("Error: Unsupported payload method %u in stego header.\n", h->method);
+        return -1;
+    }
+    if (h->depth < 1 || h->depth > LSB_MAX_DEPTH) {
+        stegoError("Error: Unsupported LSB depth %u in stego header.\n", h->depth);
+        return -1;
+    }
+    if (h->method == STEGO_METHOD_STORED) {
+        if ((h->flags & STEGO_FLAG_BLOCKS) || h->originalSize > (~0ULL >> 3) || h->compressedBits != h->originalSize * 8) {
+            stegoError("Error: Invalid stored payload in stego header.\n");
+            return -1;
+        }
+    } else if (h->method == STEGO_METHOD_TANS && !(h->flags & STEGO_FLAG_BLOCKS)) {
+        stegoError("Error: tANS payloads must use block mode.\n");
+        return -1;
+    } else if (h->method == STEGO_METHOD_HUFFMAN && !(h->flags & STEGO_FLAG_BLOCKS) && h->originalSize > h->compressedBits) {
+        // Every byte of a single Huffman stream takes at least one bit
+        stegoError("Error: Invalid Huffman payload in stego header.\n");
+        return -1;
+    }
+    if ((h->flags & STEGO_FLAG_SEEK) && (h->method != STEGO_METHOD_HUFFMAN || (h->flags & STEGO_FLAG_BLOCKS) || h->originalSize == 0)) {
+        stegoError("Error: Seek indexes need a single Huffman stream.\n");
+        return -1;
+    }
+    if (h->flags & STEGO_FLAG_BLOCKS) {
+        h->blockSizeLog2 = bitReaderGet(&br, 8);
+        if (h->blockSizeLog2 < BLOCK_SIZE_LOG2_MIN || h->blockSizeLog2 > BLOCK_SIZE_LOG2_MAX) {
+            stegoError("Error: Invalid block size in stego header.\n");
+            return -1;
+        }
+    } else if (h->method == STEGO_METHOD_HUFFMAN && h->originalSize > 0) {
+        readCodeLengths(&br, h->codeLengths);
+        if (h->flags & STEGO_FLAG_SEEK) {
+            h->seekLog2 = bitReaderGet(&br, 8);
+            if (h->seekLog2 < SEEK_LOG2_MIN || h->seekLog2 > SEEK_LOG2_MAX) {
+                stegoError("Error: Invalid seek interval in stego header.\n");
+                return -1;
+            }
+        }
+    }
+    if (h->flags & STEGO_FLAG_SHARD) {
+        StegoShard* shard = &h->shard;
+        shard->setId = bitReaderGet(&br, 32);
+        shard->index = bitReaderGet(&br, 16);
+        shard->count = bitReaderGet(&br, 16);
+        shard->offset = bitReaderGet64(&br);
+        shard->totalSize = bitReaderGet64(&br);
+        shard->totalChecksum = bitReaderGet(&br, 32);
+        if (shard->index >= shard->count || shard->offset > shard->totalSize || h->originalSize > shard->totalSize - shard->offset) {
+            stegoError("Error: Invalid shard record in stego header.\n");
+            return -1;
+        }
+    }
+
+    unsigned long long consumed = bitReaderConsumed(&br);
+    size_t bytes = (size_t)((consumed + 7) / 8);
+    size_t checksumBytes = h->version >= STEGO_CHECKSUM_VERSION ? STEGO_CHECKSUM_BITS / 8 : 0;
+    if (consumed > (unsigned long long)size * 8 || size - bytes < checksumBytes) {
+        stegoError("Error: Stego header is truncated.\n");
+        return -1;
+    }
+    if (checksumBytes && crc32c(0, data, bytes) != loadBigEndian32(data + bytes)) {
+        stegoError("Error: Stego header checksum mismatch.\n");
+        return -1;
+    }
+    *headerBytes = bytes + checksumBytes;
+    return 1;
+}
+
+static inline const char* stegoMethodName(unsigned int method) {
+    return method == STEGO_METHOD_STORED ? "stored" : method == STEGO_METHOD_TANS ? "tans" : "huffman";
+}
+
+// Number of blocks a block-mode payload is split into.
+static inline unsigned long long stegoBlockCount(const StegoHeader* h) {
+    return (h->originalSize >> h->blockSizeLog2) + ((h->originalSize & ((1ULL << h->blockSizeLog2) - 1)) != 0);
+}
+
+// Whether the block index of h, 32 bits per block, fits in the pixel bytes from 'pixel' on.
+// The block count comes from the header, so decoders check this before allocating a plan.
+static inline int stegoBlockIndexFits(const StegoHeader* h, unsigned long long availablePixels, unsigned long long pixel) {
+    return pixel <= availablePixels && stegoBlockCount(h) <= (availablePixels - pixel) / 32 * h->depth;
+}
+
+// Pixel bytes taken by the payload checksum at the end of the payload, if the format has one.
+static inline unsigned long long stegoChecksumPixels(const StegoHeader* h) {
+    return h->version >= STEGO_CHECKSUM_VERSION ? (STEGO_CHECKSUM_BITS + h->depth - 1) / h->depth : 0;
+}
+
+// Compares the payload checksum read from an image with the CRC32C of the decoded payload.
+// Images from before STEGO_CHECKSUM_VERSION have none and always pass. Returns 1 if they match.
+static int payloadChecksumMatches(const StegoHeader* h, const unsigned char* stored, uint32_t actual) {
+    if (h->version < STEGO_CHECKSUM_VERSION || loadBigEndian32(stored) == actual) return 1;
+    stegoError("Error: Payload checksum mismatch; the stego image is damaged.\n");
+    return 0;
+}
+
+// Number of checkpoints in a seek index: one per interval boundary inside the payload.
+static inline unsigned long long stegoSeekCount(const StegoHeader* h) {
+    return h->flags & STEGO_FLAG_SEEK ? (h->originalSize - 1) >> h->seekLog2 : 0;
+}
+
+// A shard holds only part of a file, so decoding one on its own would produce a fragment.
+// Reports it and returns 1 if h is a shard's header.
+static int shardRefused(const StegoHeader* h) {
+    if (!(h->flags & STEGO_FLAG_SHARD)) return 0;
+    stegoError("Error: The image holds shard %u of %u of a file; decode it together with the others (unshard).\n",
+               h->shard.index + 1, h->shard.count);
+    return 1;
+}
+
+
+// --- Job Statistics (StegoStats, statsBegin, statsPhase, statsAlloc, formatStatsFields) ---
+// With --stats, every encode and decode records where its time went and how much it moved,
+// reported as one JSON object per job. Phases are timed back to back: statsPhase() charges the
+// time since the previous call to the phase it names. In block mode, packing and embedding (and
+// extraction and decoding) run fused per block and are charged to embed (decode); in streaming
+// mode the file reads and writes are charged to the phase that needs them. allocBytes counts the
+// working buffers as they are reserved; a job keeps them all until it ends, so the total is its
+// peak. Mapped images are not included (see bytesRead and bytesWritten). A NULL StegoStats
+// records nothing.
+typedef enum {
+    STATS_READ, STATS_ANALYZE, STATS_COMPRESS, STATS_COVER, STATS_EMBED, STATS_COPY,
+    STATS_EXTRACT, STATS_DECODE, STATS_WRITE, STATS_PHASES
+} StatsPhase;
+
+static const char* const statsPhaseNames[STATS_PHASES] = {
+    "read", "analyze", "compress", "cover", "embed", "copy", "extract", "decode", "write"
+};
+
+typedef struct {
+    int decoding;
+    int streaming;
+    int legacy;                         // Decoded from the pre-header layout
+    unsigned int method;                // STEGO_METHOD_*
+    unsigned int depth;
+    int blocks;
+    double phaseMs[STATS_PHASES];
+    double mark;                        // End of the last phase charged
+    unsigned long long bytesRead;       // Secret and cover bytes read (encode), stego bytes read (decode)
+    unsigned long long bytesWritten;    // Stego image (encode) or recovered file (decode)
+    unsigned long long payloadBytes;
+    unsigned long long compressedBits;  // Payload bits after the header, block or seek index included
+    unsigned long long coverPixels;     // Usable pixel bytes of the cover
+    unsigned long long usedPixels;      // Pixel bytes carrying the header and payload
+    unsigned long long allocBytes;
+} StegoStats;
+
+static double stegoNowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void statsBegin(StegoStats* s, int decoding) {
+    if (!s) return;
+    memset(s, 0, sizeof(*s));
+    s->decoding = decoding;
+    s->depth = 1;
+    s->mark = stegoNowMs();
+}
+
+static inline void statsPhase(StegoStats* s, StatsPhase phase) {
+    if (!s) return;
+    double now = stegoNowMs();
+    s->phaseMs[phase] += now - s->mark;
+    s->mark = now;
+}
+
+static inline void statsAlloc(StegoStats* s, unsigned long long bytes) {
+    if (s) s->allocBytes += bytes;
+}
+
+// Records what the stego header says about the payload, and the cover's usable and used pixel bytes.
+void statsHeader(StegoStats* s, const StegoHeader* h, unsigned long long coverPixels, unsigned long long usedPixels) {
+    if (!s) return;
+    s->method = h->method;
+    s->depth = h->depth;
+    s->blocks = (h->flags & STEGO_FLAG_BLOCKS) != 0;
+    s->payloadBytes = h->originalSize;
+    s->compressedBits = h->compressedBits + (s->blocks ? stegoBlockCount(h) : stegoSeekCount(h)) * 32;
+    s->coverPixels = coverPixels;
+    s->usedPixels = usedPixels;
+}
+
+// Formats the members of a JSON object describing a job's statistics (no braces) into buf.
+// The process's peak resident size is added where the platform reports it.
+void formatStatsFields(char* buf, size_t size, const StegoStats* s) {
+    static const int encodePhases[] = { STATS_READ, STATS_ANALYZE, STATS_COMPRESS, STATS_COVER, STATS_EMBED, STATS_COPY, STATS_WRITE };
+    static const int decodePhases[] = { STATS_COVER, STATS_EXTRACT, STATS_DECODE, STATS_WRITE };
+    const int* phases = s->decoding ? decodePhases : encodePhases;
+    size_t phaseCount = s->decoding ? sizeof(decodePhases) / sizeof(decodePhases[0]) : sizeof(encodePhases) / sizeof(encodePhases[0]);
+    size_t n = 0;
+    n += (size_t)snprintf(buf + n, size - n, "\"mode\":\"%s\",\"method\":\"%s\",\"block_mode\":%s,\"depth\":%u,\"phases_ms\":{",
+                          s->streaming ? "streaming" : "memory", s->legacy ? "legacy" : stegoMethodName(s->method),
+                          s->blocks ? "true" : "false", s->depth);
+    for (size_t i = 0; i < phaseCount && n < size; i++) {
+        n += (size_t)snprintf(buf + n, size - n, "%s\"%s\":%.3f", i ? "," : "", statsPhaseNames[phases[i]], s->phaseMs[phases[i]]);
+    }
+    if (n >= size) return;
+    n += (size_t)snprintf(buf + n, size - n, "},\"bytes_read\":%llu,\"bytes_written\":%llu,\"payload_bytes\":%llu,"
+                          "\"compressed_bits\":%llu,\"compression_ratio\":%.4f,\"cover_pixel_bytes\":%llu,\"used_pixel_bytes\":%llu,"
+                          "\"cover_utilization\":%.4f,\"peak_alloc_bytes\":%llu",
+                          s->bytesRead, s->bytesWritten, s->payloadBytes, s->compressedBits,
+                          s->compressedBits ? s->payloadBytes * 8.0 / s->compressedBits : 0.0, s->coverPixels, s->usedPixels,
+                          s->coverPixels ? (double)s->usedPixels / s->coverPixels : 0.0, s->allocBytes);
+#ifndef _WIN32
+    struct rusage usage;
+    if (n < size && getrusage(RUSAGE_SELF, &usage) == 0) {
+        snprintf(buf + n, size - n, ",\"max_rss_kb\":%ld", (long)usage.ru_maxrss);
+    }
+#endif
+}
+
+
+// --- File I/O (readBinaryFile) ---
+// Reads a whole file into buffer. Returns the data, or NULL for an empty file (*fileSize is 0)
+// and for one that cannot be read (*fileSize is -1).
+unsigned char* readBinaryFile(const char* filePath, long* fileSize, ScratchBuffer* buffer) {
+    *fileSize = -1;
+    FILE* file = fopen(filePath, "rb");
+    if (!file) {
+        stegoError("Error opening file: %s\n", filePath);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    if (size < 0) {
+        stegoSystemError("ftell error");
+        fclose(file);
+        return NULL;
+    }
+    if (size == 0) {
+        stegoProgress("Input file '%s' is empty.\n", filePath);
+        fclose(file);
+        *fileSize = 0;
+        return NULL;
+    }
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char* data = scratchReserve(buffer, (size_t)size);
+    if (!data) {
+        stegoError("Memory allocation failed for reading file!\n");
+        fclose(file);
+        return NULL;
+    }
+
+    size_t bytesRead = fread(data, 1, (size_t)size, file);
+    if (bytesRead != (size_t)size) {
+         stegoError("Error reading file content.\n");
+         fclose(file);
+         return NULL;
+    }
+    fclose(file);
+    *fileSize = size;
+    return data;
+}
+
+// --- Pipes (pathIsStream, openInputStream, openOutputStream, closeStream, bufferSecretStream) ---
+// On the command line "-" stands for stdin as an input and stdout as an output, so that an
+// encode or decode runs without temporary files; other pipes (e.g. /dev/fd/3) work as well.
+// They take the streaming path, which reads the cover or stego image front to back once and
+// writes its output as it is produced. A piped secret is read into memory first, since
+// encoding reads it twice. With both the secret and the cover on stdin, the secret comes
+// first as a frame: its length in decimal on a line of its own, then its bytes.
+#define SECRET_FRAME_LINE 32           // Longest length line of a framed secret
+#define SECRET_BUFFER_BYTES (1u << 20) // First allocation for a piped secret; doubled as needed
+
+// Whether path is "-" or names something other than a regular file, such as a pipe.
+int pathIsStream(const char* path) {
+    if (strcmp(path, "-") == 0) return 1;
+#ifndef _WIN32
+    struct stat st;
+    if (stat(path, &st) == 0 && !S_ISREG(st.st_mode)) return 1;
+#endif
+    return 0;
+}
+
+static FILE* binaryStdio(FILE* stream) {
+#ifdef _WIN32
+    _setmode(_fileno(stream), _O_BINARY);
+#endif
+    return stream;
+}
+
+FILE* openInputStream(const char* path) {
+    return strcmp(path, "-") == 0 ? binaryStdio(stdin) : fopen(path, "rb");
+}
+
+FILE* openOutputStream(const char* path) {
+    return strcmp(path, "-") == 0 ? binaryStdio(stdout) : fopen(path, "wb");
+}
+
+// Closes a stream from openInputStream or openOutputStream; stdin and stdout are only
+// flushed. Returns 0 on success, as fclose.
+int closeStream(FILE* file) {
+    if (file == stdin) return 0;
+    if (file == stdout) return fflush(stdout);
+    return fclose(file);
+}
+
+// Deletes a partly written output, unless it went to stdout or a pipe.
+static void removeOutput(const char* path) {
+    if (!pathIsStream(path)) remove(path);
+}
+
+// Reads a secret from a stream that cannot be rewound (all of it, or the frame at the head
+// of stdin if framed) and returns a stream over a copy in memory that can be. *buffer receives
+// the copy; free it after closing the returned stream. Returns NULL on failure.
+FILE* bufferSecretStream(FILE* in, int framed, unsigned char** buffer) {
+    unsigned long long length = ~0ULL;
+    size_t size = 0, capacity = 0;
+    unsigned char* data = NULL;
+    FILE* file = NULL;
+    *buffer = NULL;
+    if (framed) {
+        char line[SECRET_FRAME_LINE];
+        char* end = NULL;
+        if (fgets(line, sizeof(line), in)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            length = strtoull(line, &end, 10);
+        }
+        if (!end || line[0] < '0' || line[0] > '9' || *end) {
+            stegoError("Error: A secret framed on stdin must start with its length on a line of its own.\n");
+            return NULL;
+        }
+    }
+    while (size < length) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : SECRET_BUFFER_BYTES;
+            if (capacity > length) capacity = (size_t)length;
+            unsigned char* grown = (unsigned char*)realloc(data, capacity);
+            if (!grown) { stegoSystemError("Failed to allocate secret buffer"); free(data); return NULL; }
+            data = grown;
+        }
+        size_t got = fread(data + size, 1, capacity - size, in);
+        if (got == 0) break;
+        size += got;
+    }
+    if (ferror(in) || (framed && size != length)) {
+        stegoError("Error reading secret file from %s.\n", framed ? "its frame on stdin" : "a pipe");
+        free(data);
+        return NULL;
+    }
+#ifndef _WIN32
+    file = size ? fmemopen(data, size, "rb") : fopen("/dev/null", "rb");
+#else
+    file = tmpfile(); // No fmemopen; the copy goes to a temporary file instead
+    if (file && (fwrite(data, 1, size, file) != size || fseek(file, 0, SEEK_SET) != 0)) {
+        fclose(file);
+        file = NULL;
+    }
+#endif
+    if (!file) { stegoSystemError("Failed to buffer secret file"); free(data); return NULL; }
+    *buffer = data;
+    return file;
+}
+
+// --- Image Buffers (openImageRead, createImageOutput, closeImage) ---
+// Cover and stego images are accessed as one contiguous byte array: memory-mapped where the
+// platform supports it, otherwise read/written with a single bulk fread/fwrite.
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    int mapped;        // 1 if data is an mmap of the file, 0 if it is a heap buffer
+    int writable;      // Output images are flushed to disk by closeImage
+    FILE* file;        // Heap-buffered output only: destination of the final write
+} ImageBuffer;
+
+int openImageRead(const char* path, ImageBuffer* img) {
+    memset(img, 0, sizeof(*img));
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            img->data = (unsigned char*)p;
+            img->size = (size_t)st.st_size;
+            img->mapped = 1;
+            return 1;
+        }
+    }
+    close(fd);
+#endif
+    long size = 0;
+    ScratchBuffer buffer = {0}; // Owned by img from here on
+    img->data = readBinaryFile(path, &size, &buffer);
+    if (!img->data) {
+        free(buffer.data);
+        return 0;
+    }
+    img->size = (size_t)size;
+    return 1;
+}
+
+int createImageOutput(const char* path, size_t size, ImageBuffer* img) {
+    memset(img, 0, sizeof(*img));
+    img->writable = 1;
+#ifndef _WIN32
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    if (size > 0 && ftruncate(fd, (off_t)size) == 0) {
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            close(fd);
+            img->data = (unsigned char*)p;
+            img->size = size;
+            img->mapped = 1;
+            return 1;
+        }
+    }
+    close(fd);
+#endif
+    img->file = fopen(path, "wb");
+    if (!img->file) return 0;
+    img->data = (unsigned char*)malloc(size ? size : 1);
+    if (!img->data) {
+        fclose(img->file);
+        img->file = NULL;
+        return 0;
+    }
+    img->size = size;
+    return 1;
+}
+
+// Releases the image; for outputs this is where the data reaches the file. Returns 1 on success.
+int closeImage(ImageBuffer* img) {
+    int ok = 1;
+    if (!img->data && !img->file) return 1;
+#ifndef _WIN32
+    if (img->mapped) {
+        if (munmap(img->data, img->size) != 0) ok = 0;
+        img->data = NULL;
+        return ok;
+    }
+#endif
+    if (img->file) {
+        if (fwrite(img->data, 1, img->size, img->file) != img->size) ok = 0;
+        if (fclose(img->file) != 0) ok = 0;
+        img->file = NULL;
+    }
+    free(img->data);
+    img->data = NULL;
+    return ok;
+}
+
+
+// --- Cover Clones (sameFile, cloneCoverFile, writeFileRange) ---
+// Most of a stego image is its cover unchanged. Rather than write every byte of it, an encode
+// from one file to another starts the output as a clone of the cover file and then writes
+// just the bytes from the first pixel byte to the last one the payload uses. On file systems
+// with shared extents (Btrfs, XFS) the clone costs next to nothing; elsewhere the kernel
+// copies the file (copy_file_range), and read and write are the last resort. With the cover
+// itself as the output the image is patched in place, e.g. to replace the payload of a stego
+// image. POSIX only; on Windows the output is written in full.
+#define CLONE_COPY_BYTES (1u << 20) // Buffer for the read and write fallback
+
+// Returns 1 if both paths name the same existing file.
+int sameFile(const char* a, const char* b) {
+#ifndef _WIN32
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#else
+    return _stricmp(a, b) == 0;
+#endif
+}
+
+#ifndef _WIN32
+// Writes size bytes of data to fd at offset, as pwrite but all of them. Returns 1 on success.
+int writeFileRange(int fd, const unsigned char* data, size_t size, unsigned long long offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        data += n;
+        size -= (size_t)n;
+        offset += (unsigned long long)n;
+    }
+    return 1;
+}
+
+// Makes outputPath a copy of the file at coverPath, or opens it as it is if it is that file,
+// and returns a descriptor open for writing it, or -1.
+int cloneCoverFile(const char* coverPath, const char* outputPath) {
+    struct stat from;
+    int src = open(coverPath, O_RDONLY);
+    if (src < 0) return -1;
+    if (fstat(src, &from) != 0) { close(src); return -1; }
+    if (sameFile(coverPath, outputPath)) {
+        close(src);
+        return open(outputPath, O_WRONLY);
+    }
+    int dst = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0) { close(src); return -1; }
+    off_t copied = 0;
+#ifdef FICLONE
+    if (ioctl(dst, FICLONE, src) == 0) copied = from.st_size;
+#endif
+#ifdef SYS_copy_file_range
+    while (copied < from.st_size) {
+        long n = syscall(SYS_copy_file_range, src, NULL, dst, NULL, (size_t)(from.st_size - copied), 0u);
+        if (n <= 0) break; // Not supported here; carry on from the same offsets below
+        copied += n;
+    }
+#endif
+    unsigned char* buffer = copied < from.st_size ? (unsigned char*)malloc(CLONE_COPY_BYTES) : NULL;
+    while (buffer && copied < from.st_size) {
+        ssize_t n = read(src, buffer, CLONE_COPY_BYTES);
+        if (n <= 0 || !writeFileRange(dst, buffer, (size_t)n, (unsigned long long)copied)) break;
+        copied += n;
+    }
+    free(buffer);
+    close(src);
+    if (copied < from.st_size) {
+        close(dst);
+        remove(outputPath);
+        return -1;
+    }
+    return dst;
+}
+#endif
+
+// --- BMP Layout (CoverLayout, parseBmpLayout, flatLayout, spanOffset, spanPixelsBelow) ---
+// Payload bits only go into the colour bytes of a BMP. Pixel rows start at bfOffBits and are
+// padded to a multiple of 4 bytes, and 32-bit images with an alpha mask keep their alpha
+// bytes as they are. A layout describes the rows as spans of usable bytes; "pixel byte" k
+// everywhere below is the k-th usable byte, taken row by row in file order (so bottom-up and
+// top-down images alike are walked front to back). Rows without gaps are merged into a single
+// span, which the LSB functions handle as one contiguous run. Format versions before 6 used
+// every byte from offset 54 on instead, which flatLayout describes.
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_LAYOUT_BYTES 70 // File bytes parseBmpLayout looks at, up to the V3+ alpha mask
+#define SCATTER_ROUNDS 4
+
+// A keyed order of the pixel bytes (see Keyed Scatter).
+typedef struct {
+    int enabled;
+    uint32_t roundKeys[SCATTER_ROUNDS];
+    unsigned long long blocks;     // Whole blocks of SCATTER_BLOCK_PIXELS
+    unsigned int blockBits;        // Width of the permutation of blocks 1 and up (even)
+    unsigned int tailBits;         // Width of the permutation of the pixel bytes after them (even)
+} PixelScatter;
+
+typedef struct {
+    unsigned long long dataOffset; // File offset of the first pixel row (bfOffBits)
+    unsigned long long rowStride;  // File bytes from one row to the next, padding included
+    unsigned long long rowBytes;   // Usable bytes per row; never 0
+    unsigned long long rows;
+    int alphaByte;                 // Byte of each 4-byte pixel that is left alone, or -1
+    unsigned long long capacity;   // Usable bytes in all rows
+    PixelScatter scatter;          // Pixel byte k is the scatter's k-th when enabled
+} CoverLayout;
+
+static inline unsigned int loadLittleEndian16(const unsigned char* p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+static inline unsigned int loadLittleEndian32(const unsigned char* p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// Parses the headers of a BMP whose first 'size' bytes are in data (at least BMP_LAYOUT_BYTES
+// of them when the file is that long) and whose whole file is fileSize bytes. Accepts
+// BITMAPINFOHEADER and its V2-V5 extensions with uncompressed 24-bit or 32-bit pixels.
+// Returns 1 on success; otherwise 0, with *error (if error is not NULL) saying why.
+int parseBmpLayout(const unsigned char* data, size_t size, unsigned long long fileSize, CoverLayout* layout, const char** error) {
+    const char* reason = NULL;
+    memset(layout, 0, sizeof(*layout));
+    layout->alphaByte = -1;
+    if (size < BMP_FILE_HEADER_SIZE + 40 || data[0] != 'B' || data[1] != 'M') {
+        reason = "not a BMP file";
+    } else if (loadLittleEndian32(data + 14) < 40) {
+        reason = "unsupported BMP header (BITMAPINFOHEADER or later needed)";
+    } else {
+        unsigned int infoSize = loadLittleEndian32(data + 14);
+        long long width = (int32_t)loadLittleEndian32(data + 18);
+        long long height = (int32_t)loadLittleEndian32(data + 22);
+        unsigned int bitCount = loadLittleEndian16(data + 28);
+        unsigned int compression = loadLittleEndian32(data + 30);
+        unsigned int alphaMask = 0;
+        // V3 and later headers, and BI_ALPHABITFIELDS masks after a V1 header, put the alpha
+        // mask at offset 66.
+        if (bitCount == 32 && (infoSize >= 56 || compression == 6) && size >= BMP_LAYOUT_BYTES) alphaMask = loadLittleEndian32(data + 66);
+        if (height < 0) height = -height;
+        if (width <= 0 || height == 0 || loadLittleEndian16(data + 26) != 1) {
+            reason = "invalid BMP dimensions";
+        } else if (!(bitCount == 24 && compression == 0) && !(bitCount == 32 && (compression == 0 || compression == 3 || compression == 6))) {
+            reason = "only uncompressed 24-bit and 32-bit BMPs are supported";
+        } else if (alphaMask != 0 && alphaMask != 0xFFu && alphaMask != 0xFF00u && alphaMask != 0xFF0000u && alphaMask != 0xFF000000u) {
+            reason = "unsupported BMP alpha mask";
+        } else {
+            unsigned long long rowData = (unsigned long long)width * (bitCount / 8);
+            layout->dataOffset = loadLittleEndian32(data + 10);
+            layout->rowStride = ((unsigned long long)width * bitCount + 31) / 32 * 4;
+            layout->rows = (unsigned long long)height;
+            layout->rowBytes = rowData;
+            if (alphaMask) {
+                layout->alphaByte = __builtin_ctz(alphaMask) / 8;
+                layout->rowBytes = (unsigned long long)width * 3;
+            }
+            // The last row may come without its padding.
+            if (layout->dataOffset < BMP_FILE_HEADER_SIZE + (unsigned long long)infoSize || layout->dataOffset > fileSize ||
+                layout->rows - 1 > (fileSize - layout->dataOffset) / layout->rowStride ||
+                layout->dataOffset + (layout->rows - 1) * layout->rowStride + rowData > fileSize) {
+                reason = "BMP pixel data is truncated";
+            } else if (layout->alphaByte < 0 && layout->rowStride == layout->rowBytes) {
+                layout->rowBytes = layout->rowStride = layout->rows * layout->rowStride;
+                layout->rows = 1;
+            }
+        }
+    }
+    if (reason) {
+        if (error) *error = reason;
+        return 0;
+    }
+    layout->capacity = layout->rows * layout->rowBytes;
+    return 1;
+}
+
+// The layout of images from before format version 6: every byte from offset 54 on.
+void flatLayout(CoverLayout* layout, unsigned long long fileSize) {
+    memset(layout, 0, sizeof(*layout));
+    layout->dataOffset = BMP_HEADER_SIZE;
+    layout->alphaByte = -1;
+    layout->rows = fileSize > BMP_HEADER_SIZE;
+    layout->rowBytes = layout->rowStride = layout->rows ? fileSize - BMP_HEADER_SIZE : 1;
+    layout->capacity = layout->rows * layout->rowBytes;
+}
+
+static inline int layoutContiguous(const CoverLayout* layout) {
+    return layout->rows <= 1 && layout->alphaByte < 0 && !layout->scatter.enabled;
+}
+
+// File offset of pixel byte 'pixel', in file order whether or not the layout is scattered.
+static inline unsigned long long spanOffset(const CoverLayout* layout, unsigned long long pixel) {
+    unsigned long long row = pixel / layout->rowBytes, col = pixel % layout->rowBytes;
+    if (layout->alphaByte >= 0) {
+        unsigned int channel = (unsigned int)(col % 3);
+        col = col / 3 * 4 + channel + (channel >= (unsigned int)layout->alphaByte);
+    }
+    return layout->dataOffset + row * layout->rowStride + col;
+}
+
+// Number of pixel bytes that lie before file offset 'offset'.
+static unsigned long long spanPixelsBelow(const CoverLayout* layout, unsigned long long offset) {
+    if (offset <= layout->dataOffset) return 0;
+    unsigned long long row = (offset - layout->dataOffset) / layout->rowStride;
+    unsigned long long col = (offset - layout->dataOffset) % layout->rowStride;
+    if (row >= layout->rows) return layout->capacity;
+    if (layout->alphaByte >= 0) {
+        unsigned int part = (unsigned int)(col % 4);
+        col = col / 4 * 3 + part - ((unsigned int)layout->alphaByte < part);
+    }
+    return row * layout->rowBytes + (col < layout->rowBytes ? col : layout->rowBytes);
+}
+
+
+// --- Keyed Scatter (scatterKeyRequested, scatterLayout, scatterPixel) ---
+// Payloads written front to back change the low bits of the first pixel bytes and leave the
+// rest alone, which is easy to spot. With a key (--key or STEGO_KEY) the pixel bytes are
+// taken in a keyed order instead, computed on the fly, so there is no index table.
+// Pixel bytes are numbered in SCATTER_CHUNK_PIXELS chunks, and the chunks are dealt out to
+// the whole SCATTER_BLOCK_PIXELS blocks of the image in turn, block 0 first (it holds the
+// header, so that a prefix of the file finds it) and the others in a keyed order, so that
+// even a small payload lands all over the image. Inside a block a keyed Feistel network,
+// tweaked by the block number, permutes the position. A chunk stays within one block, which
+// fits in the L2 cache, so gathering and scattering its bytes keeps the locality of the
+// kernels, and distinct chunks can be embedded in parallel. The pixel bytes after the last
+// whole block are permuted among themselves by cycle walking a Feistel network of the next
+// even width. The header is scattered as well; only the key finds it again. Such images
+// carry STEGO_FLAG_SCATTER. The key picks the order but does not encrypt anything.
+#define SCATTER_BLOCK_LOG2 16
+#define SCATTER_BLOCK_PIXELS (1ULL << SCATTER_BLOCK_LOG2)
+#define SCATTER_CHUNK_LOG2 12
+#define SCATTER_CHUNK_PIXELS (1ULL << SCATTER_CHUNK_LOG2)
+
+// The process-wide key: --key or STEGO_KEY if set, otherwise NULL (file order).
+const char* scatterKeyRequested(void) {
+    const char* forced = getenv("STEGO_KEY");
+    if (stegoOptions.key) return stegoOptions.key;
+    return forced && *forced ? forced : NULL;
+}
+
+// Orders the pixel bytes of a parsed layout by key, or in file order if key is NULL.
+void scatterLayout(CoverLayout* layout, const char* key) {
+    PixelScatter* scatter = &layout->scatter;
+    memset(scatter, 0, sizeof(*scatter));
+    if (!key) return;
+    uint64_t seed = 0xCBF29CE484222325ULL; // FNV-1a, then splitmix64 for the round keys
+    for (const char* c = key; *c; c++) seed = (seed ^ (unsigned char)*c) * 0x100000001B3ULL;
+    for (int r = 0; r < SCATTER_ROUNDS; r++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        scatter->roundKeys[r] = (uint32_t)(z ^ (z >> 31));
+    }
+    scatter->blocks = layout->capacity >> SCATTER_BLOCK_LOG2;
+    unsigned long long tail = layout->capacity & (SCATTER_BLOCK_PIXELS - 1);
+    scatter->blockBits = 2;
+    while (scatter->blocks > 1 && (1ULL << scatter->blockBits) < scatter->blocks - 1) scatter->blockBits += 2;
+    scatter->tailBits = 2;
+    while ((1ULL << scatter->tailBits) < tail) scatter->tailBits += 2;
+    scatter->enabled = 1;
+}
+
+// Round function: the top 'half' bits of a keyed multiplicative hash.
+static inline uint32_t scatterRound(uint32_t x, uint32_t key, unsigned int half) {
+    return ((x ^ key) * 0x9E3779B1u + key) >> (32 - half);
+}
+
+// Round keys of the permutations tweaked by 'tweak'.
+static inline void scatterKeys(const PixelScatter* scatter, uint32_t tweak, uint32_t keys[SCATTER_ROUNDS]) {
+    for (int r = 0; r < SCATTER_ROUNDS; r++) keys[r] = scatter->roundKeys[r] + tweak * 0x9E3779B9u;
+}
+
+// Permutes x in [0, 2^bits), bits even, by a Feistel network with the given round keys.
+static inline uint32_t scatterFeistel(const uint32_t keys[SCATTER_ROUNDS], uint32_t x, unsigned int bits) {
+    unsigned int half = bits / 2;
+    uint32_t mask = (1u << half) - 1;
+    uint32_t left = x >> half, right = x & mask;
+    for (int r = 0; r < SCATTER_ROUNDS; r++) {
+        uint32_t next = left ^ scatterRound(right, keys[r], half);
+        left = right;
+        right = next;
+    }
+    return (left << half) | right;
+}
+
+#if defined(STEGO_X86) && defined(__x86_64__)
+// For j below n, a multiple of 8: offsets[j] = start + the block position 'position' + j,
+// permuted as scatterFeistel does with SCATTER_BLOCK_LOG2 bits, eight positions at a time.
+__attribute__((target("avx2")))
+static void scatterBlockOffsetsAvx2(const uint32_t keys[SCATTER_ROUNDS], uint32_t position, size_t start, size_t* offsets, size_t n) {
+    const unsigned int half = SCATTER_BLOCK_LOG2 / 2;
+    const __m256i mask = _mm256_set1_epi32((1 << half) - 1), golden = _mm256_set1_epi32((int)0x9E3779B1u);
+    const __m256i base = _mm256_set1_epi64x((long long)start), step = _mm256_set1_epi32(8);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32((int)position), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    for (size_t j = 0; j < n; j += 8) {
+        __m256i left = _mm256_srli_epi32(index, half), right = _mm256_and_si256(index, mask);
+        for (int r = 0; r < SCATTER_ROUNDS; r++) {
+            __m256i key = _mm256_set1_epi32((int)keys[r]);
+            __m256i f = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_xor_si256(right, key), golden), key);
+            __m256i next = _mm256_xor_si256(left, _mm256_srli_epi32(f, 32 - half));
+            left = right;
+            right = next;
+        }
+        __m256i permuted = _mm256_or_si256(_mm256_slli_epi32(left, half), right);
+        _mm256_storeu_si256((__m256i*)(offsets + j), _mm256_add_epi64(base, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(permuted))));
+        _mm256_storeu_si256((__m256i*)(offsets + j + 4), _mm256_add_epi64(base, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(permuted, 1))));
+        index = _mm256_add_epi32(index, step);
+    }
+}
+#endif
+
+// Permutes x in [0, count) by cycle walking a Feistel network of width bits.
+static inline uint32_t scatterWalk(const PixelScatter* scatter, uint32_t x, uint32_t count, unsigned int bits, uint32_t tweak) {
+    uint32_t keys[SCATTER_ROUNDS];
+    scatterKeys(scatter, tweak, keys);
+    do x = scatterFeistel(keys, x, bits); while (x >= count);
+    return x;
+}
+
+// Whole block that chunk 'chunk' is dealt to; *position receives the chunk's first position
+// in it before the permutation.
+static inline uint32_t scatterChunkBlock(const PixelScatter* scatter, unsigned long long chunk, uint32_t* position) {
+    uint32_t block = (uint32_t)(chunk % scatter->blocks);
+    *position = (uint32_t)(chunk / scatter->blocks) << SCATTER_CHUNK_LOG2;
+    return block ? 1 + scatterWalk(scatter, block - 1, (uint32_t)scatter->blocks - 1, scatter->blockBits, 0xFFFFFFFFu) : 0;
+}
+
+// Pixel byte in file order that the scattered layout takes as its pixel byte 'pixel'.
+unsigned long long scatterPixel(const CoverLayout* layout, unsigned long long pixel) {
+    const PixelScatter* scatter = &layout->scatter;
+    unsigned long long whole = scatter->blocks << SCATTER_BLOCK_LOG2;
+    if (pixel >= whole) {
+        uint32_t tail = (uint32_t)(layout->capacity - whole);
+        return whole + scatterWalk(scatter, (uint32_t)(pixel - whole), tail, scatter->tailBits, (uint32_t)scatter->blocks);
+    }
+    uint32_t position;
+    uint32_t block = scatterChunkBlock(scatter, pixel >> SCATTER_CHUNK_LOG2, &position);
+    uint32_t keys[SCATTER_ROUNDS];
+    scatterKeys(scatter, block, keys);
+    position |= (uint32_t)(pixel & (SCATTER_CHUNK_PIXELS - 1));
+    return ((unsigned long long)block << SCATTER_BLOCK_LOG2) + scatterFeistel(keys, position, SCATTER_BLOCK_LOG2);
+}
+
+// Pixel bytes, in file order, that hold the first chunk of a scattered layout and so its
+// header: the first block, or all of them if there is no whole block.
+static inline unsigned long long scatterPrefixPixels(const CoverLayout* layout) {
+    return layout->capacity < SCATTER_BLOCK_PIXELS ? layout->capacity : SCATTER_BLOCK_PIXELS;
+}
+
+
+// --- LSB Kernels (scalar, BMI2, SSE2, AVX2, AVX-512BW) and runtime dispatch ---
+// A kernel writes or reads the low 'depth' bits of every pixel byte (1 to LSB_MAX_DEPTH) and
+// handles whole groups: 'depth' payload bytes map to 8 consecutive pixel bytes, the payload's
+// most significant bits going into the first of them, and within a pixel byte the earlier
+// payload bit sits in the higher position.
+
+typedef void (*EmbedKernelFn)(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount);
+typedef void (*ExtractKernelFn)(const unsigned char* src, unsigned char* bits, size_t groupCount);
+
+typedef struct {
+    const char* name;
+    unsigned int depth;
+    EmbedKernelFn embed;
+    ExtractKernelFn extract;
+    int (*supported)(void);
+} LsbKernel;
+
+static void embedKernelScalar(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t byteCount) {
+    for (size_t i = 0; i < byteCount; i++) {
+        unsigned int b = bits[i];
+        for (int j = 0; j < 8; j++) {
+            dst[j] = (unsigned char)((src[j] & 0xFE) | ((b >> (7 - j)) & 1));
+        }
+        dst += 8;
+        src += 8;
+    }
+}
+
+static void extractKernelScalar(const unsigned char* src, unsigned char* bits, size_t byteCount) {
+    for (size_t i = 0; i < byteCount; i++) {
+        unsigned int b = 0;
+        for (int j = 0; j < 8; j++) b = (b << 1) | (src[j] & 1);
+        bits[i] = (unsigned char)b;
+        src += 8;
+    }
+}
+
+// Depths 2 to 4: each group is loaded as one big-endian value of 8 * depth bits.
+static inline void embedGroupsScalar(unsigned char* dst, const unsigned char* src, const unsigned char* bits,
+                                     size_t groupCount, const unsigned int depth) {
+    const unsigned int low = (1u << depth) - 1;
+    for (size_t i = 0; i < groupCount; i++) {
+        uint32_t v = 0;
+        for (unsigned int j = 0; j < depth; j++) v = (v << 8) | bits[j];
+        for (unsigned int j = 0; j < 8; j++) {
+            dst[j] = (unsigned char)((src[j] & ~low) | ((v >> (depth * (7 - j))) & low));
+        }
+        dst += 8;
+        src += 8;
+        bits += depth;
+    }
+}
+
+static inline void extractGroupsScalar(const unsigned char* src, unsigned char* bits, size_t groupCount, const unsigned int depth) {
+    const unsigned int low = (1u << depth) - 1;
+    for (size_t i = 0; i < groupCount; i++) {
+        uint32_t v = 0;
+        for (unsigned int j = 0; j < 8; j++) v = (v << depth) | (src[j] & low);
+        for (unsigned int j = 0; j < depth; j++) bits[j] = (unsigned char)(v >> (8 * (depth - 1 - j)));
+        src += 8;
+        bits += depth;
+    }
+}
+
+static void embedKernelScalar2(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount) {
+    embedGroupsScalar(dst, src, bits, groupCount, 2);
+}
+
+static void extractKernelScalar2(const unsigned char* src, unsigned char* bits, size_t groupCount) {
+    extractGroupsScalar(src, bits, groupCount, 2);
+}
+
+static void embedKernelScalar3(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount) {
+    embedGroupsScalar(dst, src, bits, groupCount, 3);
+}
+
+static void extractKernelScalar3(const unsigned char* src, unsigned char* bits, size_t groupCount) {
+    extractGroupsScalar(src, bits, groupCount, 3);
+}
+
+static void embedKernelScalar4(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount) {
+    embedGroupsScalar(dst, src, bits, groupCount, 4);
+}
+
+static void extractKernelScalar4(const unsigned char* src, unsigned char* bits, size_t groupCount) {
+    extractGroupsScalar(src, bits, groupCount, 4);
+}
+
+static int kernelAlwaysSupported(void) { return 1; }
+
+#ifdef STEGO_X86
+static const uint64_t LSB_MASK64 = 0x0101010101010101ull;
+
+// Mirrors the bit order inside every byte, turning "byte k holds the LSB of pixel 8k+j at
+// bit j" into the MSB-first payload order and back.
+static inline uint64_t reverseBitsInBytes(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+    x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return x;
+}
+
+#ifdef __x86_64__
+__attribute__((target("bmi2")))
+static void embedKernelBmi2(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t byteCount) {
+    for (size_t i = 0; i < byteCount; i++) {
+        uint64_t pixels;
+        memcpy(&pixels, src + i * 8, 8);
+        uint64_t spread = _pdep_u64(reverseBitsInBytes(bits[i]), LSB_MASK64);
+        pixels = (pixels & ~LSB_MASK64) | spread;
+        memcpy(dst + i * 8, &pixels, 8);
+    }
+}
+
+__attribute__((target("bmi2")))
+static void extractKernelBmi2(const unsigned char* src, unsigned char* bits, size_t byteCount) {
+    for (size_t i = 0; i < byteCount; i++) {
+        uint64_t pixels;
+        memcpy(&pixels, src + i * 8, 8);
+        bits[i] = (unsigned char)reverseBitsInBytes(_pext_u64(pixels, LSB_MASK64));
+    }
+}
+
+// Depth 3: with the 8 pixel bytes read big-endian, the 24-bit group deposits straight into
+// the low 3 bits of each byte.
+__attribute__((target("bmi2")))
+static void embedKernelBmi2Depth3(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount) {
+    const uint64_t mask = LSB_MASK64 * 7;
+    for (size_t i = 0; i < groupCount; i++) {
+        uint64_t pixels;
+        memcpy(&pixels, src + i * 8, 8);
+        uint64_t v = ((uint64_t)bits[i * 3] << 16) | ((uint64_t)bits[i * 3 + 1] << 8) | bits[i * 3 + 2];
+        pixels = __builtin_bswap64((__builtin_bswap64(pixels) & ~mask) | _pdep_u64(v, mask));
+        memcpy(dst + i * 8, &pixels, 8);
+    }
+}
+
+__attribute__((target("bmi2")))
+static void extractKernelBmi2Depth3(const unsigned char* src, unsigned char* bits, size_t groupCount) {
+    const uint64_t mask = LSB_MASK64 * 7;
+    for (size_t i = 0; i < groupCount; i++) {
+        uint64_t pixels;
+        memcpy(&pixels, src + i * 8, 8);
+        uint64_t v = _pext_u64(__builtin_bswap64(pixels), mask);
+        bits[i * 3] = (unsigned char)(v >> 16);
+        bits[i * 3 + 1] = (unsigned char)(v >> 8);
+        bits[i * 3 + 2] = (unsigned char)v;
+    }
+}
+
+static int kernelBmi2Supported(void) { return __builtin_cpu_supports("bmi2"); }
+#endif
+
+__attribute__((target("sse2")))
+static void embedKernelSse2(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t byteCount) {
+    const __m128i select = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i keep = _mm_set1_epi8((char)0xFE);
+    size_t i = 0;
+    for (; i + 2 <= byteCount; i += 2) {
+        __m128i v = _mm_cvtsi32_si128(bits[i] | (bits[i + 1] << 8));
+        v = _mm_unpacklo_epi8(v, v);
+        v = _mm_unpacklo_epi16(v, v);
+        v = _mm_unpacklo_epi32(v, v); // bits[i] in lanes 0-7, bits[i + 1] in lanes 8-15
+        __m128i lsb = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, select), select), one);
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 8));
+        _mm_storeu_si128((__m128i*)(dst + i * 8), _mm_or_si128(_mm_and_si128(pixels, keep), lsb));
+    }
+    embedKernelScalar(dst + i * 8, src + i * 8, bits + i, byteCount - i);
+}
+
+__attribute__((target("sse2")))
+static void extractKernelSse2(const unsigned char* src, unsigned char* bits, size_t byteCount) {
+    size_t i = 0;
+    for (; i + 2 <= byteCount; i += 2) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 8));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_slli_epi16(pixels, 7));
+        uint64_t packed = reverseBitsInBytes(mask);
+        bits[i] = (unsigned char)packed;
+        bits[i + 1] = (unsigned char)(packed >> 8);
+    }
+    extractKernelScalar(src + i * 8, bits + i, byteCount - i);
+}
+
+// Depth 2: 16 payload bytes (8 groups) per step, each byte split into four 2-bit pixels.
+__attribute__((target("sse2")))
+static void embedKernelSse2Depth2(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount) {
+    const __m128i three = _mm_set1_epi8(3);
+    const __m128i keep = _mm_set1_epi8((char)0xFC);
+    size_t g = 0;
+    for (; g + 8 <= groupCount; g += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bits + g * 2));
+        __m128i a = _mm_and_si128(_mm_srli_epi16(v, 6), three);
+        __m128i b = _mm_and_si128(_mm_srli_epi16(v, 4), three);
+        __m128i c = _mm_and_si128(_mm_srli_epi16(v, 2), three);
+        __m128i d = _mm_and_si128(v, three);
+        __m128i abLow = _mm_unpacklo_epi8(a, b), abHigh = _mm_unpackhi_epi8(a, b);
+        __m128i cdLow = _mm_unpacklo_epi8(c, d), cdHigh = _mm_unpackhi_epi8(c, d);
+        __m128i spread[4] = { _mm_unpacklo_epi16(abLow, cdLow), _mm_unpackhi_epi16(abLow, cdLow),
+                              _mm_unpacklo_epi16(abHigh, cdHigh), _mm_unpackhi_epi16(abHigh, cdHigh) };
+        for (int k = 0; k < 4; k++) {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(src + g * 8 + k * 16));
+            _mm_storeu_si128((__m128i*)(dst + g * 8 + k * 16), _mm_or_si128(_mm_and_si128(pixels, keep), spread[k]));
+        }
+    }
+    embedKernelScalar2(dst + g * 8, src + g * 8, bits + g * 2, groupCount - g);
+}
+
+// Pairs of pixels become nibbles in 16-bit lanes, pairs of nibbles bytes in 32-bit lanes.
+__attribute__((target("sse2")))
+static void extractKernelSse2Depth2(const unsigned char* src, unsigned char* bits, size_t groupCount) {
+    const __m128i three = _mm_set1_epi8(3);
+    const __m128i byteMask16 = _mm_set1_epi16(0xFF);
+    const __m128i byteMask32 = _mm_set1_epi32(0xFF);
+    size_t g = 0;
+    for (; g + 8 <= groupCount; g += 8) {
+        __m128i packed[4];
+        for (int k = 0; k < 4; k++) {
+            __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + g * 8 + k * 16)), three);
+            __m128i nibbles = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(x, 2), _mm_srli_epi16(x, 8)), byteMask16);
+            packed[k] = _mm_and_si128(_mm_or_si128(_mm_slli_epi32(nibbles, 4), _mm_srli_epi32(nibbles, 16)), byteMask32);
+        }
+        __m128i words = _mm_packs_epi32(packed[0], packed[1]);
+        __m128i words2 = _mm_packs_epi32(packed[2], packed[3]);
+        _mm_storeu_si128((__m128i*)(bits + g * 2), _mm_packus_epi16(words, words2));
+    }
+    extractKernelScalar2(src + g * 8, bits + g * 2, groupCount - g);
+}
+
+// Depth 4: 16 payload bytes (4 groups) per step, each byte split into two nibble pixels.
+__attribute__((target("sse2")))
+static void embedKernelSse2Depth4(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t groupCount) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i keep = _mm_set1_epi8((char)0xF0);
+    size_t g = 0;
+    for (; g + 4 <= groupCount; g += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bits + g * 4));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i low = _mm_and_si128(v, nibble);
+        __m128i pixels0 = _mm_loadu_si128((const __m128i*)(src + g * 8));
+        __m128i pixels1 = _mm_loadu_si128((const __m128i*)(src + g * 8 + 16));
+        _mm_storeu_si128((__m128i*)(dst + g * 8), _mm_or_si128(_mm_and_si128(pixels0, keep), _mm_unpacklo_epi8(high, low)));
+        _mm_storeu_si128((__m128i*)(dst + g * 8 + 16), _mm_or_si128(_mm_and_si128(pixels1, keep), _mm_unpackhi_epi8(high, low)));
+    }
+    embedKernelScalar4(dst + g * 8, src + g * 8, bits + g * 4, groupCount - g);
+}
+
+__attribute__((target("sse2")))
+static void extractKernelSse2Depth4(const unsigned char* src, unsigned char* bits, size_t groupCount) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i byteMask16 = _mm_set1_epi16(0xFF);
+    size_t g = 0;
+    for (; g + 4 <= groupCount; g += 4) {
+        __m128i x0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + g * 8)), nibble);
+        __m128i x1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + g * 8 + 16)), nibble);
+        __m128i b0 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(x0, 4), _mm_srli_epi16(x0, 8)), byteMask16);
+        __m128i b1 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(x1, 4), _mm_srli_epi16(x1, 8)), byteMask16);
+        _mm_storeu_si128((__m128i*)(bits + g * 4), _mm_packus_epi16(b0, b1));
+    }
+    extractKernelScalar4(src + g * 8, bits + g * 4, groupCount - g);
+}
+
+static int kernelSse2Supported(void) { return __builtin_cpu_supports("sse2"); }
+
+__attribute__((target("avx2")))
+static void embedKernelAvx2(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t byteCount) {
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i select = _mm256_set1_epi64x((long long)0x0102040810204080ull);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i keep = _mm256_set1_epi8((char)0xFE);
+    size_t i = 0;
+    for (; i + 4 <= byteCount; i += 4) {
+        int word;
+        memcpy(&word, bits + i, 4);
+        __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        __m256i lsb = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(v, select), select), one);
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + i * 8));
+        _mm256_storeu_si256((__m256i*)(dst + i * 8), _mm256_or_si256(_mm256_and_si256(pixels, keep), lsb));
+    }
+    embedKernelScalar(dst + i * 8, src + i * 8, bits + i, byteCount - i);
+}
+
+__attribute__((target("avx2")))
+static void extractKernelAvx2(const unsigned char* src, unsigned char* bits, size_t byteCount) {
+    // Reverse each group of 8 pixel bytes so movemask yields MSB-first payload bytes directly.
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+    for (; i + 4 <= byteCount; i += 4) {
+        __m256i pixels = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i * 8)), reverse);
+        int mask = _mm256_movemask_epi8(_mm256_slli_epi16(pixels, 7));
+        memcpy(bits + i, &mask, 4);
+    }
+    extractKernelScalar(src + i * 8, bits + i, byteCount - i);
+}
+
+static int kernelAvx2Supported(void) { return __builtin_cpu_supports("avx2"); }
+
+__attribute__((target("avx512f,avx512bw")))
+static void embedKernelAvx512(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t byteCount) {
+    const __m512i keep = _mm512_set1_epi8((char)0xFE);
+    const __m512i one = _mm512_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 8 <= byteCount; i += 8) {
+        uint64_t word;
+        memcpy(&word, bits + i, 8);
+        __m512i pixels = _mm512_loadu_si512((const void*)(src + i * 8));
+        __m512i lsb = _mm512_maskz_mov_epi8((__mmask64)reverseBitsInBytes(word), one);
+        _mm512_storeu_si512((void*)(dst + i * 8), _mm512_or_si512(_mm512_and_si512(pixels, keep), lsb));
+    }
+    embedKernelScalar(dst + i * 8, src + i * 8, bits + i, byteCount - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void extractKernelAvx512(const unsigned char* src, unsigned char* bits, size_t byteCount) {
+    const __m512i one = _mm512_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 8 <= byteCount; i += 8) {
+        __m512i pixels = _mm512_loadu_si512((const void*)(src + i * 8));
+        uint64_t word = reverseBitsInBytes((uint64_t)_mm512_test_epi8_mask(pixels, one));
+        memcpy(bits + i, &word, 8);
+    }
+    extractKernelScalar(src + i * 8, bits + i, byteCount - i);
+}
+
+static int kernelAvx512Supported(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+// Ordered from most to least preferred; for each depth the first supported entry is used by default.
+static const LsbKernel lsbKernels[] = {
+#ifdef STEGO_X86
+    { "avx512bw", 1, embedKernelAvx512, extractKernelAvx512, kernelAvx512Supported },
+    { "avx2", 1, embedKernelAvx2, extractKernelAvx2, kernelAvx2Supported },
+    { "sse2", 1, embedKernelSse2, extractKernelSse2, kernelSse2Supported },
+    { "sse2", 2, embedKernelSse2Depth2, extractKernelSse2Depth2, kernelSse2Supported },
+    { "sse2", 4, embedKernelSse2Depth4, extractKernelSse2Depth4, kernelSse2Supported },
+#ifdef __x86_64__
+    { "bmi2", 1, embedKernelBmi2, extractKernelBmi2, kernelBmi2Supported },
+    { "bmi2", 3, embedKernelBmi2Depth3, extractKernelBmi2Depth3, kernelBmi2Supported },
+#endif
+#endif
+    { "scalar", 1, embedKernelScalar, extractKernelScalar, kernelAlwaysSupported },
+    { "scalar", 2, embedKernelScalar2, extractKernelScalar2, kernelAlwaysSupported },
+    { "scalar", 3, embedKernelScalar3, extractKernelScalar3, kernelAlwaysSupported },
+    { "scalar", 4, embedKernelScalar4, extractKernelScalar4, kernelAlwaysSupported },
+};
+#define LSB_KERNEL_COUNT ((int)(sizeof(lsbKernels) / sizeof(lsbKernels[0])))
+
+static const LsbKernel* activeKernels[LSB_MAX_DEPTH + 1];
+static pthread_once_t activeKernelsOnce = PTHREAD_ONCE_INIT;
+
+static void resolveLsbKernels(void) {
+#ifdef STEGO_X86
+    __builtin_cpu_init();
+#endif
+    const char* forced = getenv("STEGO_LSB_KERNEL");
+    for (unsigned int d = 1; d <= LSB_MAX_DEPTH; d++) {
+        for (int i = 0; i < LSB_KERNEL_COUNT && forced && !activeKernels[d]; i++) {
+            if (lsbKernels[i].depth == d && strcmp(lsbKernels[i].name, forced) == 0 && lsbKernels[i].supported()) {
+                activeKernels[d] = &lsbKernels[i];
+            }
+        }
+        for (int i = 0; i < LSB_KERNEL_COUNT && !activeKernels[d]; i++) {
+            if (lsbKernels[i].depth == d && lsbKernels[i].supported()) activeKernels[d] = &lsbKernels[i];
+        }
+    }
+}
+
+// Picks the best kernel for this CPU and depth. STEGO_LSB_KERNEL=<name> forces a specific
+// (supported) one where it exists for the depth. The first call resolves every depth, once
+// even when library calls on several threads make it at the same time.
+const LsbKernel* selectLsbKernel(unsigned int depth) {
+    pthread_once(&activeKernelsOnce, resolveLsbKernels);
+    return activeKernels[depth];
+}
+
+
+// --- LSB Embedding (lsbPixels, embedBits, extractBits, spanEmbedBits, spanExtractBits) ---
+// Bit k of an MSB-first packed stream goes into pixel byte k / depth, at bit position
+// depth - 1 - k % depth. Every stream starts on a fresh pixel byte; a final pixel byte that is
+// only partly used keeps the cover's remaining low bits.
+
+// Pixel bytes taken by bitCount bits at the given depth.
+static inline unsigned long long lsbPixels(unsigned long long bitCount, unsigned int depth) {
+    return (bitCount + depth - 1) / depth;
+}
+
+// Bit-at-a-time embedding for the part of a stream that does not fill a whole group.
+static void embedBitsTail(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t bitCount, unsigned int depth) {
+    for (size_t k = 0; k < bitCount; k++) {
+        size_t p = k / depth;
+        unsigned int shift = depth - 1 - (unsigned int)(k % depth);
+        unsigned int bit = (bits[k / 8] >> (7 - k % 8)) & 1;
+        unsigned int base = k % depth == 0 ? src[p] : dst[p];
+        dst[p] = (unsigned char)((base & ~(1u << shift)) | (bit << shift));
+    }
+}
+
+static void extractBitsTail(const unsigned char* src, unsigned char* bits, size_t bitCount, unsigned int depth) {
+    if (bitCount) memset(bits, 0, (bitCount + 7) / 8);
+    for (size_t k = 0; k < bitCount; k++) {
+        unsigned int bit = (src[k / depth] >> (depth - 1 - k % depth)) & 1;
+        bits[k / 8] |= (unsigned char)(bit << (7 - k % 8));
+    }
+}
+
+// Replaces the low depth bits of the pixel bytes in src with bitCount bits of an MSB-first
+// packed stream and stores the result in dst. dst may equal src.
+void embedBits(unsigned char* dst, const unsigned char* src, const unsigned char* bits, size_t bitCount, unsigned int depth) {
+    size_t groups = bitCount / (8 * depth);
+    selectLsbKernel(depth)->embed(dst, src, bits, groups);
+    embedBitsTail(dst + groups * 8, src + groups * 8, bits + groups * depth, bitCount - groups * 8 * depth, depth);
+}
+
+// Packs bitCount bits from the low depth bits of the source bytes MSB-first; a trailing
+// partial byte is zero-padded.
+void extractBits(const unsigned char* src, unsigned char* bits, size_t bitCount, unsigned int depth) {
+    size_t groups = bitCount / (8 * depth);
+    selectLsbKernel(depth)->extract(src, bits, groups);
+    extractBitsTail(src + groups * 8, bits + groups * depth, bitCount - groups * 8 * depth, depth);
+}
+
+// Pixel bytes of an image seen through its layout. dst and src hold the file bytes from
+// offset 'origin' on: the whole file for in-memory images, the window of a CoverStream.
+// dst is NULL when only extracting and may equal src.
+typedef struct {
+    const CoverLayout* layout;
+    unsigned char* dst;
+    const unsigned char* src;
+    unsigned long long origin;
+} PixelView;
+
+#define SPAN_BOUNCE_BYTES 4096 // Pixel bytes gathered at once from rows with alpha bytes or scattered layouts
+
+// Offsets into the view's bytes of 'count' pixel bytes of a scattered layout from pixel byte
+// 'pixel' on. The block of a chunk and its round keys are looked up once, and rows without
+// padding or alpha bytes need no division, so the loop over a chunk vectorizes.
+static void scatterOffsets(const PixelView* view, unsigned long long pixel, size_t* offsets, size_t count) {
+    const CoverLayout* layout = view->layout;
+    const PixelScatter* scatter = &layout->scatter;
+    const unsigned long long whole = scatter->blocks << SCATTER_BLOCK_LOG2;
+    const int packed = layout->alphaByte < 0 && layout->rowStride == layout->rowBytes;
+    size_t i = 0;
+    while (i < count && pixel + i < whole) {
+        uint32_t keys[SCATTER_ROUNDS], position, block = scatterChunkBlock(scatter, (pixel + i) >> SCATTER_CHUNK_LOG2, &position);
+        uint32_t first = (uint32_t)((pixel + i) & (SCATTER_CHUNK_PIXELS - 1));
+        unsigned long long base = (unsigned long long)block << SCATTER_BLOCK_LOG2;
+        size_t n = SCATTER_CHUNK_PIXELS - first < count - i ? (size_t)(SCATTER_CHUNK_PIXELS - first) : count - i;
+        scatterKeys(scatter, block, keys);
+        if (packed) {
+            size_t start = (size_t)(layout->dataOffset + base - view->origin), j = 0;
+#if defined(STEGO_X86) && defined(__x86_64__)
+            if (__builtin_cpu_supports("avx2")) {
+                j = n / 8 * 8;
+                scatterBlockOffsetsAvx2(keys, position | first, start, offsets + i, j);
+            }
+#endif
+            for (; j < n; j++) offsets[i + j] = start + scatterFeistel(keys, position | (first + (uint32_t)j), SCATTER_BLOCK_LOG2);
+        } else {
+            for (size_t j = 0; j < n; j++) {
+                unsigned long long q = base + scatterFeistel(keys, position | (first + (uint32_t)j), SCATTER_BLOCK_LOG2);
+                offsets[i + j] = (size_t)(spanOffset(layout, q) - view->origin);
+            }
+        }
+        i += n;
+    }
+    for (; i < count; i++) offsets[i] = (size_t)(spanOffset(layout, scatterPixel(layout, pixel + i)) - view->origin);
+}
+
+
+// Copies 'count' pixel bytes from pixel byte 'pixel' on out of the view's source into
+// buffer, or with scatter set, from buffer into its destination.
+static void spanCopy(const PixelView* view, unsigned long long pixel, unsigned char* buffer, size_t count, int scatter) {
+    const CoverLayout* layout = view->layout;
+    while (count > 0) {
+        unsigned long long col = pixel % layout->rowBytes;
+        size_t n = layout->rowBytes - col < count ? (size_t)(layout->rowBytes - col) : count;
+        size_t at = (size_t)(spanOffset(layout, pixel) - view->origin);
+        if (layout->alphaByte < 0) {
+            if (scatter) memcpy(view->dst + at, buffer, n);
+            else memcpy(buffer, view->src + at, n);
+        } else {
+            // A partial pixel first and last, whole pixels (three bytes of four) in between.
+            unsigned int alpha = (unsigned int)layout->alphaByte;
+            unsigned int channel = (unsigned int)(col % 3);
+            const unsigned int c0 = alpha == 0, c1 = 1 + (alpha <= 1), c2 = 2 + (alpha <= 2);
+            size_t i = 0;
+            at -= channel + (channel >= alpha); // Start of the 4-byte pixel
+            for (; i < n && channel > 0; i++, channel = (channel + 1) % 3) {
+                unsigned int part = channel + (channel >= alpha);
+                if (scatter) view->dst[at + part] = buffer[i];
+                else buffer[i] = view->src[at + part];
+                if (channel == 2) at += 4;
+            }
+            if (scatter) {
+                for (; i + 3 <= n; i += 3, at += 4) {
+                    view->dst[at + c0] = buffer[i];
+                    view->dst[at + c1] = buffer[i + 1];
+                    view->dst[at + c2] = buffer[i + 2];
+                }
+            } else {
+                for (; i + 3 <= n; i += 3, at += 4) {
+                    buffer[i] = view->src[at + c0];
+                    buffer[i + 1] = view->src[at + c1];
+                    buffer[i + 2] = view->src[at + c2];
+                }
+            }
+            for (unsigned int c = 0; i < n; i++, c++) {
+                if (scatter) view->dst[at + c + (c >= alpha)] = buffer[i];
+                else buffer[i] = view->src[at + c + (c >= alpha)];
+            }
+        }
+        pixel += n;
+        buffer += n;
+        count -= n;
+    }
+}
+
+// embedBits from pixel byte 'pixel' of a view on. Runs of contiguous pixel bytes go straight
+// to the kernels; a group that crosses the end of a row, rows with alpha bytes and scattered
+// layouts are gathered into a small buffer, embedded there and scattered back.
+void spanEmbedBits(const PixelView* view, unsigned long long pixel, const unsigned char* bits, size_t bitCount, unsigned int depth) {
+    const CoverLayout* layout = view->layout;
+    while (bitCount > 0) {
+        unsigned long long pixels = lsbPixels(bitCount, depth);
+        unsigned long long run = layout->alphaByte < 0 && !layout->scatter.enabled ? layout->rowBytes - pixel % layout->rowBytes : 0;
+        size_t n;
+        if (run >= pixels || run >= 8) {
+            size_t at = (size_t)(spanOffset(layout, pixel) - view->origin);
+            n = run >= pixels ? bitCount : (size_t)(run / 8) * 8 * depth;
+            embedBits(view->dst + at, view->src + at, bits, n, depth);
+        } else {
+            unsigned char bounce[SPAN_BOUNCE_BYTES];
+            size_t count = layout->alphaByte < 0 && !layout->scatter.enabled ? 8 : SPAN_BOUNCE_BYTES;
+            if (count >= pixels) count = (size_t)pixels;
+            n = count == pixels ? bitCount : count * depth;
+            if (layout->scatter.enabled) {
+                size_t offsets[SPAN_BOUNCE_BYTES];
+                scatterOffsets(view, pixel, offsets, count);
+                for (size_t i = 0; i < count; i++) bounce[i] = view->src[offsets[i]];
+                embedBits(bounce, bounce, bits, n, depth);
+                for (size_t i = 0; i < count; i++) view->dst[offsets[i]] = bounce[i];
+            } else {
+                spanCopy(view, pixel, bounce, count, 0);
+                embedBits(bounce, bounce, bits, n, depth);
+                spanCopy(view, pixel, bounce, count, 1);
+            }
+        }
+        pixel += lsbPixels(n, depth);
+        bits += n / 8;
+        bitCount -= n;
+    }
+}
+
+// extractBits from pixel byte 'pixel' of a view on, the same way.
+void spanExtractBits(const PixelView* view, unsigned long long pixel, unsigned char* bits, size_t bitCount, unsigned int depth) {
+    const CoverLayout* layout = view->layout;
+    while (bitCount > 0) {
+        unsigned long long pixels = lsbPixels(bitCount, depth);
+        unsigned long long run = layout->alphaByte < 0 && !layout->scatter.enabled ? layout->rowBytes - pixel % layout->rowBytes : 0;
+        size_t n;
+        if (run >= pixels || run >= 8) {
+            n = run >= pixels ? bitCount : (size_t)(run / 8) * 8 * depth;
+            extractBits(view->src + (size_t)(spanOffset(layout, pixel) - view->origin), bits, n, depth);
+        } else {
+            unsigned char bounce[SPAN_BOUNCE_BYTES];
+            size_t count = layout->alphaByte < 0 && !layout->scatter.enabled ? 8 : SPAN_BOUNCE_BYTES;
+            if (count >= pixels) count = (size_t)pixels;
+            n = count == pixels ? bitCount : count * depth;
+            if (layout->scatter.enabled) {
+                size_t offsets[SPAN_BOUNCE_BYTES];
+                scatterOffsets(view, pixel, offsets, count);
+                for (size_t i = 0; i < count; i++) bounce[i] = view->src[offsets[i]];
+            } else {
+                spanCopy(view, pixel, bounce, count, 0);
+            }
+            extractBits(bounce, bits, n, depth);
+        }
+        pixel += lsbPixels(n, depth);
+        bits += n / 8;
+        bitCount -= n;
+    }
+}
+
+
+// --- Stego Header Lookup (readImagePrefix, readCoverPrefix, findStegoHeader) ---
+// Format version 6 and later put everything on the pixel spans of the BMP, older versions
+// (and legacy payloads) on every byte from offset 54 on. An image is read through its spans
+// if the magic and such a version are found there, and through the flat layout otherwise.
+
+// Extracts up to 'bytes' header bytes (one bit per pixel byte) through a layout from the
+// file bytes data[0, size). Returns the number extracted.
+static size_t extractHeaderBytes(const CoverLayout* layout, const unsigned char* data, size_t size, unsigned char* header, size_t bytes) {
+    PixelView view = { layout, NULL, data, 0 };
+    unsigned long long pixels = spanPixelsBelow(layout, size);
+    if (layout->scatter.enabled && pixels < scatterPrefixPixels(layout)) pixels = 0;
+    if (pixels / 8 < bytes) bytes = (size_t)(pixels / 8);
+    spanExtractBits(&view, 0, header, bytes * 8, 1);
+    return bytes;
+}
+
+// File bytes findStegoHeader needs from the start of an image, given its first
+// BMP_LAYOUT_BYTES (or all of it, if shorter) in start.
+static unsigned long long coverPrefixBytes(const unsigned char* start, size_t size, unsigned long long fileSize) {
+    const unsigned long long headerPixels = scatterKeyRequested() ? SCATTER_BLOCK_PIXELS : STEGO_MAX_HEADER_BYTES * 8;
+    unsigned long long need = BMP_HEADER_SIZE + headerPixels;
+    CoverLayout layout;
+    if (parseBmpLayout(start, size, fileSize, &layout, NULL) && layout.capacity > 0) {
+        unsigned long long spans = spanOffset(&layout, (layout.capacity < headerPixels ? layout.capacity : headerPixels) - 1) + 1;
+        if (spans > need) need = spans;
+    }
+    return need < fileSize ? need : fileSize;
+}
+
+// Size of an image read from a pipe, which cannot be measured, given its first
+// BMP_LAYOUT_BYTES in start: bfSize, or the end of the pixel rows if bfSize falls short of
+// them. 0 if start is not a BMP header that parseBmpLayout accepts.
+unsigned long long streamedImageSize(const unsigned char* start, size_t size) {
+    CoverLayout layout;
+    if (!parseBmpLayout(start, size, ~0ULL >> 1, &layout, NULL)) return 0;
+    unsigned long long rowsEnd = layout.dataOffset + layout.rows * layout.rowStride;
+    unsigned long long declared = loadLittleEndian32(start + 2);
+    return declared > rowsEnd ? declared : rowsEnd;
+}
+
+// Reads the start of an image for findStegoHeader from the current position of 'image' into
+// a new buffer, leaving the file just after it. A *fileSize of 0 stands for an image read
+// from a pipe; it is then set from the BMP header by streamedImageSize. Returns the buffer
+// (free it) with its length in *size, or NULL on a read error.
+unsigned char* readImagePrefix(FILE* image, unsigned long long* fileSize, size_t* size) {
+    unsigned char start[BMP_LAYOUT_BYTES];
+    *size = 0;
+    size_t got = fread(start, 1, sizeof(start), image);
+    if (*fileSize == 0) *fileSize = streamedImageSize(start, got);
+    size_t need = (size_t)coverPrefixBytes(start, got, *fileSize);
+    unsigned char* prefix = (unsigned char*)malloc(need > got ? need : got);
+    if (!prefix) return NULL;
+    memcpy(prefix, start, got);
+    if (need > got) got += fread(prefix + got, 1, need - got, image);
+    if (got < need) {
+        free(prefix);
+        return NULL;
+    }
+    *size = got;
+    return prefix;
+}
+
+// readImagePrefix from the start of a file, which is rewound afterwards.
+unsigned char* readCoverPrefix(FILE* image, unsigned long long fileSize, size_t* size) {
+    *size = 0;
+    if (stegoSeek(image, 0, SEEK_SET) != 0) return NULL;
+    unsigned char* prefix = readImagePrefix(image, &fileSize, size);
+    if (prefix && stegoSeek(image, 0, SEEK_SET) != 0) {
+        free(prefix);
+        return NULL;
+    }
+    return prefix;
+}
+
+// Parses the stego header of an image of fileSize bytes, whose first 'size' bytes (all of
+// them, or at least readCoverPrefix's share) are in data. *layout receives the layout the
+// image is read through. With a key (see Keyed Scatter) only a header in the keyed order is
+// looked for, and not finding one is an error. Returns as readStegoHeader.
+int findStegoHeader(const unsigned char* data, size_t size, unsigned long long fileSize, CoverLayout* layout,
+                    StegoHeader* h, size_t* headerBytes) {
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    const char* key = scatterKeyRequested();
+    if (key) {
+        const char* layoutError = "not a BMP file";
+        if (!parseBmpLayout(data, size, fileSize, layout, &layoutError)) { stegoError("Error: Unsupported stego image: %s.\n", layoutError); return -1; }
+        scatterLayout(layout, key);
+        size_t got = extractHeaderBytes(layout, data, size, header, STEGO_MAX_HEADER_BYTES);
+        int status = readStegoHeader(header, got, h, headerBytes);
+        if (status == 0) stegoError("Error: No stego header found with this key.\n");
+        return status > 0 ? 1 : -1;
+    }
+    if (!parseBmpLayout(data, size, fileSize, layout, NULL) || extractHeaderBytes(layout, data, size, header, 5) < 5 ||
+        loadBigEndian32(header) != STEGO_MAGIC || header[4] < STEGO_SPAN_VERSION) {
+        flatLayout(layout, fileSize);
+    }
+    size_t got = extractHeaderBytes(layout, data, size, header, STEGO_MAX_HEADER_BYTES);
+    return readStegoHeader(header, got, h, headerBytes);
+}
+
+
+// --- Thread Pool (stegoThreadCount, parallelFor, parallelEmbedBits, parallelExtractBits) ---
+// Block mode spreads independent blocks over worker threads. Indices are handed out through
+// a shared counter, so blocks that take longer than others balance out across threads.
+#define MAX_THREADS 256
+
+typedef void (*ParallelTaskFn)(void* ctx, size_t index, int worker);
+
+typedef struct {
+    ParallelTaskFn fn;
+    void* ctx;
+    size_t count;
+    size_t next; // Next unclaimed index, updated atomically
+} ParallelJob;
+
+typedef struct {
+    ParallelJob* job;
+    int worker;
+} ParallelWorker;
+
+// Number of worker threads: --threads or STEGO_THREADS if set, otherwise the number of online CPUs.
+int stegoThreadCount(void) {
+    long count = 0;
+    const char* forced = getenv("STEGO_THREADS");
+    if (stegoOptions.threads > 0) {
+        count = stegoOptions.threads;
+    } else if (forced && *forced) {
+        count = strtol(forced, NULL, 10);
+    } else {
+#ifdef _WIN32
+        const char* cpus = getenv("NUMBER_OF_PROCESSORS");
+        count = cpus ? strtol(cpus, NULL, 10) : 1;
+#else
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    if (count < 1) count = 1;
+    if (count > MAX_THREADS) count = MAX_THREADS;
+    return (int)count;
+}
+
+static void* parallelWorkerMain(void* arg) {
+    ParallelWorker* w = (ParallelWorker*)arg;
+    ParallelJob* job = w->job;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        job->fn(job->ctx, i, w->worker);
+    }
+    return NULL;
+}
+
+// Calls fn(ctx, i, worker) for every i in [0, count) on up to 'threads' threads (the calling
+// thread included) and returns once all calls have finished. worker is in [0, threads), so
+// tasks can index per-thread scratch buffers with it.
+void parallelFor(size_t count, int threads, ParallelTaskFn fn, void* ctx) {
+    ParallelJob job = { fn, ctx, count, 0 };
+    ParallelWorker workers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    int started[MAX_THREADS];
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if ((size_t)threads > count) threads = (int)count;
+    for (int t = 0; t < threads; t++) {
+        workers[t].job = &job;
+        workers[t].worker = t;
+        started[t] = t > 0 && pthread_create(&ids[t], NULL, parallelWorkerMain, &workers[t]) == 0;
+    }
+    // Worker 0 runs here; if a thread could not be started, the others pick up its share.
+    if (threads > 0) parallelWorkerMain(&workers[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(ids[t], NULL);
+    }
+}
+
+// Whole-payload LSB copies (stored payloads, single Huffman streams) are split into pieces
+// of about PARALLEL_COPY_BYTES of packed data so that the kernels run on every thread. Pieces
+// are whole groups, so each one starts on a pixel byte of its own.
+#define PARALLEL_COPY_BYTES (1 << 20)
+
+typedef struct {
+    const PixelView* view;
+    unsigned long long pixel;  // First pixel byte of the stream
+    unsigned char* bits;
+    unsigned long long bitCount;
+    unsigned int depth;
+    size_t pieceBytes;
+} BitCopyJob;
+
+static inline size_t bitCopyPieceBits(const BitCopyJob* job, size_t i) {
+    unsigned long long start = (unsigned long long)i * job->pieceBytes * 8;
+    unsigned long long left = job->bitCount - start;
+    return (size_t)(left < job->pieceBytes * 8ULL ? left : job->pieceBytes * 8ULL);
+}
+
+static void embedPieceTask(void* ctx, size_t i, int worker) {
+    BitCopyJob* job = (BitCopyJob*)ctx;
+    size_t offset = i * job->pieceBytes;
+    (void)worker;
+    spanEmbedBits(job->view, job->pixel + offset / job->depth * 8, job->bits + offset, bitCopyPieceBits(job, i), job->depth);
+}
+
+static void extractPieceTask(void* ctx, size_t i, int worker) {
+    BitCopyJob* job = (BitCopyJob*)ctx;
+    size_t offset = i * job->pieceBytes;
+    (void)worker;
+    spanExtractBits(job->view, job->pixel + offset / job->depth * 8, job->bits + offset, bitCopyPieceBits(job, i), job->depth);
+}
+
+// spanEmbedBits and spanExtractBits spread over up to 'threads' threads.
+void parallelEmbedBits(const PixelView* view, unsigned long long pixel, const unsigned char* bits, size_t bitCount,
+                       unsigned int depth, int threads) {
+    BitCopyJob job = { view, pixel, (unsigned char*)bits, bitCount, depth, PARALLEL_COPY_BYTES / depth * depth };
+    selectLsbKernel(depth); // Resolve the kernels before the workers use them
+    parallelFor((bitCount + job.pieceBytes * 8 - 1) / (job.pieceBytes * 8), threads, embedPieceTask, &job);
+}
+
+void parallelExtractBits(const PixelView* view, unsigned long long pixel, unsigned char* bits, size_t bitCount,
+                         unsigned int depth, int threads) {
+    BitCopyJob job = { view, pixel, bits, bitCount, depth, PARALLEL_COPY_BYTES / depth * depth };
+    selectLsbKernel(depth);
+    parallelFor((bitCount + job.pieceBytes * 8 - 1) / (job.pieceBytes * 8), threads, extractPieceTask, &job);
+}
+
+
+// --- Byte Histogram (countBytes, countBytesParallel) ---
+// Counting into a single table stalls whenever neighbouring bytes are equal, as in text or
+// images, since each increment has to wait for the store of the one before. Bytes are
+// counted into HISTOGRAM_LANES tables in turn instead, which are summed at the end, and large
+// inputs are split over the worker threads, each with tables of its own.
+#define HISTOGRAM_LANES 4
+#define HISTOGRAM_FLUSH_BYTES ((size_t)1 << 30)   // Keeps the 32-bit lane counts from overflowing
+#define HISTOGRAM_PIECE_BYTES ((size_t)1 << 20)   // Bytes counted per task
+#define HISTOGRAM_PARALLEL_BYTES ((size_t)4 << 20) // Smaller inputs are counted on one thread
+
+// Adds the number of times each byte value occurs in data to counts.
+void countBytes(const unsigned char* data, size_t length, unsigned long long counts[BYTE_RANGE]) {
+    uint32_t lanes[HISTOGRAM_LANES][BYTE_RANGE];
+    while (length > 0) {
+        size_t n = length < HISTOGRAM_FLUSH_BYTES ? length : HISTOGRAM_FLUSH_BYTES, i = 0;
+        memset(lanes, 0, sizeof(lanes));
+        for (; i + 8 <= n; i += 8) {
+            uint64_t w;
+            memcpy(&w, data + i, 8);
+            lanes[0][w & 0xFF]++;
+            lanes[1][(w >> 8) & 0xFF]++;
+            lanes[2][(w >> 16) & 0xFF]++;
+            lanes[3][(w >> 24) & 0xFF]++;
+            lanes[0][(w >> 32) & 0xFF]++;
+            lanes[1][(w >> 40) & 0xFF]++;
+            lanes[2][(w >> 48) & 0xFF]++;
+            lanes[3][w >> 56]++;
+        }
+        for (; i < n; i++) lanes[0][data[i]]++;
+        for (int s = 0; s < BYTE_RANGE; s++) counts[s] += (unsigned long long)lanes[0][s] + lanes[1][s] + lanes[2][s] + lanes[3][s];
+        data += n;
+        length -= n;
+    }
+}
+
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    unsigned long long (*counts)[BYTE_RANGE]; // One table per worker
+} HistogramJob;
+
+static void histogramTask(void* ctx, size_t index, int worker) {
+    HistogramJob* job = (HistogramJob*)ctx;
+    size_t start = index * HISTOGRAM_PIECE_BYTES;
+    size_t n = job->length - start < HISTOGRAM_PIECE_BYTES ? job->length - start : HISTOGRAM_PIECE_BYTES;
+    countBytes(job->data + start, n, job->counts[worker]);
+}
+
+// countBytes on up to 'threads' threads.
+void countBytesParallel(const unsigned char* data, size_t length, int threads, unsigned long long counts[BYTE_RANGE]) {
+    size_t pieces = (length + HISTOGRAM_PIECE_BYTES - 1) / HISTOGRAM_PIECE_BYTES;
+    if ((size_t)threads > pieces) threads = (int)pieces;
+    HistogramJob job = { data, length, NULL };
+    if (threads > 1 && length >= HISTOGRAM_PARALLEL_BYTES) {
+        job.counts = (unsigned long long (*)[BYTE_RANGE])calloc((size_t)threads, sizeof(*job.counts));
+    }
+    if (!job.counts) { // Small inputs, one thread, or no memory for the tables
+        countBytes(data, length, counts);
+        return;
+    }
+    parallelFor(pieces, threads, histogramTask, &job);
+    for (int t = 0; t < threads; t++) {
+        for (int s = 0; s < BYTE_RANGE; s++) counts[s] += job.counts[t][s];
+    }
+    free(job.counts);
+}
+
+
+// --- Block Codecs (BlockCodec, huffmanPlanBlock, huffmanPackBlock, huffmanUnpackBlock) ---
+// A block codec turns one block of payload bytes into a self-contained byte stream and back.
+// plan() takes the histogram of a block, builds the model (code lengths, normalized counts)
+// and returns the exact size of the stream, so that block mode can lay out the image before
+// anything is packed; pack() writes the stream from that model and unpack() decodes it. The
+// codec's id is the method byte of the stego header.
+typedef union {
+    unsigned char codeLengths[BYTE_RANGE]; // Huffman
+    struct {
+        uint16_t counts[BYTE_RANGE];       // Normalized counts, summing to 1 << tableLog
+        unsigned int tableLog;
+    } tans;
+} CodecModel;
+
+typedef struct {
+    const char* name;
+    unsigned int method;                   // STEGO_METHOD_* recorded in the header
+    size_t (*plan)(const unsigned char* data, size_t length, CodecModel* model);
+    size_t (*pack)(const unsigned char* data, size_t length, const CodecModel* model, unsigned char* out);
+    int (*unpack)(const unsigned char* stream, size_t streamBytes, unsigned char* out, size_t length);
+    size_t (*bound)(size_t length);        // Largest possible stream for a block of length bytes
+} BlockCodec;
+
+// Huffman block streams hold the code lengths (see writeCodeLengths) followed by the
+// Huffman data, padded to a whole byte.
+static size_t huffmanBlockBound(size_t length) {
+    return STEGO_MAX_CODE_LENGTHS_BYTES + (length * MAX_CANONICAL_LENGTH + 7) / 8;
+}
+
+// Builds the code lengths of one block and returns the size of its stream in bytes (0 on failure).
+size_t huffmanPlanBlock(const unsigned char* data, size_t length, CodecModel* model) {
+    unsigned char* lengths = model->codeLengths;
+    unsigned long long counts[BYTE_RANGE] = {0};
+    int freq[BYTE_RANGE];
+    countBytes(data, length, counts);
+    scaleFrequencies(counts, freq);
+    if (!computeCodeLengths(freq, lengths, MAX_CANONICAL_LENGTH)) return 0;
+
+    int symbolCount = 0;
+    unsigned long long bits = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        symbolCount += lengths[s] != 0;
+        bits += counts[s] * lengths[s];
+    }
+    bits += 8 + 12 * symbolCount < 4 * BYTE_RANGE ? 9 + 12 * symbolCount : 1 + 4 * BYTE_RANGE;
+    return (size_t)((bits + 7) / 8);
+}
+
+// Writes the stream of one block into out (huffmanBlockBound(length) bytes). Returns its size.
+size_t huffmanPackBlock(const unsigned char* data, size_t length, const CodecModel* model, unsigned char* out) {
+    CodeTable codeTable[BYTE_RANGE];
+    if (!buildCanonicalCodes(model->codeLengths, codeTable)) return 0;
+    BitWriter bw;
+    bitWriterInit(&bw, out);
+    writeCodeLengths(&bw, model->codeLengths);
+    for (size_t i = 0; i < length; i++) {
+        const CodeTable* entry = &codeTable[data[i]];
+        bitWriterPut(&bw, entry->code, entry->length);
+    }
+    bitWriterFlush(&bw);
+    return bw.pos;
+}
+
+// Decodes one block stream of streamBytes bytes into out (exactly length bytes). Returns 1 on success.
+int huffmanUnpackBlock(const unsigned char* stream, size_t streamBytes, unsigned char* out, size_t length) {
+    BitReader br;
+    unsigned char lengths[BYTE_RANGE];
+    CodeTable codeTable[BYTE_RANGE];
+    HuffmanDecodeTable table;
+    size_t decoded = 0;
+    bitReaderInit(&br, stream, streamBytes);
+    readCodeLengths(&br, lengths);
+    if (!buildCanonicalCodes(lengths, codeTable)) { stegoError("Error: Invalid code lengths in block stream.\n"); return 0; }
+    if (!buildDecodeTable(codeTable, &table)) { stegoError("Error building decode table.\n"); return 0; }
+    int ok = huffmanDecodeChunk(&table, &br, out, length, 1, &decoded);
+    freeDecodeTable(&table);
+    if (ok && bitReaderConsumed(&br) > (unsigned long long)streamBytes * 8) {
+        stegoError("Error: Unexpected end of compressed data during decoding.\n");
+        ok = 0;
+    }
+    return ok;
+}
+
+
+// --- tANS Codec (tansNormalize, tansPlanBlock, tansPackBlock, tansUnpackBlock) ---
+// Table-based asymmetric numeral systems, as in FSE. Symbols cost fractional numbers of
+// bits, which pays off on skewed payloads where Huffman rounds every code up to whole bits,
+// and decoding is one table lookup per byte with no branches on the data. A block stream is:
+//   table log - TANS_MIN_TABLE_LOG (3) | normalized counts, sparse (0) or dense (1) as in
+//   writeCodeLengths but with tableLog-bit values (sparse: count - 1) | padding to a byte |
+//   zero bits, a 1 bit, the two initial decoder states (tableLog bits each), then the bits
+//   of every symbol in order.
+// The encoder runs backwards over the block and fills the data from the end of the buffer,
+// so the decoder reads it front to back with the usual BitReader. Even and odd bytes use
+// separate states, giving two independent dependency chains when decoding. Both states end
+// at 0, which together with the exact bit count catches corrupt streams.
+#define TANS_MIN_TABLE_LOG 5
+#define TANS_MAX_TABLE_LOG 11
+#define TANS_MAX_TABLE_BYTES 353 // Dense counts for the largest table, rounded up to bytes
+
+typedef struct {
+    uint16_t newState;  // Base of the next state; the bits read are added to it
+    unsigned char symbol;
+    unsigned char nbBits;
+} TansDecodeEntry;
+
+typedef struct {
+    int deltaNbBits;    // (state + deltaNbBits) >> 16 is the number of bits to write
+    int deltaFindState;
+} TansSymbolTransform;
+
+// Writes an MSB-first stream backwards: each put() goes in front of everything put before it.
+typedef struct {
+    unsigned char* pos; // First byte written so far; the next byte goes just before it
+    uint64_t acc;       // Pending bits, the newest in the high positions
+    int bits;
+} ReverseBitWriter;
+
+static inline void reverseBitWriterPut(ReverseBitWriter* w, uint64_t value, int count) {
+    w->acc |= value << w->bits;
+    w->bits += count;
+    if (w->bits >= 32) {
+        w->pos -= 4;
+        w->pos[3] = (unsigned char)w->acc;
+        w->pos[2] = (unsigned char)(w->acc >> 8);
+        w->pos[1] = (unsigned char)(w->acc >> 16);
+        w->pos[0] = (unsigned char)(w->acc >> 24);
+        w->acc >>= 32;
+        w->bits -= 32;
+    }
+}
+
+// Writes out the pending bits; a partial first byte is padded with zeros in front.
+static inline void reverseBitWriterFlush(ReverseBitWriter* w) {
+    while (w->bits > 0) {
+        *--w->pos = (unsigned char)w->acc;
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+    w->bits = 0;
+}
+
+static inline int highBit32(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+// Table size for a block: smaller blocks and alphabets use smaller tables, whose counts
+// cost less to store.
+static int tansTableLog(size_t length, int symbolCount) {
+    int log = TANS_MAX_TABLE_LOG;
+    int sizeLog = length > 1 ? 63 - __builtin_clzll((unsigned long long)length - 1) : 0;
+    int minLog = (symbolCount > 1 ? highBit32((uint32_t)symbolCount - 1) : 0) + 2;
+    if (sizeLog - 2 < log) log = sizeLog - 2;
+    if (log < minLog) log = minLog;
+    if (log < TANS_MIN_TABLE_LOG) log = TANS_MIN_TABLE_LOG;
+    if (log > TANS_MAX_TABLE_LOG) log = TANS_MAX_TABLE_LOG;
+    return log;
+}
+
+// Scales counts (summing to total) to normalized counts summing to 1 << tableLog, keeping
+// every present byte at 1 or more. Rounding errors are settled one step at a time where
+// they cost the fewest bits.
+void tansNormalize(const unsigned int counts[BYTE_RANGE], size_t total, int tableLog, uint16_t norm[BYTE_RANGE]) {
+    const unsigned int tableSize = 1u << tableLog;
+    unsigned int sum = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        unsigned long long scaled = counts[s] ? ((unsigned long long)counts[s] * tableSize + total / 2) / total : 0;
+        norm[s] = (uint16_t)(counts[s] && scaled == 0 ? 1 : scaled);
+        sum += norm[s];
+    }
+    while (sum > tableSize) {
+        // Take from the byte whose bits per occurrence grow least: smallest counts / norm.
+        int best = -1;
+        for (int s = 0; s < BYTE_RANGE; s++) {
+            if (norm[s] > 1 && (best < 0 || (unsigned long long)counts[s] * norm[best] < (unsigned long long)counts[best] * norm[s])) best = s;
+        }
+        norm[best]--;
+        sum--;
+    }
+    while (sum < tableSize) {
+        int best = -1;
+        for (int s = 0; s < BYTE_RANGE; s++) {
+            if (counts[s] && (best < 0 || (unsigned long long)counts[s] * norm[best] > (unsigned long long)counts[best] * norm[s])) best = s;
+        }
+        norm[best]++;
+        sum++;
+    }
+}
+
+// Spreads the bytes over the states so that each byte's states are scattered evenly.
+static void tansSpread(const uint16_t norm[BYTE_RANGE], int tableLog, unsigned char* symbols) {
+    const unsigned int mask = (1u << tableLog) - 1;
+    const unsigned int step = ((mask + 1) >> 1) + ((mask + 1) >> 3) + 3; // Odd, so every state is visited once
+    unsigned int pos = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        for (unsigned int i = 0; i < norm[s]; i++) {
+            symbols[pos] = (unsigned char)s;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+static void tansBuildEncodeTable(const uint16_t norm[BYTE_RANGE], int tableLog, uint16_t* stateTable,
+                                 TansSymbolTransform transforms[BYTE_RANGE]) {
+    const unsigned int tableSize = 1u << tableLog;
+    unsigned char symbols[1 << TANS_MAX_TABLE_LOG];
+    unsigned int cumul[BYTE_RANGE + 1];
+    unsigned int next[BYTE_RANGE];
+    tansSpread(norm, tableLog, symbols);
+    cumul[0] = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) cumul[s + 1] = cumul[s] + norm[s];
+    memcpy(next, cumul, sizeof(next));
+    for (unsigned int u = 0; u < tableSize; u++) stateTable[next[symbols[u]]++] = (uint16_t)(tableSize + u);
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        if (norm[s] == 0) continue;
+        if (norm[s] == 1) {
+            transforms[s].deltaNbBits = (tableLog << 16) - (int)tableSize;
+            transforms[s].deltaFindState = (int)cumul[s] - 1;
+        } else {
+            int maxBitsOut = tableLog - highBit32(norm[s] - 1u);
+            transforms[s].deltaNbBits = (maxBitsOut << 16) - (int)(norm[s] << maxBitsOut);
+            transforms[s].deltaFindState = (int)cumul[s] - norm[s];
+        }
+    }
+}
+
+static void tansBuildDecodeTable(const uint16_t norm[BYTE_RANGE], int tableLog, TansDecodeEntry* table) {
+    const unsigned int tableSize = 1u << tableLog;
+    unsigned char symbols[1 << TANS_MAX_TABLE_LOG];
+    unsigned int next[BYTE_RANGE];
+    tansSpread(norm, tableLog, symbols);
+    for (int s = 0; s < BYTE_RANGE; s++) next[s] = norm[s];
+    for (unsigned int u = 0; u < tableSize; u++) {
+        unsigned char s = symbols[u];
+        unsigned int x = next[s]++;
+        int nbBits = tableLog - highBit32(x);
+        table[u].symbol = s;
+        table[u].nbBits = (unsigned char)nbBits;
+        table[u].newState = (uint16_t)((x << nbBits) - tableSize);
+    }
+}
+
+static size_t tansCountsBits(const CodecModel* model) {
+    int symbolCount = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) symbolCount += model->tans.counts[s] != 0;
+    int log = (int)model->tans.tableLog;
+    size_t sparse = 9 + (size_t)symbolCount * (8 + log);
+    size_t dense = 1 + (size_t)BYTE_RANGE * log;
+    return 3 + (sparse < dense ? sparse : dense);
+}
+
+static void writeTansCounts(BitWriter* bw, const CodecModel* model) {
+    int log = (int)model->tans.tableLog;
+    int symbolCount = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) symbolCount += model->tans.counts[s] != 0;
+    bitWriterPut(bw, (uint64_t)(log - TANS_MIN_TABLE_LOG), 3);
+    if (9 + (size_t)symbolCount * (8 + log) < 1 + (size_t)BYTE_RANGE * log) {
+        bitWriterPut(bw, 0, 1);
+        bitWriterPut(bw, (uint64_t)(symbolCount - 1), 8);
+        for (int s = 0; s < BYTE_RANGE; s++) {
+            if (model->tans.counts[s]) bitWriterPut(bw, ((uint64_t)s << log) | (model->tans.counts[s] - 1u), 8 + log);
+        }
+    } else {
+        bitWriterPut(bw, 1, 1);
+        for (int s = 0; s < BYTE_RANGE; s++) bitWriterPut(bw, model->tans.counts[s], log);
+    }
+}
+
+// Reads counts written by writeTansCounts. Returns 0 if they do not describe a valid table.
+static int readTansCounts(BitReader* br, CodecModel* model) {
+    int log = (int)bitReaderGet(br, 3) + TANS_MIN_TABLE_LOG;
+    unsigned int sum = 0;
+    memset(model->tans.counts, 0, sizeof(model->tans.counts));
+    model->tans.tableLog = (unsigned int)log;
+    if (log > TANS_MAX_TABLE_LOG) return 0;
+    if (bitReaderGet(br, 1) == 0) {
+        int symbolCount = (int)bitReaderGet(br, 8) + 1;
+        for (int i = 0; i < symbolCount; i++) {
+            unsigned int entry = bitReaderGet(br, 8 + log);
+            model->tans.counts[entry >> log] = (uint16_t)((entry & ((1u << log) - 1)) + 1);
+        }
+    } else {
+        for (int s = 0; s < BYTE_RANGE; s++) model->tans.counts[s] = (uint16_t)bitReaderGet(br, log);
+    }
+    for (int s = 0; s < BYTE_RANGE; s++) sum += model->tans.counts[s];
+    return sum == 1u << log;
+}
+
+static size_t tansBlockBound(size_t length) {
+    return TANS_MAX_TABLE_BYTES + (length * TANS_MAX_TABLE_LOG + 2 * TANS_MAX_TABLE_LOG + 1 + 7) / 8;
+}
+
+// One encoder step for byte sym on state st; put either counts the bits or writes them to w.
+#define TANS_ENCODE(st, sym, put)                                          \
+    do {                                                                  \
+        const TansSymbolTransform* t = &transforms[sym];                  \
+        unsigned int nbBits = (st + (uint32_t)t->deltaNbBits) >> 16;      \
+        put(st, nbBits);                                                  \
+        st = stateTable[(st >> nbBits) + t->deltaFindState];              \
+    } while (0)
+#define TANS_COUNT_BITS(st, nbBits) bits += (nbBits)
+#define TANS_WRITE_BITS(st, nbBits) reverseBitWriterPut(&w, (st) & ((1u << (nbBits)) - 1), (int)(nbBits))
+
+// Encodes data backwards into the bytes just before end. Returns the number of bytes written,
+// or, if end is NULL, just counts them.
+static size_t tansEncode(const unsigned char* data, size_t length, const CodecModel* model, unsigned char* end) {
+    const int tableLog = (int)model->tans.tableLog;
+    uint16_t stateTable[1 << TANS_MAX_TABLE_LOG];
+    TansSymbolTransform transforms[BYTE_RANGE];
+    tansBuildEncodeTable(model->tans.counts, tableLog, stateTable, transforms);
+
+    // Even bytes use state0 and odd bytes state1; an odd last byte goes first.
+    uint32_t state0 = 1u << tableLog, state1 = 1u << tableLog;
+    size_t i = length;
+    if (!end) {
+        unsigned long long bits = 2 * (unsigned long long)tableLog + 1;
+        if (i & 1) { i--; TANS_ENCODE(state0, data[i], TANS_COUNT_BITS); }
+        while (i > 0) {
+            i -= 2;
+            TANS_ENCODE(state1, data[i + 1], TANS_COUNT_BITS);
+            TANS_ENCODE(state0, data[i], TANS_COUNT_BITS);
+        }
+        return (size_t)((bits + 7) / 8);
+    }
+    ReverseBitWriter w = { end, 0, 0 };
+    if (i & 1) { i--; TANS_ENCODE(state0, data[i], TANS_WRITE_BITS); }
+    while (i > 0) {
+        i -= 2;
+        TANS_ENCODE(state1, data[i + 1], TANS_WRITE_BITS);
+        TANS_ENCODE(state0, data[i], TANS_WRITE_BITS);
+    }
+    reverseBitWriterPut(&w, state1 - (1u << tableLog), tableLog);
+    reverseBitWriterPut(&w, state0 - (1u << tableLog), tableLog);
+    reverseBitWriterPut(&w, 1, 1);
+    reverseBitWriterFlush(&w);
+    return (size_t)(end - w.pos);
+}
+
+size_t tansPlanBlock(const unsigned char* data, size_t length, CodecModel* model) {
+    unsigned long long wide[BYTE_RANGE] = {0};
+    unsigned int counts[BYTE_RANGE];
+    int symbolCount = 0;
+    countBytes(data, length, wide);
+    for (int s = 0; s < BYTE_RANGE; s++) {
+        counts[s] = (unsigned int)wide[s]; // Blocks are far below 4 GB
+        symbolCount += counts[s] != 0;
+    }
+    if (symbolCount == 0) return 0;
+    model->tans.tableLog = (unsigned int)tansTableLog(length, symbolCount);
+    tansNormalize(counts, length, (int)model->tans.tableLog, model->tans.counts);
+    return (tansCountsBits(model) + 7) / 8 + tansEncode(data, length, model, NULL);
+}
+
+// Writes the stream of one block into out (tansBlockBound(length) bytes). Returns its size.
+size_t tansPackBlock(const unsigned char* data, size_t length, const CodecModel* model, unsigned char* out) {
+    BitWriter bw;
+    bitWriterInit(&bw, out);
+    writeTansCounts(&bw, model);
+    bitWriterFlush(&bw);
+    // The data is built at the end of out and then moved up behind the counts.
+    unsigned char* end = out + tansBlockBound(length);
+    size_t dataBytes = tansEncode(data, length, model, end);
+    memmove(out + bw.pos, end - dataBytes, dataBytes);
+    return bw.pos + dataBytes;
+}
+
+#define TANS_DECODE(st)                                       \
+    do {                                                      \
+        TansDecodeEntry e = table[st];                        \
+        out[n++] = e.symbol;                                  \
+        st = e.newState + (unsigned int)((br.buf >> 1) >> (63 - e.nbBits)); \
+        bitReaderSkip(&br, e.nbBits);                         \
+    } while (0)
+
+int tansUnpackBlock(const unsigned char* stream, size_t streamBytes, unsigned char* out, size_t length) {
+    BitReader br;
+    CodecModel model;
+    TansDecodeEntry table[1 << TANS_MAX_TABLE_LOG];
+    bitReaderInit(&br, stream, streamBytes);
+    if (!readTansCounts(&br, &model)) { stegoError("Error: Invalid tANS table in block stream.\n"); return 0; }
+    size_t countsBytes = (size_t)((bitReaderConsumed(&br) + 7) / 8);
+    if (countsBytes >= streamBytes || stream[countsBytes] == 0) {
+        stegoError("Error: Unexpected end of compressed data during decoding.\n");
+        return 0;
+    }
+    const int tableLog = (int)model.tans.tableLog;
+    tansBuildDecodeTable(model.tans.counts, tableLog, table);
+
+    const unsigned char* data = stream + countsBytes;
+    size_t dataBytes = streamBytes - countsBytes;
+    bitReaderInit(&br, data, dataBytes);
+    bitReaderRefill(&br);
+    bitReaderSkip(&br, __builtin_clz((unsigned int)data[0]) - 23); // Leading zeros and the 1 bit
+    unsigned int state0 = bitReaderGet(&br, tableLog);
+    unsigned int state1 = bitReaderGet(&br, tableLog);
+    size_t n = 0;
+    // One refill covers four symbols of at most TANS_MAX_TABLE_LOG bits.
+    while (n + 4 <= length) {
+        bitReaderRefill(&br);
+        TANS_DECODE(state0);
+        TANS_DECODE(state1);
+        TANS_DECODE(state0);
+        TANS_DECODE(state1);
+    }
+    while (n < length) {
+        bitReaderRefill(&br);
+        if (n & 1) TANS_DECODE(state1);
+        else TANS_DECODE(state0);
+    }
+    if (state0 != 0 || state1 != 0 || bitReaderConsumed(&br) != (unsigned long long)dataBytes * 8) {
+        stegoError("Error: Corrupt tANS data in block stream.\n");
+        return 0;
+    }
+    return 1;
+}
+
+static const BlockCodec blockCodecs[] = {
+    { "huffman", STEGO_METHOD_HUFFMAN, huffmanPlanBlock, huffmanPackBlock, huffmanUnpackBlock, huffmanBlockBound },
+    { "tans", STEGO_METHOD_TANS, tansPlanBlock, tansPackBlock, tansUnpackBlock, tansBlockBound },
+};
+
+// The codec recorded under method in the header, or NULL (stored payloads have none).
+const BlockCodec* codecForMethod(unsigned int method) {
+    for (size_t i = 0; i < sizeof(blockCodecs) / sizeof(blockCodecs[0]); i++) {
+        if (blockCodecs[i].method == method) return &blockCodecs[i];
+    }
+    return NULL;
+}
+
+
+// --- Block Mode (BlockPlan, block index, block tasks) ---
+// Block mode cuts the payload into 2^blockSizeLog2-byte blocks that a block codec compresses
+// on their own. Stream sizes are known once every block is planned, so the block index can
+// be written before anything is packed, and every block can then be packed, embedded,
+// extracted and decoded independently of the others.
+// Payloads of at least BLOCK_MODE_THRESHOLD use block mode; --blocks/--no-blocks or
+// STEGO_BLOCKS=1 or 0 force it on or off. tANS payloads always use it.
+#define BLOCK_MODE_THRESHOLD (4LL << 20)
+
+typedef struct {
+    const BlockCodec* codec;
+    unsigned long long originalSize;
+    unsigned int blockSizeLog2;
+    size_t count;
+    CodecModel* models;                // Encoding only
+    uint32_t* streamBytes;
+    unsigned long long totalBytes;
+    unsigned int depth;                // LSB depth the layout below was computed for
+    unsigned long long* pixelOffsets;  // First pixel byte of each stream, counted from the first stream
+    unsigned long long totalPixels;
+} BlockPlan;
+
+int blockModeRequested(unsigned long long payloadSize) {
+    const char* forced = getenv("STEGO_BLOCKS");
+    if (payloadSize == 0) return 0;
+    if (stegoOptions.blocks >= 0) return stegoOptions.blocks;
+    if (forced && *forced) return strcmp(forced, "0") != 0;
+    return payloadSize >= (unsigned long long)BLOCK_MODE_THRESHOLD;
+}
+
+static inline size_t blockLength(const BlockPlan* plan, size_t block) {
+    unsigned long long start = (unsigned long long)block << plan->blockSizeLog2;
+    unsigned long long left = plan->originalSize - start;
+    return (size_t)(left < (1ULL << plan->blockSizeLog2) ? left : (1ULL << plan->blockSizeLog2));
+}
+
+// Stream slot size: the largest stream of a whole block.
+static inline size_t blockSlotSize(const BlockPlan* plan) {
+    return plan->codec->bound((size_t)1 << plan->blockSizeLog2);
+}
+
+// Allocates a plan for a payload of originalSize bytes. Returns 0 if allocation fails.
+int blockPlanInit(BlockPlan* plan, const BlockCodec* codec, unsigned long long originalSize, unsigned int blockSizeLog2, int withModels) {
+    memset(plan, 0, sizeof(*plan));
+    plan->codec = codec;
+    plan->originalSize = originalSize;
+    plan->blockSizeLog2 = blockSizeLog2;
+    unsigned long long count = (originalSize >> blockSizeLog2) + ((originalSize & ((1ULL << blockSizeLog2) - 1)) != 0);
+    if (count > (size_t)-1 / sizeof(CodecModel)) return 0;
+    plan->count = (size_t)count;
+    plan->streamBytes = (uint32_t*)calloc(plan->count + 1, sizeof(uint32_t));
+    plan->pixelOffsets = (unsigned long long*)calloc(plan->count + 1, sizeof(unsigned long long));
+    if (withModels) plan->models = (CodecModel*)calloc(plan->count + 1, sizeof(CodecModel));
+    return plan->streamBytes && plan->pixelOffsets && (!withModels || plan->models);
+}
+
+void blockPlanFree(BlockPlan* plan) {
+    free(plan->models);
+    free(plan->streamBytes);
+    free(plan->pixelOffsets);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// Fills in totalBytes, and pixelOffsets and totalPixels for the given depth, from streamBytes.
+void blockPlanLayout(BlockPlan* plan, unsigned int depth) {
+    unsigned long long bytes = 0, pixels = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        plan->pixelOffsets[i] = pixels;
+        bytes += plan->streamBytes[i];
+        pixels += lsbPixels(plan->streamBytes[i] * 8ULL, depth);
+    }
+    plan->totalBytes = bytes;
+    plan->depth = depth;
+    plan->totalPixels = pixels;
+}
+
+// The block index holds one 32-bit big-endian stream size per block.
+void writeBlockIndex(const BlockPlan* plan, unsigned char* out) {
+    for (size_t i = 0; i < plan->count; i++) {
+        uint32_t n = plan->streamBytes[i];
+        out[i * 4] = (unsigned char)(n >> 24);
+        out[i * 4 + 1] = (unsigned char)(n >> 16);
+        out[i * 4 + 2] = (unsigned char)(n >> 8);
+        out[i * 4 + 3] = (unsigned char)n;
+    }
+}
+
+// Loads stream sizes from an index and checks them against the header. Returns 1 if consistent.
+int readBlockIndex(BlockPlan* plan, const unsigned char* index, unsigned long long compressedBits, unsigned int depth) {
+    for (size_t i = 0; i < plan->count; i++) {
+        plan->streamBytes[i] = loadBigEndian32(index + i * 4);
+        if (plan->streamBytes[i] == 0 || plan->streamBytes[i] > plan->codec->bound(blockLength(plan, i))) {
+            stegoError("Error: Invalid block index entry %lu.\n", (unsigned long)i);
+            return 0;
+        }
+    }
+    blockPlanLayout(plan, depth);
+    if (plan->totalBytes * 8 != compressedBits) {
+        stegoError("Error: Block index does not match the compressed size.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Shared state of the block tasks below. Blocks [first, first + n) of the payload are
+// processed per parallelFor call; input/output point at the first of them.
+typedef struct {
+    BlockPlan* plan;
+    size_t first;
+    const unsigned char* input;     // Payload bytes (encoding)
+    unsigned char* output;          // Payload bytes (decoding)
+    unsigned char* streams;         // Stream slots of slotSize bytes, per block or per worker
+    size_t slotSize;
+    const PixelView* pixels;        // The image, in-memory paths only
+    unsigned long long dataPixel;   // Its pixel byte where the first block stream starts
+    int failed;
+} BlockJob;
+
+static inline const unsigned char* blockJobInput(const BlockJob* job, size_t block) {
+    return job->input + ((unsigned long long)(block - job->first) << job->plan->blockSizeLog2);
+}
+
+static inline unsigned char* blockJobOutput(const BlockJob* job, size_t block) {
+    return job->output + ((unsigned long long)(block - job->first) << job->plan->blockSizeLog2);
+}
+
+static void blockFail(BlockJob* job) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+}
+
+// Histogram and model of block first + i.
+static void planBlockTask(void* ctx, size_t i, int worker) {
+    BlockJob* job = (BlockJob*)ctx;
+    size_t block = job->first + i;
+    size_t bytes = job->plan->codec->plan(blockJobInput(job, block), blockLength(job->plan, block), &job->plan->models[block]);
+    (void)worker;
+    if (bytes == 0) blockFail(job);
+    job->plan->streamBytes[block] = (uint32_t)bytes;
+}
+
+// Packs block first + i into its own slot (streaming: embedded afterwards in order).
+static void packBlockTask(void* ctx, size_t i, int worker) {
+    BlockJob* job = (BlockJob*)ctx;
+    size_t block = job->first + i;
+    size_t bytes = job->plan->codec->pack(blockJobInput(job, block), blockLength(job->plan, block), &job->plan->models[block],
+                                          job->streams + i * job->slotSize);
+    (void)worker;
+    if (bytes != job->plan->streamBytes[block]) blockFail(job);
+}
+
+// Packs block first + i into the worker's slot and embeds it straight into the output image.
+static void packEmbedBlockTask(void* ctx, size_t i, int worker) {
+    BlockJob* job = (BlockJob*)ctx;
+    size_t block = job->first + i;
+    unsigned char* stream = job->streams + (size_t)worker * job->slotSize;
+    size_t bytes = job->plan->codec->pack(blockJobInput(job, block), blockLength(job->plan, block), &job->plan->models[block], stream);
+    if (bytes != job->plan->streamBytes[block]) { blockFail(job); return; }
+    spanEmbedBits(job->pixels, job->dataPixel + job->plan->pixelOffsets[block], stream, bytes * 8, job->plan->depth);
+}
+
+// Decodes block first + i from its own slot (streaming: extracted beforehand in order).
+static void unpackBlockTask(void* ctx, size_t i, int worker) {
+    BlockJob* job = (BlockJob*)ctx;
+    size_t block = job->first + i;
+    (void)worker;
+    if (!job->plan->codec->unpack(job->streams + i * job->slotSize, job->plan->streamBytes[block], blockJobOutput(job, block),
+                                  blockLength(job->plan, block))) {
+        blockFail(job);
+    }
+}
+
+// Extracts block first + i from the stego image into the worker's slot and decodes it.
+static void extractUnpackBlockTask(void* ctx, size_t i, int worker) {
+    BlockJob* job = (BlockJob*)ctx;
+    size_t block = job->first + i;
+    unsigned char* stream = job->streams + (size_t)worker * job->slotSize;
+    size_t bytes = job->plan->streamBytes[block];
+    spanExtractBits(job->pixels, job->dataPixel + job->plan->pixelOffsets[block], stream, bytes * 8, job->plan->depth);
+    if (!job->plan->codec->unpack(stream, bytes, blockJobOutput(job, block), blockLength(job->plan, block))) blockFail(job);
+}
+
+
+// --- Seek Index (parseSeekInterval, seekRequested, seekIndexInit, seekIndexAdd, seekCheckpointBits) ---
+// A single Huffman stream can only be decoded from its start unless something records where
+// the code of a given payload byte begins. The seek index does that every 2^seekLog2 payload
+// bytes: one 32-bit big-endian entry per interval but the last, holding the code bits that
+// interval took, so checkpoint k lies at the sum of the first k entries. Canonical Huffman
+// decoding carries no state from one code to the next, so that bit offset is all a decoder
+// needs to start there (see Range Extraction). The index follows the stream, which lets the
+// streaming encoder fill it in as it packs. Block mode needs none; its block index already
+// says where every block starts.
+// Payloads longer than one interval get an index every 2^SEEK_LOG2_DEFAULT bytes; --seek <KB>
+// or STEGO_SEEK choose another interval, or 0 for none.
+#define SEEK_LOG2_DEFAULT 16 // 64 KB
+
+typedef struct {
+    unsigned int intervalLog2;
+    size_t count;                   // Entries, see stegoSeekCount
+    unsigned char* entries;
+    size_t filled;                  // Entries written so far
+    unsigned long long position;    // Payload bytes added so far
+    uint32_t bits;                  // Code bits of the interval in progress
+} SeekIndex;
+
+// Parses an interval in KB, a power of two from 4 to 16384, or 0. Returns its log2 in bytes,
+// 0 for no index or -1 if it is invalid.
+int parseSeekInterval(const char* text) {
+    char* end;
+    unsigned long kb = strtoul(text, &end, 10);
+    if (end == text || *end) return -1;
+    if (kb == 0) return 0;
+    for (int log2 = SEEK_LOG2_MIN; log2 <= SEEK_LOG2_MAX; log2++) {
+        if (kb == 1ul << (log2 - 10)) return log2;
+    }
+    return -1;
+}
+
+// The seek interval for a payload of payloadSize bytes, or 0 if it gets no index.
+unsigned int seekRequested(unsigned long long payloadSize) {
+    const char* forced = getenv("STEGO_SEEK");
+    int log2 = SEEK_LOG2_DEFAULT;
+    if (stegoOptions.seek >= 0) log2 = stegoOptions.seek;
+    else if (forced && *forced && parseSeekInterval(forced) >= 0) log2 = parseSeekInterval(forced);
+    return log2 > 0 && payloadSize > (1ULL << log2) ? (unsigned int)log2 : 0;
+}
+
+// Prepares the index described by h (empty without STEGO_FLAG_SEEK). Returns 0 if allocation fails.
+int seekIndexInit(SeekIndex* index, const StegoHeader* h) {
+    memset(index, 0, sizeof(*index));
+    index->intervalLog2 = h->seekLog2;
+    index->count = (size_t)stegoSeekCount(h);
+    if (index->count == 0) return 1;
+    index->entries = (unsigned char*)malloc(index->count * 4);
+    return index->entries != NULL;
+}
+
+// Accounts for the next n payload bytes, coded with codeTable.
+void seekIndexAdd(SeekIndex* index, const unsigned char* data, size_t n, const CodeTable codeTable[BYTE_RANGE]) {
+    unsigned long long interval = 1ULL << index->intervalLog2;
+    while (n > 0 && index->filled < index->count) {
+        unsigned long long room = interval - (index->position & (interval - 1));
+        size_t take = room < n ? (size_t)room : n;
+        uint32_t bits = index->bits;
+        for (size_t i = 0; i < take; i++) bits += (uint32_t)codeTable[data[i]].length;
+        index->position += take;
+        data += take;
+        n -= take;
+        if (take == room) {
+            unsigned char* out = index->entries + index->filled++ * 4;
+            out[0] = (unsigned char)(bits >> 24);
+            out[1] = (unsigned char)(bits >> 16);
+            out[2] = (unsigned char)(bits >> 8);
+            out[3] = (unsigned char)bits;
+            bits = 0;
+        }
+        index->bits = bits;
+    }
+}
+
+// Bit offset of checkpoint k of an index read back from an image.
+static unsigned long long seekCheckpointBits(const unsigned char* entries, size_t k) {
+    unsigned long long bits = 0;
+    for (size_t i = 0; i < k; i++) bits += loadBigEndian32(entries + i * 4);
+    return bits;
+}
+
+
+// --- Method Selection (parseMethodName, methodRequested, samplePayload, chooseMethod) ---
+// Payloads that are already compressed (PNG, JPEG, ZIP, ...) gain nothing from entropy coding
+// and can even grow by their code tables. Before doing any real work the encoder copies
+// SAMPLE_CHUNKS evenly spaced SAMPLE_CHUNK_BYTES pieces of the payload (all of it if it is
+// small) and plans them as one block with each codec. The payload is stored as it is unless
+// the better codec saves at least STORED_MIN_SAVING_PERCENT on the sample, and tANS is only
+// picked when it also beats Huffman by TANS_MIN_GAIN_PERCENT of the sample size. A payload that
+// is coded after all but comes out no smaller is still stored. --method, the "method" of a
+// worker job or STEGO_METHOD=huffman, tans, stored or auto override this.
+#define STEGO_METHOD_AUTO -1
+#define SAMPLE_CHUNKS 16
+#define SAMPLE_CHUNK_BYTES 4096
+#define SAMPLE_BYTES (SAMPLE_CHUNKS * SAMPLE_CHUNK_BYTES)
+#define STORED_MIN_SAVING_PERCENT 3
+#define TANS_MIN_GAIN_PERCENT 1
+
+// Parses a method name. Returns STEGO_METHOD_* or STEGO_METHOD_AUTO, or -2 if it is unknown.
+int parseMethodName(const char* name) {
+    if (strcmp(name, "auto") == 0) return STEGO_METHOD_AUTO;
+    if (strcmp(name, "huffman") == 0) return STEGO_METHOD_HUFFMAN;
+    if (strcmp(name, "stored") == 0) return STEGO_METHOD_STORED;
+    if (strcmp(name, "tans") == 0) return STEGO_METHOD_TANS;
+    return -2;
+}
+
+// The process-wide method: --method or STEGO_METHOD if set, otherwise STEGO_METHOD_AUTO.
+int methodRequested(void) {
+    const char* forced = getenv("STEGO_METHOD");
+    if (stegoOptions.method >= 0) return stegoOptions.method;
+    if (forced && *forced && parseMethodName(forced) >= 0) return parseMethodName(forced);
+    return STEGO_METHOD_AUTO;
+}
+
+// Start of sample piece i of a payload of 'size' bytes (larger than SAMPLE_BYTES).
+static inline unsigned long long sampleOffset(unsigned long long size, int i) {
+    return (size - SAMPLE_CHUNK_BYTES) / (SAMPLE_CHUNKS - 1) * (unsigned long long)i;
+}
+
+// Copies the sampled pieces of data into sample (SAMPLE_BYTES long). Returns the sample size.
+size_t samplePayload(const unsigned char* data, size_t size, unsigned char* sample) {
+    if (size <= SAMPLE_BYTES) {
+        memcpy(sample, data, size);
+        return size;
+    }
+    for (int c = 0; c < SAMPLE_CHUNKS; c++) memcpy(sample + c * SAMPLE_CHUNK_BYTES, data + sampleOffset(size, c), SAMPLE_CHUNK_BYTES);
+    return SAMPLE_BYTES;
+}
+
+// The same for a file of 'size' bytes; leaves the file position at the start. Returns 1 on success.
+int sampleFile(FILE* file, unsigned long long size, unsigned char* sample, size_t* sampleSize) {
+    *sampleSize = 0;
+    if (size <= SAMPLE_BYTES) {
+        if (stegoSeek(file, 0, SEEK_SET) != 0 || fread(sample, 1, (size_t)size, file) != (size_t)size) return 0;
+        *sampleSize = (size_t)size;
+    } else {
+        for (int c = 0; c < SAMPLE_CHUNKS; c++) {
+            if (stegoSeek(file, (long long)sampleOffset(size, c), SEEK_SET) != 0 ||
+                fread(sample + c * SAMPLE_CHUNK_BYTES, 1, SAMPLE_CHUNK_BYTES, file) != SAMPLE_CHUNK_BYTES) {
+                return 0;
+            }
+        }
+        *sampleSize = SAMPLE_BYTES;
+    }
+    return stegoSeek(file, 0, SEEK_SET) == 0;
+}
+
+// Picks STEGO_METHOD_HUFFMAN, STEGO_METHOD_TANS or STEGO_METHOD_STORED for a payload from
+// its sample (see above).
+int chooseMethod(const unsigned char* sample, size_t size) {
+    CodecModel model;
+    if (size == 0) return STEGO_METHOD_HUFFMAN;
+    unsigned long long huffmanBytes = huffmanPlanBlock(sample, size, &model);
+    unsigned long long tansBytes = tansPlanBlock(sample, size, &model);
+    int useTans = tansBytes * 100 + size * TANS_MIN_GAIN_PERCENT <= huffmanBytes * 100;
+    unsigned long long best = useTans ? tansBytes : huffmanBytes;
+    if (best * 100 >= size * (100 - STORED_MIN_SAVING_PERCENT)) return STEGO_METHOD_STORED;
+    return useTans ? STEGO_METHOD_TANS : STEGO_METHOD_HUFFMAN;
+}
+
+
+// --- LSB Depth (parseDepth, depthRequested, payloadPixels, fitDepth) ---
+// Each pixel byte after the header can carry 1 to LSB_MAX_DEPTH payload bits. More bits per
+// byte fit a payload into a smaller cover and touch fewer bytes, at the cost of larger changes
+// to each pixel. The depth is 1 unless --depth, the "depth" of a worker job or STEGO_DEPTH
+// asks for another; "auto" picks the smallest depth at which the payload fits the cover.
+#define STEGO_DEPTH_AUTO 0
+
+// Parses a depth: "1" to "4" or "auto" (STEGO_DEPTH_AUTO). Returns -1 if it is invalid.
+int parseDepth(const char* name) {
+    if (strcmp(name, "auto") == 0) return STEGO_DEPTH_AUTO;
+    if (name[0] >= '1' && name[0] <= '0' + LSB_MAX_DEPTH && name[1] == '\0') return name[0] - '0';
+    return -1;
+}
+
+// The process-wide depth: --depth or STEGO_DEPTH if set, otherwise 1.
+int depthRequested(void) {
+    const char* forced = getenv("STEGO_DEPTH");
+    if (stegoOptions.depth >= 0) return stegoOptions.depth;
+    if (forced && *forced && parseDepth(forced) >= 0) return parseDepth(forced);
+    return 1;
+}
+
+// Pixel bytes taken after the header by the payload and its index of indexBytes: the block
+// index and the blocks of plan if it is not NULL (laid out for depth as a side effect),
+// otherwise a single stream of dataBits and its seek index.
+unsigned long long payloadPixels(BlockPlan* plan, size_t indexBytes, unsigned long long dataBits, unsigned int depth) {
+    if (!plan) return lsbPixels(dataBits, depth) + lsbPixels(indexBytes * 8ULL, depth);
+    blockPlanLayout(plan, depth);
+    return lsbPixels(indexBytes * 8ULL, depth) + plan->totalPixels;
+}
+
+// Returns the depth to embed at, or 0 if the payload does not fit into availablePixels cover
+// bytes even at the deepest depth allowed. *requiredPixels receives the cover bytes needed at
+// the returned depth (or at the deepest one tried), the payload checksum included.
+unsigned int fitDepth(int requested, unsigned long long availablePixels, size_t headerBytes, BlockPlan* plan,
+                      size_t indexBytes, unsigned long long dataBits, unsigned long long* requiredPixels) {
+    unsigned int first = requested == STEGO_DEPTH_AUTO ? 1 : (unsigned int)requested;
+    unsigned int last = requested == STEGO_DEPTH_AUTO ? LSB_MAX_DEPTH : (unsigned int)requested;
+    for (unsigned int depth = first; depth <= last; depth++) {
+        *requiredPixels = headerBytes * 8ULL + payloadPixels(plan, indexBytes, dataBits, depth) + lsbPixels(STEGO_CHECKSUM_BITS, depth);
+        if (*requiredPixels <= availablePixels) return depth;
+    }
+    return 0;
+}
+
+
+// --- Streaming Cover I/O (coverStreamOpen, coverStreamPreload, coverStreamEmbed, coverStreamExtract, coverStreamFinish) ---
+// Walks a cover image front to back through a fixed-size window, so that streaming encodes
+// and decodes use the same amount of memory however large the payload is. The window holds
+// file bytes, BMP headers and row padding included; those pass through to the output as they
+// are, and the pixel bytes are found in it through the cover's layout.
+#define STREAM_WINDOW_BYTES (8u << 20)  // Cover bytes held in memory at once
+#define STREAM_CHUNK_BYTES (1u << 20)   // Payload bytes processed per step
+#define STREAMING_THRESHOLD (64LL << 20) // Payloads above this size are streamed by default
+
+typedef struct {
+    FILE* in;
+    FILE* out;                  // NULL when only extracting
+    const CoverLayout* layout;
+    unsigned char* window;
+    unsigned long long origin;  // File offset of window[0]
+    size_t length;              // Bytes of the cover currently held in window
+    unsigned long long pixel;   // Next pixel byte to embed into or extract from
+    unsigned int depth;         // Bits per pixel byte of the current section
+} CoverStream;
+
+// Starts a stream over a cover whose file position is at its first byte, or just after the
+// bytes handed over by coverStreamPreload.
+int coverStreamOpen(CoverStream* cs, FILE* in, FILE* out, const CoverLayout* layout) {
+    cs->in = in;
+    cs->out = out;
+    cs->layout = layout;
+    cs->origin = 0;
+    cs->length = 0;
+    cs->pixel = 0;
+    cs->depth = 1;
+    cs->window = (unsigned char*)malloc(STREAM_WINDOW_BYTES);
+    if (!cs->window) stegoSystemError("Failed to allocate cover stream window");
+    return cs->window != NULL;
+}
+
+// Hands a freshly opened stream the first 'size' bytes of the cover, already read from 'in' to
+// parse its headers, so that the cover is never rewound (pipes cannot be).
+int coverStreamPreload(CoverStream* cs, const unsigned char* data, size_t size) {
+    if (size > STREAM_WINDOW_BYTES) {
+        stegoError("Error: BMP headers too large to stream.\n");
+        return 0;
+    }
+    memcpy(cs->window, data, size);
+    cs->length = size;
+    return 1;
+}
+
+void coverStreamClose(CoverStream* cs) {
+    free(cs->window);
+    cs->window = NULL;
+}
+
+// Slides the window so that it holds the file up to offset 'end' (less at the end of the
+// cover or when the window is full), writing the bytes before the next pixel byte to the
+// output. Returns the file offset up to which the window is filled.
+static unsigned long long coverStreamFill(CoverStream* cs, unsigned long long end) {
+    if (end <= cs->origin + cs->length) return cs->origin + cs->length;
+    unsigned long long next = spanOffset(cs->layout, cs->pixel);
+    size_t done = next - cs->origin < cs->length ? (size_t)(next - cs->origin) : cs->length;
+    if (cs->out && done > 0 && fwrite(cs->window, 1, done, cs->out) != done) {
+        stegoError("Error writing output image data.\n");
+        return 0;
+    }
+    memmove(cs->window, cs->window + done, cs->length - done);
+    cs->origin += done;
+    cs->length -= done;
+    while (cs->origin + cs->length < end && cs->length < STREAM_WINDOW_BYTES) {
+        size_t got = fread(cs->window + cs->length, 1, STREAM_WINDOW_BYTES - cs->length, cs->in);
+        if (got == 0) break;
+        cs->length += got;
+    }
+    return cs->origin + cs->length;
+}
+
+// Number of bits of a bitCount-bit piece whose pixel bytes are in the window after topping
+// it up: all of them, or else as many whole groups as are available.
+static size_t coverStreamTake(CoverStream* cs, unsigned long long bitCount) {
+    unsigned long long pixels = lsbPixels(bitCount, cs->depth);
+    unsigned long long held = spanPixelsBelow(cs->layout, coverStreamFill(cs, spanOffset(cs->layout, cs->pixel + pixels - 1) + 1));
+    unsigned long long available = held > cs->pixel ? held - cs->pixel : 0;
+    return available < pixels ? (size_t)(available & ~7ULL) * cs->depth : (size_t)bitCount;
+}
+
+// Embeds bitCount bits of an MSB-first packed stream into the next pixel bytes, cs->depth
+// bits per byte. Every call starts on a new pixel byte, so only the last call of a stream may
+// pass a bitCount that is not a multiple of 8 * depth.
+int coverStreamEmbed(CoverStream* cs, const unsigned char* bits, unsigned long long bitCount) {
+    while (bitCount > 0) {
+        size_t n = coverStreamTake(cs, bitCount);
+        if (n == 0) {
+            stegoError("Error: Unexpected end of image data while embedding.\n");
+            return 0;
+        }
+        PixelView view = { cs->layout, cs->window, cs->window, cs->origin };
+        spanEmbedBits(&view, cs->pixel, bits, n, cs->depth);
+        cs->pixel += lsbPixels(n, cs->depth);
+        bits += n / 8;
+        bitCount -= n;
+    }
+    return 1;
+}
+
+// Extracts bitCount bits from the next pixel bytes, packed MSB-first; same rules as coverStreamEmbed.
+int coverStreamExtract(CoverStream* cs, unsigned char* bits, unsigned long long bitCount) {
+    while (bitCount > 0) {
+        size_t n = coverStreamTake(cs, bitCount);
+        if (n == 0) {
+            stegoError("Error: Unexpected end of image data during decoding.\n");
+            return 0;
+        }
+        PixelView view = { cs->layout, NULL, cs->window, cs->origin };
+        spanExtractBits(&view, cs->pixel, bits, n, cs->depth);
+        cs->pixel += lsbPixels(n, cs->depth);
+        bits += n / 8;
+        bitCount -= n;
+    }
+    return 1;
+}
+
+// Writes out the rest of the window and copies the remainder of the cover unchanged.
+int coverStreamFinish(CoverStream* cs) {
+    if (fwrite(cs->window, 1, cs->length, cs->out) != cs->length) return 0;
+    cs->origin += cs->length;
+    cs->length = 0;
+    size_t got;
+    while ((got = fread(cs->window, 1, STREAM_WINDOW_BYTES, cs->in)) > 0) {
+        if (fwrite(cs->window, 1, got, cs->out) != got) return 0;
+        cs->origin += got;
+    }
+    return !ferror(cs->in);
+}
+
+long long getFileSize(FILE* file) {
+    long long current = stegoTell(file);
+    if (current < 0 || stegoSeek(file, 0, SEEK_END) != 0) return -1;
+    long long size = stegoTell(file);
+    stegoSeek(file, current, SEEK_SET);
+    return size;
+}
+
+// Streaming is used above STREAMING_THRESHOLD; --stream/--no-stream or STEGO_STREAMING=1 or 0
+// force it on or off. Pipes are always streamed (see Pipes). Scattered pixel bytes (see Keyed
+// Scatter) cannot be walked front to back, so a key rules streaming out.
+int streamingRequested(unsigned long long payloadSize) {
+    const char* forced = getenv("STEGO_STREAMING");
+    if (scatterKeyRequested()) return 0;
+    if (stegoOptions.streaming >= 0) return stegoOptions.streaming;
+    if (forced && *forced) return strcmp(forced, "0") != 0;
+    return payloadSize > (unsigned long long)STREAMING_THRESHOLD;
+}
+
+
+// --- Streaming Encoding (readBlockGroup, encodeBinaryIntoImageStreaming) ---
+// Two passes over the secret file in STREAM_CHUNK_BYTES pieces: the first counts bytes, the
+// second packs codes and embeds them through a CoverStream. In block mode both passes read
+// one block per thread at a time, plan or pack those blocks in parallel and embed them in
+// order. Produces the same image as the in-memory path.
+
+// Reads blocks [first, first + n) of the secret file into buffer. Returns 1 on success.
+static int readBlockGroup(FILE* secret, const BlockPlan* plan, size_t first, size_t n, unsigned char* buffer) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) bytes += blockLength(plan, first + i);
+    return fread(buffer, 1, bytes, secret) == bytes;
+}
+
+int encodeBinaryIntoImageStreaming(const char *imagePath, const char *binaryFilePath, const char *outputPath, int method, int depth,
+                                   StegoStats* stats) {
+    FILE *secret = NULL, *image = NULL, *output = NULL;
+    unsigned char *chunk = NULL, *packed = NULL, *blockIndex = NULL, *secretBuffer = NULL;
+    BlockPlan plan = {0};
+    SeekIndex seek = {0};
+    CoverStream cs = {0};
+    int threads = stegoThreadCount();
+    int ok = 0;
+
+    if (scatterKeyRequested()) { stegoError("Error: Keyed encodes cannot be streamed; use files rather than pipes.\n"); return 0; }
+    if (stats) stats->streaming = 1;
+    secret = openInputStream(binaryFilePath);
+    if (!secret) { stegoError("Error opening file: %s\n", binaryFilePath); return 0; }
+    if (pathIsStream(binaryFilePath)) {
+        FILE* buffered = bufferSecretStream(secret, strcmp(binaryFilePath, "-") == 0 && strcmp(imagePath, "-") == 0, &secretBuffer);
+        closeStream(secret);
+        secret = buffered;
+        if (!secret) return 0;
+    }
+    long long secretSize = getFileSize(secret);
+    if (stats && secretSize > 0) stats->payloadBytes = (unsigned long long)secretSize;
+    if (secretBuffer && secretSize > 0) statsAlloc(stats, (unsigned long long)secretSize);
+    statsPhase(stats, STATS_READ);
+    int autoMethod = method == STEGO_METHOD_AUTO;
+    if (autoMethod) {
+        unsigned char sample[SAMPLE_BYTES];
+        size_t sampleSize = 0;
+        if (secretSize > 0 && !sampleFile(secret, (unsigned long long)secretSize, sample, &sampleSize)) { stegoError("Error reading file content.\n"); goto stream_encode_cleanup; }
+        method = chooseMethod(sample, sampleSize);
+        statsPhase(stats, STATS_ANALYZE);
+    }
+    if (method == STEGO_METHOD_TANS && secretSize <= 0) method = STEGO_METHOD_HUFFMAN;
+    const BlockCodec* codec = codecForMethod(method == STEGO_METHOD_TANS ? STEGO_METHOD_TANS : STEGO_METHOD_HUFFMAN);
+    size_t slotSize = codec->bound((size_t)1 << BLOCK_SIZE_LOG2);
+    int blockMode = method != STEGO_METHOD_STORED && secretSize > 0 &&
+                    (method == STEGO_METHOD_TANS || blockModeRequested((unsigned long long)secretSize));
+    size_t chunkSize = blockMode ? ((size_t)1 << BLOCK_SIZE_LOG2) * (size_t)threads : STREAM_CHUNK_BYTES;
+    size_t packedSize = blockMode ? slotSize * (size_t)threads : STREAM_CHUNK_BYTES * 2 + 8; // Codes are at most 15 bits
+    chunk = (unsigned char*)malloc(chunkSize);
+    packed = (unsigned char*)malloc(packedSize);
+    statsAlloc(stats, chunkSize + packedSize);
+    if (!chunk || !packed) { stegoSystemError("Failed to allocate streaming buffers"); goto stream_encode_cleanup; }
+
+    StegoHeader stegoHeader;
+    memset(&stegoHeader, 0, sizeof(stegoHeader));
+    stegoHeader.version = STEGO_FORMAT_VERSION;
+    CodeTable codeTable[BYTE_RANGE];
+    unsigned long long originalFileSize = 0;
+    size_t indexSize = 0;
+    size_t got;
+    if (method == STEGO_METHOD_STORED) {
+        originalFileSize = secretSize > 0 ? (unsigned long long)secretSize : 0;
+        stegoHeader.originalSize = originalFileSize;
+    } else if (blockMode) {
+        originalFileSize = (unsigned long long)secretSize;
+        stegoHeader.flags = STEGO_FLAG_BLOCKS;
+        stegoHeader.blockSizeLog2 = BLOCK_SIZE_LOG2;
+        if (!blockPlanInit(&plan, codec, originalFileSize, BLOCK_SIZE_LOG2, 1)) { stegoSystemError("Failed to allocate block index"); goto stream_encode_cleanup; }
+        stegoProgress("Streaming mode: planning %lu %s blocks on %d threads...\n", (unsigned long)plan.count, codec->name, threads);
+        for (size_t first = 0; first < plan.count; first += (size_t)threads) {
+            size_t n = plan.count - first < (size_t)threads ? plan.count - first : (size_t)threads;
+            if (!readBlockGroup(secret, &plan, first, n, chunk)) { stegoError("Error reading file content.\n"); goto stream_encode_cleanup; }
+            BlockJob job = { &plan, first, chunk, NULL, NULL, 0, NULL, 0, 0 };
+            parallelFor(n, threads, planBlockTask, &job);
+            if (job.failed) { stegoError("Compression failed.\n"); goto stream_encode_cleanup; }
+        }
+        blockPlanLayout(&plan, 1);
+        indexSize = plan.count * 4;
+        blockIndex = (unsigned char*)malloc(indexSize);
+        if (!blockIndex) { stegoSystemError("Failed to allocate block index"); goto stream_encode_cleanup; }
+        writeBlockIndex(&plan, blockIndex);
+        stegoHeader.originalSize = originalFileSize;
+        stegoHeader.compressedBits = plan.totalBytes * 8;
+    } else {
+        stegoProgress("Streaming mode: counting byte frequencies...\n");
+        unsigned long long counts[BYTE_RANGE] = {0};
+        while ((got = fread(chunk, 1, STREAM_CHUNK_BYTES, secret)) > 0) {
+            countBytes(chunk, got, counts);
+            originalFileSize += got;
+        }
+        if (ferror(secret)) { stegoError("Error reading file content.\n"); goto stream_encode_cleanup; }
+
+        stegoHeader.originalSize = originalFileSize;
+        if (originalFileSize > 0) {
+            int freq[BYTE_RANGE];
+            scaleFrequencies(counts, freq);
+            if (!computeCodeLengths(freq, stegoHeader.codeLengths, MAX_CANONICAL_LENGTH) ||
+                !buildCanonicalCodes(stegoHeader.codeLengths, codeTable)) {
+                stegoError("Huffman compression failed.\n");
+                goto stream_encode_cleanup;
+            }
+            for (int i = 0; i < BYTE_RANGE; i++) stegoHeader.compressedBits += counts[i] * (unsigned long long)codeTable[i].length;
+            stegoHeader.seekLog2 = seekRequested(originalFileSize);
+            if (stegoHeader.seekLog2) stegoHeader.flags = STEGO_FLAG_SEEK;
+        }
+    }
+    size_t seekSize = (size_t)stegoSeekCount(&stegoHeader) * 4;
+    if (autoMethod && method != STEGO_METHOD_STORED && originalFileSize > 0 &&
+        stegoHeader.compressedBits + (indexSize + seekSize) * 8ULL >= originalFileSize * 8) {
+        method = STEGO_METHOD_STORED;
+        stegoHeader.flags = 0;
+        indexSize = seekSize = 0;
+    }
+    if (method == STEGO_METHOD_STORED) {
+        stegoProgress("Payload does not compress; storing it as is.\n");
+        stegoHeader.compressedBits = originalFileSize * 8;
+    }
+    if (!seekIndexInit(&seek, &stegoHeader)) { stegoSystemError("Failed to allocate seek index"); goto stream_encode_cleanup; }
+    stegoHeader.method = (unsigned int)method;
+    stegoHeader.depth = 1;
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    size_t headerSize = writeStegoHeader(&stegoHeader, header);
+    if (stats && method != STEGO_METHOD_STORED) stats->bytesRead += originalFileSize; // The counting or planning pass
+    statsAlloc(stats, indexSize + seekSize);
+    statsPhase(stats, STATS_COMPRESS);
+
+    image = openInputStream(imagePath);
+    if (!image) { stegoError("Error opening input image: %s\n", imagePath); goto stream_encode_cleanup; }
+    long long imageFileSize = pathIsStream(imagePath) ? 0 : getFileSize(image);
+    unsigned char bmpHeader[BMP_LAYOUT_BYTES];
+    size_t bmpHeaderSize = imageFileSize >= 0 ? fread(bmpHeader, 1, sizeof(bmpHeader), image) : 0;
+    if (imageFileSize == 0) imageFileSize = (long long)streamedImageSize(bmpHeader, bmpHeaderSize);
+    CoverLayout layout;
+    const char* layoutError = "not a BMP file";
+    if (imageFileSize < 0 || !parseBmpLayout(bmpHeader, bmpHeaderSize, (unsigned long long)imageFileSize, &layout, &layoutError)) {
+        stegoError("Error: Unsupported cover image: %s.\n", layoutError);
+        goto stream_encode_cleanup;
+    }
+    unsigned long long availablePixels = layout.capacity;
+    unsigned long long requiredPixels = 0;
+    stegoHeader.depth = fitDepth(depth, availablePixels, headerSize, indexSize ? &plan : NULL, indexSize + seekSize,
+                                 stegoHeader.compressedBits, &requiredPixels);
+    if (!stegoHeader.depth) {
+        stegoError("Error: Image capacity insufficient.\n");
+        stegoError("  Available pixel bytes: %llu\n", availablePixels);
+        stegoError("  Required pixel bytes: %llu at %d bits per byte\n", requiredPixels, depth == STEGO_DEPTH_AUTO ? LSB_MAX_DEPTH : depth);
+        goto stream_encode_cleanup;
+    }
+    stegoProgress("Capacity OK. Required: %llu pixel bytes at %u bits per byte, Available: %llu\n", requiredPixels,
+                  stegoHeader.depth, availablePixels);
+    writeStegoHeader(&stegoHeader, header); // Same size whatever the depth
+    statsHeader(stats, &stegoHeader, availablePixels, requiredPixels);
+
+    output = openOutputStream(outputPath);
+    if (!output) { stegoError("Error opening output image: %s\n", outputPath); goto stream_encode_cleanup; }
+    if (!coverStreamOpen(&cs, image, output, &layout) || !coverStreamPreload(&cs, bmpHeader, bmpHeaderSize)) goto stream_encode_cleanup;
+    statsAlloc(stats, STREAM_WINDOW_BYTES);
+    statsPhase(stats, STATS_COVER);
+
+    if (stegoHeader.flags & STEGO_FLAG_BLOCKS) {
+        stegoProgress("Embedding header (%lu bytes, file size %llu bytes, block index of %lu bytes)...\n",
+               (unsigned long)headerSize, originalFileSize, (unsigned long)indexSize);
+    } else if (method == STEGO_METHOD_STORED) {
+        stegoProgress("Embedding header (%lu bytes, file size %llu bytes, stored)...\n", (unsigned long)headerSize, originalFileSize);
+    } else {
+        stegoProgress("Embedding header (%lu bytes, file size %llu bytes, canonical code lengths)...\n", (unsigned long)headerSize, originalFileSize);
+    }
+    if (!coverStreamEmbed(&cs, header, headerSize * 8)) goto stream_encode_cleanup;
+    cs.depth = stegoHeader.depth;
+    if (indexSize && !coverStreamEmbed(&cs, blockIndex, indexSize * 8ULL)) goto stream_encode_cleanup;
+
+    stegoProgress("Embedding %s data (%llu bits)...\n", method == STEGO_METHOD_STORED ? "stored" : "compressed", stegoHeader.compressedBits);
+    if (stegoSeek(secret, 0, SEEK_SET) != 0) { stegoSystemError("fseek error rewinding secret file"); goto stream_encode_cleanup; }
+    uint32_t checksum = 0;
+    if (method == STEGO_METHOD_STORED) {
+        unsigned long long bytesEmbedded = 0;
+        size_t chunkBytes = STREAM_CHUNK_BYTES / cs.depth * cs.depth; // Whole groups
+        while ((got = fread(chunk, 1, chunkBytes, secret)) > 0) {
+            bytesEmbedded += got;
+            if (bytesEmbedded > originalFileSize) break;
+            checksum = crc32c(checksum, chunk, got);
+            if (!coverStreamEmbed(&cs, chunk, got * 8ULL)) goto stream_encode_cleanup;
+        }
+        if (bytesEmbedded != originalFileSize) { stegoError("Error: Secret file changed while it was being encoded.\n"); goto stream_encode_cleanup; }
+    } else if (stegoHeader.flags & STEGO_FLAG_BLOCKS) {
+        for (size_t first = 0; first < plan.count; first += (size_t)threads) {
+            size_t n = plan.count - first < (size_t)threads ? plan.count - first : (size_t)threads;
+            if (!readBlockGroup(secret, &plan, first, n, chunk)) { stegoError("Error: Secret file changed while it was being encoded.\n"); goto stream_encode_cleanup; }
+            size_t groupBytes = 0;
+            for (size_t i = 0; i < n; i++) groupBytes += blockLength(&plan, first + i);
+            checksum = crc32c(checksum, chunk, groupBytes);
+            BlockJob job = { &plan, first, chunk, NULL, packed, slotSize, NULL, 0, 0 };
+            parallelFor(n, threads, packBlockTask, &job);
+            if (job.failed) { stegoError("Error: Secret file changed while it was being encoded.\n"); goto stream_encode_cleanup; }
+            for (size_t i = 0; i < n; i++) {
+                if (!coverStreamEmbed(&cs, packed + i * slotSize, plan.streamBytes[first + i] * 8ULL)) goto stream_encode_cleanup;
+            }
+        }
+    } else {
+        BitWriter bw;
+        bitWriterInit(&bw, packed);
+        unsigned long long bytesEncoded = 0, bitsEmbedded = 0;
+        while ((got = fread(chunk, 1, STREAM_CHUNK_BYTES, secret)) > 0) {
+            bytesEncoded += got;
+            if (bytesEncoded > originalFileSize) break;
+            for (size_t i = 0; i < got; i++) {
+                const CodeTable* entry = &codeTable[chunk[i]];
+                bitWriterPut(&bw, entry->code, entry->length);
+            }
+            seekIndexAdd(&seek, chunk, got, codeTable);
+            checksum = crc32c(checksum, chunk, got);
+            // Embed whole groups only and keep the remaining bytes for the next chunk.
+            size_t ready = bw.pos / cs.depth * cs.depth;
+            if (!coverStreamEmbed(&cs, packed, ready * 8ULL)) goto stream_encode_cleanup;
+            bitsEmbedded += ready * 8ULL;
+            memmove(packed, packed + ready, bw.pos - ready);
+            bw.pos -= ready;
+        }
+        if (bytesEncoded != originalFileSize) { stegoError("Error: Secret file changed while it was being encoded.\n"); goto stream_encode_cleanup; }
+        bitWriterFlush(&bw);
+        if (!coverStreamEmbed(&cs, packed, stegoHeader.compressedBits - bitsEmbedded)) goto stream_encode_cleanup;
+        if (seek.count) {
+            stegoProgress("Embedding seek index (%lu checkpoints)...\n", (unsigned long)seek.count);
+            if (!coverStreamEmbed(&cs, seek.entries, seek.count * 32ULL)) goto stream_encode_cleanup;
+        }
+    }
+    unsigned char trailer[STEGO_CHECKSUM_BITS / 8] = { (unsigned char)(checksum >> 24), (unsigned char)(checksum >> 16),
+                                                      (unsigned char)(checksum >> 8), (unsigned char)checksum };
+    if (!coverStreamEmbed(&cs, trailer, STEGO_CHECKSUM_BITS)) goto stream_encode_cleanup;
+    statsPhase(stats, STATS_EMBED);
+
+    stegoProgress("Copying remaining image data...\n");
+    if (!coverStreamFinish(&cs)) { stegoError("Error writing remaining pixel data.\n"); goto stream_encode_cleanup; }
+    statsPhase(stats, STATS_COPY);
+    if (closeStream(output) != 0) { output = NULL; stegoError("Error writing output image: %s\n", outputPath); goto stream_encode_cleanup; }
+    output = NULL;
+    statsPhase(stats, STATS_WRITE);
+    if (stats) {
+        stats->bytesRead += originalFileSize + cs.origin; // The whole cover has passed through the window
+        stats->bytesWritten = cs.origin;
+    }
+    stegoProgress("Encoding finished successfully for '%s'.\n", outputPath);
+    ok = 1;
+
+stream_encode_cleanup:
+    coverStreamClose(&cs);
+    if (secret) fclose(secret);
+    if (image) closeStream(image);
+    if (output) closeStream(output);
+    free(secretBuffer);
+    free(chunk);
+    free(packed);
+    free(blockIndex);
+    free(seek.entries);
+    blockPlanFree(&plan);
+    return ok;
+}
+
+
+// --- Payload Planning (planPayload, measurePayload, formatCapacityFields) ---
+// Works out how a payload held in memory is stored and how many bits that takes, without
+// building its bit stream: the method, block mode and the stored fallback for payloads that
+// do not compress are decided as encoding decides them, and a single Huffman stream is sized
+// from the byte histogram and its code lengths. Block mode plans every block, which sizes a
+// Huffman block the same way and a tANS block by running its coder without output. The
+// capacity command (measurePayload) stops there, so a web form can turn away a payload that
+// will not fit without encoding it.
+
+// Plans data for method (STEGO_METHOD_AUTO to choose) into h, which gets everything but
+// the depth and shard, and for block mode into plan (laid out at depth 1), which the caller
+// frees. *indexSize and *seekSize receive the sizes of the block and seek indexes. stats
+// may be NULL. Returns 1 on success.
+int planPayload(const unsigned char* data, size_t size, int method, int threads, StegoHeader* h, BlockPlan* plan,
+                size_t* indexSize, size_t* seekSize, StegoStats* stats) {
+    memset(h, 0, sizeof(*h));
+    h->version = STEGO_FORMAT_VERSION;
+    h->originalSize = size;
+    *indexSize = *seekSize = 0;
+
+    int autoMethod = method == STEGO_METHOD_AUTO;
+    if (autoMethod) {
+        unsigned char sample[SAMPLE_BYTES];
+        method = chooseMethod(sample, size > 0 ? samplePayload(data, size, sample) : 0);
+        statsPhase(stats, STATS_ANALYZE);
+    }
+    if (method == STEGO_METHOD_TANS && size == 0) method = STEGO_METHOD_HUFFMAN;
+    const BlockCodec* codec = codecForMethod(method == STEGO_METHOD_TANS ? STEGO_METHOD_TANS : STEGO_METHOD_HUFFMAN);
+
+    if (method == STEGO_METHOD_STORED) {
+        h->compressedBits = size * 8ULL;
+    } else if (method == STEGO_METHOD_TANS || blockModeRequested(size)) {
+        h->flags = STEGO_FLAG_BLOCKS;
+        h->blockSizeLog2 = BLOCK_SIZE_LOG2;
+        if (!blockPlanInit(plan, codec, size, BLOCK_SIZE_LOG2, 1)) { stegoSystemError("Failed to allocate block index"); return 0; }
+        stegoProgress("Block mode: compressing %lu %s blocks of %u KB on %d threads...\n", (unsigned long)plan->count,
+               codec->name, 1u << (BLOCK_SIZE_LOG2 - 10), threads);
+        BlockJob planJob = { plan, 0, data, NULL, NULL, 0, NULL, 0, 0 };
+        parallelFor(plan->count, threads, planBlockTask, &planJob);
+        if (planJob.failed) { stegoError("Compression failed.\n"); return 0; }
+        blockPlanLayout(plan, 1);
+        *indexSize = plan->count * 4;
+        h->compressedBits = plan->totalBytes * 8;
+    } else if (size > 0) {
+        unsigned long long counts[BYTE_RANGE] = {0};
+        int freq[BYTE_RANGE];
+        countBytesParallel(data, size, threads, counts);
+        scaleFrequencies(counts, freq); // As the streaming encoder does, for the same code
+        if (!computeCodeLengths(freq, h->codeLengths, MAX_CANONICAL_LENGTH)) { stegoError("Failed to build Huffman tree.\n"); return 0; }
+        for (int s = 0; s < BYTE_RANGE; s++) h->compressedBits += counts[s] * h->codeLengths[s];
+        h->seekLog2 = seekRequested(size);
+        if (h->seekLog2) h->flags = STEGO_FLAG_SEEK;
+    }
+    *seekSize = (size_t)stegoSeekCount(h) * 4;
+    if (autoMethod && method != STEGO_METHOD_STORED && size > 0 &&
+        h->compressedBits + (*indexSize + *seekSize) * 8ULL >= size * 8ULL) {
+        method = STEGO_METHOD_STORED;
+        h->flags = 0;
+        *indexSize = *seekSize = 0;
+        h->compressedBits = size * 8ULL;
+    }
+    h->method = (unsigned int)method;
+    return 1;
+}
+
+typedef struct {
+    StegoHeader header;                 // As encoding would write it; depth 0 if it does not fit
+    size_t headerBytes;
+    size_t indexBytes;                  // Block or seek index
+    unsigned long long availablePixels;
+    unsigned long long requiredPixels;  // At the depth, or at the deepest depth tried if it does not fit
+} PayloadFit;
+
+// Plans secret as encoding it into a cover with method and depth would, and checks it against
+// the cover's capacity. cover holds the first coverBytes bytes of a cover of coverFileSize
+// bytes, at least its BMP headers. Returns 1 if the payload fits, 0 if it does not (fit
+// filled in either way) and -1 on errors.
+int measurePayload(const unsigned char* cover, size_t coverBytes, unsigned long long coverFileSize, const unsigned char* secret,
+                   size_t secretSize, int method, int depth, PayloadFit* fit) {
+    CoverLayout layout;
+    BlockPlan plan = {0};
+    size_t indexSize = 0, seekSize = 0;
+    const char* layoutError = NULL;
+    memset(fit, 0, sizeof(*fit));
+    if (!parseBmpLayout(cover, coverBytes, coverFileSize, &layout, &layoutError)) {
+        stegoError("Error: Unsupported cover image: %s.\n", layoutError);
+        return -1;
+    }
+    if (!planPayload(secret, secretSize, method, stegoThreadCount(), &fit->header, &plan, &indexSize, &seekSize, NULL)) {
+        blockPlanFree(&plan);
+        return -1;
+    }
+    if (scatterKeyRequested()) fit->header.flags |= STEGO_FLAG_SCATTER;
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    fit->header.depth = 1;
+    fit->headerBytes = writeStegoHeader(&fit->header, header);
+    fit->indexBytes = indexSize + seekSize;
+    fit->availablePixels = layout.capacity;
+    fit->header.depth = fitDepth(depth, layout.capacity, fit->headerBytes, indexSize ? &plan : NULL, fit->indexBytes,
+                                 fit->header.compressedBits, &fit->requiredPixels);
+    blockPlanFree(&plan);
+    return fit->header.depth != 0;
+}
+
+// Formats the members of a JSON object describing a measured payload (no braces) into buf.
+void formatCapacityFields(char* buf, size_t size, int status, const PayloadFit* fit) {
+    const StegoHeader* h = &fit->header;
+    snprintf(buf, size, "\"fits\":%s,\"method\":\"%s\",\"depth\":%u,\"original_size\":%llu,\"compressed_bits\":%llu,"
+             "\"header_bytes\":%lu,\"index_bytes\":%lu,\"block_mode\":%s,\"required_pixels\":%llu,\"available_pixels\":%llu",
+             status > 0 ? "true" : "false", stegoMethodName(h->method), h->depth, h->originalSize, h->compressedBits,
+             (unsigned long)fit->headerBytes, (unsigned long)fit->indexBytes, h->flags & STEGO_FLAG_BLOCKS ? "true" : "false",
+             fit->requiredPixels, fit->availablePixels);
+}
+
+// measurePayload for files: only the BMP headers of the cover are read, and the secret into
+// buffer (which may be NULL).
+int measurePayloadFiles(const char* coverPath, const char* secretPath, int method, int depth, ScratchBuffer* buffer, PayloadFit* fit) {
+    unsigned char bmpHeader[BMP_LAYOUT_BYTES];
+    ScratchBuffer localBuffer = {0};
+    FILE* image = fopen(coverPath, "rb");
+    if (!image) { stegoError("Error opening input image: %s\n", coverPath); return -1; }
+    long long imageFileSize = getFileSize(image);
+    size_t bmpHeaderSize = imageFileSize >= 0 ? fread(bmpHeader, 1, sizeof(bmpHeader), image) : 0;
+    fclose(image);
+    if (imageFileSize < 0) { stegoError("Error reading input image: %s\n", coverPath); return -1; }
+    long secretSize = 0;
+    unsigned char* secret = readBinaryFile(secretPath, &secretSize, buffer ? buffer : &localBuffer);
+    int status = -1;
+    if (secret || secretSize == 0) {
+        status = measurePayload(bmpHeader, bmpHeaderSize, (unsigned long long)imageFileSize, secret, (size_t)secretSize, method, depth, fit);
+    } else {
+        stegoError("Failed to read file to hide.\n");
+    }
+    free(localBuffer.data);
+    return status;
+}
+
+
+// --- Encoding (encodeCoverBuffer, encodeBinaryIntoImage) ---
+// Hides secretSize bytes of secret in the BMP cover held in memory. The stego image goes to
+// output, which must hold coverSize bytes and may not overlap the cover, or when output is NULL
+// to the file at outputPath, created only once the payload is known to fit. If coverPath names
+// the file the cover was read from, the output file starts as a clone of it and only the bytes
+// the payload changes are written (see Cover Clones). If shard is not NULL, the secret is that
+// shard of a larger file (see Shards). scratch and stats may be NULL; see Scratch Buffers and
+// Job Statistics. Returns 1 on success.
+int encodeCoverBuffer(const unsigned char* cover, size_t coverSize, const unsigned char* secret, size_t secretSize,
+                      unsigned char* output, const char* outputPath, const char* coverPath, int method, int depth,
+                      const StegoShard* shard, StegoScratch* scratch, StegoStats* stats) {
+    ImageBuffer outputFile = {0};
+    int cloneFile = -1, cloned = 0, inPlace = 0;
+    const unsigned char* inputData = secret;
+    unsigned char* bitStream = NULL;
+    unsigned char* blockIndex = NULL;
+    unsigned char* blockSlots = NULL;
+    StegoScratch localScratch = {0};
+    BlockPlan plan = {0};
+    SeekIndex seek = {0};
+    int threads = stegoThreadCount();
+    int ok = 0;
+
+    if (!scratch) scratch = &localScratch;
+    if (secretSize > (size_t)LONG_MAX / 8) { stegoError("Error: File to hide is too large to encode in memory.\n"); return 0; }
+    // The cover is checked before any payload work, so an unusable one fails without compressing.
+    CoverLayout layout;
+    const char* layoutError = NULL;
+    if (!parseBmpLayout(cover, coverSize, coverSize, &layout, &layoutError)) {
+        stegoError("Error: Unsupported cover image: %s.\n", layoutError);
+        return 0;
+    }
+    scatterLayout(&layout, scatterKeyRequested());
+    long originalFileSize = (long)secretSize;
+    statsAlloc(stats, (unsigned long long)originalFileSize);
+    if (stats) stats->payloadBytes = (unsigned long long)originalFileSize;
+
+    StegoHeader stegoHeader;
+    size_t indexSize = 0, seekSize = 0;
+    if (!planPayload(inputData, (size_t)originalFileSize, method, threads, &stegoHeader, &plan, &indexSize, &seekSize, stats)) goto encode_cleanup;
+    method = (int)stegoHeader.method;
+    long compressedBitsCount = (long)stegoHeader.compressedBits;
+    if (indexSize) {
+        blockIndex = scratchReserve(&scratch->packed, indexSize);
+        if (!blockIndex) { stegoSystemError("Failed to allocate block index"); goto encode_cleanup; }
+        writeBlockIndex(&plan, blockIndex);
+    } else if (method != STEGO_METHOD_STORED && compressedBitsCount > 0) {
+        CodeTable codeTable[BYTE_RANGE];
+        buildCanonicalCodes(stegoHeader.codeLengths, codeTable);
+        bitStream = packHuffmanCodes(inputData, originalFileSize, codeTable, compressedBitsCount, &scratch->packed);
+        if (!bitStream) { stegoError("Huffman compression failed.\n"); goto encode_cleanup; }
+    }
+    if (method == STEGO_METHOD_STORED) stegoProgress("Payload does not compress; storing it as is.\n");
+    if (shard) {
+        stegoHeader.flags |= STEGO_FLAG_SHARD;
+        stegoHeader.shard = *shard;
+    }
+    uint32_t checksum = crc32c(0, inputData, (size_t)originalFileSize);
+    if (seekSize) {
+        CodeTable codeTable[BYTE_RANGE];
+        if (!seekIndexInit(&seek, &stegoHeader)) { stegoSystemError("Failed to allocate seek index"); goto encode_cleanup; }
+        buildCanonicalCodes(stegoHeader.codeLengths, codeTable);
+        seekIndexAdd(&seek, inputData, (size_t)originalFileSize, codeTable);
+    }
+    statsAlloc(stats, (bitStream ? (unsigned long long)(compressedBitsCount + 7) / 8 : indexSize) + seekSize);
+    statsPhase(stats, STATS_COMPRESS);
+
+    if (layout.scatter.enabled) stegoHeader.flags |= STEGO_FLAG_SCATTER;
+
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    stegoHeader.depth = 1;
+    size_t headerSize = writeStegoHeader(&stegoHeader, header);
+
+    unsigned long long availablePixels = layout.capacity;
+    unsigned long long requiredPixels = 0;
+    stegoHeader.depth = fitDepth(depth, availablePixels, headerSize, indexSize ? &plan : NULL, indexSize + seekSize,
+                                 stegoHeader.compressedBits, &requiredPixels);
+    if (!stegoHeader.depth) {
+        stegoError("Error: Image capacity insufficient.\n");
+        stegoError("  Available pixel bytes: %llu\n", availablePixels);
+        stegoError("  Required pixel bytes: %llu at %d bits per byte\n", requiredPixels, depth == STEGO_DEPTH_AUTO ? LSB_MAX_DEPTH : depth);
+        goto encode_cleanup;
+    }
+    stegoProgress("Capacity OK. Required: %llu pixel bytes at %u bits per byte, Available: %llu\n", requiredPixels,
+                  stegoHeader.depth, availablePixels);
+    writeStegoHeader(&stegoHeader, header); // Same size whatever the depth
+    statsHeader(stats, &stegoHeader, availablePixels, requiredPixels);
+    statsPhase(stats, STATS_COVER);
+
+    // File bytes [patchStart, patchEnd) of the output are written here: all of them, unless the
+    // output is a clone of the cover file, when only those from the first to the last pixel byte
+    // used are (all pixel bytes, if they are scattered).
+    size_t patchStart = 0, patchEnd = coverSize;
+    if (!output) {
+#ifndef _WIN32
+        inPlace = coverPath && sameFile(coverPath, outputPath);
+        if (coverPath && (stegoOptions.clone || inPlace)) {
+            patchStart = (size_t)spanOffset(&layout, 0);
+            patchEnd = (size_t)spanOffset(&layout, (layout.scatter.enabled ? layout.capacity : requiredPixels) - 1) + 1;
+            output = scratchReserve(&scratch->output, patchEnd - patchStart);
+            if (!output) { stegoSystemError("Failed to allocate output buffer"); goto encode_cleanup; }
+            statsAlloc(stats, patchEnd - patchStart);
+            cloneFile = cloneCoverFile(coverPath, outputPath);
+            if (cloneFile < 0) { stegoSystemError("Error cloning cover image to output"); goto encode_cleanup; }
+            cloned = 1;
+            stegoProgress("%s; writing %llu of its %llu bytes...\n", inPlace ? "Encoding in place" : "Cloned cover image",
+                          (unsigned long long)(patchEnd - patchStart), (unsigned long long)coverSize);
+        }
+#endif
+        if (cloneFile < 0) {
+            if (!createImageOutput(outputPath, coverSize, &outputFile)) { stegoError("Error opening output image: %s\n", outputPath); goto encode_cleanup; }
+            output = outputFile.data;
+        }
+    }
+    // The embedding below only writes pixel bytes. With contiguous spans the rest is copied
+    // around it; otherwise the output starts as a copy of the cover and is embedded in place.
+    PixelView view = { &layout, output, cover + patchStart, patchStart };
+    if (layoutContiguous(&layout) && cloneFile < 0) {
+        memcpy(output, cover, (size_t)layout.dataOffset);
+    } else {
+        memcpy(output, cover + patchStart, patchEnd - patchStart);
+        view.src = output;
+    }
+    statsPhase(stats, STATS_COPY);
+
+    if (stegoHeader.flags & STEGO_FLAG_BLOCKS) {
+        stegoProgress("Embedding header (%lu bytes, file size %ld bytes, block index of %lu bytes)...\n",
+               (unsigned long)headerSize, originalFileSize, (unsigned long)indexSize);
+    } else if (stegoHeader.method == STEGO_METHOD_STORED) {
+        stegoProgress("Embedding header (%lu bytes, file size %ld bytes, stored)...\n", (unsigned long)headerSize, originalFileSize);
+    } else {
+        stegoProgress("Embedding header (%lu bytes, file size %ld bytes, canonical code lengths)...\n", (unsigned long)headerSize, originalFileSize);
+    }
+    unsigned int lsbDepth = stegoHeader.depth;
+    spanEmbedBits(&view, 0, header, headerSize * 8, 1);
+    if (indexSize) spanEmbedBits(&view, headerSize * 8, blockIndex, indexSize * 8, lsbDepth);
+
+    stegoProgress("Embedding %s data (%ld bits)...\n", method == STEGO_METHOD_STORED ? "stored" : "compressed", compressedBitsCount);
+    size_t dataStart = headerSize * 8 + (size_t)lsbPixels(indexSize * 8, lsbDepth);
+    if (method == STEGO_METHOD_STORED) {
+        if (compressedBitsCount > 0) parallelEmbedBits(&view, dataStart, inputData, (size_t)compressedBitsCount, lsbDepth, threads);
+    } else if (stegoHeader.flags & STEGO_FLAG_BLOCKS) {
+        size_t slotSize = blockSlotSize(&plan);
+        blockSlots = scratchReserve(&scratch->slots, slotSize * (size_t)threads);
+        if (!blockSlots) { stegoSystemError("Failed to allocate block buffers"); goto encode_cleanup; }
+        statsAlloc(stats, slotSize * (size_t)threads);
+        selectLsbKernel(lsbDepth); // Resolve the kernels before the workers use them
+        BlockJob embedJob = { &plan, 0, inputData, NULL, blockSlots, slotSize, &view, dataStart, 0 };
+        parallelFor(plan.count, threads, packEmbedBlockTask, &embedJob);
+        if (embedJob.failed) { stegoError("Compression failed.\n"); goto encode_cleanup; }
+    } else if (bitStream && compressedBitsCount > 0) {
+        // Only embed if there are bits to embed (handles empty file case)
+        parallelEmbedBits(&view, dataStart, bitStream, (size_t)compressedBitsCount, lsbDepth, threads);
+        if (seekSize) {
+            stegoProgress("Embedding seek index (%lu checkpoints)...\n", (unsigned long)seek.count);
+            spanEmbedBits(&view, dataStart + (size_t)lsbPixels((unsigned long long)compressedBitsCount, lsbDepth), seek.entries, seekSize * 8, lsbDepth);
+        }
+    }
+    // The checksum takes the last pixel bytes counted by fitDepth.
+    unsigned char trailer[STEGO_CHECKSUM_BITS / 8] = { (unsigned char)(checksum >> 24), (unsigned char)(checksum >> 16),
+                                                      (unsigned char)(checksum >> 8), (unsigned char)checksum };
+    spanEmbedBits(&view, requiredPixels - lsbPixels(STEGO_CHECKSUM_BITS, lsbDepth), trailer, STEGO_CHECKSUM_BITS, lsbDepth);
+    statsPhase(stats, STATS_EMBED);
+
+    if (layoutContiguous(&layout) && cloneFile < 0) {
+        stegoProgress("Copying remaining image data...\n");
+        size_t usedEnd = (size_t)(layout.dataOffset + requiredPixels);
+        memcpy(output + usedEnd, cover + usedEnd, coverSize - usedEnd);
+        statsPhase(stats, STATS_COPY);
+    }
+
+#ifndef _WIN32
+    if (cloneFile >= 0) {
+        int written = writeFileRange(cloneFile, output, patchEnd - patchStart, patchStart);
+        int closed = close(cloneFile) == 0;
+        cloneFile = -1;
+        if (!written || !closed) { stegoSystemError("Error writing output image"); goto encode_cleanup; }
+    }
+#endif
+    if (!closeImage(&outputFile)) { stegoError("Error writing output image: %s\n", outputPath); goto encode_cleanup; }
+    if (stats) stats->bytesWritten = patchEnd - patchStart;
+    ok = 1;
+
+encode_cleanup:
+#ifndef _WIN32
+    if (cloneFile >= 0) close(cloneFile);
+    if (!ok && cloned && !inPlace) remove(outputPath);
+#endif
+    closeImage(&outputFile);
+    stegoScratchFree(&localScratch);
+    free(seek.entries);
+    blockPlanFree(&plan);
+    return ok;
+}
+
+// Hides a file in a cover image. scratch and stats may be NULL; see Scratch Buffers and Job
+// Statistics. Returns 1 on success.
+int encodeBinaryIntoImage(const char *imagePath, const char *binaryFilePath, const char *outputPath, int method, int depth,
+                          StegoScratch* scratch, StegoStats* stats) {
+    ImageBuffer image = {0};
+    StegoScratch localScratch = {0};
+    int ok = 0;
+
+    statsBegin(stats, 0);
+    // Only this path can patch the cover file in place (see Cover Clones); streaming would
+    // truncate it before reading it.
+    int inPlace = !pathIsStream(imagePath) && !pathIsStream(outputPath) && sameFile(imagePath, outputPath);
+    if (inPlace && pathIsStream(binaryFilePath)) { stegoError("Error: Encoding in place needs the secret in a file.\n"); return 0; }
+    // Pipes can only be read and written front to back, which is what streaming does.
+    if (!inPlace && (pathIsStream(imagePath) || pathIsStream(binaryFilePath) || pathIsStream(outputPath))) {
+        return encodeBinaryIntoImageStreaming(imagePath, binaryFilePath, outputPath, method, depth, stats);
+    }
+    FILE* secret = inPlace ? NULL : fopen(binaryFilePath, "rb");
+    if (secret) {
+        long long secretSize = getFileSize(secret);
+        fclose(secret);
+        if (secretSize >= 0 && streamingRequested((unsigned long long)secretSize)) {
+            return encodeBinaryIntoImageStreaming(imagePath, binaryFilePath, outputPath, method, depth, stats);
+        }
+    }
+
+    if (!scratch) scratch = &localScratch;
+    long originalFileSize = 0;
+    unsigned char* inputData = readBinaryFile(binaryFilePath, &originalFileSize, &scratch->input);
+    // A secret that cannot be read must fail here, before the image is opened: in place, an
+    // empty payload would replace the one the image holds.
+    if (!inputData && originalFileSize != 0) {
+        stegoError("Failed to read file to hide.\n");
+        goto encode_cleanup;
+    }
+    // If inputData is NULL and originalFileSize is 0, it's an empty file, proceed.
+    if (stats) stats->bytesRead = (unsigned long long)originalFileSize;
+    statsPhase(stats, STATS_READ);
+
+    if (!openImageRead(imagePath, &image)) { stegoError("Error opening input image: %s\n", imagePath); goto encode_cleanup; }
+    if (!encodeCoverBuffer(image.data, image.size, inputData, (size_t)originalFileSize, NULL, outputPath, imagePath, method, depth,
+                           NULL, scratch, stats)) goto encode_cleanup;
+    statsPhase(stats, STATS_WRITE);
+    if (stats) stats->bytesRead += image.size;
+    stegoProgress("Encoding finished successfully for '%s'.\n", outputPath);
+    ok = 1;
+
+encode_cleanup:
+    closeImage(&image);
+    stegoScratchFree(&localScratch);
+    return ok;
+}
+
+
+// --- Streaming Decoding (decodeHuffmanFromImageStreaming) ---
+// Extracts and decodes the payload in STREAM_CHUNK_BYTES pieces, writing each decoded piece
+// straight to the output file. In block mode one block per thread is extracted at a time and
+// the group is decoded in parallel.
+int decodeHuffmanFromImageStreaming(const char *stegoImagePath, const char *outputFilePath, StegoStats* stats) {
+    FILE *image = NULL, *output = NULL;
+    unsigned char *packed = NULL, *decoded = NULL;
+    unsigned char *blockIndex = NULL;
+    HuffmanDecodeTable decodeTable = {0};
+    BlockPlan plan = {0};
+    CoverStream cs = {0};
+    uint32_t checksum = 0;
+    int ok = 0;
+
+    if (scatterKeyRequested()) { stegoError("Error: Keyed decodes cannot be streamed; use files rather than pipes.\n"); return 0; }
+    if (stats) stats->streaming = 1;
+    image = openInputStream(stegoImagePath);
+    if (!image) { stegoError("Error opening stego image: %s\n", stegoImagePath); return 0; }
+
+    stegoProgress("Reading header...\n");
+    long long imageFileSize = pathIsStream(stegoImagePath) ? 0 : getFileSize(image);
+    unsigned long long prefixFileSize = imageFileSize > 0 ? (unsigned long long)imageFileSize : 0;
+    size_t prefixSize = 0;
+    unsigned char* prefix = imageFileSize >= 0 ? readImagePrefix(image, &prefixFileSize, &prefixSize) : NULL;
+    if (!prefix) { stegoError("Error reading stego image: %s\n", stegoImagePath); goto stream_decode_cleanup; }
+    CoverLayout layout;
+    StegoHeader stegoHeader;
+    size_t headerSize = 0;
+    int headerStatus = findStegoHeader(prefix, prefixSize, prefixFileSize, &layout, &stegoHeader, &headerSize);
+    if (headerStatus == 0) stegoError("Error: No stego header found (legacy images cannot be streamed).\n");
+    if (headerStatus > 0 && outputFilePath && shardRefused(&stegoHeader)) headerStatus = -1;
+    int streamOpen = headerStatus > 0 && coverStreamOpen(&cs, image, NULL, &layout) && coverStreamPreload(&cs, prefix, prefixSize);
+    free(prefix);
+    if (!streamOpen) goto stream_decode_cleanup;
+    cs.pixel = headerSize * 8;
+    cs.depth = stegoHeader.depth;
+    statsHeader(stats, &stegoHeader, layout.capacity, headerSize * 8 + lsbPixels(stegoHeader.compressedBits, stegoHeader.depth));
+    statsAlloc(stats, STREAM_WINDOW_BYTES);
+    statsPhase(stats, STATS_COVER);
+    stegoProgress("Extracted original file size: %llu bytes\n", stegoHeader.originalSize);
+
+    if (outputFilePath) {
+        output = openOutputStream(outputFilePath);
+        if (!output) { stegoSystemError("Error creating output file"); goto stream_decode_cleanup; }
+    }
+
+    if (stegoHeader.method == STEGO_METHOD_STORED && stegoHeader.originalSize > 0) {
+        decoded = (unsigned char*)malloc(STREAM_CHUNK_BYTES);
+        if (!decoded) { stegoSystemError("Failed to allocate streaming buffers"); goto stream_decode_cleanup; }
+        statsAlloc(stats, STREAM_CHUNK_BYTES);
+        stegoProgress("Extracting stored data in streaming mode (%llu bits)...\n", stegoHeader.compressedBits);
+        size_t chunkBytes = STREAM_CHUNK_BYTES / cs.depth * cs.depth; // Whole groups
+        for (unsigned long long bytesLeft = stegoHeader.originalSize; bytesLeft > 0; ) {
+            size_t n = bytesLeft < chunkBytes ? (size_t)bytesLeft : chunkBytes;
+            if (!coverStreamExtract(&cs, decoded, n * 8ULL)) goto stream_decode_cleanup;
+            checksum = crc32c(checksum, decoded, n);
+            if (output && fwrite(decoded, 1, n, output) != n) { stegoError("Error writing decoded data to output file.\n"); goto stream_decode_cleanup; }
+            bytesLeft -= n;
+        }
+        statsPhase(stats, STATS_EXTRACT);
+        stegoProgress("Decoded %llu bytes.\n", stegoHeader.originalSize);
+    } else if (stegoHeader.flags & STEGO_FLAG_BLOCKS) {
+        int threads = stegoThreadCount();
+        if (!stegoBlockIndexFits(&stegoHeader, layout.capacity, headerSize * 8)) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto stream_decode_cleanup; }
+        if (!blockPlanInit(&plan, codecForMethod(stegoHeader.method), stegoHeader.originalSize, stegoHeader.blockSizeLog2, 0)) { stegoSystemError("Failed to allocate block index"); goto stream_decode_cleanup; }
+        size_t slotSize = blockSlotSize(&plan);
+        blockIndex = (unsigned char*)malloc(plan.count * 4);
+        packed = (unsigned char*)malloc(slotSize * (size_t)threads);
+        decoded = (unsigned char*)malloc(((size_t)1 << stegoHeader.blockSizeLog2) * (size_t)threads);
+        if (!blockIndex || !packed || !decoded) { stegoSystemError("Failed to allocate streaming buffers"); goto stream_decode_cleanup; }
+        statsAlloc(stats, plan.count * 4 + (slotSize + ((size_t)1 << stegoHeader.blockSizeLog2)) * (size_t)threads);
+        if (!coverStreamExtract(&cs, blockIndex, plan.count * 32ULL)) goto stream_decode_cleanup;
+        if (!readBlockIndex(&plan, blockIndex, stegoHeader.compressedBits, stegoHeader.depth)) goto stream_decode_cleanup;
+        if (plan.totalPixels > layout.capacity - cs.pixel) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto stream_decode_cleanup; }
+        if (stats) stats->usedPixels = headerSize * 8 + lsbPixels(plan.count * 32ULL, stegoHeader.depth) + plan.totalPixels;
+
+        stegoProgress("Decoding %lu blocks in streaming mode on %d threads (%llu bits)...\n", (unsigned long)plan.count,
+               threads, stegoHeader.compressedBits);
+        for (size_t first = 0; first < plan.count; first += (size_t)threads) {
+            size_t n = plan.count - first < (size_t)threads ? plan.count - first : (size_t)threads;
+            size_t bytes = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (!coverStreamExtract(&cs, packed + i * slotSize, plan.streamBytes[first + i] * 8ULL)) goto stream_decode_cleanup;
+                bytes += blockLength(&plan, first + i);
+            }
+            BlockJob job = { &plan, first, NULL, decoded, packed, slotSize, NULL, 0, 0 };
+            parallelFor(n, threads, unpackBlockTask, &job);
+            if (job.failed) goto stream_decode_cleanup;
+            checksum = crc32c(checksum, decoded, bytes);
+            if (output && fwrite(decoded, 1, bytes, output) != bytes) { stegoError("Error writing decoded data to output file.\n"); goto stream_decode_cleanup; }
+        }
+        statsPhase(stats, STATS_DECODE);
+        stegoProgress("Decoded %llu bytes.\n", stegoHeader.originalSize);
+    } else if (stegoHeader.originalSize > 0) {
+        CodeTable codeTable[BYTE_RANGE];
+        if (!buildCanonicalCodes(stegoHeader.codeLengths, codeTable)) { stegoError("Error: Invalid code lengths in header.\n"); goto stream_decode_cleanup; }
+        if (!buildDecodeTable(codeTable, &decodeTable)) { stegoError("Error building decode table.\n"); goto stream_decode_cleanup; }
+        packed = (unsigned char*)malloc(STREAM_CHUNK_BYTES);
+        decoded = (unsigned char*)malloc(STREAM_CHUNK_BYTES);
+        if (!packed || !decoded) { stegoSystemError("Failed to allocate streaming buffers"); goto stream_decode_cleanup; }
+        statsAlloc(stats, STREAM_CHUNK_BYTES * 2ULL + decodeTable.count * sizeof(uint32_t));
+
+        stegoProgress("Decoding data in streaming mode (%llu bits)...\n", stegoHeader.compressedBits);
+        unsigned long long bitsLeft = stegoHeader.compressedBits; // Not yet extracted
+        unsigned long long bytesLeft = stegoHeader.originalSize;  // Not yet decoded
+        unsigned long long bitsDiscarded = 0;                     // Consumed bits dropped from packed
+        size_t packedLength = 0;
+        BitReader br;
+        bitReaderInit(&br, packed, 0);
+        while (bytesLeft > 0) {
+            int final = bitsLeft == 0;
+            if (!final) {
+                // Keep the unread tail of packed and append freshly extracted bits after it.
+                unsigned long long used = bitReaderConsumed(&br);
+                size_t keepFrom = (size_t)(used / 8);
+                int bitOffset = (int)(used % 8);
+                memmove(packed, packed + keepFrom, packedLength - keepFrom);
+                packedLength -= keepFrom;
+                bitsDiscarded += keepFrom * 8ULL;
+                // All remaining bits if they fit, otherwise whole groups (see coverStreamEmbed).
+                unsigned long long room = (STREAM_CHUNK_BYTES - packedLength) * 8ULL;
+                unsigned long long take = bitsLeft <= room ? bitsLeft : room / (8 * cs.depth) * (8 * cs.depth);
+                if (!coverStreamExtract(&cs, packed + packedLength, take)) goto stream_decode_cleanup;
+                packedLength += (size_t)((take + 7) / 8);
+                bitsLeft -= take;
+                final = bitsLeft == 0;
+                bitReaderInit(&br, packed, packedLength);
+                if (bitOffset) {
+                    bitReaderRefill(&br);
+                    bitReaderSkip(&br, bitOffset);
+                }
+            }
+            size_t want = bytesLeft < STREAM_CHUNK_BYTES ? (size_t)bytesLeft : STREAM_CHUNK_BYTES;
+            size_t got = 0;
+            if (!huffmanDecodeChunk(&decodeTable, &br, decoded, want, final, &got)) goto stream_decode_cleanup;
+            // Past the end the reader returns zero bits, so a header that claims more bytes than
+            // the stream holds is caught here, before anything it decodes is written.
+            if (bitsDiscarded + bitReaderConsumed(&br) > stegoHeader.compressedBits) {
+                stegoError("Error: Unexpected end of compressed data during decoding.\n");
+                goto stream_decode_cleanup;
+            }
+            checksum = crc32c(checksum, decoded, got);
+            if (output && fwrite(decoded, 1, got, output) != got) { stegoError("Error writing decoded data to output file.\n"); goto stream_decode_cleanup; }
+            bytesLeft -= got;
+        }
+        cs.pixel += lsbPixels(stegoSeekCount(&stegoHeader) * 32, cs.depth); // Full decodes skip the seek index
+        statsPhase(stats, STATS_DECODE);
+        stegoProgress("Decoded %llu bytes.\n", stegoHeader.originalSize);
+    } else {
+        stegoProgress("Original file was empty. Creating empty output file.\n");
+    }
+    if (stegoHeader.version >= STEGO_CHECKSUM_VERSION) {
+        unsigned char stored[STEGO_CHECKSUM_BITS / 8];
+        if (!coverStreamExtract(&cs, stored, STEGO_CHECKSUM_BITS)) goto stream_decode_cleanup;
+        if (!payloadChecksumMatches(&stegoHeader, stored, checksum)) goto stream_decode_cleanup;
+        if (stats) stats->usedPixels = cs.pixel;
+    }
+
+    if (output && closeStream(output) != 0) { output = NULL; stegoError("Error writing decoded data to output file.\n"); goto stream_decode_cleanup; }
+    output = NULL;
+    statsPhase(stats, STATS_WRITE);
+    if (stats) {
+        stats->bytesRead = cs.origin + cs.length;
+        stats->bytesWritten = outputFilePath ? stegoHeader.originalSize : 0;
+    }
+    if (outputFilePath) stegoProgress("File extracted successfully to '%s'\n", outputFilePath);
+    else stegoProgress("Decoded and checked %llu bytes.\n", stegoHeader.originalSize);
+    ok = 1;
+
+stream_decode_cleanup:
+    if (output) {
+        closeStream(output);
+        removeOutput(outputFilePath);
+    }
+    if (image) closeStream(image);
+    coverStreamClose(&cs);
+    freeDecodeTable(&decodeTable);
+    free(packed);
+    free(decoded);
+    free(blockIndex);
+    blockPlanFree(&plan);
+    return ok;
+}
+
+
+// --- Decoding Functions (decodeLegacyPayload, decodeImageBuffer, decodeHuffmanFromImage) ---
+// Reads the pre-header layout: 32-bit size, 256 32-bit frequencies, then the Huffman stream
+// coded with the tree rebuilt from those frequencies. Returns 1 on success; *out receives the
+// decoded bytes (NULL for an empty file).
+int decodeLegacyPayload(const unsigned char* pixels, size_t availableBits, unsigned char** out, size_t* outSize) {
+    unsigned char header[4 + BYTE_RANGE * 4];
+    unsigned char *bitStream = NULL, *decodedData = NULL;
+    HuffmanArena arena;
+    int ok = 0;
+    *out = NULL;
+    *outSize = 0;
+
+    stegoProgress("Reading original file size...\n");
+    if (availableBits < 32) { stegoError("Error reading file size from image.\n"); return 0; }
+    extractBits(pixels, header, 32, 1);
+    unsigned int originalFileSize = loadBigEndian32(header);
+    stegoProgress("Extracted original file size: %u bytes\n", originalFileSize);
+    if (originalFileSize == 0) return 1;
+
+    int freq[BYTE_RANGE];
+    stegoProgress("Reading frequency table...\n");
+    if (availableBits < 32 + BYTE_RANGE * 32) { stegoError("Error reading frequency table from image.\n"); return 0; }
+    extractBits(pixels + 32, header + 4, BYTE_RANGE * 32, 1);
+    for (int i = 0; i < BYTE_RANGE; i++) {
+        freq[i] = (int)loadBigEndian32(header + 4 + i * 4);
+    }
+
+    stegoProgress("Rebuilding Huffman tree...\n");
+    long long freqTotal = 0;
+    for (int i = 0; i < BYTE_RANGE; i++) freqTotal += (unsigned int)freq[i];
+    if (freqTotal != (long long)originalFileSize) { stegoError("Error: Frequency table does not match file size.\n"); return 0; }
+    HuffmanNode* root = buildHuffmanTree(&arena, freq);
+    if (!root) { stegoError("Error rebuilding Huffman tree.\n"); return 0; }
+
+    CodeTable codeTable[BYTE_RANGE];
+    if (!generateCodes(root, codeTable)) { stegoError("Error regenerating Huffman codes.\n"); goto legacy_cleanup; }
+    unsigned long long compressedBitsCount = 0;
+    for (int i = 0; i < BYTE_RANGE; i++) compressedBitsCount += (unsigned long long)(unsigned int)freq[i] * codeTable[i].length;
+
+    stegoProgress("Reading compressed data (%llu bits)...\n", compressedBitsCount);
+    size_t dataStart = 32 + BYTE_RANGE * 32;
+    if (compressedBitsCount > availableBits - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto legacy_cleanup; }
+    bitStream = (unsigned char*)malloc((size_t)((compressedBitsCount + 7) / 8));
+    if (!bitStream) { stegoSystemError("Memory allocation failed for compressed data"); goto legacy_cleanup; }
+    extractBits(pixels + dataStart, bitStream, (size_t)compressedBitsCount, 1);
+
+    decodedData = (unsigned char*)malloc(originalFileSize);
+    if (!decodedData) { stegoSystemError("Memory allocation failed for decoded data"); goto legacy_cleanup; }
+
+    stegoProgress("Decoding data...\n");
+    HuffmanDecodeTable decodeTable;
+    if (buildDecodeTable(codeTable, &decodeTable)) {
+        ok = huffmanDecodeTable(&decodeTable, bitStream, compressedBitsCount, decodedData, originalFileSize);
+        freeDecodeTable(&decodeTable);
+    } else {
+        ok = huffmanDecodeTreeWalk(root, bitStream, compressedBitsCount, decodedData, originalFileSize);
+    }
+    if (ok) {
+        *out = decodedData;
+        *outSize = originalFileSize;
+        decodedData = NULL;
+    }
+
+legacy_cleanup:
+    free(bitStream);
+    free(decodedData);
+    return ok;
+}
+
+// Decodes the payload of the stego image held in memory into target, which must hold
+// targetSize bytes, or into scratch->output when target is NULL; *decoded and *decodedSize
+// receive where it went and its size. If the image is a shard (see Shards), *shard receives its
+// shard record; with a NULL shard such images are refused. stats may be NULL, and scratch too
+// when target is given; see Scratch Buffers and Job Statistics. Returns 1 on success, 0 on
+// failure, and -1 without decoding anything when target is NULL and the payload is too large
+// to decode in memory (see Streaming Mode).
+int decodeImageBuffer(const unsigned char* data, size_t size, unsigned char* target, size_t targetSize,
+                      unsigned char** decoded, size_t* decodedSize, StegoShard* shard, StegoScratch* scratch, StegoStats* stats) {
+    unsigned char *decodedData = NULL;
+    unsigned char *bitStream = NULL;
+    unsigned char *blockSlots = NULL;
+    unsigned char *legacyData = NULL;
+    StegoScratch localScratch = {0};
+    BlockPlan plan = {0};
+    size_t originalFileSize = 0;
+    int ok = 0;
+
+    if (!scratch) scratch = &localScratch;
+    *decoded = NULL;
+    *decodedSize = 0;
+    if (shard) memset(shard, 0, sizeof(*shard));
+    if (size < BMP_HEADER_SIZE) { stegoError("Error: Image is smaller than a BMP header.\n"); return 0; }
+
+    stegoProgress("Reading header...\n");
+    CoverLayout layout;
+    StegoHeader stegoHeader;
+    size_t headerSize = 0;
+    int headerStatus = findStegoHeader(data, size, size, &layout, &stegoHeader, &headerSize);
+    if (headerStatus < 0) goto decode_cleanup;
+    unsigned int lsbDepth = stegoHeader.depth;
+    unsigned long long availablePixels = layout.capacity;
+    PixelView view = { &layout, NULL, data, 0 };
+    statsPhase(stats, STATS_COVER);
+
+    if (headerStatus == 0) {
+        stegoProgress("No format header found; reading legacy frequency-table layout.\n");
+        if (!decodeLegacyPayload(data + BMP_HEADER_SIZE, (size_t)availablePixels, &legacyData, &originalFileSize)) goto decode_cleanup;
+        if (target && originalFileSize > targetSize) { stegoError("Error: Output buffer is too small for the hidden file.\n"); goto decode_cleanup; }
+        decodedData = target ? target : scratchReserve(&scratch->output, originalFileSize);
+        if (!decodedData && originalFileSize > 0) { stegoSystemError("Memory allocation failed for decoded data"); goto decode_cleanup; }
+        if (originalFileSize > 0) memcpy(decodedData, legacyData, originalFileSize);
+        statsPhase(stats, STATS_DECODE);
+        if (stats) {
+            stats->legacy = 1;
+            stats->payloadBytes = originalFileSize;
+            stats->coverPixels = availablePixels;
+            stats->allocBytes = originalFileSize;
+        }
+    } else {
+        if (!shard && shardRefused(&stegoHeader)) goto decode_cleanup;
+        if (shard) *shard = stegoHeader.shard;
+        if (!target && (streamingRequested(stegoHeader.originalSize) || stegoHeader.originalSize > (size_t)-1)) return -1;
+        if (target && stegoHeader.originalSize > targetSize) { stegoError("Error: Output buffer is too small for the hidden file.\n"); goto decode_cleanup; }
+        statsHeader(stats, &stegoHeader, availablePixels, headerSize * 8 + lsbPixels(stegoHeader.compressedBits, lsbDepth));
+        originalFileSize = (size_t)stegoHeader.originalSize;
+        unsigned long long payloadEnd = headerSize * 8; // Pixel byte after the payload and its index
+        stegoProgress("Extracted original file size: %lu bytes\n", (unsigned long)originalFileSize);
+        if (stegoHeader.method == STEGO_METHOD_STORED && originalFileSize > 0) {
+            size_t dataStart = headerSize * 8;
+            stegoProgress("Reading stored data (%llu bits)...\n", stegoHeader.compressedBits);
+            if (lsbPixels(stegoHeader.compressedBits, lsbDepth) > availablePixels - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto decode_cleanup; }
+            decodedData = target ? target : scratchReserve(&scratch->output, originalFileSize);
+            if (!decodedData) { stegoSystemError("Memory allocation failed for decoded data"); goto decode_cleanup; }
+            statsAlloc(stats, originalFileSize);
+            parallelExtractBits(&view, dataStart, decodedData, (size_t)stegoHeader.compressedBits, lsbDepth, stegoThreadCount());
+            payloadEnd = dataStart + lsbPixels(stegoHeader.compressedBits, lsbDepth);
+            statsPhase(stats, STATS_EXTRACT);
+        } else if (stegoHeader.flags & STEGO_FLAG_BLOCKS) {
+            int threads = stegoThreadCount();
+            size_t indexStart = headerSize * 8;
+            if (!stegoBlockIndexFits(&stegoHeader, availablePixels, indexStart)) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto decode_cleanup; }
+            if (!blockPlanInit(&plan, codecForMethod(stegoHeader.method), stegoHeader.originalSize, stegoHeader.blockSizeLog2, 0)) { stegoSystemError("Failed to allocate block index"); goto decode_cleanup; }
+            size_t slotSize = blockSlotSize(&plan);
+            bitStream = scratchReserve(&scratch->packed, plan.count * 4);
+            if (!bitStream) { stegoSystemError("Memory allocation failed for block index"); goto decode_cleanup; }
+            spanExtractBits(&view, indexStart, bitStream, plan.count * 32, lsbDepth);
+            if (!readBlockIndex(&plan, bitStream, stegoHeader.compressedBits, lsbDepth)) goto decode_cleanup;
+
+            size_t dataStart = indexStart + (size_t)lsbPixels(plan.count * 32ULL, lsbDepth);
+            stegoProgress("Reading compressed data (%llu bits in %lu blocks)...\n", stegoHeader.compressedBits, (unsigned long)plan.count);
+            if (plan.totalPixels > availablePixels - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto decode_cleanup; }
+            decodedData = target ? target : scratchReserve(&scratch->output, originalFileSize);
+            blockSlots = scratchReserve(&scratch->slots, slotSize * (size_t)threads);
+            if (!decodedData || !blockSlots) { stegoSystemError("Memory allocation failed for decoded data"); goto decode_cleanup; }
+            statsAlloc(stats, plan.count * 4 + originalFileSize + slotSize * (size_t)threads);
+            payloadEnd = dataStart + plan.totalPixels;
+
+            stegoProgress("Decoding data on %d threads...\n", threads);
+            selectLsbKernel(lsbDepth); // Resolve the kernels before the workers use them
+            BlockJob job = { &plan, 0, NULL, decodedData, blockSlots, slotSize, &view, dataStart, 0 };
+            parallelFor(plan.count, threads, extractUnpackBlockTask, &job);
+            if (job.failed) goto decode_cleanup;
+            statsPhase(stats, STATS_DECODE);
+        } else if (originalFileSize > 0) {
+            CodeTable codeTable[BYTE_RANGE];
+            HuffmanDecodeTable decodeTable;
+            unsigned long long compressedBitsCount = stegoHeader.compressedBits;
+            if (!buildCanonicalCodes(stegoHeader.codeLengths, codeTable)) { stegoError("Error: Invalid code lengths in header.\n"); goto decode_cleanup; }
+
+            stegoProgress("Reading compressed data (%llu bits)...\n", compressedBitsCount);
+            size_t dataStart = headerSize * 8;
+            if (lsbPixels(compressedBitsCount, lsbDepth) > availablePixels - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto decode_cleanup; }
+            bitStream = scratchReserve(&scratch->packed, (size_t)((compressedBitsCount + 7) / 8));
+            if (!bitStream) { stegoSystemError("Memory allocation failed for compressed data"); goto decode_cleanup; }
+            parallelExtractBits(&view, dataStart, bitStream, (size_t)compressedBitsCount, lsbDepth, stegoThreadCount());
+            statsPhase(stats, STATS_EXTRACT);
+
+            decodedData = target ? target : scratchReserve(&scratch->output, originalFileSize);
+            if (!decodedData) { stegoSystemError("Memory allocation failed for decoded data"); goto decode_cleanup; }
+            statsAlloc(stats, (compressedBitsCount + 7) / 8 + originalFileSize);
+
+            stegoProgress("Decoding data...\n");
+            if (!buildDecodeTable(codeTable, &decodeTable)) { stegoError("Error building decode table.\n"); goto decode_cleanup; }
+            int decodedOk = huffmanDecodeTable(&decodeTable, bitStream, compressedBitsCount, decodedData, originalFileSize);
+            freeDecodeTable(&decodeTable);
+            if (!decodedOk) goto decode_cleanup;
+            payloadEnd = dataStart + lsbPixels(compressedBitsCount, lsbDepth) + lsbPixels(stegoSeekCount(&stegoHeader) * 32, lsbDepth);
+            statsPhase(stats, STATS_DECODE);
+        }
+        if (stegoHeader.version >= STEGO_CHECKSUM_VERSION) {
+            unsigned char stored[STEGO_CHECKSUM_BITS / 8];
+            if (payloadEnd + stegoChecksumPixels(&stegoHeader) > availablePixels) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto decode_cleanup; }
+            spanExtractBits(&view, payloadEnd, stored, STEGO_CHECKSUM_BITS, lsbDepth);
+            if (!payloadChecksumMatches(&stegoHeader, stored, crc32c(0, decodedData, originalFileSize))) goto decode_cleanup;
+            statsPhase(stats, STATS_DECODE);
+        }
+        if (stats) stats->usedPixels = payloadEnd + stegoChecksumPixels(&stegoHeader);
+    }
+    if (stats) {
+        // Everything up to the last pixel byte used was read; legacy images are read to the end.
+        unsigned long long used = stats->usedPixels < layout.capacity ? stats->usedPixels : layout.capacity;
+        stats->bytesRead = headerStatus == 0 || used == 0 ? size : spanOffset(&layout, used - 1) + 1;
+    }
+    *decoded = decodedData;
+    *decodedSize = originalFileSize;
+    ok = 1;
+
+decode_cleanup:
+    free(legacyData);
+    stegoScratchFree(&localScratch);
+    blockPlanFree(&plan);
+    return ok;
+}
+
+
+// Recovers the hidden file from a stego image. scratch and stats may be NULL; see Scratch
+// Buffers and Job Statistics. With a NULL outputFilePath the payload is only decoded and checked
+// against its checksum; that also works for a shard. Returns 1 on success.
+int decodeHuffmanFromImage(const char *stegoImagePath, const char *outputFilePath, StegoScratch* scratch, StegoStats* stats) {
+    ImageBuffer image = {0};
+    FILE *output = NULL;
+    unsigned char *decodedData = NULL;
+    StegoScratch localScratch = {0};
+    StegoShard shard;
+    size_t originalFileSize = 0;
+    int ok = 0;
+
+    if (!scratch) scratch = &localScratch;
+    statsBegin(stats, 1);
+    if (pathIsStream(stegoImagePath)) return decodeHuffmanFromImageStreaming(stegoImagePath, outputFilePath, stats);
+
+    if (!openImageRead(stegoImagePath, &image)) { stegoError("Error opening stego image: %s\n", stegoImagePath); return 0; }
+    int decodedOk = decodeImageBuffer(image.data, image.size, NULL, 0, &decodedData, &originalFileSize,
+                                      outputFilePath ? NULL : &shard, scratch, stats);
+    if (decodedOk < 0) {
+        closeImage(&image);
+        return decodeHuffmanFromImageStreaming(stegoImagePath, outputFilePath, stats);
+    }
+    if (!decodedOk) goto decode_cleanup;
+    if (stats) stats->bytesWritten = outputFilePath ? originalFileSize : 0;
+
+    if (!outputFilePath && shard.count) {
+        stegoProgress("Decoded and checked %lu bytes (shard %u of %u).\n", (unsigned long)originalFileSize, shard.index + 1, shard.count);
+        ok = 1;
+        goto decode_cleanup;
+    }
+    if (!outputFilePath) {
+        stegoProgress("Decoded and checked %lu bytes.\n", (unsigned long)originalFileSize);
+        ok = 1;
+        goto decode_cleanup;
+    }
+    if (originalFileSize == 0) {
+        stegoProgress("Original file was empty. Creating empty output file.\n");
+        output = openOutputStream(outputFilePath);
+        if (!output) stegoSystemError("Error creating empty output file");
+        else ok = closeStream(output) == 0;
+        output = NULL;
+        statsPhase(stats, STATS_WRITE);
+        goto decode_cleanup;
+    }
+    stegoProgress("Decoded %lu bytes.\n", (unsigned long)originalFileSize);
+
+    output = openOutputStream(outputFilePath);
+    if (!output) { stegoSystemError("Error creating output file"); goto decode_cleanup; }
+
+    if (fwrite(decodedData, 1, originalFileSize, output) != originalFileSize) {
+        stegoError("Error writing decoded data to output file.\n");
+        closeStream(output); output = NULL;
+        removeOutput(outputFilePath);
+        goto decode_cleanup;
+    }
+    if (closeStream(output) != 0) {
+        output = NULL;
+        stegoError("Error writing decoded data to output file.\n");
+        removeOutput(outputFilePath);
+        goto decode_cleanup;
+    }
+    output = NULL;
+    statsPhase(stats, STATS_WRITE);
+    stegoProgress("File extracted successfully to '%s'\n", outputFilePath);
+    ok = 1;
+
+decode_cleanup:
+    closeImage(&image);
+    if (output) closeStream(output);
+    stegoScratchFree(&localScratch);
+    return ok;
+}
+
+
+// --- Range Extraction (extractStreamBits, extractRangeFromImage) ---
+// Recovers bytes [offset, offset + length) of a hidden file without decoding all of it, e.g.
+// the first few KB to tell its type. Stored payloads are read straight from their bit range
+// and block-mode payloads decode just the blocks that overlap it. A single Huffman stream is
+// decoded from the last seek index checkpoint at or before offset up to the first one at or
+// after the end of the range; without an index, from its start. Images from before the header
+// existed are decoded in full and cut.
+#define RANGE_PIECE_BYTES STREAM_CHUNK_BYTES // Payload bytes decoded and written at once
+
+// Extracts bits [firstBit, firstBit + bitCount) of the stream starting at pixel byte dataStart,
+// packed MSB-first into out, which must hold (bitCount + 7) / 8 + 1 bytes.
+static void extractStreamBits(const PixelView* view, unsigned long long dataStart, unsigned int depth,
+                              unsigned long long firstBit, size_t bitCount, unsigned char* out) {
+    unsigned int phase = (unsigned int)(firstBit % depth);
+    size_t bytes = (bitCount + 7) / 8;
+    out[bytes] = 0;
+    spanExtractBits(view, dataStart + firstBit / depth, out, bitCount + phase, depth);
+    if (phase == 0) return;
+    for (size_t i = 0; i < bytes; i++) out[i] = (unsigned char)((out[i] << phase) | (out[i + 1] >> (8 - phase)));
+}
+
+// Writes bytes [offset, offset + length) of the file hidden in a stego image to outputFilePath;
+// the range is cut at the end of the file. Returns 1 on success.
+int extractRangeFromImage(const char* stegoImagePath, const char* outputFilePath, unsigned long long offset, unsigned long long length) {
+    ImageBuffer image = {0};
+    FILE* output = NULL;
+    unsigned char *bits = NULL, *piece = NULL, *slots = NULL, *legacyData = NULL;
+    BlockPlan plan = {0};
+    HuffmanDecodeTable decodeTable = {0};
+    int created = 0, ok = 0;
+
+    if (!openImageRead(stegoImagePath, &image)) { stegoError("Error opening stego image: %s\n", stegoImagePath); return 0; }
+    if (image.size < BMP_HEADER_SIZE) { stegoError("Error: Image is smaller than a BMP header.\n"); goto range_cleanup; }
+    CoverLayout layout;
+    StegoHeader h;
+    size_t headerSize = 0;
+    int headerStatus = findStegoHeader(image.data, image.size, image.size, &layout, &h, &headerSize);
+    if (headerStatus < 0 || (headerStatus > 0 && shardRefused(&h))) goto range_cleanup;
+    output = openOutputStream(outputFilePath);
+    if (!output) { stegoSystemError("Error creating output file"); goto range_cleanup; }
+    created = 1;
+
+    if (headerStatus == 0) {
+        size_t legacySize = 0;
+        stegoProgress("No format header found; decoding the legacy layout in full.\n");
+        if (!decodeLegacyPayload(image.data + BMP_HEADER_SIZE, (size_t)layout.capacity, &legacyData, &legacySize)) goto range_cleanup;
+        if (offset > legacySize) offset = legacySize;
+        if (length > legacySize - offset) length = legacySize - offset;
+        if (length && fwrite(legacyData + offset, 1, (size_t)length, output) != length) goto range_write_error;
+    } else {
+        unsigned int depth = h.depth;
+        unsigned long long availablePixels = layout.capacity;
+        unsigned long long dataStart = headerSize * 8ULL;
+        PixelView view = { &layout, NULL, image.data, 0 };
+        if (offset > h.originalSize) offset = h.originalSize;
+        if (length > h.originalSize - offset) length = h.originalSize - offset;
+        unsigned long long end = offset + length;
+        stegoProgress("Extracting bytes %llu to %llu of %llu...\n", offset, end, h.originalSize);
+
+        if (length == 0) {
+            // Nothing to read
+        } else if (h.method == STEGO_METHOD_STORED) {
+            if (lsbPixels(h.compressedBits, depth) > availablePixels - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto range_cleanup; }
+            piece = (unsigned char*)malloc(RANGE_PIECE_BYTES + 1);
+            if (!piece) { stegoSystemError("Memory allocation failed for decoded data"); goto range_cleanup; }
+            for (unsigned long long at = offset; at < end;) {
+                size_t n = end - at < RANGE_PIECE_BYTES ? (size_t)(end - at) : RANGE_PIECE_BYTES;
+                extractStreamBits(&view, dataStart, depth, at * 8, n * 8, piece);
+                if (fwrite(piece, 1, n, output) != n) goto range_write_error;
+                at += n;
+            }
+        } else if (h.flags & STEGO_FLAG_BLOCKS) {
+            int threads = stegoThreadCount();
+            if (!stegoBlockIndexFits(&h, availablePixels, dataStart)) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto range_cleanup; }
+            if (!blockPlanInit(&plan, codecForMethod(h.method), h.originalSize, h.blockSizeLog2, 0)) { stegoSystemError("Failed to allocate block index"); goto range_cleanup; }
+            size_t slotSize = blockSlotSize(&plan);
+            bits = (unsigned char*)malloc(plan.count * 4);
+            if (!bits) { stegoSystemError("Memory allocation failed for block index"); goto range_cleanup; }
+            spanExtractBits(&view, dataStart, bits, plan.count * 32, depth);
+            if (!readBlockIndex(&plan, bits, h.compressedBits, depth)) goto range_cleanup;
+            dataStart += lsbPixels(plan.count * 32ULL, depth);
+            if (plan.totalPixels > availablePixels - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto range_cleanup; }
+
+            size_t first = (size_t)(offset >> h.blockSizeLog2), last = (size_t)((end - 1) >> h.blockSizeLog2);
+            size_t group = last - first + 1 < (size_t)threads ? last - first + 1 : (size_t)threads;
+            piece = (unsigned char*)malloc(group << h.blockSizeLog2);
+            slots = (unsigned char*)malloc(slotSize * group);
+            if (!piece || !slots) { stegoSystemError("Memory allocation failed for decoded data"); goto range_cleanup; }
+            stegoProgress("Decoding blocks %lu to %lu of %lu...\n", (unsigned long)first, (unsigned long)last, (unsigned long)plan.count);
+            selectLsbKernel(depth); // Resolve the kernels before the workers use them
+            for (size_t block = first; block <= last; block += group) {
+                size_t n = last - block + 1 < group ? last - block + 1 : group;
+                BlockJob job = { &plan, block, NULL, piece, slots, slotSize, &view, dataStart, 0 };
+                parallelFor(n, (int)group, extractUnpackBlockTask, &job);
+                if (job.failed) goto range_cleanup;
+                unsigned long long start = (unsigned long long)block << h.blockSizeLog2;
+                unsigned long long from = offset > start ? offset : start;
+                unsigned long long to = start + ((unsigned long long)n << h.blockSizeLog2);
+                if (to > end) to = end;
+                if (fwrite(piece + (from - start), 1, (size_t)(to - from), output) != to - from) goto range_write_error;
+            }
+        } else {
+            CodeTable codeTable[BYTE_RANGE];
+            if (!buildCanonicalCodes(h.codeLengths, codeTable)) { stegoError("Error: Invalid code lengths in header.\n"); goto range_cleanup; }
+            if (lsbPixels(h.compressedBits, depth) > availablePixels - dataStart) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto range_cleanup; }
+
+            // The bits to extract, and the payload bytes before the range they start with
+            unsigned long long firstBit = 0, lastBit = h.compressedBits, skip = offset;
+            size_t count = (size_t)stegoSeekCount(&h);
+            if (count) {
+                unsigned long long seekStart = dataStart + lsbPixels(h.compressedBits, depth);
+                if (count > (availablePixels - seekStart) / 32 * depth) { stegoError("Error: Unexpected end of image data during decoding.\n"); goto range_cleanup; }
+                bits = (unsigned char*)malloc(count * 4);
+                if (!bits) { stegoSystemError("Memory allocation failed for seek index"); goto range_cleanup; }
+                spanExtractBits(&view, seekStart, bits, count * 32, depth);
+                size_t k = (size_t)(offset >> h.seekLog2);
+                size_t kEnd = (size_t)((end - 1) >> h.seekLog2) + 1;
+                if (k > count) k = count;
+                firstBit = seekCheckpointBits(bits, k);
+                if (kEnd <= count) lastBit = seekCheckpointBits(bits, kEnd);
+                if (firstBit > lastBit || lastBit > h.compressedBits) { stegoError("Error: Invalid seek index.\n"); goto range_cleanup; }
+                skip = offset - ((unsigned long long)k << h.seekLog2);
+                free(bits);
+                bits = NULL;
+                stegoProgress("Starting at checkpoint %lu of %lu (bit %llu).\n", (unsigned long)k, (unsigned long)count, firstBit);
+            } else if (end * MAX_CANONICAL_LENGTH < lastBit) {
+                lastBit = end * MAX_CANONICAL_LENGTH; // No code is longer
+            }
+
+            size_t bitCount = (size_t)(lastBit - firstBit);
+            bits = (unsigned char*)malloc(bitCount / 8 + 2);
+            piece = (unsigned char*)malloc(RANGE_PIECE_BYTES);
+            if (!bits || !piece) { stegoSystemError("Memory allocation failed for compressed data"); goto range_cleanup; }
+            extractStreamBits(&view, dataStart, depth, firstBit, bitCount, bits);
+            if (!buildDecodeTable(codeTable, &decodeTable)) { stegoError("Error building decode table.\n"); goto range_cleanup; }
+
+            stegoProgress("Decoding %llu bits...\n", (unsigned long long)bitCount);
+            BitReader br;
+            bitReaderInit(&br, bits, (bitCount + 7) / 8);
+            for (unsigned long long at = 0; at < skip + length;) {
+                size_t want = skip + length - at < RANGE_PIECE_BYTES ? (size_t)(skip + length - at) : RANGE_PIECE_BYTES;
+                size_t got = 0;
+                if (!huffmanDecodeChunk(&decodeTable, &br, piece, want, 1, &got)) goto range_cleanup;
+                if (bitReaderConsumed(&br) > bitCount) { stegoError("Error: Unexpected end of compressed data during decoding.\n"); goto range_cleanup; }
+                size_t from = at >= skip ? 0 : skip - at < want ? (size_t)(skip - at) : want;
+                if (fwrite(piece + from, 1, want - from, output) != want - from) goto range_write_error;
+                at += want;
+            }
+        }
+    }
+
+    if (closeStream(output) != 0) { output = NULL; goto range_write_error; }
+    output = NULL;
+    stegoProgress("Extracted %llu bytes to '%s'\n", length, outputFilePath);
+    ok = 1;
+    goto range_cleanup;
+
+range_write_error:
+    stegoError("Error writing decoded data to output file.\n");
+range_cleanup:
+    if (output) closeStream(output);
+    if (!ok && created) removeOutput(outputFilePath);
+    closeImage(&image);
+    free(bits);
+    free(piece);
+    free(slots);
+    free(legacyData);
+    freeDecodeTable(&decodeTable);
+    blockPlanFree(&plan);
+    return ok;
+}
+
+
+// --- Shards (planShards, encodeShards, decodeShards) ---
+// A file too large for one cover can be spread over several. It is cut into contiguous byte
+// ranges, one per cover and sized in proportion to what each cover holds, and every range is
+// hidden in its cover as a payload of its own, with a shard record in its header (see Stego
+// Header): a set id shared by the shards of one encode, the shard's index and the shard
+// count, the offset of its range and the size and CRC32C of the whole file. Shards are
+// encoded and decoded in parallel, and the decoder orders them by their
+// records, so the images can be given in any order.
+// The ranges are cut where the cost of the file so far reaches each cover's share, at the
+// code lengths of one Huffman code for the whole file (8 bits per byte when stored). Coding a
+// range with its own code never takes more than that; SHARD_RESERVE_BITS and 1/SHARD_MARGIN
+// of every cover are kept back for headers, indexes, tANS tables and checksums.
+#define SHARD_RESERVE_BITS 8192
+#define SHARD_MARGIN 64
+#define SHARD_ERROR_BYTES 1024
+
+typedef struct {
+    const char* imagePath;
+    const char* outputPath;       // Encode only
+    ImageBuffer image;            // Cover when encoding, stego image when decoding
+    unsigned long long capacity;  // Pixel bytes of the cover
+    unsigned long long offset;    // Range of the file held by the shard
+    unsigned long long size;
+    StegoShard shard;
+    char errors[SHARD_ERROR_BYTES];
+    int ok;
+} ShardSlot;
+
+typedef struct {
+    ShardSlot* slots;
+    const unsigned char* data;    // The file to hide
+    unsigned char* output;        // The file being put back together
+    int method;
+    int depth;
+} ShardJob;
+
+// Payload bits planned for a cover of 'capacity' pixel bytes at depth.
+static unsigned long long shardBudget(unsigned long long capacity, unsigned int depth) {
+    const unsigned long long headerPixels = STEGO_MAX_HEADER_BYTES * 8;
+    if (capacity <= headerPixels) return 0;
+    unsigned long long bits = (capacity - headerPixels) * depth;
+    bits -= bits / SHARD_MARGIN;
+    return bits > SHARD_RESERVE_BITS ? bits - SHARD_RESERVE_BITS : 0;
+}
+
+// Cuts the size bytes of data into the ranges of slots[0, count), whose images are the covers,
+// at the smallest depth (depth itself unless it is STEGO_DEPTH_AUTO) at which they hold it
+// all. method is not STEGO_METHOD_AUTO. Returns the depth, or 0 if the covers are too small.
+unsigned int planShards(ShardSlot* slots, int count, const unsigned char* data, size_t size, int method, int depth) {
+    unsigned char cost[BYTE_RANGE];
+    unsigned long long total = 0, available = 0;
+    for (int i = 0; i < count; i++) {
+        CoverLayout layout;
+        const char* layoutError = NULL;
+        if (!parseBmpLayout(slots[i].image.data, slots[i].image.size, slots[i].image.size, &layout, &layoutError)) {
+            stegoError("Error: Unsupported cover image %s: %s.\n", slots[i].imagePath, layoutError);
+            return 0;
+        }
+        slots[i].capacity = layout.capacity;
+    }
+    if (method == STEGO_METHOD_STORED) {
+        memset(cost, 8, sizeof(cost));
+        total = size * 8ULL;
+    } else if (size > 0) {
+        unsigned long long counts[BYTE_RANGE] = {0};
+        int freq[BYTE_RANGE];
+        countBytesParallel(data, size, stegoThreadCount(), counts);
+        scaleFrequencies(counts, freq);
+        computeCodeLengths(freq, cost, MAX_CANONICAL_LENGTH);
+        for (int s = 0; s < BYTE_RANGE; s++) total += counts[s] * cost[s];
+    }
+
+    unsigned int first = depth == STEGO_DEPTH_AUTO ? 1 : (unsigned int)depth;
+    unsigned int last = depth == STEGO_DEPTH_AUTO ? LSB_MAX_DEPTH : (unsigned int)depth;
+    unsigned int planned = first;
+    for (; planned <= last; planned++) {
+        available = 0;
+        for (int i = 0; i < count; i++) available += shardBudget(slots[i].capacity, planned);
+        if (total <= available) break;
+    }
+    if (planned > last) {
+        stegoError("Error: Image capacity insufficient for the shards.\n");
+        stegoError("  Available payload bits: %llu at %u bits per byte\n", available, last);
+        stegoError("  Required payload bits: about %llu\n", total);
+        return 0;
+    }
+
+    // Cover i takes the file up to where its cost reaches the budgets of covers 0 to i.
+    unsigned long long spent = 0, share = 0;
+    size_t position = 0;
+    for (int i = 0; i < count; i++) {
+        share += shardBudget(slots[i].capacity, planned);
+        unsigned long long target = i == count - 1 || available == 0 ? total : (unsigned long long)((long double)total * share / available);
+        slots[i].offset = position;
+        while (position < size && spent + cost[data[position]] <= target) spent += cost[data[position++]];
+        slots[i].size = position - slots[i].offset;
+    }
+    return planned;
+}
+
+static void encodeShardTask(void* ctx, size_t i, int worker) {
+    ShardJob* job = (ShardJob*)ctx;
+    ShardSlot* slot = &job->slots[i];
+    (void)worker;
+    // Each shard's errors are reported after all of them have finished, under its name.
+    stegoErrorCapture = slot->errors;
+    stegoErrorCaptureSize = sizeof(slot->errors);
+    slot->ok = encodeCoverBuffer(slot->image.data, slot->image.size, job->data ? job->data + slot->offset : NULL, (size_t)slot->size,
+                                 NULL, slot->outputPath, slot->imagePath, job->method, job->depth, &slot->shard, NULL, NULL);
+    stegoErrorCapture = NULL;
+}
+
+static void decodeShardTask(void* ctx, size_t i, int worker) {
+    ShardJob* job = (ShardJob*)ctx;
+    ShardSlot* slot = &job->slots[i];
+    unsigned char none;
+    unsigned char* decoded = NULL;
+    size_t decodedSize = 0;
+    StegoShard shard;
+    (void)worker;
+    stegoErrorCapture = slot->errors;
+    stegoErrorCaptureSize = sizeof(slot->errors);
+    slot->ok = decodeImageBuffer(slot->image.data, slot->image.size, job->output ? job->output + slot->offset : &none, (size_t)slot->size,
+                                 &decoded, &decodedSize, &shard, NULL, NULL) == 1 && decodedSize == slot->size;
+    stegoErrorCapture = NULL;
+}
+
+// Hides the file at secretPath in the covers coverPaths[0, count), writing shard i to
+// outputPaths[i], with up to 'threads' shards at once. Returns 1 on success; if any shard
+// fails, none of the outputs is kept (outputs written over their own cover excepted).
+int encodeShards(const char* secretPath, const char** coverPaths, const char** outputPaths, int count, int method, int depth,
+                 int threads) {
+    ScratchBuffer secret = {0};
+    ShardSlot* slots = NULL;
+    int failed = 0, ok = 0;
+
+    if (count < 1 || count > STEGO_MAX_SHARDS) { stegoError("Error: A shard set takes 1 to %d covers.\n", STEGO_MAX_SHARDS); return 0; }
+    for (int i = 0; i < count; i++) {
+        if (pathIsStream(coverPaths[i]) || pathIsStream(outputPaths[i])) { stegoError("Error: Shards need files, not pipes.\n"); return 0; }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(outputPaths[i], outputPaths[j]) == 0) { stegoError("Error: Shards %d and %d both go to %s.\n", j + 1, i + 1, outputPaths[i]); return 0; }
+        }
+    }
+    long size = 0;
+    unsigned char* data = readBinaryFile(secretPath, &size, &secret);
+    if (!data && size != 0) { stegoError("Failed to read file to hide.\n"); return 0; }
+    slots = (ShardSlot*)calloc((size_t)count, sizeof(ShardSlot));
+    if (!slots) { stegoSystemError("Failed to allocate shards"); goto shard_encode_cleanup; }
+    for (int i = 0; i < count; i++) {
+        slots[i].imagePath = coverPaths[i];
+        slots[i].outputPath = outputPaths[i];
+        if (!openImageRead(coverPaths[i], &slots[i].image)) { stegoError("Error opening input image: %s\n", coverPaths[i]); goto shard_encode_cleanup; }
+    }
+
+    // One method for every shard, so that the plan's costs hold for each of them
+    if (method == STEGO_METHOD_AUTO) {
+        unsigned char sample[SAMPLE_BYTES];
+        method = chooseMethod(sample, size > 0 ? samplePayload(data, (size_t)size, sample) : 0);
+    }
+    unsigned int planned = planShards(slots, count, data, (size_t)size, method, depth);
+    if (!planned) goto shard_encode_cleanup;
+    uint32_t checksum = crc32c(0, data, (size_t)size);
+    unsigned long long seed[3] = { (unsigned long long)time(NULL), (unsigned long long)(stegoNowMs() * 1000.0), (unsigned long long)(uintptr_t)&seed };
+    uint32_t setId = crc32c(checksum, (const unsigned char*)seed, sizeof(seed));
+    for (int i = 0; i < count; i++) {
+        StegoShard shard = { setId, (unsigned int)i, (unsigned int)count, slots[i].offset, (unsigned long long)size, checksum };
+        slots[i].shard = shard;
+    }
+
+    stegoProgress("Hiding %ld bytes %s in %d shards (set %08x) at up to %u bits per byte on %d threads...\n", size,
+                  stegoMethodName((unsigned int)method), count, setId, planned, threads);
+    ShardJob job = { slots, data, NULL, method, depth };
+    parallelFor((size_t)count, threads, encodeShardTask, &job);
+    for (int i = 0; i < count; i++) {
+        if (!slots[i].ok) {
+            stegoError("Error: Shard %d of %d (%s) failed:\n%s", i + 1, count, slots[i].outputPath, slots[i].errors);
+            failed = 1;
+        } else {
+            stegoProgress("  shard %d: %llu bytes from offset %llu in %s\n", i + 1, slots[i].size, slots[i].offset, slots[i].outputPath);
+        }
+    }
+    if (failed) {
+        for (int i = 0; i < count; i++) {
+            if (slots[i].ok && !sameFile(slots[i].imagePath, slots[i].outputPath)) remove(slots[i].outputPath);
+        }
+        goto shard_encode_cleanup;
+    }
+    stegoProgress("Encoding finished successfully for %d shards.\n", count);
+    ok = 1;
+
+shard_encode_cleanup:
+    if (slots) {
+        for (int i = 0; i < count; i++) closeImage(&slots[i].image);
+    }
+    free(slots);
+    free(secret.data);
+    return ok;
+}
+
+// Puts the file hidden in the shards stegoPaths[0, count), given in any order, back together
+// into outputFilePath, decoding up to 'threads' shards at once. All shards of the set are
+// needed. Returns 1 on success.
+int decodeShards(const char** stegoPaths, int count, const char* outputFilePath, int threads) {
+    ShardSlot* slots = NULL;
+    ShardSlot** ordered = NULL;
+    ImageBuffer outputFile = {0};
+    unsigned char* output = NULL;
+    int toStream = pathIsStream(outputFilePath), created = 0, failed = 0, ok = 0;
+
+    if (count < 1 || count > STEGO_MAX_SHARDS) { stegoError("Error: A shard set takes 1 to %d images.\n", STEGO_MAX_SHARDS); return 0; }
+    slots = (ShardSlot*)calloc((size_t)count, sizeof(ShardSlot));
+    ordered = (ShardSlot**)calloc((size_t)count, sizeof(ShardSlot*));
+    if (!slots || !ordered) { stegoSystemError("Failed to allocate shards"); goto shard_decode_cleanup; }
+
+    stegoProgress("Reading shard headers...\n");
+    for (int i = 0; i < count; i++) {
+        ShardSlot* slot = &slots[i];
+        CoverLayout layout;
+        StegoHeader h;
+        size_t headerBytes = 0;
+        slot->imagePath = stegoPaths[i];
+        if (pathIsStream(stegoPaths[i])) { stegoError("Error: Shards need files, not pipes.\n"); goto shard_decode_cleanup; }
+        if (!openImageRead(stegoPaths[i], &slot->image)) { stegoError("Error opening stego image: %s\n", stegoPaths[i]); goto shard_decode_cleanup; }
+        int status = slot->image.size < BMP_HEADER_SIZE ? 0 :
+                     findStegoHeader(slot->image.data, slot->image.size, slot->image.size, &layout, &h, &headerBytes);
+        if (status <= 0 || !(h.flags & STEGO_FLAG_SHARD)) { stegoError("Error: %s is not a shard.\n", stegoPaths[i]); goto shard_decode_cleanup; }
+        slot->shard = h.shard;
+        slot->offset = h.shard.offset;
+        slot->size = h.originalSize;
+        const StegoShard* first = &slots[0].shard;
+        if (h.shard.setId != first->setId || h.shard.count != first->count || h.shard.totalSize != first->totalSize ||
+            h.shard.totalChecksum != first->totalChecksum) {
+            stegoError("Error: %s and %s belong to different shard sets.\n", stegoPaths[0], stegoPaths[i]);
+            goto shard_decode_cleanup;
+        }
+        if (h.shard.count != (unsigned int)count) {
+            stegoError("Error: The shard set has %u shards, but %d images were given.\n", h.shard.count, count);
+            goto shard_decode_cleanup;
+        }
+        if (ordered[h.shard.index]) {
+            stegoError("Error: %s and %s both hold shard %u.\n", ordered[h.shard.index]->imagePath, stegoPaths[i], h.shard.index + 1);
+            goto shard_decode_cleanup;
+        }
+        ordered[h.shard.index] = slot;
+    }
+    // Every index is taken once; the ranges must follow each other to the end of the file.
+    unsigned long long totalSize = slots[0].shard.totalSize, end = 0;
+    for (int i = 0; i < count; i++) {
+        if (ordered[i]->offset != end) {
+            stegoError("Error: Shard %d starts at byte %llu instead of %llu.\n", i + 1, ordered[i]->offset, end);
+            goto shard_decode_cleanup;
+        }
+        end += ordered[i]->size;
+    }
+    if (end != totalSize || totalSize > (size_t)-1) { stegoError("Error: The shards hold %llu of %llu bytes.\n", end, totalSize); goto shard_decode_cleanup; }
+
+    if (toStream) {
+        output = (unsigned char*)malloc(totalSize ? (size_t)totalSize : 1);
+        if (!output) { stegoSystemError("Memory allocation failed for decoded data"); goto shard_decode_cleanup; }
+    } else {
+        if (!createImageOutput(outputFilePath, (size_t)totalSize, &outputFile)) { stegoSystemError("Error creating output file"); goto shard_decode_cleanup; }
+        output = outputFile.data;
+    }
+    created = 1;
+
+    stegoProgress("Decoding %llu bytes from %d shards on %d threads...\n", totalSize, count, threads);
+    ShardJob job = { slots, NULL, totalSize ? output : NULL, 0, 0 };
+    parallelFor((size_t)count, threads, decodeShardTask, &job);
+    for (int i = 0; i < count; i++) {
+        if (!ordered[i]->ok) {
+            stegoError("Error: Shard %d of %d (%s) failed:\n%s", i + 1, count, ordered[i]->imagePath, ordered[i]->errors);
+            failed = 1;
+        }
+    }
+    if (failed) goto shard_decode_cleanup;
+    if (crc32c(0, output, (size_t)totalSize) != slots[0].shard.totalChecksum) {
+        stegoError("Error: Checksum mismatch in the reassembled file.\n");
+        goto shard_decode_cleanup;
+    }
+
+    if (toStream) {
+        FILE* stream = openOutputStream(outputFilePath);
+        if (!stream) { stegoSystemError("Error creating output file"); goto shard_decode_cleanup; }
+        int written = fwrite(output, 1, (size_t)totalSize, stream) == totalSize;
+        if (closeStream(stream) != 0 || !written) { stegoError("Error writing decoded data to output file.\n"); goto shard_decode_cleanup; }
+    } else {
+        output = NULL;
+        if (!closeImage(&outputFile)) { stegoError("Error writing decoded data to output file.\n"); goto shard_decode_cleanup; }
+    }
+    stegoProgress("File reassembled successfully to '%s'\n", outputFilePath);
+    ok = 1;
+
+shard_decode_cleanup:
+    if (toStream) free(output);
+    closeImage(&outputFile);
+    if (!ok && created) removeOutput(outputFilePath);
+    if (slots) {
+        for (int i = 0; i < count; i++) closeImage(&slots[i].image);
+    }
+    free(slots);
+    free(ordered);
+    return ok;
+}
+
+
+// --- Probe (probeStegoImage, formatProbeFields) ---
+// Reads just enough of an image to parse its stego header, without mapping the whole file.
+// Returns 1 with h and headerBytes filled in, 0 if the image has no header (a legacy stego
+// image or no stego image at all) and -1 if the header is malformed or the file unreadable.
+int probeStegoImage(const char* path, StegoHeader* h, size_t* headerBytes) {
+    FILE* image = fopen(path, "rb");
+    if (!image) { stegoError("Error opening stego image: %s\n", path); return -1; }
+    long long fileSize = getFileSize(image);
+    size_t size = 0;
+    unsigned char* prefix = fileSize >= 0 ? readCoverPrefix(image, (unsigned long long)fileSize, &size) : NULL;
+    fclose(image);
+    if (!prefix) { stegoError("Error reading stego image: %s\n", path); return -1; }
+    CoverLayout layout;
+    int status = findStegoHeader(prefix, size, (unsigned long long)fileSize, &layout, h, headerBytes);
+    free(prefix);
+    return status;
+}
+
+// Formats the members of a JSON object describing a successful probe (no braces) into buf.
+void formatProbeFields(char* buf, size_t size, int status, const StegoHeader* h, size_t headerBytes) {
+    if (status == 0) {
+        snprintf(buf, size, "\"format\":\"none\"");
+    } else if (h->flags & STEGO_FLAG_BLOCKS) {
+        snprintf(buf, size, "\"format\":\"stgh\",\"version\":%u,\"method\":\"%s\",\"depth\":%u,\"original_size\":%llu,"
+                 "\"compressed_bits\":%llu,\"header_bytes\":%lu,\"checksums\":%s,\"block_mode\":true,\"block_size\":%llu,\"block_count\":%llu",
+                 h->version, stegoMethodName(h->method), h->depth, h->originalSize, h->compressedBits, (unsigned long)headerBytes,
+                 h->version >= STEGO_CHECKSUM_VERSION ? "true" : "false", 1ULL << h->blockSizeLog2, stegoBlockCount(h));
+    } else {
+        snprintf(buf, size, "\"format\":\"stgh\",\"version\":%u,\"method\":\"%s\",\"depth\":%u,\"original_size\":%llu,"
+                 "\"compressed_bits\":%llu,\"header_bytes\":%lu,\"checksums\":%s,\"block_mode\":false,\"seek_interval\":%llu,\"seek_count\":%llu",
+                 h->version, stegoMethodName(h->method), h->depth, h->originalSize, h->compressedBits, (unsigned long)headerBytes,
+                 h->version >= STEGO_CHECKSUM_VERSION ? "true" : "false", h->flags & STEGO_FLAG_SEEK ? 1ULL << h->seekLog2 : 0ULL, stegoSeekCount(h));
+    }
+    size_t n = strlen(buf);
+    if (status > 0 && n < size) n += (size_t)snprintf(buf + n, size - n, ",\"scatter\":%s", h->flags & STEGO_FLAG_SCATTER ? "true" : "false");
+    if (status > 0 && (h->flags & STEGO_FLAG_SHARD) && n < size) {
+        snprintf(buf + n, size - n, ",\"shard\":{\"set\":\"%08x\",\"index\":%u,\"count\":%u,\"offset\":%llu,\"total_size\":%llu}",
+                 h->shard.setId, h->shard.index, h->shard.count, h->shard.offset, h->shard.totalSize);
+    }
+}
+
+
+// --- Self-Test (runSelfTest) ---
+// Checks every LSB kernel the CPU supports against the bit-by-bit reference for its depth, the
+// walk over BMP pixel spans, the table decoder against the tree walk, a block-mode round trip,
+// decoding from seek index checkpoints, the stored-mode decision, encoding and decoding in
+// memory, shard sets, keyed scatter, the byte histogram and capacity dry runs.
+// Run with: code --self-test
+static unsigned int selfTestRandom(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int selfTestKernels(unsigned int* seed) {
+    static const size_t sizes[] = { 0, 1, 2, 3, 4, 7, 8, 9, 31, 33, 64, 65, 1000, 4099 };
+    static const size_t bitCounts[] = { 1, 5, 13, 24, 95, 1001, 8 * 4099 - 3 }; // At most one bit per cover byte
+    const size_t maxGroups = 4099;
+    unsigned char* cover = (unsigned char*)malloc(maxGroups * 8);
+    unsigned char* expected = (unsigned char*)malloc(maxGroups * 8);
+    unsigned char* actual = (unsigned char*)malloc(maxGroups * 8);
+    unsigned char* payload = (unsigned char*)malloc(maxGroups * LSB_MAX_DEPTH);
+    unsigned char* extracted = (unsigned char*)malloc(maxGroups * LSB_MAX_DEPTH);
+    int failures = 0;
+    if (!cover || !expected || !actual || !payload || !extracted) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        failures = 1;
+        goto kernels_cleanup;
+    }
+    for (size_t i = 0; i < maxGroups * 8; i++) cover[i] = (unsigned char)selfTestRandom(seed);
+    for (size_t i = 0; i < maxGroups * LSB_MAX_DEPTH; i++) payload[i] = (unsigned char)selfTestRandom(seed);
+
+    // Every kernel against the bit-at-a-time reference for its depth.
+    for (int k = 0; k < LSB_KERNEL_COUNT; k++) {
+        const LsbKernel* kernel = &lsbKernels[k];
+        unsigned int depth = kernel->depth;
+        if (!kernel->supported()) {
+            printf("  kernel %-9s depth %u skipped (not supported by this CPU)\n", kernel->name, depth);
+            continue;
+        }
+        int kernelFailures = 0;
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t n = sizes[s];
+            embedBitsTail(expected, cover, payload, n * 8 * depth, depth);
+            kernel->embed(actual, cover, payload, n);
+            if (memcmp(expected, actual, n * 8) != 0) kernelFailures++;
+
+            memcpy(actual, cover, n * 8); // In place, as used on mapped outputs
+            kernel->embed(actual, actual, payload, n);
+            if (memcmp(expected, actual, n * 8) != 0) kernelFailures++;
+
+            memset(extracted, 0, n * depth);
+            kernel->extract(expected, extracted, n);
+            if (memcmp(extracted, payload, n * depth) != 0) kernelFailures++;
+        }
+        printf("  kernel %-9s depth %u %s\n", kernel->name, depth, kernelFailures ? "FAILED" : "ok");
+        failures += kernelFailures;
+    }
+
+    // embedBits and extractBits with partial groups at the end, which leave the cover's
+    // remaining low bits alone.
+    for (unsigned int depth = 1; depth <= LSB_MAX_DEPTH; depth++) {
+        int depthFailures = 0;
+        for (size_t s = 0; s < sizeof(bitCounts) / sizeof(bitCounts[0]); s++) {
+            size_t bitCount = bitCounts[s];
+            size_t pixels = (size_t)lsbPixels(bitCount, depth);
+            embedBitsTail(expected, cover, payload, bitCount, depth);
+            memcpy(actual, cover, maxGroups * 8);
+            embedBits(actual, actual, payload, bitCount, depth);
+            if (memcmp(expected, actual, pixels) != 0 || memcmp(actual + pixels, cover + pixels, maxGroups * 8 - pixels) != 0) depthFailures++;
+            extractBits(actual, extracted, bitCount, depth);
+            if (memcmp(extracted, payload, bitCount / 8) != 0) depthFailures++;
+            if (bitCount % 8 && (extracted[bitCount / 8] ^ payload[bitCount / 8]) >> (8 - bitCount % 8)) depthFailures++;
+        }
+        printf("  embed    depth %u partial groups %s\n", depth, depthFailures ? "FAILED" : "ok");
+        failures += depthFailures;
+    }
+
+kernels_cleanup:
+    free(cover);
+    free(expected);
+    free(actual);
+    free(payload);
+    free(extracted);
+    return failures;
+}
+
+static void selfTestStore32(unsigned char* p, unsigned int value) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+// BMP parsing and the span walk on two small images: 5 x 7 top-down 24-bit pixels (rows of
+// 15 bytes padded to 16) after a gap, and 3 x 9 32-bit pixels with an alpha mask. The walk is
+// checked against the reference embedding applied to the pixel bytes taken one at a time.
+static int selfTestSpans(unsigned int* seed) {
+    unsigned char file[256], expected[256], actual[256], linear[256];
+    unsigned char payload[128], extracted[128];
+    int failures = 0;
+    for (int alpha = 0; alpha <= 1; alpha++) {
+        unsigned int offset = alpha ? 138 : 60, width = alpha ? 3 : 5, height = alpha ? 9 : 7, stride = alpha ? 12 : 16;
+        size_t size = offset + height * stride;
+        int shapeFailures = 0;
+        for (size_t i = 0; i < size; i++) file[i] = (unsigned char)selfTestRandom(seed);
+        file[0] = 'B';
+        file[1] = 'M';
+        selfTestStore32(file + 10, offset);
+        selfTestStore32(file + 14, alpha ? 124 : 40);
+        selfTestStore32(file + 18, width);
+        selfTestStore32(file + 22, alpha ? height : 0u - height);
+        selfTestStore32(file + 26, alpha ? 0x200001u : 0x180001u); // One plane, 32 or 24 bits
+        selfTestStore32(file + 30, alpha ? 3 : 0);
+        if (alpha) selfTestStore32(file + 66, 0xFF000000u);
+
+        CoverLayout layout;
+        if (!parseBmpLayout(file, size, size, &layout, NULL) || layout.capacity != width * 3ULL * height) {
+            printf("  spans    %-13s layout FAILED\n", alpha ? "32-bit alpha" : "24-bit padded");
+            failures++;
+            continue;
+        }
+        size_t capacity = (size_t)layout.capacity;
+        for (size_t offsetBelow = 0, k = 0; offsetBelow <= size; offsetBelow++) {
+            while (k < capacity && spanOffset(&layout, k) < offsetBelow) k++;
+            if (spanPixelsBelow(&layout, offsetBelow) != k) shapeFailures++;
+        }
+        for (unsigned int depth = 1; depth <= LSB_MAX_DEPTH; depth++) {
+            for (size_t start = 0; start < 20; start += 7) {
+                size_t bitCount = (capacity - start) * depth - 3;
+                for (size_t i = 0; i < sizeof(payload); i++) payload[i] = (unsigned char)selfTestRandom(seed);
+                memcpy(expected, file, size);
+                for (size_t k = 0; k < capacity; k++) linear[k] = file[spanOffset(&layout, k)];
+                embedBitsTail(linear + start, linear + start, payload, bitCount, depth);
+                for (size_t k = 0; k < capacity; k++) expected[spanOffset(&layout, k)] = linear[k];
+
+                // From the cover into a copy of it, then in place
+                memcpy(actual, file, size);
+                PixelView view = { &layout, actual, file, 0 };
+                spanEmbedBits(&view, start, payload, bitCount, depth);
+                if (memcmp(actual, expected, size) != 0) shapeFailures++;
+                memcpy(actual, file, size);
+                view.src = actual;
+                spanEmbedBits(&view, start, payload, bitCount, depth);
+                if (memcmp(actual, expected, size) != 0) shapeFailures++;
+
+                spanExtractBits(&view, start, extracted, bitCount, depth);
+                if (memcmp(extracted, payload, bitCount / 8) != 0 ||
+                    (extracted[bitCount / 8] ^ payload[bitCount / 8]) >> (8 - bitCount % 8)) {
+                    shapeFailures++;
+                }
+            }
+        }
+        printf("  spans    %-13s %s\n", alpha ? "32-bit alpha" : "24-bit padded", shapeFailures ? "FAILED" : "ok");
+        failures += shapeFailures;
+    }
+    return failures;
+}
+
+// Decodes bits with both the lookup tables and the tree walk and checks each against input.
+static int selfTestCompareDecoders(const char* codes, const char* data, const CodeTable codeTable[BYTE_RANGE],
+                                   HuffmanNode* root, const unsigned char* bits, long bitCount,
+                                   const unsigned char* input, long n, unsigned char* viaTable, unsigned char* viaTree) {
+    int ok = bits && root;
+    int treeOk = ok && huffmanDecodeTreeWalk(root, bits, (unsigned long long)bitCount, viaTree, (size_t)n) &&
+                 memcmp(viaTree, input, (size_t)n) == 0;
+    HuffmanDecodeTable table;
+    int tableBuilt = ok && buildDecodeTable(codeTable, &table);
+    int tableOk = 1;
+    if (tableBuilt) {
+        tableOk = huffmanDecodeTable(&table, bits, (unsigned long long)bitCount, viaTable, (size_t)n) &&
+                  memcmp(viaTable, input, (size_t)n) == 0;
+        freeDecodeTable(&table);
+    }
+    printf("  decode %-9s %-12s tree walk %s, table %s\n", codes, data, treeOk ? "ok" : "FAILED",
+           tableBuilt ? (tableOk ? "ok" : "FAILED") : "n/a (codes too long)");
+    return (!treeOk || !tableOk) ? 1 : 0;
+}
+
+static int selfTestDecoders(unsigned int* seed) {
+    static const char* names[] = { "uniform", "skewed", "single byte", "deep tree", "too deep" };
+    const long size = 400000;
+    unsigned char* input = (unsigned char*)malloc(size);
+    unsigned char* viaTable = (unsigned char*)malloc(size);
+    unsigned char* viaTree = (unsigned char*)malloc(size);
+    int failures = 0;
+    if (!input || !viaTable || !viaTree) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        free(input);
+        free(viaTable);
+        free(viaTree);
+        return 1;
+    }
+
+    for (int d = 0; d < 5; d++) {
+        long n = size;
+        if (d >= 3) {
+            // Fibonacci frequencies give a maximally deep tree: 20 symbols exercise the
+            // secondary tables, 26 push codes past what the tables can hold.
+            int symbols = d == 3 ? 20 : 26;
+            long fib[26] = { 1, 1 };
+            for (int i = 2; i < symbols; i++) fib[i] = fib[i - 1] + fib[i - 2];
+            n = 0;
+            for (int i = 0; i < symbols && n < size; i++)
+                for (long j = 0; j < fib[i] && n < size; j++) input[n++] = (unsigned char)i;
+        } else {
+            for (long i = 0; i < n; i++) {
+                unsigned int r = selfTestRandom(seed);
+                if (d == 0) input[i] = (unsigned char)r;
+                else if (d == 1) input[i] = (unsigned char)((r & 0xF) ? (r >> 8) % 6 : r >> 24);
+                else input[i] = 'A';
+            }
+        }
+
+        int freq[BYTE_RANGE] = {0};
+        for (long i = 0; i < n; i++) freq[input[i]]++;
+        CodeTable codeTable[BYTE_RANGE];
+        HuffmanArena arena;
+        HuffmanNode* root = NULL;
+
+        // Canonical, length-limited codes as written by the encoder
+        unsigned char lengths[BYTE_RANGE];
+        long bitCount = 0;
+        unsigned char* bits = huffmanCompress(input, n, &bitCount, freq, lengths, NULL);
+        if (bits && buildCanonicalCodes(lengths, codeTable)) root = buildTreeFromCodes(&arena, codeTable);
+        failures += selfTestCompareDecoders("canonical", names[d], codeTable, root, bits, bitCount,
+                                            input, n, viaTable, viaTree);
+        free(bits);
+
+        // Unlimited tree codes, as used by images from before the canonical header
+        bits = NULL;
+        root = buildHuffmanTree(&arena, freq);
+        if (root && generateCodes(root, codeTable)) {
+            bitCount = 0;
+            for (int i = 0; i < BYTE_RANGE; i++) bitCount += (long)freq[i] * codeTable[i].length;
+            bits = packHuffmanCodes(input, n, codeTable, bitCount, NULL);
+        }
+        failures += selfTestCompareDecoders("legacy", names[d], codeTable, root, bits, bitCount,
+                                            input, n, viaTable, viaTree);
+        free(bits);
+    }
+
+    free(input);
+    free(viaTable);
+    free(viaTree);
+    return failures;
+}
+
+// Round-trips a payload through block mode (plan, pack, unpack) with every codec on several threads.
+static int selfTestBlocks(unsigned int* seed) {
+    const unsigned int blockSizeLog2 = BLOCK_SIZE_LOG2_MIN;
+    const size_t size = (11u << BLOCK_SIZE_LOG2_MIN) + 123; // Ends in a partial block
+    const int threads = 4;
+    unsigned char* input = (unsigned char*)malloc(size);
+    unsigned char* output = (unsigned char*)malloc(size);
+    size_t slotSize = 0;
+    for (size_t c = 0; c < sizeof(blockCodecs) / sizeof(blockCodecs[0]); c++) {
+        if (blockCodecs[c].bound((size_t)1 << blockSizeLog2) > slotSize) slotSize = blockCodecs[c].bound((size_t)1 << blockSizeLog2);
+    }
+    unsigned char* streams = (unsigned char*)malloc(slotSize * 12);
+    int failures = 0;
+    if (!input || !output || !streams) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        free(input);
+        free(output);
+        free(streams);
+        return 1;
+    }
+    // Mix uniform, skewed, very skewed and single-byte blocks so their code tables differ.
+    for (size_t i = 0; i < size; i++) {
+        unsigned int r = selfTestRandom(seed);
+        size_t block = i >> blockSizeLog2;
+        input[i] = (unsigned char)(block % 4 == 0 ? r : block % 4 == 1 ? (r >> 8) % 6 :
+                                   block % 4 == 2 ? ((r >> 8) % 20 ? 'A' : r >> 16) : 'A');
+    }
+
+    for (size_t c = 0; c < sizeof(blockCodecs) / sizeof(blockCodecs[0]); c++) {
+        BlockPlan plan;
+        if (!blockPlanInit(&plan, &blockCodecs[c], size, blockSizeLog2, 1)) {
+            fprintf(stderr, "Self-test allocation failed.\n");
+            failures++;
+            continue;
+        }
+        memset(output, 0, size);
+        BlockJob job = { &plan, 0, input, output, streams, slotSize, NULL, 0, 0 };
+        parallelFor(plan.count, threads, planBlockTask, &job);
+        if (!job.failed) parallelFor(plan.count, threads, packBlockTask, &job);
+        if (!job.failed) parallelFor(plan.count, threads, unpackBlockTask, &job);
+        blockPlanLayout(&plan, 1);
+        int failed = job.failed || memcmp(input, output, size) != 0;
+        printf("  blocks   %-8s %lu blocks on %d threads, %llu bytes %s\n", blockCodecs[c].name, (unsigned long)plan.count,
+               threads, plan.totalBytes, failed ? "FAILED" : "ok");
+        failures += failed;
+        blockPlanFree(&plan);
+    }
+
+    free(input);
+    free(output);
+    free(streams);
+    return failures;
+}
+
+// Builds a seek index in uneven pieces, round-trips its header and decodes from every checkpoint.
+static int selfTestSeek(unsigned int* seed) {
+    const size_t size = (5u << SEEK_LOG2_MIN) + 77;
+    unsigned char* input = (unsigned char*)malloc(size);
+    unsigned char output[256];
+    int freq[BYTE_RANGE] = {0};
+    int failures = 0;
+    if (!input) { fprintf(stderr, "Self-test allocation failed.\n"); return 1; }
+    for (size_t i = 0; i < size; i++) {
+        unsigned int r = selfTestRandom(seed);
+        input[i] = (unsigned char)((r >> 8) % 7 ? 'a' + (r >> 16) % 5 : r >> 24);
+        freq[input[i]]++;
+    }
+
+    StegoHeader h, parsed;
+    SeekIndex seek = {0};
+    CodeTable codeTable[BYTE_RANGE];
+    HuffmanDecodeTable decodeTable = {0};
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    size_t headerBytes = 0;
+    long bitCount = 0;
+    memset(&h, 0, sizeof(h));
+    h.flags = STEGO_FLAG_SEEK;
+    h.depth = 1;
+    h.originalSize = size;
+    h.seekLog2 = SEEK_LOG2_MIN;
+    unsigned char* stream = huffmanCompress(input, (long)size, &bitCount, freq, h.codeLengths, NULL);
+    h.compressedBits = (unsigned long long)bitCount;
+    size_t written = writeStegoHeader(&h, header);
+    if (!stream || !seekIndexInit(&seek, &h) || !buildCanonicalCodes(h.codeLengths, codeTable) ||
+        !buildDecodeTable(codeTable, &decodeTable)) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        failures = 1;
+        goto seek_cleanup;
+    }
+    seekIndexAdd(&seek, input, 1000, codeTable);
+    seekIndexAdd(&seek, input + 1000, size - 1000, codeTable);
+    failures = readStegoHeader(header, written, &parsed, &headerBytes) != 1 || headerBytes != written ||
+               parsed.seekLog2 != h.seekLog2 || stegoSeekCount(&parsed) != 5 || seek.filled != seek.count;
+    for (size_t k = 0; k <= seek.count && !failures; k++) {
+        unsigned long long firstBit = seekCheckpointBits(seek.entries, k);
+        size_t at = k << SEEK_LOG2_MIN, want = size - at < sizeof(output) ? size - at : sizeof(output), got = 0;
+        BitReader br;
+        bitReaderInit(&br, stream + firstBit / 8, (size_t)((bitCount + 7) / 8 - firstBit / 8));
+        bitReaderRefill(&br);
+        bitReaderSkip(&br, (int)(firstBit % 8));
+        failures = !huffmanDecodeChunk(&decodeTable, &br, output, want, 1, &got) || memcmp(output, input + at, want) != 0;
+    }
+    printf("  seek     %lu checkpoints every %u KB %s\n", (unsigned long)seek.count, 1u << (SEEK_LOG2_MIN - 10), failures ? "FAILED" : "ok");
+
+seek_cleanup:
+    free(input);
+    free(stream);
+    free(seek.entries);
+    freeDecodeTable(&decodeTable);
+    return failures;
+}
+
+// Checks CRC-32C against its check value, the hardware path against slicing-by-8 over many
+// lengths and alignments, and that a damaged header is rejected.
+static int selfTestChecksum(unsigned int* seed) {
+    const size_t size = CRC32C_LONG * 3 + CRC32C_SHORT * 5 + 64;
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (!data) { fprintf(stderr, "Self-test allocation failed.\n"); return 1; }
+    for (size_t i = 0; i < size; i++) data[i] = (unsigned char)selfTestRandom(seed);
+    int failures = crc32c(0, (const unsigned char*)"123456789", 9) != 0xE3069283u ||
+                   crc32cSoftware(0, (const unsigned char*)"123456789", 9) != 0xE3069283u;
+    for (size_t length = 0; length < size && !failures; length += length < 64 ? 1 : 97 + length / 8) {
+        for (size_t offset = 0; offset < 8 && offset + length <= size; offset += 3) {
+            uint32_t split = crc32c(crc32c(0, data + offset, length / 3), data + offset + length / 3, length - length / 3);
+            failures |= crc32c(0, data + offset, length) != crc32cSoftware(0, data + offset, length) ||
+                        split != crc32cSoftware(0, data + offset, length);
+        }
+    }
+
+    StegoHeader h, parsed;
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    size_t headerBytes = 0;
+    memset(&h, 0, sizeof(h));
+    h.method = STEGO_METHOD_STORED;
+    h.depth = 2;
+    h.originalSize = 4321;
+    h.compressedBits = h.originalSize * 8;
+    size_t written = writeStegoHeader(&h, header);
+    failures |= readStegoHeader(header, written, &parsed, &headerBytes) != 1 ||
+                readStegoHeader(header, written - 1, &parsed, &headerBytes) != -1;
+    header[written - 1] ^= 0x10;
+    failures |= readStegoHeader(header, written, &parsed, &headerBytes) != -1;
+    printf("  crc32c   %s against slicing-by-8 and damaged header %s\n", crc32cPathName(), failures ? "FAILED" : "ok");
+    free(data);
+    return failures;
+}
+
+// Checks the method choice on random, skewed and very skewed samples and a stored header round trip.
+static int selfTestMethod(unsigned int* seed) {
+    static unsigned char uniform[SAMPLE_BYTES], skewed[SAMPLE_BYTES], verySkewed[SAMPLE_BYTES];
+    for (int i = 0; i < SAMPLE_BYTES; i++) {
+        unsigned int r = selfTestRandom(seed);
+        uniform[i] = (unsigned char)r;
+        skewed[i] = (unsigned char)((r >> 8) % 40);
+        verySkewed[i] = (unsigned char)((r >> 8) % 10 ? 'A' : 'a' + (r >> 16) % 10);
+    }
+    StegoHeader h, parsed;
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    size_t headerBytes = 0;
+    memset(&h, 0, sizeof(h));
+    h.method = STEGO_METHOD_STORED;
+    h.depth = 3;
+    h.originalSize = 12345;
+    h.compressedBits = h.originalSize * 8;
+    size_t written = writeStegoHeader(&h, header);
+    int failures = chooseMethod(uniform, SAMPLE_BYTES) != STEGO_METHOD_STORED ||
+                   chooseMethod(skewed, SAMPLE_BYTES) == STEGO_METHOD_STORED ||
+                   chooseMethod(verySkewed, SAMPLE_BYTES) != STEGO_METHOD_TANS ||
+                   readStegoHeader(header, written, &parsed, &headerBytes) != 1 || headerBytes != written ||
+                   parsed.method != STEGO_METHOD_STORED || parsed.depth != h.depth || parsed.originalSize != h.originalSize;
+    printf("  method   stored/huffman/tans choice and stored header %s\n", failures ? "FAILED" : "ok");
+    return failures;
+}
+
+// A 24-bit BMP of random pixels, width a multiple of 4 (no row padding), in a new buffer of
+// *size bytes; NULL if allocation fails.
+static unsigned char* selfTestBmp(unsigned int width, unsigned int height, unsigned int* seed, size_t* size) {
+    *size = BMP_HEADER_SIZE + (size_t)width * 3 * height;
+    unsigned char* bmp = (unsigned char*)malloc(*size);
+    if (!bmp) return NULL;
+    for (size_t i = 0; i < *size; i++) bmp[i] = (unsigned char)selfTestRandom(seed);
+    memset(bmp, 0, BMP_HEADER_SIZE);
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    selfTestStore32(bmp + 2, (unsigned int)*size);
+    selfTestStore32(bmp + 10, BMP_HEADER_SIZE);
+    selfTestStore32(bmp + 14, 40);
+    selfTestStore32(bmp + 18, width);
+    selfTestStore32(bmp + 22, height);
+    selfTestStore32(bmp + 26, 0x180001u); // One plane, 24 bits
+    return bmp;
+}
+
+// Encodes a payload into a small cover held in memory with each method and decodes it into a
+// caller buffer, then checks that a buffer one byte too small is refused with a captured error.
+static int selfTestMemory(unsigned int* seed) {
+    static const int methods[] = { STEGO_METHOD_HUFFMAN, STEGO_METHOD_TANS, STEGO_METHOD_STORED };
+    const size_t payloadSize = 3000;
+    size_t size = 0;
+    unsigned char* cover = selfTestBmp(64, 48, seed, &size);
+    unsigned char* output = (unsigned char*)malloc(size);
+    unsigned char* payload = (unsigned char*)malloc(payloadSize);
+    unsigned char* target = (unsigned char*)malloc(payloadSize);
+    char errors[256];
+    int failures = 0;
+    if (!cover || !output || !payload || !target) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        free(cover); free(output); free(payload); free(target);
+        return 1;
+    }
+    for (size_t i = 0; i < payloadSize; i++) payload[i] = (unsigned char)('a' + (selfTestRandom(seed) >> 8) % 12);
+
+    // Captured as in a library call, which also keeps progress quiet
+    stegoErrorCapture = errors;
+    stegoErrorCaptureSize = sizeof(errors);
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        unsigned char* decoded = NULL;
+        size_t decodedSize = 0;
+        errors[0] = '\0';
+        memset(target, 0, payloadSize);
+        failures += !encodeCoverBuffer(cover, size, payload, payloadSize, output, NULL, NULL, methods[m], STEGO_DEPTH_AUTO, NULL, NULL, NULL) ||
+                    decodeImageBuffer(output, size, target, payloadSize, &decoded, &decodedSize, NULL, NULL, NULL) != 1 ||
+                    decoded != target || decodedSize != payloadSize || memcmp(target, payload, payloadSize) != 0 || errors[0];
+        failures += decodeImageBuffer(output, size, target, payloadSize - 1, &decoded, &decodedSize, NULL, NULL, NULL) != 0 ||
+                    !strstr(errors, "too small");
+    }
+
+    // Headers before STEGO_CHECKSUM_VERSION have no checksum, so a damaged original size must
+    // fail on the image's capacity before a block index is allocated for it.
+    int savedBlocks = stegoOptions.blocks, savedStreaming = stegoOptions.streaming;
+    stegoOptions.blocks = 1;
+    stegoOptions.streaming = 0;
+    StegoHeader h;
+    size_t headerBytes = 0;
+    unsigned char header[STEGO_MAX_HEADER_BYTES];
+    CoverLayout layout;
+    if (encodeCoverBuffer(cover, size, payload, payloadSize, output, NULL, NULL, STEGO_METHOD_HUFFMAN, STEGO_DEPTH_AUTO, NULL, NULL, NULL) &&
+        findStegoHeader(output, size, size, &layout, &h, &headerBytes) == 1 && (h.flags & STEGO_FLAG_BLOCKS)) {
+        BitWriter bw;
+        bitWriterInit(&bw, header);
+        bitWriterPut(&bw, STEGO_MAGIC, 32);
+        bitWriterPut(&bw, STEGO_CHECKSUM_VERSION - 1, 8);
+        bitWriterPut(&bw, h.flags, 8);
+        bitWriterPut(&bw, h.method, 8);
+        bitWriterPut(&bw, h.depth, 8);
+        bitWriterPut(&bw, h.originalSize ^ (1ULL << 47), 64);
+        bitWriterPut(&bw, h.compressedBits, 64);
+        bitWriterPut(&bw, BLOCK_SIZE_LOG2_MIN, 8);
+        bitWriterFlush(&bw);
+        embedBits(output + BMP_HEADER_SIZE, output + BMP_HEADER_SIZE, header, bw.pos * 8, 1);
+        unsigned char* decoded = NULL;
+        size_t decodedSize = 0;
+        StegoScratch scratch = {0};
+        errors[0] = '\0';
+        failures += decodeImageBuffer(output, size, NULL, 0, &decoded, &decodedSize, NULL, &scratch, NULL) != 0 ||
+                    !strstr(errors, "end of image");
+        stegoScratchFree(&scratch);
+    } else {
+        failures++;
+    }
+    stegoOptions.blocks = savedBlocks;
+    stegoOptions.streaming = savedStreaming;
+    stegoErrorCapture = NULL;
+    printf("  memory   buffer round trips and captured errors %s\n", failures ? "FAILED" : "ok");
+    free(cover);
+    free(output);
+    free(payload);
+    free(target);
+    return failures;
+}
+
+// Plans a payload over three covers of different sizes for each method, hides the shards and
+// puts them back together decoding the last one first. A shard must be refused where a whole
+// payload is expected.
+static int selfTestShards(unsigned int* seed) {
+    static const int methods[] = { STEGO_METHOD_HUFFMAN, STEGO_METHOD_TANS, STEGO_METHOD_STORED };
+    static const unsigned int widths[3] = { 128, 96, 160 }, heights[3] = { 96, 64, 80 };
+    const size_t payloadSize = 20000;
+    ShardSlot slots[3];
+    unsigned char* outputs[3] = { NULL, NULL, NULL };
+    unsigned char* payload = (unsigned char*)malloc(payloadSize);
+    unsigned char* target = (unsigned char*)malloc(payloadSize);
+    char errors[256];
+    int failures = 0, allocated = payload && target;
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < 3; i++) {
+        slots[i].imagePath = "self-test cover";
+        slots[i].image.data = selfTestBmp(widths[i], heights[i], seed, &slots[i].image.size);
+        outputs[i] = (unsigned char*)malloc(slots[i].image.size);
+        allocated &= slots[i].image.data && outputs[i];
+    }
+    if (!allocated) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        failures = 1;
+        goto shards_cleanup;
+    }
+    for (size_t i = 0; i < payloadSize; i++) payload[i] = (unsigned char)('a' + (selfTestRandom(seed) >> 8) % 12);
+
+    stegoErrorCapture = errors;
+    stegoErrorCaptureSize = sizeof(errors);
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        unsigned char* decoded = NULL;
+        size_t decodedSize = 0;
+        errors[0] = '\0';
+        memset(target, 0, payloadSize);
+        if (!planShards(slots, 3, payload, payloadSize, methods[m], STEGO_DEPTH_AUTO) || slots[0].offset != 0 ||
+            slots[1].offset != slots[0].size || slots[2].offset != slots[1].offset + slots[1].size ||
+            slots[2].offset + slots[2].size != payloadSize) {
+            failures++;
+            continue;
+        }
+        for (int i = 0; i < 3; i++) {
+            StegoShard shard = { 0x5EED0000u + (uint32_t)m, (unsigned int)i, 3, slots[i].offset, payloadSize, crc32c(0, payload, payloadSize) };
+            failures += !encodeCoverBuffer(slots[i].image.data, slots[i].image.size, payload + slots[i].offset, (size_t)slots[i].size,
+                                           outputs[i], NULL, NULL, methods[m], STEGO_DEPTH_AUTO, &shard, NULL, NULL);
+        }
+        for (int i = 2; i >= 0; i--) {
+            StegoShard shard;
+            failures += decodeImageBuffer(outputs[i], slots[i].image.size, target + slots[i].offset, (size_t)slots[i].size,
+                                          &decoded, &decodedSize, &shard, NULL, NULL) != 1 ||
+                        shard.index != (unsigned int)i || shard.count != 3 || shard.offset != slots[i].offset || decodedSize != slots[i].size;
+        }
+        failures += memcmp(target, payload, payloadSize) != 0 || errors[0];
+        failures += decodeImageBuffer(outputs[0], slots[0].image.size, target, payloadSize, &decoded, &decodedSize, NULL, NULL, NULL) != 0 ||
+                    !strstr(errors, "shard 1 of 3");
+    }
+    stegoErrorCapture = NULL;
+    printf("  shards   planned, hidden and reassembled out of order %s\n", failures ? "FAILED" : "ok");
+
+shards_cleanup:
+    for (int i = 0; i < 3; i++) {
+        free(slots[i].image.data);
+        free(outputs[i]);
+    }
+    free(payload);
+    free(target);
+    return failures;
+}
+
+// The keyed order must be a permutation of the pixel bytes, with or without row padding, that
+// keeps the header in the first block, and a keyed payload must only come back with its key.
+static int selfTestScatter(unsigned int* seed) {
+    static const int methods[] = { STEGO_METHOD_HUFFMAN, STEGO_METHOD_STORED };
+    const size_t payloadSize = 6000;
+    const char* savedKey = stegoOptions.key;
+    size_t size = 0;
+    unsigned char* cover = selfTestBmp(256, 260, seed, &size); // Three whole blocks and a tail
+    unsigned char* output = (unsigned char*)malloc(size);
+    unsigned char* visited = (unsigned char*)malloc(size);
+    unsigned char* payload = (unsigned char*)malloc(payloadSize);
+    unsigned char* target = (unsigned char*)malloc(payloadSize);
+    size_t offsets[SPAN_BOUNCE_BYTES];
+    char errors[256];
+    int failures = 0;
+    if (!cover || !output || !visited || !payload || !target) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        free(cover); free(output); free(visited); free(payload); free(target);
+        return 1;
+    }
+    for (size_t i = 0; i < payloadSize; i++) payload[i] = (unsigned char)('a' + (selfTestRandom(seed) >> 8) % 12);
+
+    stegoErrorCapture = errors;
+    stegoErrorCaptureSize = sizeof(errors);
+    for (int padded = 0; padded <= 1; padded++) {
+        CoverLayout layout;
+        PixelView view = { &layout, NULL, cover, 0 };
+        selfTestStore32(cover + 18, padded ? 255 : 256); // 765 pixel bytes in rows of 768
+        if (!parseBmpLayout(cover, size, size, &layout, NULL)) {
+            failures++;
+            continue;
+        }
+        scatterLayout(&layout, "self-test key");
+        memset(visited, 0, size);
+        // Odd-sized spans start mid-chunk and cross chunk, block and tail boundaries.
+        for (unsigned long long k = 0; k < layout.capacity; k += SPAN_BOUNCE_BYTES - 5) {
+            size_t count = layout.capacity - k < SPAN_BOUNCE_BYTES - 5 ? (size_t)(layout.capacity - k) : SPAN_BOUNCE_BYTES - 5;
+            scatterOffsets(&view, k, offsets, count);
+            for (size_t j = 0; j < count; j++) {
+                failures += offsets[j] != spanOffset(&layout, scatterPixel(&layout, k + j)) || offsets[j] >= size || visited[offsets[j]]++;
+            }
+        }
+        for (unsigned long long k = 0; k < STEGO_MAX_HEADER_BYTES * 8; k++) {
+            failures += spanPixelsBelow(&layout, spanOffset(&layout, scatterPixel(&layout, k))) >= scatterPrefixPixels(&layout);
+        }
+
+        for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+            unsigned char* decoded = NULL;
+            size_t decodedSize = 0;
+            errors[0] = '\0';
+            memset(target, 0, payloadSize);
+            stegoOptions.key = "self-test key";
+            failures += !encodeCoverBuffer(cover, size, payload, payloadSize, output, NULL, NULL, methods[m], STEGO_DEPTH_AUTO, NULL, NULL, NULL) ||
+                        decodeImageBuffer(output, size, target, payloadSize, &decoded, &decodedSize, NULL, NULL, NULL) != 1 ||
+                        decodedSize != payloadSize || memcmp(target, payload, payloadSize) != 0 || errors[0];
+            stegoOptions.key = "another key";
+            failures += decodeImageBuffer(output, size, target, payloadSize, &decoded, &decodedSize, NULL, NULL, NULL) != 0 ||
+                        !strstr(errors, "with this key");
+            stegoOptions.key = NULL;
+            memset(target, 0, payloadSize);
+            failures += decodeImageBuffer(output, size, target, payloadSize, &decoded, &decodedSize, NULL, NULL, NULL) == 1 &&
+                        memcmp(target, payload, payloadSize) == 0;
+        }
+    }
+    stegoOptions.key = savedKey;
+    stegoErrorCapture = NULL;
+    printf("  scatter  keyed permutation and round trips %s\n", failures ? "FAILED" : "ok");
+    free(cover);
+    free(output);
+    free(visited);
+    free(payload);
+    free(target);
+    return failures;
+}
+
+// Checks the lane and threaded byte counts against a plain count, then that a capacity dry run
+// predicts the header each method's encode writes, and that an oversize payload does not fit.
+static int selfTestCapacity(unsigned int* seed) {
+    static const int methods[] = { STEGO_METHOD_AUTO, STEGO_METHOD_HUFFMAN, STEGO_METHOD_TANS, STEGO_METHOD_STORED };
+    static const size_t lengths[] = { 0, 1, 7, 8, 9, 4099, HISTOGRAM_PARALLEL_BYTES + 3 };
+    const size_t payloadSize = 3000, oversize = 5000;
+    size_t size = 0;
+    unsigned char* cover = selfTestBmp(64, 48, seed, &size); // 9216 pixel bytes
+    unsigned char* output = (unsigned char*)malloc(size);
+    unsigned char* payload = (unsigned char*)malloc(oversize);
+    unsigned char* data = (unsigned char*)malloc(HISTOGRAM_PARALLEL_BYTES + 4);
+    unsigned long long counts[BYTE_RANGE], expected[BYTE_RANGE];
+    char errors[256];
+    int failures = 0;
+    if (!cover || !output || !payload || !data) {
+        fprintf(stderr, "Self-test allocation failed.\n");
+        free(cover); free(output); free(payload); free(data);
+        return 1;
+    }
+    for (size_t i = 0; i < HISTOGRAM_PARALLEL_BYTES + 4; i++) {
+        unsigned int r = selfTestRandom(seed);
+        data[i] = (unsigned char)(i < HISTOGRAM_PARALLEL_BYTES / 2 ? r : (r >> 8) % 3); // Random, then runs
+    }
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        memset(expected, 0, sizeof(expected));
+        for (size_t i = 0; i < lengths[l]; i++) expected[data[1 + i]]++;
+        for (int threads = 1; threads <= 3; threads += 2) {
+            memset(counts, 0, sizeof(counts));
+            countBytesParallel(data + 1, lengths[l], threads, counts); // Unaligned on purpose
+            failures += memcmp(counts, expected, sizeof(counts)) != 0;
+        }
+    }
+
+    for (size_t i = 0; i < oversize; i++) payload[i] = (unsigned char)('a' + (selfTestRandom(seed) >> 8) % 12);
+    stegoErrorCapture = errors;
+    stegoErrorCaptureSize = sizeof(errors);
+    errors[0] = '\0';
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        PayloadFit fit;
+        CoverLayout layout;
+        StegoHeader h;
+        size_t headerBytes = 0;
+        int fits = measurePayload(cover, size, size, payload, payloadSize, methods[m], STEGO_DEPTH_AUTO, &fit);
+        failures += fits != 1 || fit.requiredPixels > fit.availablePixels ||
+                    !encodeCoverBuffer(cover, size, payload, payloadSize, output, NULL, NULL, methods[m], STEGO_DEPTH_AUTO, NULL, NULL, NULL) ||
+                    findStegoHeader(output, size, size, &layout, &h, &headerBytes) != 1 || headerBytes != fit.headerBytes ||
+                    h.method != fit.header.method || h.depth != fit.header.depth || h.compressedBits != fit.header.compressedBits;
+    }
+    for (size_t i = 0; i < oversize; i++) payload[i] = (unsigned char)selfTestRandom(seed);
+    PayloadFit fit;
+    failures += measurePayload(cover, size, size, payload, oversize, STEGO_METHOD_AUTO, STEGO_DEPTH_AUTO, &fit) != 0 ||
+                fit.requiredPixels <= fit.availablePixels || errors[0];
+    stegoErrorCapture = NULL;
+    printf("  capacity byte histogram and dry runs against encodes %s\n", failures ? "FAILED" : "ok");
+    free(cover);
+    free(output);
+    free(payload);
+    free(data);
+    return failures;
+}
+
+int runSelfTest(void) {
+    unsigned int seed = 0x9E3779B9u;
+    printf("Running self-test (active kernels: %s", selectLsbKernel(1)->name);
+    for (unsigned int depth = 2; depth <= LSB_MAX_DEPTH; depth++) printf(", %s", selectLsbKernel(depth)->name);
+    printf(")\n");
+    int failures = selfTestKernels(&seed) + selfTestSpans(&seed) + selfTestDecoders(&seed) + selfTestBlocks(&seed) +
+                   selfTestSeek(&seed) + selfTestChecksum(&seed) + selfTestMethod(&seed) + selfTestMemory(&seed) +
+                   selfTestShards(&seed) + selfTestScatter(&seed) + selfTestCapacity(&seed);
+    printf("Self-test %s.\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+
+// --- Worker Mode (parseJobLine, runJob, serveJobs, runSocketWorker) ---
+// A long-running alternative to one process per request. Jobs arrive as one JSON object per
+// line and each is answered with one JSON line, e.g.
+//   {"id": 7, "op": "encode", "cover": "in.bmp", "secret": "a.zip", "output": "out.bmp"}
+//   {"id":7,"op":"encode","ok":true,"ms":12.5}
+// Ops: encode (cover, secret, output), decode (stego, output), verify (stego: decode and check
+// the payload checksum without writing it), probe (stego) and capacity (cover, secret: whether
+// the secret would fit, see Payload Planning). Failed jobs answer with
+// "ok":false and an "error" message; details go to stderr as usual. Jobs are read from stdin
+// with answers on stdout, or from clients of a Unix domain socket, each of which is served
+// by its own thread. With --stats, encode and decode answers also carry a
+// "stats" object (see Job Statistics).
+#define JOB_LINE_LEN (8 * MAX_PATH_LEN)
+#define JOB_ID_LEN 64
+
+typedef struct {
+    char id[JOB_ID_LEN]; // Raw JSON number or string, echoed back as is ("" if absent)
+    char op[16];
+    char method[16];     // Optional: auto, huffman, tans or stored
+    char depth[8];       // Optional: 1 to 4 or auto
+    char cover[MAX_PATH_LEN];
+    char secret[MAX_PATH_LEN];
+    char stego[MAX_PATH_LEN];
+    char output[MAX_PATH_LEN];
+} WorkerJob;
+
+static const char* jsonSkipSpace(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+static int jsonHexDigits(const char* p, unsigned int* value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) return 0;
+        *value = (*value << 4) | (unsigned int)digit;
+    }
+    return 1;
+}
+
+// Parses the string starting at the opening quote p into out (UTF-8, NUL-terminated; skipped
+// if out is NULL). Returns the position after the closing quote, or NULL if the string is
+// malformed or does not fit.
+static const char* jsonParseString(const char* p, char* out, size_t outSize) {
+    size_t n = 0;
+    if (*p++ != '"') return NULL;
+    while (*p != '"') {
+        unsigned int c = (unsigned char)*p++;
+        if (c == 0 || c < 0x20) return NULL;
+        if (c == '\\') {
+            char e = *p++;
+            switch (e) {
+                case '"': case '\\': case '/': c = (unsigned char)e; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u': {
+                    if (!jsonHexDigits(p, &c)) return NULL;
+                    p += 4;
+                    unsigned int low;
+                    if (c >= 0xD800 && c < 0xDC00 && p[0] == '\\' && p[1] == 'u' && jsonHexDigits(p + 2, &low) &&
+                        low >= 0xDC00 && low < 0xE000) {
+                        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                    if (c == 0) return NULL;
+                    break;
+                }
+                default: return NULL;
+            }
+            // Re-encode escaped code points as UTF-8; plain bytes are copied below.
+            if (c >= 0x80) {
+                unsigned char bytes[4];
+                int count = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+                for (int i = count - 1; i > 0; i--) {
+                    bytes[i] = (unsigned char)(0x80 | (c & 0x3F));
+                    c >>= 6;
+                }
+                bytes[0] = (unsigned char)((count == 2 ? 0xC0 : count == 3 ? 0xE0 : 0xF0) | c);
+                for (int i = 0; i < count; i++) {
+                    if (out && n + 1 >= outSize) return NULL;
+                    if (out) out[n] = (char)bytes[i];
+                    n++;
+                }
+                continue;
+            }
+        }
+        if (out && n + 1 >= outSize) return NULL;
+        if (out) out[n] = (char)c;
+        n++;
+    }
+    if (out) out[n] = '\0';
+    return p + 1;
+}
+
+// Skips any JSON value. Returns the position after it, or NULL if it is malformed.
+static const char* jsonSkipValue(const char* p) {
+    p = jsonSkipSpace(p);
+    if (*p == '"') return jsonParseString(p, NULL, 0);
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        do {
+            if (*p == '"') {
+                p = jsonParseString(p, NULL, 0);
+                if (!p) return NULL;
+                continue;
+            }
+            if (*p == '{' || *p == '[') depth++;
+            else if (*p == '}' || *p == ']') depth--;
+            else if (*p == '\0') return NULL;
+            p++;
+        } while (depth > 0);
+        return p;
+    }
+    const char* start = p;
+    while (*p && strchr(",}] \t\r\n", *p) == NULL) p++;
+    return p > start ? p : NULL;
+}
+
+// Fills job from one line of JSON. Returns 1 on success, otherwise 0 with *error set.
+int parseJobLine(const char* line, WorkerJob* job, const char** error) {
+    memset(job, 0, sizeof(*job));
+    const char* p = jsonSkipSpace(line);
+    *error = "job is not a JSON object";
+    if (*p++ != '{') return 0;
+    p = jsonSkipSpace(p);
+    while (*p != '}') {
+        char key[16];
+        const char* keyStart = p;
+        p = jsonParseString(keyStart, key, sizeof(key));
+        if (!p) {
+            // Keys longer than any we know are skipped along with their values.
+            key[0] = '\0';
+            p = jsonParseString(keyStart, NULL, 0);
+        }
+        if (!p) { *error = "malformed JSON"; return 0; }
+        p = jsonSkipSpace(p);
+        if (*p++ != ':') { *error = "malformed JSON"; return 0; }
+        p = jsonSkipSpace(p);
+
+        char* field = NULL;
+        size_t fieldSize = 0;
+        if (strcmp(key, "op") == 0) { field = job->op; fieldSize = sizeof(job->op); }
+        else if (strcmp(key, "method") == 0) { field = job->method; fieldSize = sizeof(job->method); }
+        else if (strcmp(key, "depth") == 0) { field = job->depth; fieldSize = sizeof(job->depth); }
+        else if (strcmp(key, "cover") == 0) { field = job->cover; fieldSize = sizeof(job->cover); }
+        else if (strcmp(key, "secret") == 0) { field = job->secret; fieldSize = sizeof(job->secret); }
+        else if (strcmp(key, "stego") == 0) { field = job->stego; fieldSize = sizeof(job->stego); }
+        else if (strcmp(key, "output") == 0) { field = job->output; fieldSize = sizeof(job->output); }
+
+        const char* start = p;
+        if (field) {
+            if (*p != '"') { *error = "job fields must be strings"; return 0; }
+            p = jsonParseString(p, field, fieldSize);
+            if (!p) { *error = "malformed or overlong string"; return 0; }
+        } else {
+            p = jsonSkipValue(p);
+            if (!p) { *error = "malformed JSON"; return 0; }
+            if (strcmp(key, "id") == 0) {
+                int isNumber = strspn(start, "+-0123456789.eE") == (size_t)(p - start);
+                if ((*start != '"' && !isNumber) || (size_t)(p - start) >= sizeof(job->id)) { *error = "id must be a short string or number"; return 0; }
+                memcpy(job->id, start, (size_t)(p - start));
+                job->id[p - start] = '\0';
+            }
+        }
+        p = jsonSkipSpace(p);
+        if (*p == ',') p = jsonSkipSpace(p + 1);
+        else if (*p != '}') { *error = "malformed JSON"; return 0; }
+    }
+    return 1;
+}
+
+typedef struct {
+    const char* error;          // NULL if the job succeeded
+    double ms;
+    unsigned long long bytes;   // Payload size: the file hidden or recovered
+    int probeStatus;            // probe only, see probeStegoImage
+    StegoHeader header;
+    size_t headerBytes;
+    int hasFit;                 // capacity only, see measurePayload
+    int fits;
+    PayloadFit fit;
+    int hasStats;               // encode and decode with --stats, see Job Statistics
+    StegoStats stats;
+} JobResult;
+
+static unsigned long long fileSizeOf(const char* path) {
+    FILE* file = fopen(path, "rb");
+    long long size = file ? getFileSize(file) : -1;
+    if (file) fclose(file);
+    return size > 0 ? (unsigned long long)size : 0;
+}
+
+// Runs one job, reusing scratch (which may be NULL) for its buffers.
+void runJob(const WorkerJob* job, StegoScratch* scratch, JobResult* result) {
+    double start = stegoNowMs();
+    memset(result, 0, sizeof(*result));
+    result->probeStatus = -1;
+    StegoStats* stats = stegoOptions.stats ? &result->stats : NULL;
+    if (strcmp(job->cover, "-") == 0 || strcmp(job->secret, "-") == 0 || strcmp(job->output, "-") == 0 ||
+        strcmp(job->stego, "-") == 0) {
+        result->error = "- (stdin or stdout) is not a path in jobs";
+    } else if (strcmp(job->op, "encode") == 0) {
+        int method = job->method[0] ? parseMethodName(job->method) : methodRequested();
+        int depth = job->depth[0] ? parseDepth(job->depth) : depthRequested();
+        if (!job->cover[0] || !job->secret[0] || !job->output[0]) result->error = "encode needs cover, secret and output";
+        else if (method < STEGO_METHOD_AUTO) result->error = "unknown method";
+        else if (depth < 0) result->error = "depth must be 1 to 4 or auto";
+        else if (!encodeBinaryIntoImage(job->cover, job->secret, job->output, method, depth, scratch, stats)) result->error = "encode failed";
+        else result->bytes = fileSizeOf(job->secret);
+    } else if (strcmp(job->op, "decode") == 0) {
+        if (!job->stego[0] || !job->output[0]) result->error = "decode needs stego and output";
+        else if (!decodeHuffmanFromImage(job->stego, job->output, scratch, stats)) result->error = "decode failed";
+        else result->bytes = fileSizeOf(job->output);
+    } else if (strcmp(job->op, "verify") == 0) {
+        if (!job->stego[0]) result->error = "verify needs stego";
+        else if (!decodeHuffmanFromImage(job->stego, NULL, scratch, stats)) result->error = "verify failed";
+    } else if (strcmp(job->op, "probe") == 0) {
+        if (!job->stego[0]) result->error = "probe needs stego";
+        else if ((result->probeStatus = probeStegoImage(job->stego, &result->header, &result->headerBytes)) < 0) result->error = "probe failed";
+    } else if (strcmp(job->op, "capacity") == 0) {
+        int method = job->method[0] ? parseMethodName(job->method) : methodRequested();
+        int depth = job->depth[0] ? parseDepth(job->depth) : depthRequested();
+        if (!job->cover[0] || !job->secret[0]) result->error = "capacity needs cover and secret";
+        else if (method < STEGO_METHOD_AUTO) result->error = "unknown method";
+        else if (depth < 0) result->error = "depth must be 1 to 4 or auto";
+        else if ((result->fits = measurePayloadFiles(job->cover, job->secret, method, depth, scratch ? &scratch->input : NULL, &result->fit)) < 0) {
+            result->error = "capacity failed";
+        } else {
+            result->hasFit = 1;
+            result->bytes = result->fit.header.originalSize;
+        }
+    } else {
+        result->error = "unknown op";
+    }
+    result->hasStats = stats && stats->mark > 0; // Set once encoding or decoding has started
+    result->ms = stegoNowMs() - start;
+}
+
+// Writes text into buf as a JSON string literal, cut to fit. Returns the length written.
+static size_t formatJsonString(char* buf, size_t size, const char* text) {
+    size_t n = 0;
+    if (size < 3) return 0;
+    buf[n++] = '"';
+    for (; *text && n + 8 < size; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') n += (size_t)snprintf(buf + n, size - n, "\\%c", c);
+        else if (c < 0x20) n += (size_t)snprintf(buf + n, size - n, "\\u%04x", c);
+        else buf[n++] = (char)c;
+    }
+    buf[n++] = '"';
+    buf[n] = '\0';
+    return n;
+}
+
+// Formats the answer to a job (op, and id if not empty) as one JSON object into line. index is
+// the job's manifest line in batch mode, or 0.
+void formatJobResult(char* line, size_t size, const char* op, const char* id, const JobResult* result, long index) {
+    size_t n = 0;
+    n += (size_t)snprintf(line + n, size - n, "{");
+    if (index > 0) n += (size_t)snprintf(line + n, size - n, "\"index\":%ld,", index);
+    if (id[0]) n += (size_t)snprintf(line + n, size - n, "\"id\":%s,", id);
+    if (strcmp(op, "encode") == 0 || strcmp(op, "decode") == 0 || strcmp(op, "verify") == 0 || strcmp(op, "probe") == 0 ||
+        strcmp(op, "capacity") == 0) {
+        n += (size_t)snprintf(line + n, size - n, "\"op\":\"%s\",", op);
+    }
+    n += (size_t)snprintf(line + n, size - n, "\"ok\":%s,\"ms\":%.3f", result->error ? "false" : "true", result->ms);
+    if (n >= size) return;
+    if (result->error) {
+        n += (size_t)snprintf(line + n, size - n, ",\"error\":");
+        if (n < size) n += formatJsonString(line + n, size - n, result->error);
+    }
+    if (result->bytes && n < size) n += (size_t)snprintf(line + n, size - n, ",\"bytes\":%llu", result->bytes);
+    if (!result->error && result->probeStatus >= 0 && n + 1 < size) {
+        line[n++] = ',';
+        formatProbeFields(line + n, size - n, result->probeStatus, &result->header, result->headerBytes);
+        n += strlen(line + n);
+    }
+    if (!result->error && result->hasFit && n + 1 < size) {
+        line[n++] = ',';
+        formatCapacityFields(line + n, size - n, result->fits, &result->fit);
+        n += strlen(line + n);
+    }
+    if (result->hasStats && n < size) {
+        n += (size_t)snprintf(line + n, size - n, ",\"stats\":{");
+        if (n < size) formatStatsFields(line + n, size - n, &result->stats);
+        if (n < size) n += strlen(line + n);
+        if (n < size) n += (size_t)snprintf(line + n, size - n, "}");
+    }
+    if (n < size) snprintf(line + n, size - n, "}");
+}
+
+// Writes the answer to a job as one line. The line goes out in a single write so that threads
+// sharing out do not interleave.
+void writeJobResult(FILE* out, const WorkerJob* job, const JobResult* result, long index) {
+    char line[2048];
+    formatJobResult(line, sizeof(line) - 1, job->op, job->id, result, index);
+    strcat(line, "\n");
+    fputs(line, out);
+    fflush(out);
+}
+
+// Reads one job line into line (JOB_LINE_LEN bytes). Returns 1 for a line, 0 at end of file,
+// and -1 for a line that was too long (the rest of it is skipped).
+int readJobLine(FILE* in, char* line) {
+    if (!fgets(line, JOB_LINE_LEN, in)) return 0;
+    size_t length = strlen(line);
+    if (length == JOB_LINE_LEN - 1 && line[length - 1] != '\n') {
+        int c;
+        while ((c = getc(in)) != EOF && c != '\n') {}
+        return -1;
+    }
+    return 1;
+}
+
+// Parses and runs one line read by readJobLine. Returns 0 for blank and comment (#) lines.
+static int handleJobLine(int status, const char* line, StegoScratch* scratch, WorkerJob* job, JobResult* result) {
+    memset(job, 0, sizeof(*job));
+    memset(result, 0, sizeof(*result));
+    if (status < 0) {
+        result->error = "job line too long";
+        return 1;
+    }
+    const char* p = jsonSkipSpace(line);
+    if (*p == '\0' || *p == '#') return 0;
+    if (parseJobLine(line, job, &result->error)) runJob(job, scratch, result);
+    return 1;
+}
+
+// Answers jobs from in until it reaches end of file.
+void serveJobs(FILE* in, FILE* out) {
+    char* line = (char*)malloc(JOB_LINE_LEN);
+    StegoScratch scratch = {0};
+    int status;
+    if (!line) { perror("Failed to allocate job buffer"); return; }
+    while ((status = readJobLine(in, line)) != 0) {
+        WorkerJob job;
+        JobResult result;
+        if (!handleJobLine(status, line, &scratch, &job, &result)) continue;
+        writeJobResult(out, &job, &result, 0);
+        stegoScratchTrim(&scratch);
+    }
+    stegoScratchFree(&scratch);
+    free(line);
+}
+
+#ifndef _WIN32
+static void* workerConnectionMain(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    int outFd = dup(fd);
+    FILE* in = fdopen(fd, "r");
+    FILE* out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+    if (in && out) serveJobs(in, out);
+    if (in) fclose(in); else close(fd);
+    if (out) fclose(out); else if (outFd >= 0) close(outFd);
+    return NULL;
+}
+
+// Listens on a Unix domain socket at path and serves every client on its own thread.
+// Only returns if the socket cannot be set up or accept fails.
+int runSocketWorker(const char* path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "Socket path is too long: %s\n", path); return 0; }
+    strcpy(addr.sun_path, path);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); // Left over from an earlier worker
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) { perror("socket"); return 0; }
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 16) != 0) {
+        perror("Error listening on worker socket");
+        close(server);
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN); // A client that hangs up must not take the worker down
+    selectLsbKernel(1);       // Resolve the kernels before connection threads use them
+    fprintf(stderr, "Worker listening on %s\n", path);
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerConnectionMain, (void*)(intptr_t)client) != 0) {
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(server);
+    return 0;
+}
+#endif
+
+
+// --- Library API (stegoEncodeBuffer, stegoProbeBuffer, stegoDecodeBuffer, stegoCapacityBuffer) ---
+// Built with -shared -fPIC -DSTEGO_LIBRARY, code.c is a library for programs that hold their
+// images and files in memory, such as the Python module, which loads it with ctypes. These
+// calls read and write only the buffers they are given and print nothing. Each writes its
+// answer into answer (answerSize bytes, 4 KB is plenty) as a worker would, with the error
+// messages under "error" and the job statistics under "stats", and returns 1 on success.
+// Calls on different threads are independent, and none keeps a pointer once it returns.
+#if defined(_WIN32) && defined(STEGO_LIBRARY)
+#define STEGO_API __declspec(dllexport)
+#else
+#define STEGO_API
+#endif
+#define LIBRARY_ERROR_BYTES 1024
+
+// Starts a library call: until libraryCallEnd, errors from this thread are collected in errors.
+static void libraryCallBegin(JobResult* result, char* errors) {
+    memset(result, 0, sizeof(*result));
+    result->probeStatus = -1;
+    result->ms = stegoNowMs();
+    errors[0] = '\0';
+    stegoErrorCapture = errors;
+    stegoErrorCaptureSize = LIBRARY_ERROR_BYTES;
+}
+
+static int libraryCallEnd(int ok, const char* op, JobResult* result, char* errors, char* answer, size_t answerSize) {
+    stegoErrorCapture = NULL;
+    size_t length = strlen(errors);
+    while (length > 0 && (errors[length - 1] == '\n' || errors[length - 1] == ' ')) errors[--length] = '\0';
+    if (!ok) result->error = length ? errors : "failed";
+    result->hasStats = result->stats.mark > 0;
+    result->ms = stegoNowMs() - result->ms;
+    if (answer && answerSize) formatJobResult(answer, answerSize, op, "", result, 0);
+    return ok;
+}
+
+// Hides secret in cover (a BMP file's bytes) and writes the stego image to output, which must
+// hold coverSize bytes. method and depth are as the command line's; NULL picks them as it does.
+STEGO_API int stegoEncodeBuffer(const unsigned char* cover, size_t coverSize, const unsigned char* secret, size_t secretSize,
+                                const char* method, const char* depth, unsigned char* output, char* answer, size_t answerSize) {
+    char errors[LIBRARY_ERROR_BYTES];
+    JobResult result;
+    libraryCallBegin(&result, errors);
+    int methodValue = method ? parseMethodName(method) : methodRequested();
+    int depthValue = depth ? parseDepth(depth) : depthRequested();
+    int ok = 0;
+    if (!cover || !output || (!secret && secretSize > 0)) stegoError("cover, secret and output are needed\n");
+    else if (methodValue < STEGO_METHOD_AUTO) stegoError("unknown method\n");
+    else if (depthValue < 0) stegoError("depth must be 1 to 4 or auto\n");
+    else {
+        statsBegin(&result.stats, 0);
+        ok = encodeCoverBuffer(cover, coverSize, secret, secretSize, output, NULL, NULL, methodValue, depthValue, NULL, NULL, &result.stats);
+        result.stats.bytesRead = coverSize + secretSize;
+        if (ok) result.bytes = secretSize;
+    }
+    return libraryCallEnd(ok, "encode", &result, errors, answer, answerSize);
+}
+
+// Parses the stego header of image (a BMP file's bytes), as the probe command. *decodedSize
+// receives the size of the hidden file, which is what stegoDecodeBuffer needs room for.
+STEGO_API int stegoProbeBuffer(const unsigned char* image, size_t size, unsigned long long* decodedSize,
+                               char* answer, size_t answerSize) {
+    char errors[LIBRARY_ERROR_BYTES];
+    JobResult result;
+    CoverLayout layout;
+    libraryCallBegin(&result, errors);
+    *decodedSize = 0;
+    int ok = 0;
+    if (!image || size < BMP_HEADER_SIZE) {
+        stegoError("Error: Image is smaller than a BMP header.\n");
+    } else {
+        // Callers size their output from *decodedSize, so sizes the image cannot hold are refused
+        // here rather than allocated.
+        result.probeStatus = findStegoHeader(image, size, size, &layout, &result.header, &result.headerBytes);
+        if (result.probeStatus > 0) {
+            if (result.header.compressedBits > layout.capacity * result.header.depth) {
+                stegoError("Error: Stego header claims a payload larger than the image.\n");
+            } else {
+                *decodedSize = result.header.originalSize;
+                ok = 1;
+            }
+        } else if (result.probeStatus == 0) {
+            // Images from before the header existed start with the file size, then 256 32-bit
+            // frequencies and at least one bit per byte.
+            unsigned char legacySize[4];
+            if (layout.capacity < 32) {
+                stegoError("Error reading file size from image.\n");
+            } else {
+                extractBits(image + BMP_HEADER_SIZE, legacySize, 32, 1);
+                unsigned long long legacyBytes = loadBigEndian32(legacySize);
+                unsigned long long dataStart = 32 + BYTE_RANGE * 32;
+                if (legacyBytes > 0 && (layout.capacity < dataStart || legacyBytes > layout.capacity - dataStart)) {
+                    stegoError("Error: No stego header found, and the image is too small for the legacy size it holds.\n");
+                } else {
+                    *decodedSize = legacyBytes;
+                    ok = 1;
+                }
+            }
+        }
+        result.bytes = *decodedSize;
+    }
+    return libraryCallEnd(ok, "probe", &result, errors, answer, answerSize);
+}
+
+// Recovers the file hidden in image (a BMP file's bytes) into output, which must hold
+// outputSize bytes, at least the size stegoProbeBuffer reports. The payload checksum is
+// checked as in any decode.
+STEGO_API int stegoDecodeBuffer(const unsigned char* image, size_t size, unsigned char* output, size_t outputSize,
+                                char* answer, size_t answerSize) {
+    char errors[LIBRARY_ERROR_BYTES];
+    JobResult result;
+    unsigned char none = 0;
+    unsigned char* decoded = NULL;
+    size_t decodedSize = 0;
+    libraryCallBegin(&result, errors);
+    int ok = 0;
+    if (!image) {
+        stegoError("image is needed\n");
+    } else {
+        statsBegin(&result.stats, 1);
+        ok = decodeImageBuffer(image, size, output ? output : &none, output ? outputSize : 0, &decoded, &decodedSize,
+                               NULL, NULL, &result.stats) > 0;
+        result.stats.bytesWritten = decodedSize;
+        if (ok) result.bytes = decodedSize;
+    }
+    return libraryCallEnd(ok, "decode", &result, errors, answer, answerSize);
+}
+
+// Works out whether secret would fit in cover (a BMP file's bytes) without encoding it, as the
+// capacity command. Returns 1 whether or not it fits, which the answer's "fits" tells.
+STEGO_API int stegoCapacityBuffer(const unsigned char* cover, size_t coverSize, const unsigned char* secret, size_t secretSize,
+                                  const char* method, const char* depth, char* answer, size_t answerSize) {
+    char errors[LIBRARY_ERROR_BYTES];
+    JobResult result;
+    libraryCallBegin(&result, errors);
+    int methodValue = method ? parseMethodName(method) : methodRequested();
+    int depthValue = depth ? parseDepth(depth) : depthRequested();
+    int ok = 0;
+    if (!cover || (!secret && secretSize > 0)) stegoError("cover and secret are needed\n");
+    else if (methodValue < STEGO_METHOD_AUTO) stegoError("unknown method\n");
+    else if (depthValue < 0) stegoError("depth must be 1 to 4 or auto\n");
+    else if ((result.fits = measurePayload(cover, coverSize, coverSize, secret, secretSize, methodValue, depthValue, &result.fit)) >= 0) {
+        result.hasFit = 1;
+        result.bytes = secretSize;
+        ok = 1;
+    }
+    return libraryCallEnd(ok, "capacity", &result, errors, answer, answerSize);
+}
+
+
+// --- Batch Mode (runBatch) ---
+// Runs a manifest of jobs in the worker's format, one JSON job per line, on a bounded pool of
+// threads. Each thread takes the next manifest line when it is free and keeps its scratch
+// buffers from one job to the next. One status line (with "index", the job's manifest line)
+// is printed as each job finishes, then a summary with the aggregate throughput.
+typedef struct {
+    FILE* manifest;
+    FILE* out;
+    pthread_mutex_t lock; // Guards manifest reads, output and the totals
+    long lineNumber;
+    long jobs;
+    long failed;
+    unsigned long long bytes;
+    StegoScratch scratch[MAX_THREADS];
+} BatchRun;
+
+static void batchWorkerTask(void* ctx, size_t index, int worker) {
+    BatchRun* run = (BatchRun*)ctx;
+    StegoScratch* scratch = &run->scratch[worker];
+    char* line = (char*)malloc(JOB_LINE_LEN);
+    (void)index;
+    if (!line) { perror("Failed to allocate job buffer"); return; }
+    for (;;) {
+        pthread_mutex_lock(&run->lock);
+        int status = readJobLine(run->manifest, line);
+        long lineNumber = ++run->lineNumber;
+        pthread_mutex_unlock(&run->lock);
+        if (status == 0) break;
+
+        WorkerJob job;
+        JobResult result;
+        if (!handleJobLine(status, line, scratch, &job, &result)) continue;
+        stegoScratchTrim(scratch);
+
+        pthread_mutex_lock(&run->lock);
+        run->jobs++;
+        if (result.error) run->failed++;
+        run->bytes += result.bytes;
+        writeJobResult(run->out, &job, &result, lineNumber);
+        pthread_mutex_unlock(&run->lock);
+    }
+    free(line);
+}
+
+// Runs every job in manifestPath ("-" for stdin) on up to 'jobs' threads. Returns 1 if all succeeded.
+int runBatch(const char* manifestPath, int jobs) {
+    BatchRun* run = (BatchRun*)calloc(1, sizeof(BatchRun));
+    if (!run) { perror("Failed to allocate batch state"); return 0; }
+    run->manifest = strcmp(manifestPath, "-") == 0 ? stdin : fopen(manifestPath, "r");
+    run->out = stdout;
+    if (!run->manifest) {
+        fprintf(stderr, "Error opening manifest: %s\n", manifestPath);
+        free(run);
+        return 0;
+    }
+    pthread_mutex_init(&run->lock, NULL);
+    if (jobs > MAX_THREADS) jobs = MAX_THREADS;
+    selectLsbKernel(1); // Resolve the kernels before the workers use them
+
+    double start = stegoNowMs();
+    parallelFor((size_t)jobs, jobs, batchWorkerTask, run);
+    double seconds = (stegoNowMs() - start) / 1000.0;
+    if (seconds <= 0) seconds = 1e-9;
+
+    printf("{\"summary\":true,\"jobs\":%ld,\"ok\":%ld,\"failed\":%ld,\"threads\":%d,\"seconds\":%.3f,"
+           "\"jobs_per_second\":%.1f,\"payload_bytes\":%llu,\"payload_mb_per_second\":%.2f}\n",
+           run->jobs, run->jobs - run->failed, run->failed, jobs, seconds, run->jobs / seconds,
+           run->bytes, run->bytes / seconds / (1024.0 * 1024.0));
+    fflush(stdout);
+
+    int ok = run->failed == 0;
+    for (int t = 0; t < jobs; t++) stegoScratchFree(&run->scratch[t]);
+    if (run->manifest != stdin) fclose(run->manifest);
+    pthread_mutex_destroy(&run->lock);
+    free(run);
+    return ok;
+}
+
+
+// --- Benchmark (runBenchmark) ---
+// Times the stages of the in-memory Huffman path one at a time, on synthetic payloads of three
+// sizes and three entropy levels, each hidden in a synthetic 24-bit cover just large enough to
+// hold it. Every stage runs at least BENCH_MIN_ROUNDS times and until BENCH_MIN_MS have passed;
+// its fastest run is reported as MB/s and ns per byte of that stage's own input (payload bytes
+// for histogram, codes, compress, decode and checksum, stream bytes for embed and extract, image bytes
+// for io, which writes the stego image to a temporary file and reads it back). Every round
+// checks that the payload decodes intact from the extracted stream and that the image reads
+// back unchanged. Stages run on one thread.
+// Run with: code [--depth <d>] bench [results.json|-]
+#define BENCH_MIN_ROUNDS 3
+#define BENCH_MAX_ROUNDS 1000
+#define BENCH_MIN_MS 250.0
+#define BENCH_COVER_WIDTH 1920 // Pixels per cover row; rows of 5760 bytes need no padding
+
+enum { BENCH_HISTOGRAM, BENCH_CODES, BENCH_COMPRESS, BENCH_EMBED, BENCH_EXTRACT, BENCH_DECODE, BENCH_CHECKSUM, BENCH_IO, BENCH_STAGES };
+static const char* const benchStageNames[BENCH_STAGES] = { "histogram", "codes", "compress", "embed", "extract", "decode", "checksum", "io" };
+
+typedef struct {
+    const char* payload;             // Entropy level: "low", "medium" or "high"
+    size_t size;
+    unsigned long long streamBits;   // Huffman stream
+    size_t imageBytes;
+    int rounds;
+    int ok;
+    double bestMs[BENCH_STAGES];
+    unsigned long long stageBytes[BENCH_STAGES];
+} BenchCase;
+
+// Fills data with bytes of about 2.5 bits ("low"), 4.5 bits ("medium", text-like) or 8 bits
+// ("high") of entropy each.
+static void benchPayload(const char* kind, unsigned char* data, size_t size, unsigned int* seed) {
+    static const char text[] = "eeeeeeeeetttttttaaaaaaoooooiiiiinnnnnssssshhhhrrrrddlllcuumwfgypbvk       ,.\n";
+    for (size_t i = 0; i < size; i++) {
+        unsigned int r = selfTestRandom(seed);
+        if (kind[0] == 'l') data[i] = (unsigned char)((r & 0xF) ? 'a' + (r >> 8) % 4 : r >> 24);
+        else if (kind[0] == 'm') data[i] = (unsigned char)text[(r >> 8) % (sizeof(text) - 1)];
+        else data[i] = (unsigned char)(r >> 24);
+    }
+}
+
+// Writes a bottom-up 24-bit BMP of BENCH_COVER_WIDTH x height noisy pixels into image.
+static void benchCover(unsigned char* image, unsigned int height, size_t imageBytes, unsigned int* seed) {
+    memset(image, 0, BMP_HEADER_SIZE);
+    image[0] = 'B';
+    image[1] = 'M';
+    selfTestStore32(image + 2, (unsigned int)imageBytes);
+    selfTestStore32(image + 10, BMP_HEADER_SIZE);
+    selfTestStore32(image + 14, 40);
+    selfTestStore32(image + 18, BENCH_COVER_WIDTH);
+    selfTestStore32(image + 22, height);
+    selfTestStore32(image + 26, 0x180001u); // One plane, 24 bits
+    for (size_t i = BMP_HEADER_SIZE; i < imageBytes; i++) image[i] = (unsigned char)selfTestRandom(seed);
+}
+
+static inline void benchRecord(BenchCase* c, int stage, double start) {
+    double ms = stegoNowMs() - start;
+    if (c->rounds == 0 || ms < c->bestMs[stage]) c->bestMs[stage] = ms;
+}
+
+// Runs one case. Returns 1 if every round trip succeeded.
+static int benchRunCase(BenchCase* c, unsigned int depth, unsigned int* seed) {
+    unsigned char *payload = NULL, *cover = NULL, *image = NULL, *readBack = NULL, *extracted = NULL, *decoded = NULL;
+    ScratchBuffer stream = { NULL, 0 };
+    FILE* file = NULL;
+    unsigned long long counts[BYTE_RANGE] = {0};
+    int freq[BYTE_RANGE];
+    unsigned char lengths[BYTE_RANGE];
+    CodeTable codeTable[BYTE_RANGE];
+    CoverLayout layout;
+
+    // Size the cover from the stream of the first round; every round produces the same one.
+    payload = (unsigned char*)malloc(c->size);
+    decoded = (unsigned char*)malloc(c->size);
+    if (!payload || !decoded) { perror("Failed to allocate benchmark payload"); goto bench_cleanup; }
+    benchPayload(c->payload, payload, c->size, seed);
+    countBytes(payload, c->size, counts);
+    scaleFrequencies(counts, freq);
+    if (!computeCodeLengths(freq, lengths, MAX_CANONICAL_LENGTH)) goto bench_cleanup;
+    c->streamBits = 0;
+    for (int s = 0; s < BYTE_RANGE; s++) c->streamBits += (unsigned long long)freq[s] * lengths[s];
+    unsigned long long rowBytes = BENCH_COVER_WIDTH * 3ULL;
+    unsigned int height = (unsigned int)((lsbPixels(c->streamBits, depth) + rowBytes - 1) / rowBytes);
+    c->imageBytes = BMP_HEADER_SIZE + (size_t)(height * rowBytes);
+    size_t streamBytes = (size_t)((c->streamBits + 7) / 8);
+    cover = (unsigned char*)malloc(c->imageBytes);
+    image = (unsigned char*)malloc(c->imageBytes);
+    readBack = (unsigned char*)malloc(c->imageBytes);
+    extracted = (unsigned char*)malloc(streamBytes + 1);
+    if (!cover || !image || !readBack || !extracted) { perror("Failed to allocate benchmark cover"); goto bench_cleanup; }
+    benchCover(cover, height, c->imageBytes, seed);
+    memcpy(image, cover, c->imageBytes);
+    if (!parseBmpLayout(cover, c->imageBytes, c->imageBytes, &layout, NULL)) { fprintf(stderr, "Error: Benchmark cover rejected.\n"); goto bench_cleanup; }
+    file = tmpfile();
+    if (!file) { perror("Failed to create benchmark file"); goto bench_cleanup; }
+
+    c->stageBytes[BENCH_HISTOGRAM] = c->stageBytes[BENCH_CODES] = c->stageBytes[BENCH_COMPRESS] = c->size;
+    c->stageBytes[BENCH_DECODE] = c->stageBytes[BENCH_CHECKSUM] = c->size;
+    c->stageBytes[BENCH_EMBED] = c->stageBytes[BENCH_EXTRACT] = streamBytes;
+    c->stageBytes[BENCH_IO] = c->imageBytes;
+    uint32_t checksum = crc32c(0, payload, c->size);
+    c->ok = 1;
+    double started = stegoNowMs();
+    for (c->rounds = 0; c->ok && c->rounds < BENCH_MAX_ROUNDS &&
+                        (c->rounds < BENCH_MIN_ROUNDS || stegoNowMs() - started < BENCH_MIN_MS); c->rounds++) {
+        double t = stegoNowMs();
+        memset(counts, 0, sizeof(counts));
+        countBytes(payload, c->size, counts);
+        benchRecord(c, BENCH_HISTOGRAM, t);
+
+        t = stegoNowMs();
+        long totalBits = 0;
+        scaleFrequencies(counts, freq);
+        if (!computeCodeLengths(freq, lengths, MAX_CANONICAL_LENGTH) || !buildCanonicalCodes(lengths, codeTable)) c->ok = 0;
+        for (int s = 0; s < BYTE_RANGE; s++) totalBits += (long)freq[s] * codeTable[s].length;
+        benchRecord(c, BENCH_CODES, t);
+
+        t = stegoNowMs();
+        unsigned char* bits = packHuffmanCodes(payload, (long)c->size, codeTable, totalBits, &stream);
+        benchRecord(c, BENCH_COMPRESS, t);
+        if (!bits || (unsigned long long)totalBits != c->streamBits) { c->ok = 0; break; }
+
+        t = stegoNowMs();
+        PixelView view = { &layout, image, cover, 0 };
+        spanEmbedBits(&view, 0, bits, (size_t)c->streamBits, depth);
+        benchRecord(c, BENCH_EMBED, t);
+
+        t = stegoNowMs();
+        PixelView readView = { &layout, NULL, image, 0 };
+        spanExtractBits(&readView, 0, extracted, (size_t)c->streamBits, depth);
+        benchRecord(c, BENCH_EXTRACT, t);
+
+        // The decoder only has the code lengths and the extracted stream to go on.
+        t = stegoNowMs();
+        CodeTable decodeCodes[BYTE_RANGE];
+        HuffmanDecodeTable table;
+        int decodedOk = buildCanonicalCodes(lengths, decodeCodes) && buildDecodeTable(decodeCodes, &table);
+        if (decodedOk) {
+            decodedOk = huffmanDecodeTable(&table, extracted, c->streamBits, decoded, c->size);
+            freeDecodeTable(&table);
+        }
+        benchRecord(c, BENCH_DECODE, t);
+        if (!decodedOk || memcmp(decoded, payload, c->size) != 0) c->ok = 0;
+
+        t = stegoNowMs();
+        uint32_t decodedChecksum = crc32c(0, decoded, c->size);
+        benchRecord(c, BENCH_CHECKSUM, t);
+        if (decodedChecksum != checksum) c->ok = 0;
+
+        t = stegoNowMs();
+        rewind(file);
+        int ioOk = fwrite(image, 1, c->imageBytes, file) == c->imageBytes && fflush(file) == 0;
+        rewind(file);
+        ioOk = ioOk && fread(readBack, 1, c->imageBytes, file) == c->imageBytes;
+        benchRecord(c, BENCH_IO, t);
+        if (!ioOk || memcmp(readBack, image, c->imageBytes) != 0) c->ok = 0;
+    }
+    if (!c->ok) fprintf(stderr, "Error: Benchmark round trip failed (%s payload, %lu bytes).\n", c->payload, (unsigned long)c->size);
+
+bench_cleanup:
+    if (file) fclose(file);
+    free(stream.data);
+    free(payload);
+    free(decoded);
+    free(cover);
+    free(image);
+    free(readBack);
+    free(extracted);
+    return c->ok;
+}
+
+static double benchMbPerSecond(const BenchCase* c, int stage) {
+    double seconds = c->bestMs[stage] / 1000.0;
+    return seconds > 0 ? c->stageBytes[stage] / seconds / (1024.0 * 1024.0) : 0;
+}
+
+static double benchNsPerByte(const BenchCase* c, int stage) {
+    return c->stageBytes[stage] ? c->bestMs[stage] * 1e6 / c->stageBytes[stage] : 0;
+}
+
+static void writeBenchJson(FILE* out, const BenchCase* cases, size_t count, unsigned int depth) {
+    fprintf(out, "{\"format_version\":%d,\"kernel\":\"%s\",\"checksum\":\"%s\",\"depth\":%u,\"cases\":[",
+            STEGO_FORMAT_VERSION, selectLsbKernel(depth)->name, crc32cPathName(), depth);
+    for (size_t i = 0; i < count; i++) {
+        const BenchCase* c = &cases[i];
+        fprintf(out, "%s\n{\"payload\":\"%s\",\"bytes\":%lu,\"stream_bits\":%llu,\"image_bytes\":%lu,\"rounds\":%d,\"ok\":%s,\"stages\":{",
+                i ? "," : "", c->payload, (unsigned long)c->size, c->streamBits, (unsigned long)c->imageBytes, c->rounds,
+                c->ok ? "true" : "false");
+        for (int s = 0; s < BENCH_STAGES; s++) {
+            fprintf(out, "%s\"%s\":{\"bytes\":%llu,\"ms\":%.4f,\"mb_per_second\":%.2f,\"ns_per_byte\":%.3f}", s ? "," : "",
+                    benchStageNames[s], c->stageBytes[s], c->bestMs[s], benchMbPerSecond(c, s), benchNsPerByte(c, s));
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n]}\n");
+}
+
+// Runs every case and prints a table; with jsonPath, also writes the results there as JSON
+// ("-" for stdout, which moves the table to stderr). Returns 1 if every round trip succeeded.
+int runBenchmark(const char* jsonPath) {
+    static const char* const kinds[] = { "low", "medium", "high" };
+    static const size_t sizes[] = { 64u << 10, 1u << 20, 8u << 20 };
+    BenchCase cases[sizeof(kinds) / sizeof(kinds[0]) * sizeof(sizes) / sizeof(sizes[0])];
+    size_t count = 0;
+    unsigned int seed = 0x9E3779B9u;
+    int depth = depthRequested();
+    if (depth == STEGO_DEPTH_AUTO) depth = 1;
+    FILE* table = jsonPath && strcmp(jsonPath, "-") == 0 ? stderr : stdout;
+    int ok = 1;
+
+    fprintf(table, "Benchmark: kernel %s, checksum %s, depth %d, best of at least %d rounds\n",
+            selectLsbKernel((unsigned int)depth)->name, crc32cPathName(), depth, BENCH_MIN_ROUNDS);
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+            BenchCase* c = &cases[count++];
+            memset(c, 0, sizeof(*c));
+            c->payload = kinds[k];
+            c->size = sizes[z];
+            ok &= benchRunCase(c, (unsigned int)depth, &seed);
+            fprintf(table, "  %-6s %5lu KB  %.2f bits/byte  %3d rounds  %s\n", c->payload, (unsigned long)(c->size >> 10),
+                    (double)c->streamBits / c->size, c->rounds, c->ok ? "ok" : "FAILED");
+            for (int s = 0; s < BENCH_STAGES; s++) {
+                fprintf(table, "    %-10s %10.4f ms %9.1f MB/s %8.3f ns/byte\n", benchStageNames[s], c->bestMs[s],
+                        benchMbPerSecond(c, s), benchNsPerByte(c, s));
+            }
+            fflush(table);
+        }
+    }
+
+    if (jsonPath) {
+        FILE* out = strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w");
+        if (!out) {
+            fprintf(stderr, "Error opening benchmark output: %s\n", jsonPath);
+            return 0;
+        }
+        writeBenchJson(out, cases, count, (unsigned int)depth);
+        if (out != stdout && fclose(out) != 0) {
+            fprintf(stderr, "Error writing benchmark output: %s\n", jsonPath);
+            return 0;
+        }
+    }
+    return ok;
+}
+
+
+// --- Command Line (runCommandLine) ---
+// Without arguments the program runs the interactive menu below. Otherwise:
+//   code [options] encode <cover.bmp> <secret> <output.bmp>
+//   code [options] --in-place encode <stego.bmp> <secret>   replaces the payload, see Cover Clones
+//   code [options] decode <stego.bmp> <output>
+//   code [options] extract <stego.bmp> <output> <offset> [length]   see Range Extraction
+//   code [options] verify <stego.bmp>             decodes and checks the payload checksum
+//   code [options] probe <stego.bmp>...           prints each stego header as JSON
+//   code [options] capacity <cover.bmp> <secret>  whether the secret fits, see Payload Planning
+//   code [options] shard <secret> <cover.bmp> <output.bmp> [<cover.bmp> <output.bmp>]...   see Shards
+//   code [options] unshard <output> <shard.bmp>...   the shards in any order
+//   code [options] worker [--socket <path>]       see Worker Mode
+//   code [options] batch <manifest> [--jobs <n>]  see Batch Mode
+//   code [options] bench [results.json]           see Benchmark
+//   code --self-test
+// With --stats, encode and decode print one JSON record of their statistics on stderr, and
+// worker and batch answers carry it as "stats" (see Job Statistics). Image and file arguments
+// of encode, decode, extract and verify may be "-" for stdin or stdout (see Pipes); progress
+// messages then go to stderr.
+// Exit status: 0 on success, 1 if the operation failed (or capacity found that the secret does
+// not fit), 2 for usage errors.
+static void printUsage(FILE* out) {
+    fprintf(out, "Usage:\n");
+    fprintf(out, "  code                                        interactive menu\n");
+    fprintf(out, "  code [options] encode <cover.bmp> <secret> <output.bmp>\n");
+    fprintf(out, "  code [options] --in-place encode <image.bmp> <secret>\n");
+    fprintf(out, "  code [options] decode <stego.bmp> <output>\n");
+    fprintf(out, "  code [options] extract <stego.bmp> <output> <offset> [length]\n");
+    fprintf(out, "  code [options] verify <stego.bmp>\n");
+    fprintf(out, "  code [options] probe <stego.bmp>...\n");
+    fprintf(out, "  code [options] capacity <cover.bmp> <secret>\n");
+    fprintf(out, "  code [options] shard <secret> <cover.bmp> <output.bmp> [<cover.bmp> <output.bmp>]...\n");
+    fprintf(out, "  code [options] unshard <output> <shard.bmp>...\n");
+    fprintf(out, "  code [options] worker [--socket <path>]\n");
+    fprintf(out, "  code [options] batch <manifest|-> [--jobs <n>]\n");
+    fprintf(out, "  code [options] bench [results.json|-]\n");
+    fprintf(out, "  code --self-test\n");
+    fprintf(out, "Files may be - for stdin or stdout; with cover and secret both on stdin, send\n");
+    fprintf(out, "the secret first, after a line with its length in bytes.\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --quiet               no progress messages\n");
+    fprintf(out, "  --verbose             worker, batch: progress messages on stderr\n");
+    fprintf(out, "  --stats               report per-phase timings and counters as JSON (see README)\n");
+    fprintf(out, "  --stream, --no-stream force streaming mode on or off\n");
+    fprintf(out, "  --blocks, --no-blocks force block mode on or off\n");
+    fprintf(out, "  --method <m>          payload method: auto (default), huffman, tans or stored\n");
+    fprintf(out, "  --depth <d>           bits hidden per pixel byte: 1 (default) to 4, or auto\n");
+    fprintf(out, "  --seek <KB>           seek index interval: 4 to 16384 (default 64), or 0 for none\n");
+    fprintf(out, "  --threads <n>         worker threads for block mode\n");
+    fprintf(out, "  --key <text>          scatter the payload over the image in a keyed order (files only)\n");
+    fprintf(out, "  --in-place            encode: hide the secret in the image file itself\n");
+    fprintf(out, "  --no-clone            encode: write the whole output instead of cloning the cover\n");
+    fprintf(out, "  --jobs <n>            batch: jobs run at once (default: one per CPU)\n");
+}
+
+// Parses a byte offset or count. Returns 0 if text is not a plain decimal number.
+static int parseByteCount(const char* text, unsigned long long* value) {
+    char* end;
+    if (text[0] < '0' || text[0] > '9') return 0;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+// Prints s as a JSON string literal.
+static void printJsonString(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+int runCommandLine(int argc, char* argv[]) {
+    const char* args[5];
+    const char* socketPath = NULL;
+    char** listArgs = NULL;
+    int argCount = 0, listCount = 0, verbose = 0, jobs = 0, inPlace = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if (strcmp(a, "--self-test") == 0) return runSelfTest();
+        else if (strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0) { printUsage(stdout); return 0; }
+        else if (strcmp(a, "--quiet") == 0 || strcmp(a, "-q") == 0) stegoOptions.quiet = 1;
+        else if (strcmp(a, "--verbose") == 0) verbose = 1;
+        else if (strcmp(a, "--stats") == 0) stegoOptions.stats = 1;
+        else if (strcmp(a, "--stream") == 0) stegoOptions.streaming = 1;
+        else if (strcmp(a, "--no-stream") == 0) stegoOptions.streaming = 0;
+        else if (strcmp(a, "--blocks") == 0) stegoOptions.blocks = 1;
+        else if (strcmp(a, "--no-blocks") == 0) stegoOptions.blocks = 0;
+        else if (strcmp(a, "--in-place") == 0) inPlace = 1;
+        else if (strcmp(a, "--no-clone") == 0) stegoOptions.clone = 0;
+        else if (strcmp(a, "--method") == 0 && i + 1 < argc) {
+            stegoOptions.method = parseMethodName(argv[++i]);
+            if (stegoOptions.method < -1) { fprintf(stderr, "--method needs auto, huffman, tans or stored.\n"); return 2; }
+        }
+        else if (strcmp(a, "--depth") == 0 && i + 1 < argc) {
+            stegoOptions.depth = parseDepth(argv[++i]);
+            if (stegoOptions.depth < 0) { fprintf(stderr, "--depth needs 1 to 4 or auto.\n"); return 2; }
+        }
+        else if (strcmp(a, "--seek") == 0 && i + 1 < argc) {
+            stegoOptions.seek = parseSeekInterval(argv[++i]);
+            if (stegoOptions.seek < 0) { fprintf(stderr, "--seek needs 0 or a power of two from 4 to 16384 (KB).\n"); return 2; }
+        }
+        else if (strcmp(a, "--threads") == 0 && i + 1 < argc) {
+            stegoOptions.threads = atoi(argv[++i]);
+            if (stegoOptions.threads < 1) { fprintf(stderr, "--threads needs a positive number.\n"); return 2; }
+        }
+        else if (strcmp(a, "--key") == 0 && i + 1 < argc) {
+            stegoOptions.key = argv[++i];
+            if (!*stegoOptions.key) { fprintf(stderr, "--key needs a non-empty text.\n"); return 2; }
+        }
+        else if (strcmp(a, "--socket") == 0 && i + 1 < argc) socketPath = argv[++i];
+        else if (strcmp(a, "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) { fprintf(stderr, "--jobs needs a positive number.\n"); return 2; }
+        }
+        else if (a[0] == '-' && a[1] == '-') { fprintf(stderr, "Unknown option: %s\n", a); printUsage(stderr); return 2; }
+        else if (argCount == 1 && (strcmp(args[0], "probe") == 0 || strcmp(args[0], "shard") == 0 || strcmp(args[0], "unshard") == 0)) {
+            // Every argument from here on is a path for the command.
+            listArgs = argv + i;
+            listCount = argc - i;
+            break;
+        }
+        else if (argCount < 5) args[argCount++] = a;
+        else { fprintf(stderr, "Too many arguments.\n"); printUsage(stderr); return 2; }
+    }
+    if (argCount == 0) { printUsage(stderr); return 2; }
+
+    const char* command = args[0];
+    for (int i = 1; i < argCount; i++) {
+        if (strcmp(args[i], "-") == 0) stegoOptions.progress = stderr; // stdout may carry an image or file
+    }
+    if (strcmp(command, "unshard") == 0 && listCount > 0 && strcmp(listArgs[0], "-") == 0) stegoOptions.progress = stderr;
+    if (inPlace && strcmp(command, "encode") == 0 && argCount == 3) args[argCount++] = args[1];
+    int encoding = strcmp(command, "encode") == 0 && argCount == 4;
+    int verifying = strcmp(command, "verify") == 0 && argCount == 2;
+    if (encoding || verifying || (strcmp(command, "decode") == 0 && argCount == 3)) {
+        StegoStats stats;
+        StegoStats* recorded = stegoOptions.stats ? &stats : NULL;
+        double start = stegoNowMs();
+        int ok = encoding ? encodeBinaryIntoImage(args[1], args[2], args[3], methodRequested(), depthRequested(), NULL, recorded)
+                          : decodeHuffmanFromImage(args[1], verifying ? NULL : args[2], NULL, recorded);
+        if (recorded) {
+            // One line on stderr in the worker's answer format
+            WorkerJob job;
+            JobResult result;
+            memset(&job, 0, sizeof(job));
+            memset(&result, 0, sizeof(result));
+            snprintf(job.op, sizeof(job.op), "%s", command);
+            result.error = ok ? NULL : encoding ? "encode failed" : verifying ? "verify failed" : "decode failed";
+            result.ms = stegoNowMs() - start;
+            result.probeStatus = -1;
+            result.hasStats = 1;
+            result.stats = stats;
+            writeJobResult(stderr, &job, &result, 0);
+        }
+        return ok ? 0 : 1;
+    }
+    if (strcmp(command, "extract") == 0 && (argCount == 4 || argCount == 5)) {
+        unsigned long long offset = 0, length = ~0ULL;
+        if (!parseByteCount(args[3], &offset) || (argCount == 5 && !parseByteCount(args[4], &length))) {
+            fprintf(stderr, "extract needs a byte offset and an optional length.\n");
+            return 2;
+        }
+        return extractRangeFromImage(args[1], args[2], offset, length) ? 0 : 1;
+    }
+    if (strcmp(command, "probe") == 0 && listCount > 0) {
+        int failed = 0;
+        for (int i = 0; i < listCount; i++) {
+            StegoHeader h;
+            size_t headerBytes = 0;
+            char fields[512];
+            int status = probeStegoImage(listArgs[i], &h, &headerBytes);
+            if (status >= 0) formatProbeFields(fields, sizeof(fields), status, &h, headerBytes);
+            else snprintf(fields, sizeof(fields), "\"error\":\"probe failed\"");
+            failed |= status < 0;
+            if (listCount == 1) {
+                if (status < 0) return 1;
+                printf("{%s}\n", fields);
+                break;
+            }
+            printf("{\"path\":");
+            printJsonString(stdout, listArgs[i]);
+            printf(",%s}\n", fields);
+        }
+        return failed ? 1 : 0;
+    }
+    if (strcmp(command, "capacity") == 0 && argCount == 3) {
+        // The answer owns stdout, as in probe.
+        PayloadFit fit;
+        char fields[512];
+        stegoOptions.progress = stderr;
+        int status = measurePayloadFiles(args[1], args[2], methodRequested(), depthRequested(), NULL, &fit);
+        if (status < 0) return 1;
+        formatCapacityFields(fields, sizeof(fields), status, &fit);
+        printf("{%s}\n", fields);
+        return status ? 0 : 1;
+    }
+    int sharding = strcmp(command, "shard") == 0 && listCount >= 3 && listCount % 2 == 1;
+    if (sharding || (strcmp(command, "unshard") == 0 && listCount >= 2)) {
+        // As in batch mode, the CPUs are shared out between the shards handled at once.
+        int shards = sharding ? listCount / 2 : listCount - 1;
+        int cpus = stegoThreadCount();
+        int threads = cpus < shards ? cpus : shards;
+        if (stegoOptions.threads == 0) stegoOptions.threads = cpus / threads > 1 ? cpus / threads : 1;
+        if (!sharding) return decodeShards((const char**)listArgs + 1, shards, listArgs[0], threads) ? 0 : 1;
+        const char** coverPaths = (const char**)malloc((size_t)shards * 2 * sizeof(const char*));
+        if (!coverPaths) { perror("Failed to allocate shards"); return 1; }
+        const char** outputPaths = coverPaths + shards;
+        for (int i = 0; i < shards; i++) {
+            coverPaths[i] = listArgs[1 + 2 * i];
+            outputPaths[i] = listArgs[2 + 2 * i];
+        }
+        int ok = encodeShards(listArgs[0], coverPaths, outputPaths, shards, methodRequested(), depthRequested(), threads);
+        free(coverPaths);
+        return ok ? 0 : 1;
+    }
+    if (strcmp(command, "worker") == 0 && argCount == 1) {
+        // Answers own stdout, so progress is either off or sent to stderr.
+        stegoOptions.quiet = !verbose;
+        stegoOptions.progress = stderr;
+        if (socketPath) {
+#ifndef _WIN32
+            return runSocketWorker(socketPath) ? 0 : 1;
+#else
+            fprintf(stderr, "Socket workers are not supported on Windows; use stdin/stdout.\n");
+            return 2;
+#endif
+        }
+        serveJobs(stdin, stdout);
+        return 0;
+    }
+    if (strcmp(command, "batch") == 0 && argCount == 2) {
+        // Status lines own stdout, as in worker mode. Unless --threads says otherwise, the
+        // CPUs are shared out between concurrent jobs for their block-mode threads.
+        int cpus = stegoThreadCount();
+        if (jobs == 0) jobs = cpus;
+        if (stegoOptions.threads == 0) stegoOptions.threads = cpus / jobs > 1 ? cpus / jobs : 1;
+        stegoOptions.quiet = !verbose;
+        stegoOptions.progress = stderr;
+        return runBatch(args[1], jobs) ? 0 : 1;
+    }
+    if (strcmp(command, "bench") == 0 && argCount <= 2) {
+        stegoOptions.quiet = 1;
+        return runBenchmark(argCount == 2 ? args[1] : NULL) ? 0 : 1;
+    }
+    fprintf(stderr, "Invalid command or wrong number of arguments: %s\n", command);
+    printUsage(stderr);
+    return 2;
+}
+
+
+// -----------------------------------------------------------------------------
+// NEW Main Function (Interactive CLI)
+// -----------------------------------------------------------------------------
+
+// Helper function to read a line and remove trailing newline
+void readLine(char* buffer, int size) {
+    if (fgets(buffer, size, stdin)) {
+        buffer[strcspn(buffer, "\n")] = 0; // Remove trailing newline
+    } else {
+        buffer[0] = '\0'; // Handle EOF or read error
+    }
+}
+
+// Helper function to check if filename ends with .bmp (case-insensitive)
+int endsWithBMP(const char* filename) {
+    const char* dot = strrchr(filename, '.'); // Find last dot
+    if (dot && (strcasecmp(dot, ".bmp") == 0)) { // Compare ignoring case
+         return 1;
+    }
+    return 0;
+}
+
+
+#ifndef STEGO_LIBRARY // The library build (see Library API) has no program entry point
+int main(int argc, char* argv[]) {
+    char choice[20];
+    char inputImagePath[MAX_PATH_LEN];
+    char secretFilePath[MAX_PATH_LEN];
+    char outputImagePath[MAX_PATH_LEN];
+    char stegoImagePath[MAX_PATH_LEN];
+    char outputFilePath[MAX_PATH_LEN];
+    int ok = 0;
+
+    if (argc > 1) {
+        return runCommandLine(argc, argv);
+    }
+
+    printf("-------------------------------------------\n");
+    printf(" Simple Huffman Steganography Tool (BMP) \n");
+    printf("-------------------------------------------\n");
+
+    printf("Choose operation:\n");
+    printf("  1. Encode (hide file in BMP)\n");
+    printf("  2. Decode (extract file from BMP)\n");
+    printf("Enter choice (1 or 2): ");
+    readLine(choice, sizeof(choice));
+
+    if (strcmp(choice, "1") == 0) {
+        printf("\n--- Encode Mode ---\n");
+
+        // Get Input BMP Image Path
+        printf("Enter path to the input BMP image file: ");
+        readLine(inputImagePath, sizeof(inputImagePath));
+        if (!endsWithBMP(inputImagePath)) {
+            printf("Warning: Input image file does not end with .bmp. Proceeding anyway.\n");
+            // You could add stricter checking or loop here if needed
+        }
+
+        // Get Secret File Path (can be any file type)
+        printf("Enter path to the secret file to hide (text, image, etc.): ");
+        readLine(secretFilePath, sizeof(secretFilePath));
+
+        // Get Output BMP Image Path
+        printf("Enter path for the output BMP image file (e.g., output.bmp): ");
+        readLine(outputImagePath, sizeof(outputImagePath));
+         if (!endsWithBMP(outputImagePath)) {
+            printf("Warning: Output image file does not end with .bmp. Output will be created with this name.\n");
+        }
+
+
+        printf("\nStarting encoding...\n");
+        ok = encodeBinaryIntoImage(inputImagePath, secretFilePath, outputImagePath, methodRequested(), depthRequested(), NULL, NULL);
+        // Result message is printed inside encodeBinaryIntoImage
+
+    } else if (strcmp(choice, "2") == 0) {
+        printf("\n--- Decode Mode ---\n");
+
+        // Get Stego BMP Image Path
+        printf("Enter path to the stego BMP image file (containing hidden data): ");
+        readLine(stegoImagePath, sizeof(stegoImagePath));
+         if (!endsWithBMP(stegoImagePath)) {
+            printf("Warning: Stego image file does not end with .bmp. Proceeding anyway.\n");
+        }
 
         // Get Output File Path for Extracted Data
         printf("Enter path for the extracted output file (e.g., extracted_secret.txt): ");
         readLine(outputFilePath, sizeof(outputFilePath));
 
         printf("\nStarting decoding...\n");
-        decodeHuffmanFromImage(stegoImagePath, outputFilePath);
+        ok = decodeHuffmanFromImage(stegoImagePath, outputFilePath, NULL, NULL);
          // Result message is printed inside decodeHuffmanFromImage
 
     } else {
@@ -599,5 +7379,6 @@ int main() {
     }
 
     printf("\nOperation finished.\n");
-    return 0;
-}
\ No newline at end of file
+    return ok ? 0 : 1;
+}
+#endif
\ No newline at end of file
@@ -1,105 +1,279 @@
 import os
+import json
+import ctypes
 import subprocess
+import threading
 from PIL import Image
 import numpy as np
 
+class StegoWorker:
+    """
+    Long-running `code worker` process. Jobs are sent as JSON lines on its stdin and each
+    answer is read back as one JSON line, so no process is started per request.
+    """
+    def __init__(self, executable):
+        self.executable = executable
+        self.process = None
+        self.lock = threading.Lock()
+
+    def _start(self):
+        self.process = subprocess.Popen(
+            [self.executable, "--stats", "worker"],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            text=True,
+            encoding="utf-8",
+            bufsize=1
+        )
+
+    def run(self, job):
+        """
+        Run one job (a dict with "op" and its paths) and return the worker's answer
+        """
+        with self.lock:
+            # A worker that died since the last job is restarted once
+            for _ in range(2):
+                if self.process is None or self.process.poll() is not None:
+                    self._start()
+                try:
+                    self.process.stdin.write(json.dumps(job) + "\n")
+                    self.process.stdin.flush()
+                    line = self.process.stdout.readline()
+                    if line:
+                        return json.loads(line)
+                except (OSError, ValueError):
+                    pass
+                self.close()
+            return {"ok": False, "error": "worker process is not responding"}
+
+    def close(self):
+        if self.process is not None:
+            try:
+                self.process.stdin.close()
+                self.process.wait(timeout=5)
+            except Exception:
+                self.process.kill()
+            self.process = None
+
+class StegoLibrary:
+    """
+    The C code loaded in process: the shared library build of code.c (see "Library API"
+    there). Buffers are handed over by address, so bytes, bytearray and memoryview arguments
+    are not copied, and ctypes releases the GIL for each call, so calls from several
+    threads run in parallel. Answers are in the worker's format
+    """
+    ANSWER_BYTES = 4096
+
+    def __init__(self, path):
+        self.lib = ctypes.CDLL(path)
+        size_t, pointer, text = ctypes.c_size_t, ctypes.c_void_p, ctypes.c_char_p
+        self.lib.stegoEncodeBuffer.argtypes = [pointer, size_t, pointer, size_t, text, text, pointer, text, size_t]
+        self.lib.stegoProbeBuffer.argtypes = [pointer, size_t, ctypes.POINTER(ctypes.c_ulonglong), text, size_t]
+        self.lib.stegoDecodeBuffer.argtypes = [pointer, size_t, pointer, size_t, text, size_t]
+        self.lib.stegoCapacityBuffer.argtypes = [pointer, size_t, pointer, size_t, text, text, text, size_t]
+        for function in (self.lib.stegoEncodeBuffer, self.lib.stegoProbeBuffer, self.lib.stegoDecodeBuffer,
+                         self.lib.stegoCapacityBuffer):
+            function.restype = ctypes.c_int
+
+    @staticmethod
+    def _view(data):
+        """
+        A uint8 array over data's own memory and its address; read-only buffers work too
+        """
+        array = np.frombuffer(data, dtype=np.uint8)
+        return array, array.ctypes.data
+
+    def _call(self, function, *args):
+        answer = ctypes.create_string_buffer(self.ANSWER_BYTES)
+        ok = function(*args, answer, self.ANSWER_BYTES)
+        result = json.loads(answer.value.decode("utf-8", "replace"))
+        result["ok"] = bool(ok)
+        return result
+
+    def encode(self, cover_image, secret, method=None, depth=None):
+        """
+        Hide secret in cover_image (BMP bytes). Returns the stego image (a bytearray, None
+        on failure) and the answer
+        """
+        cover_array, cover = self._view(cover_image)
+        secret_array, secret_address = self._view(secret)
+        output = bytearray(len(cover_array))
+        output_array, output_address = self._view(output)
+        result = self._call(self.lib.stegoEncodeBuffer, cover, len(cover_array), secret_address, len(secret_array),
+                            method.encode("ascii") if method else None, str(depth).encode("ascii") if depth else None,
+                            output_address)
+        return (output if result["ok"] else None), result
+
+    def probe(self, stego_image):
+        """
+        Read the stego header of stego_image (BMP bytes); "bytes" in the answer is the size
+        of the hidden file
+        """
+        image_array, image = self._view(stego_image)
+        size = ctypes.c_ulonglong(0)
+        return self._call(self.lib.stegoProbeBuffer, image, len(image_array), ctypes.byref(size))
+
+    def decode(self, stego_image):
+        """
+        Recover the hidden file from stego_image (BMP bytes). Returns it (a bytearray, None
+        on failure) and the answer
+        """
+        image_array, image = self._view(stego_image)
+        size = ctypes.c_ulonglong(0)
+        result = self._call(self.lib.stegoProbeBuffer, image, len(image_array), ctypes.byref(size))
+        if not result["ok"]:
+            return None, result
+        # At most 4 bits are hidden per pixel byte, so a larger size is not a real payload
+        if size.value > len(image_array) * 4 // 8:
+            return None, dict(result, ok=False, error="Probed payload size is larger than the image can hold")
+        output = bytearray(size.value)
+        output_array, output_address = self._view(output)
+        result = self._call(self.lib.stegoDecodeBuffer, image, len(image_array), output_address, len(output))
+        return (output if result["ok"] else None), result
+
+    def capacity(self, cover_image, secret, method=None, depth=None):
+        """
+        Work out whether secret would fit in cover_image (BMP bytes) without encoding it;
+        "fits" in the answer tells
+        """
+        cover_array, cover = self._view(cover_image)
+        secret_array, secret_address = self._view(secret)
+        return self._call(self.lib.stegoCapacityBuffer, cover, len(cover_array), secret_address, len(secret_array),
+                          method.encode("ascii") if method else None, str(depth).encode("ascii") if depth else None)
+
 class Steganography:
     def __init__(self):
-        # Get the absolute path to code.exe
+        # Get the absolute path to the C executable
         current_dir = os.path.dirname(os.path.abspath(__file__))
-        self.c_executable = os.path.join(current_dir, "code.exe")
+        self.c_executable = os.path.join(current_dir, "code.exe" if os.name == "nt" else "code")
         print(f"Using C executable at: {self.c_executable}")
-        
-    def encode(self, cover_image_path, secret_file_path, output_path):
+        self.worker = StegoWorker(self.c_executable)
+        # In-memory encodes and decodes run in process when the library build is present
+        # (see README), and through pipes to the executable otherwise
+        self.library = None
+        library_path = os.path.join(current_dir, "stego.dll" if os.name == "nt" else "libstego.so")
+        if os.path.exists(library_path):
+            try:
+                self.library = StegoLibrary(library_path)
+                print(f"Using C library at: {library_path}")
+            except (OSError, AttributeError) as e:
+                print(f"Could not load {library_path}: {e}")
+
+    def run_library(self, call, *args):
         """
-        Encode any file into the cover image
+        Run one in-process library call. Returns the output bytes (None on failure) and the answer
         """
         try:
-            # Prepare input for the C program
-            # The program expects:
-            # 1. Choice (1 for encode)
-            # 2. Input BMP path
-            # 3. Secret file path
-            # 4. Output path
-            input_data = "1\n"  # Choose encode mode
-            input_data += f"{cover_image_path}\n"  # Input BMP path
-            input_data += f"{secret_file_path}\n"  # Secret file path
-            input_data += f"{output_path}\n"  # Output path
-            
-            # Run the C program and capture output
-            process = subprocess.Popen(
-                [self.c_executable],
-                stdin=subprocess.PIPE,
-                stdout=subprocess.PIPE,
-                stderr=subprocess.PIPE,
-                text=True
-            )
-            
-            # Send input and get output
-            stdout, stderr = process.communicate(input=input_data)
-            
-            # Print the output for debugging
-            print("Command output:", stdout)
-            if stderr:
-                print("Command errors:", stderr)
-                
-            if process.returncode == 0:
-                return True
-            else:
-                print(f"Process returned with code: {process.returncode}")
-                return False
-                
+            output, result = call(*args)
+        except (OSError, ValueError) as e:
+            output, result = None, {"ok": False, "error": str(e)}
+        print("Library result:", result)
+        return output, result
+
+    def run_job(self, job):
+        """
+        Run an encode/decode/probe job on the persistent worker and return its answer
+        """
+        try:
+            result = self.worker.run(job)
         except Exception as e:
-            print(f"Error during encoding: {e}")
-            return False
-            
+            result = {"ok": False, "error": str(e)}
+        print("Worker result:", result)
+        return result
+
+    def run_pipe(self, args, data):
+        """
+        Run one encode/decode with its files on stdin and stdout, so nothing goes through
+        the disk. Returns the output bytes (None on failure) and the answer, in the
+        worker's format
+        """
+        try:
+            process = subprocess.run([self.c_executable, "--quiet", "--stats"] + args,
+                                     input=data, capture_output=True)
+        except OSError as e:
+            return None, {"ok": False, "error": str(e)}
+        result = {"ok": False, "error": "no answer from " + args[0]}
+        details = []
+        for line in process.stderr.decode("utf-8", "replace").splitlines():
+            if line.startswith("{"):
+                result = json.loads(line)
+            elif line:
+                details.append(line)
+        if details:
+            result["details"] = details
+        ok = process.returncode == 0 and result.get("ok", False)
+        result["ok"] = ok
+        print("Pipe result:", result)
+        return (process.stdout if ok else None), result
+
+    def encode_bytes(self, cover_image, secret):
+        """
+        Hide secret (bytes) in cover_image (BMP bytes), in process if the library is loaded.
+        Otherwise both go in on stdin, the secret first after a line with its length.
+        Returns the stego image and the answer
+        """
+        if self.library:
+            return self.run_library(self.library.encode, cover_image, secret)
+        frame = str(len(secret)).encode("ascii") + b"\n"
+        return self.run_pipe(["encode", "-", "-", "-"], frame + secret + cover_image)
+
+    def decode_bytes(self, stego_image):
+        """
+        Recover the hidden file from stego_image (BMP bytes), in process if the library is
+        loaded. Returns it and the answer
+        """
+        if self.library:
+            return self.run_library(self.library.decode, stego_image)
+        return self.run_pipe(["decode", "-", "-"], stego_image)
+
+    def capacity_bytes(self, cover_image, secret):
+        """
+        Check, without encoding, whether secret (bytes) fits in cover_image (BMP bytes).
+        Returns the answer, or None without the library
+        """
+        if not self.library:
+            return None
+        return self.run_library(lambda *args: (None, self.library.capacity(*args)), cover_image, secret)[1]
+
+    def encode(self, cover_image_path, secret_file_path, output_path):
+        """
+        Encode any file into the cover image
+        """
+        return self.run_job({
+            "op": "encode",
+            "cover": cover_image_path,
+            "secret": secret_file_path,
+            "output": output_path
+        }).get("ok", False)
+
     def decode(self, stego_image_path, output_path):
         """
         Decode the hidden file from the stego image
         """
-        try:
-            # Prepare input for the C program
-            # The program expects:
-            # 1. Choice (2 for decode)
-            # 2. Stego image path
-            # 3. Output path
-            input_data = "2\n"  # Choose decode mode
-            input_data += f"{stego_image_path}\n"  # Stego image path
-            input_data += f"{output_path}\n"  # Output path
-            
-            # Run the C program and capture output
-            process = subprocess.Popen(
-                [self.c_executable],
-                stdin=subprocess.PIPE,
-                stdout=subprocess.PIPE,
-                stderr=subprocess.PIPE,
-                text=True
-            )
-            
-            # Send input and get output
-            stdout, stderr = process.communicate(input=input_data)
-            
-            # Print the output for debugging
-            print("Command output:", stdout)
-            if stderr:
-                print("Command errors:", stderr)
-                
-            if process.returncode == 0:
-                return True
-            else:
-                print(f"Process returned with code: {process.returncode}")
-                return False
-                
-        except Exception as e:
-            print(f"Error during decoding: {e}")
-            return False
-            
-    def validate_cover_image(self, image_path):
+        return self.run_job({
+            "op": "decode",
+            "stego": stego_image_path,
+            "output": output_path
+        }).get("ok", False)
+
+    def probe(self, stego_image_path):
+        """
+        Read the stego header (format, sizes, block layout) without decoding anything
+        """
+        return self.run_job({"op": "probe", "stego": stego_image_path})
+
+    def verify(self, stego_image_path):
+        """
+        Decode the hidden file and check its checksum without writing it
+        """
+        return self.run_job({"op": "verify", "stego": stego_image_path})
+
+    def validate_cover_image(self, image):
         """
-        Validate if the image is in BMP format
+        Validate if the image (a path or a file object) is in BMP format
         """
         try:
-            with Image.open(image_path) as img:
+            with Image.open(image) as img:
                 if img.format != 'BMP':
                     return False, "Cover image must be in BMP format"
                 return True, "Valid BMP image"